@@ -26,6 +26,8 @@ LIB_VNC_SVR_SRC := \
 	minilzo.c \
 	ultra.c \
 	scale.c \
+	encodecache.c \
+	parallel.c \
 	zlib.c \
 	zrle.c \
 	zrleoutstream.c \
@@ -35,6 +37,7 @@ LIB_VNC_SVR_SRC := \
 
 LOCAL_SRC_FILES := \
 	fbvncserver.c \
+	fbdiff.c \
 	$(addprefix $(LIB_VNC_SVR_PATH)/,$(LIB_VNC_SVR_SRC))
 
 LOCAL_C_INCLUDES := \
@@ -50,3 +53,27 @@ LOCAL_STATIC_LIBRARIES := libjpeg
 LOCAL_MODULE:= fbvncserver
 
 include $(BUILD_EXECUTABLE)
+
+# Frame differencing microbenchmark
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	fbdiff.c \
+	fbdiff_bench.c
+
+LOCAL_MODULE := fbdiff_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+
+# Checks of the framebuffer passes on odd row layouts
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	fbdiff.c \
+	fbdiff_test.c
+
+LOCAL_MODULE := fbdiff_test
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
@@ -46,6 +46,18 @@ rfbUsage(void)
     fprintf(stderr, "-progressive height    enable progressive updating for slow links\n");
     fprintf(stderr, "-listen ipaddr         listen for connections only on network interface with\n");
     fprintf(stderr, "                       addr ipaddr. '-listen localhost' and hostname work too.\n");
+    fprintf(stderr, "-encodecache kbytes    share up to kbytes of encoded rectangles between\n"
+                    "                       clients with the same encoding settings\n");
+    fprintf(stderr, "-outputqueue kbytes    queue output for slow clients instead of waiting,\n"
+                    "                       holding back updates with kbytes queued\n"
+                    "                       (a soft limit, one update can go over it)\n");
+    fprintf(stderr, "-updatebuf kbytes      let a client's update buffer grow up to kbytes\n"
+                    "                       (default 256)\n");
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    fprintf(stderr, "-encoders count        serve clients in the background with one I/O thread\n"
+                    "                       and count encoder threads\n");
+    fprintf(stderr, "-parallelencode count  encode large updates with count threads at once\n");
+#endif
 
     for(extension=rfbGetExtensionIterator();extension;extension=extension->next)
 	if(extension->usage)
@@ -163,6 +175,38 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
             if (! rfbStringToAddr(argv[++i], &(rfbScreen->listenInterface))) {
                 return FALSE;
             }
+        } else if (strcmp(argv[i], "-encodecache") == 0) {  /* -encodecache kbytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->encodeCacheSize = atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "-outputqueue") == 0) {  /* -outputqueue kbytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->maxOutputQueue = atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "-updatebuf") == 0) {  /* -updatebuf kbytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->maxUpdateBufSize = atoi(argv[++i]) * 1024;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+        } else if (strcmp(argv[i], "-encoders") == 0) {  /* -encoders count */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->encoderThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-parallelencode") == 0) {  /* -parallelencode count */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->parallelEncodeThreads = atoi(argv[++i]);
+#endif
         } else {
 	    rfbProtocolExtension* extension;
 	    int handled=0;
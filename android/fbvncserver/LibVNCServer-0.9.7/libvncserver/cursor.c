@@ -68,7 +68,7 @@ rfbSendCursorShape(rfbClientPtr cl)
     }
 
     if (pCursor == NULL) {
-	if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE ) {
+	if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->updateBufSize ) {
 	    if (!rfbSendUpdateBuf(cl))
 		return FALSE;
 	}
@@ -95,13 +95,13 @@ rfbSendCursorShape(rfbClientPtr cl)
     /* Send buffer contents if needed. */
 
     if ( cl->ublen + sz_rfbFramebufferUpdateRectHeader +
-	 sz_rfbXCursorColors + maskBytes + dataBytes > UPDATE_BUF_SIZE ) {
+	 sz_rfbXCursorColors + maskBytes + dataBytes > cl->updateBufSize ) {
 	if (!rfbSendUpdateBuf(cl))
 	    return FALSE;
     }
 
     if ( cl->ublen + sz_rfbFramebufferUpdateRectHeader +
-	 sz_rfbXCursorColors + maskBytes + dataBytes > UPDATE_BUF_SIZE ) {
+	 sz_rfbXCursorColors + maskBytes + dataBytes > cl->updateBufSize ) {
 	return FALSE;		/* FIXME. */
     }
 
@@ -182,7 +182,7 @@ rfbSendCursorPos(rfbClientPtr cl)
 {
   rfbFramebufferUpdateRectHeader rect;
 
-  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->updateBufSize) {
     if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -504,6 +504,7 @@ void rfbHideCursor(rfbClientPtr cl)
      memcpy(s->frameBuffer+(y1+j)*rowstride+x1*bpp,
 	    s->underCursorBuffer+j*x2*bpp,
 	    x2*bpp);
+   rfbInvalidateEncodeCache(s);
 
    /* Copy to all scaled versions */
    rfbScaledScreenUpdate(s, x1, y1, x1+x2, y1+y2);
@@ -563,6 +564,9 @@ void rfbShowCursor(rfbClientPtr cl)
      }
    }
    
+   /* the cursor is about to be drawn into the framebuffer */
+   rfbInvalidateEncodeCache(s);
+
    if(!c->richSource)
      rfbMakeRichCursorFromXCursor(s,c);
   
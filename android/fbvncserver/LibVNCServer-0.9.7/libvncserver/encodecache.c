@@ -0,0 +1,405 @@
+/*
+ * encodecache.c - share encoded rectangles between clients.
+ *
+ * When several clients watch the same screen with the same encoding and
+ * pixel format, they usually ask for the same rectangles of the same
+ * frame.  The first client to send such a rectangle keeps a copy of what
+ * its encoder produced; the others copy those bytes instead of encoding
+ * the rectangle again.
+ *
+ * Every change to the framebuffer moves the cache on to a new generation,
+ * and entries are only handed out for the generation they were encoded
+ * in.  The zlib based encoders restart their streams for every rectangle
+ * while the cache is on (see zlib.c, zrle.c and tight.c), so that their
+ * output does not depend on what the client was sent before.  Only the
+ * first zlib or ZRLE rectangle of a client, which sets up its stream, is
+ * always encoded for that client alone.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#define ENCODE_CACHE_SLOTS 1024
+
+/* Everything the bytes of an encoded rectangle depend on.  Settings an
+   encoding does not use are left at zero so more clients can share. */
+typedef struct rfbEncodeCacheKey {
+    unsigned long generation;
+    rfbScreenInfoPtr scaledScreen;
+    int x, y, w, h;
+    int encoding;
+    rfbPixelFormat format;
+    int compressLevel;
+    int qualityLevel;
+    int maxWidth, maxHeight;	/* CoRRE */
+    rfbBool lastRect;		/* Tight */
+} rfbEncodeCacheKey;
+
+typedef struct rfbEncodeCacheEntry {
+    rfbEncodeCacheKey key;
+    int refCount;		/* the slot holds one reference */
+    int len;
+    char *data;
+} rfbEncodeCacheEntry;
+
+struct rfbEncodeCache {
+    MUTEX(mutex);
+    unsigned long generation;
+    unsigned long hits, misses;
+    int size, maxSize;		/* bytes of data held by the slots */
+    rfbEncodeCacheEntry *slots[ENCODE_CACHE_SLOTS];
+};
+
+void
+rfbInitEncodeCache(rfbScreenInfoPtr screen)
+{
+    struct rfbEncodeCache *cache;
+
+    if (screen->encodeCacheSize <= 0 || screen->encodeCache)
+        return;
+
+    cache = (struct rfbEncodeCache *)calloc(1, sizeof(struct rfbEncodeCache));
+    if (!cache) {
+        rfbErr("rfbInitEncodeCache: out of memory\n");
+        return;
+    }
+    INIT_MUTEX(cache->mutex);
+    cache->maxSize = screen->encodeCacheSize;
+    screen->encodeCache = cache;
+}
+
+static void
+ReleaseEntry(struct rfbEncodeCache *cache, rfbEncodeCacheEntry *e)
+{
+    if (--e->refCount == 0) {
+        free(e->data);
+        free(e);
+    }
+}
+
+static void
+ClearSlot(struct rfbEncodeCache *cache, int slot)
+{
+    rfbEncodeCacheEntry *e = cache->slots[slot];
+
+    if (e) {
+        cache->size -= e->len;
+        cache->slots[slot] = NULL;
+        ReleaseEntry(cache, e);
+    }
+}
+
+void
+rfbFreeEncodeCache(rfbScreenInfoPtr screen)
+{
+    struct rfbEncodeCache *cache = screen->encodeCache;
+    int i;
+
+    if (!cache)
+        return;
+
+    for (i = 0; i < ENCODE_CACHE_SLOTS; i++)
+        ClearSlot(cache, i);
+    TINI_MUTEX(cache->mutex);
+    free(cache);
+    screen->encodeCache = NULL;
+}
+
+/*
+ * Called whenever the pixels of the screen change.  It has to happen
+ * before the change is marked in the clients' modifiedRegion: a client
+ * sending the marked area must not find an entry made before the change.
+ */
+
+void
+rfbInvalidateEncodeCache(rfbScreenInfoPtr screen)
+{
+    struct rfbEncodeCache *cache = screen->encodeCache;
+
+    if (!cache)
+        return;
+
+    LOCK(cache->mutex);
+    cache->generation++;
+    UNLOCK(cache->mutex);
+}
+
+unsigned long
+rfbEncodeCacheGeneration(rfbScreenInfoPtr screen)
+{
+    struct rfbEncodeCache *cache = screen->encodeCache;
+    unsigned long generation;
+
+    if (!cache)
+        return 0;
+
+    LOCK(cache->mutex);
+    generation = cache->generation;
+    UNLOCK(cache->mutex);
+    return generation;
+}
+
+void
+rfbEncodeCacheStats(rfbScreenInfoPtr screen,
+                    unsigned long *hits, unsigned long *misses)
+{
+    struct rfbEncodeCache *cache = screen->encodeCache;
+
+    *hits = *misses = 0;
+    if (!cache)
+        return;
+
+    LOCK(cache->mutex);
+    *hits = cache->hits;
+    *misses = cache->misses;
+    UNLOCK(cache->mutex);
+}
+
+/*
+ * Fill in the key for a rectangle sent to cl, or return FALSE if what
+ * this client gets cannot be shared.
+ */
+
+static rfbBool
+GetKey(rfbClientPtr cl, rfbEncodeCacheKey *key, unsigned long generation,
+       int x, int y, int w, int h)
+{
+    /* the cursor is drawn into the framebuffer for this client only */
+    if (cl->screen->cursor && !cl->enableCursorShapeUpdates)
+        return FALSE;
+
+    memset(key, 0, sizeof(*key));
+    key->generation = generation;
+    key->scaledScreen = cl->scaledScreen;
+    key->x = x;
+    key->y = y;
+    key->w = w;
+    key->h = h;
+    key->encoding = cl->preferredEncoding;
+
+    switch (cl->preferredEncoding) {
+    case -1:
+        key->encoding = rfbEncodingRaw;
+        break;
+    case rfbEncodingRaw:
+    case rfbEncodingRRE:
+    case rfbEncodingHextile:
+    case rfbEncodingUltra:
+        break;
+    case rfbEncodingCoRRE:
+        key->maxWidth = cl->correMaxWidth;
+        key->maxHeight = cl->correMaxHeight;
+        break;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    case rfbEncodingZlib:
+        /* a new stream starts with a zlib header, and the client's stream
+           has to be set up here for the rectangles after this one; the
+           parallel encoders leave the header out */
+        if (!cl->compStreamInited && !cl->encodeJob)
+            return FALSE;
+        key->compressLevel = cl->zlibCompressLevel;
+        break;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    case rfbEncodingTight:
+        key->compressLevel = cl->tightCompressLevel;
+        key->qualityLevel = cl->tightQualityLevel;
+        key->lastRect = cl->enableLastRectEncoding;
+        break;
+#endif
+    case rfbEncodingZYWRLE:
+        key->qualityLevel = cl->tightQualityLevel;
+        /* fall through */
+    case rfbEncodingZRLE:
+        /* same as zlib */
+        if (!cl->zrleData && !cl->encodeJob)
+            return FALSE;
+        break;
+#endif
+    default:
+        return FALSE;
+    }
+
+    /* the padding of a client's format is whatever it sent us */
+    key->format.bitsPerPixel = cl->format.bitsPerPixel;
+    key->format.depth = cl->format.depth;
+    key->format.bigEndian = cl->format.bigEndian;
+    key->format.trueColour = cl->format.trueColour;
+    key->format.redMax = cl->format.redMax;
+    key->format.greenMax = cl->format.greenMax;
+    key->format.blueMax = cl->format.blueMax;
+    key->format.redShift = cl->format.redShift;
+    key->format.greenShift = cl->format.greenShift;
+    key->format.blueShift = cl->format.blueShift;
+
+    return TRUE;
+}
+
+static unsigned int
+HashKey(const rfbEncodeCacheKey *key)
+{
+    const unsigned char *p = (const unsigned char *)key;
+    unsigned int hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < sizeof(*key); i++)
+        hash = (hash ^ p[i]) * 16777619U;
+    return hash;
+}
+
+static rfbBool
+SendEntry(rfbClientPtr cl, rfbEncodeCacheEntry *e)
+{
+    if (!rfbSendUpdateBytes(cl, e->data, e->len))
+        return FALSE;
+
+    rfbStatRecordEncodingSent(cl, e->key.encoding, e->len,
+        e->key.w * e->key.h * (cl->format.bitsPerPixel / 8));
+    return TRUE;
+}
+
+/*
+ * Called by rfbSendUpdateBuf while a rectangle is captured, before
+ * updateBuf is written out.  Gives up on the capture if the rectangle
+ * gets bigger than the whole cache.
+ */
+
+void
+rfbEncodeCacheCapture(rfbClientPtr cl)
+{
+    int len = cl->ublen - cl->captureStart;
+
+    if (cl->captureLen + len > cl->screen->encodeCache->maxSize) {
+        cl->captureStart = -1;
+        cl->captureLen = -1;
+        return;
+    }
+
+    if (cl->captureLen + len > cl->captureSize) {
+        int size = cl->captureSize ? cl->captureSize : UPDATE_BUF_SIZE;
+        char *buf;
+
+        while (size < cl->captureLen + len)
+            size *= 2;
+        buf = (char *)realloc(cl->captureBuf, size);
+        if (!buf) {
+            cl->captureStart = -1;
+            cl->captureLen = -1;
+            return;
+        }
+        cl->captureBuf = buf;
+        cl->captureSize = size;
+    }
+
+    memcpy(cl->captureBuf + cl->captureLen, &cl->updateBuf[cl->captureStart],
+           len);
+    cl->captureLen += len;
+    /* updateBuf is about to be emptied */
+    cl->captureStart = 0;
+}
+
+static void
+StoreEntry(struct rfbEncodeCache *cache, int slot, rfbClientPtr cl,
+           const rfbEncodeCacheKey *key)
+{
+    rfbEncodeCacheEntry *e;
+    int i;
+
+    /* nobody can ask for an old generation any more */
+    if (key->generation != cache->generation)
+        return;
+
+    ClearSlot(cache, slot);
+    if (cache->size + cl->captureLen > cache->maxSize) {
+        for (i = 0; i < ENCODE_CACHE_SLOTS; i++)
+            if (cache->slots[i] &&
+                cache->slots[i]->key.generation != cache->generation)
+                ClearSlot(cache, i);
+        if (cache->size + cl->captureLen > cache->maxSize)
+            return;
+    }
+
+    e = (rfbEncodeCacheEntry *)malloc(sizeof(rfbEncodeCacheEntry));
+    if (!e)
+        return;
+    e->key = *key;
+    e->refCount = 1;
+    e->len = cl->captureLen;
+    /* the entry takes over the capture buffer */
+    e->data = cl->captureBuf;
+    cl->captureBuf = NULL;
+    cl->captureSize = 0;
+
+    cache->slots[slot] = e;
+    cache->size += e->len;
+}
+
+/*
+ * Send a rectangle in cl's preferred encoding, from the cache if another
+ * client already encoded it, otherwise encoding it and keeping a copy.
+ */
+
+rfbBool
+rfbEncodeCacheSendRect(rfbClientPtr cl, unsigned long generation,
+                       int x, int y, int w, int h)
+{
+    struct rfbEncodeCache *cache = cl->screen->encodeCache;
+    rfbEncodeCacheKey key;
+    rfbEncodeCacheEntry *e;
+    int slot;
+    rfbBool result;
+
+    if (!cache || !GetKey(cl, &key, generation, x, y, w, h))
+        return rfbSendRectEncoding(cl, x, y, w, h);
+
+    slot = HashKey(&key) % ENCODE_CACHE_SLOTS;
+
+    LOCK(cache->mutex);
+    e = cache->slots[slot];
+    if (e && !memcmp(&e->key, &key, sizeof(key))) {
+        cache->hits++;
+        e->refCount++;
+        UNLOCK(cache->mutex);
+
+        result = SendEntry(cl, e);
+
+        LOCK(cache->mutex);
+        ReleaseEntry(cache, e);
+        UNLOCK(cache->mutex);
+        return result;
+    }
+    cache->misses++;
+    UNLOCK(cache->mutex);
+
+    cl->captureLen = 0;
+    cl->captureStart = cl->ublen;
+    result = rfbSendRectEncoding(cl, x, y, w, h);
+    if (cl->captureStart >= 0) {
+        rfbEncodeCacheCapture(cl);
+        /* nothing was written, the rectangle stays in updateBuf */
+        cl->captureStart = -1;
+    }
+
+    if (result && cl->captureLen > 0) {
+        LOCK(cache->mutex);
+        StoreEntry(cache, slot, cl, &key);
+        UNLOCK(cache->mutex);
+    }
+    return result;
+}
@@ -45,7 +45,7 @@ rfbSendRectEncodingHextile(rfbClientPtr cl,
 {
     rfbFramebufferUpdateRectHeader rect;
     
-    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->updateBufSize) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
@@ -122,7 +122,7 @@ sendHextiles##bpp(rfbClientPtr cl, int rx, int ry, int rw, int rh) {
                 h = ry+rh - y;                                                  \
                                                                                 \
             if ((cl->ublen + 1 + (2 + 16 * 16) * (bpp/8)) >                     \
-                UPDATE_BUF_SIZE) {                                              \
+                cl->updateBufSize) {                                            \
                 if (!rfbSendUpdateBuf(cl))                                      \
                     return FALSE;                                               \
             }                                                                   \
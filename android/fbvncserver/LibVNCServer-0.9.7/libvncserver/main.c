@@ -264,6 +264,8 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
 
+   rfbInvalidateEncodeCache(rfbScreen);
+
    iterator=rfbGetClientIterator(rfbScreen);
    while((cl=rfbClientIteratorNext(iterator))) {
      LOCK(cl->updateMutex);
@@ -300,7 +302,7 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
        sraRgnOr(cl->modifiedRegion,modifiedRegionBackup);
        sraRgnDestroy(modifiedRegionBackup);
 
-       if(!cl->enableCursorShapeUpdates) {
+       if(!cl->enableCursorShapeUpdates && cl->screen->cursor) {
           /*
            * n.b. (dx, dy) is the vector pointing in the direction the
            * copyrect displacement will take place.  copyRegion is the
@@ -341,7 +343,7 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
      } else {
        sraRgnOr(cl->modifiedRegion,copyRegion);
      }
-     TSIGNAL(cl->updateCond);
+     rfbSignalClientUpdate(cl);
      UNLOCK(cl->updateMutex);
    }
 
@@ -396,11 +398,14 @@ void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
 
+   /* before any client can see the region as modified */
+   rfbInvalidateEncodeCache(screen);
+
    iterator=rfbGetClientIterator(screen);
    while((cl=rfbClientIteratorNext(iterator))) {
      LOCK(cl->updateMutex);
      sraRgnOr(cl->modifiedRegion,modRegion);
-     TSIGNAL(cl->updateCond);
+     rfbSignalClientUpdate(cl);
      UNLOCK(cl->updateMutex);
    }
 
@@ -456,7 +461,16 @@ clientOutput(void *data)
 		sraRgnDestroy(updateRegion);
 	    }
 
-            if (!haveUpdate) {
+            if (!haveUpdate && cl->updateBufSize > UPDATE_BUF_SIZE) {
+                /* wake up to give back updateBuf if it stays idle */
+                struct timespec due;
+                due.tv_sec = time(NULL) + UPDATE_BUF_IDLE_TIME;
+                due.tv_nsec = 0;
+                pthread_cond_timedwait(&cl->updateCond, &cl->updateMutex, &due);
+                LOCK(cl->outputMutex);
+                rfbReclaimUpdateBuf(cl);
+                UNLOCK(cl->outputMutex);
+            } else if (!haveUpdate) {
                 WAIT(cl->updateCond, cl->updateMutex);
             }
 	    UNLOCK(cl->updateMutex);
@@ -569,9 +583,258 @@ listenerRun(void *data)
     return(NULL);
 }
 
+/*
+ * The encoder pool: instead of an input and an output thread per client,
+ * one I/O thread reads from all clients through rfbCheckFds, and a fixed
+ * number of encoder threads send the updates.  A client with an update it
+ * can send now is put on a FIFO run queue, and the first encoder thread
+ * that is free takes it once deferUpdateTime has passed.
+ */
+
+struct rfbEncoderPool {
+    MUTEX(mutex);
+    COND(cond);
+    rfbClientPtr head, tail;	/* run queue */
+    long usec;			/* rfbCheckFds timeout of the I/O thread */
+    rfbBool stop;
+    int threadCount;
+    pthread_t* threads;
+};
+
+/* caller holds cl->updateMutex */
+static rfbBool
+rfbClientCanUpdate(rfbClientPtr cl)
+{
+    return cl->sock >= 0 && !cl->onHold && !cl->outputBacklogged &&
+        FB_UPDATE_PENDING(cl) && !sraRgnEmpty(cl->requestedRegion);
+}
+
+/* caller holds cl->updateMutex and pool->mutex */
+static void
+rfbQueueClient(struct rfbEncoderPool* pool, rfbClientPtr cl)
+{
+    /* the queue's reference keeps cl around until an encoder is done */
+    rfbIncrClientRef(cl);
+    gettimeofday(&cl->queuedTime, NULL);
+    cl->updateQueued = TRUE;
+    cl->nextQueued = NULL;
+    if (pool->tail)
+        pool->tail->nextQueued = cl;
+    else
+        pool->head = cl;
+    pool->tail = cl;
+    TSIGNAL(pool->cond);
+}
+
+void
+rfbSignalClientUpdate(rfbClientPtr cl)
+{
+    struct rfbEncoderPool* pool = cl->screen->encoderPool;
+
+    TSIGNAL(cl->updateCond);
+
+    if (pool == NULL)
+        return;
+
+    LOCK(pool->mutex);
+    /* a busy client is checked again when its encoder is done */
+    if (!cl->updateQueued && !cl->updateBusy && rfbClientCanUpdate(cl))
+        rfbQueueClient(pool, cl);
+    UNLOCK(pool->mutex);
+}
+
+static void
+rfbEncodeQueuedClient(struct rfbEncoderPool* pool, rfbClientPtr cl)
+{
+    sraRegion* updateRegion;
+
+    if (cl->sock >= 0) {
+        /* as in clientOutput, take a copy so that modifications made
+           while we send end up in the next update */
+        LOCK(cl->updateMutex);
+        updateRegion = sraRgnCreateRgn(cl->modifiedRegion);
+        UNLOCK(cl->updateMutex);
+
+        rfbSendFramebufferUpdate(cl, updateRegion);
+        sraRgnDestroy(updateRegion);
+    }
+
+    LOCK(cl->updateMutex);
+    LOCK(pool->mutex);
+    cl->updateBusy = FALSE;
+    if (rfbClientCanUpdate(cl))
+        rfbQueueClient(pool, cl);
+    UNLOCK(pool->mutex);
+    UNLOCK(cl->updateMutex);
+
+    rfbDecrClientRef(cl);
+}
+
+static void *
+encoderRun(void *data)
+{
+    rfbScreenInfoPtr screen = (rfbScreenInfoPtr)data;
+    struct rfbEncoderPool* pool = screen->encoderPool;
+    rfbClientPtr cl;
+    struct timeval now;
+    struct timespec due;
+    long usec;
+
+    LOCK(pool->mutex);
+    while (!pool->stop) {
+        if ((cl = pool->head) == NULL) {
+            WAIT(pool->cond, pool->mutex);
+            continue;
+        }
+
+        /* to save bandwidth, wait a little while for more updates */
+        gettimeofday(&now, NULL);
+        usec = (cl->queuedTime.tv_sec - now.tv_sec) * 1000000L +
+            (cl->queuedTime.tv_usec - now.tv_usec) +
+            screen->deferUpdateTime * 1000L;
+        if (usec > 0 && cl->sock >= 0) {
+            usec += now.tv_usec;
+            due.tv_sec = now.tv_sec + usec / 1000000;
+            due.tv_nsec = (usec % 1000000) * 1000;
+            pthread_cond_timedwait(&pool->cond, &pool->mutex, &due);
+            continue;
+        }
+
+        pool->head = cl->nextQueued;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        cl->updateQueued = FALSE;
+        cl->updateBusy = TRUE;
+        UNLOCK(pool->mutex);
+
+        rfbEncodeQueuedClient(pool, cl);
+
+        LOCK(pool->mutex);
+    }
+    UNLOCK(pool->mutex);
+
+    return NULL;
+}
+
+static rfbBool
+rfbStartEncoderPool(rfbScreenInfoPtr screen, long usec)
+{
+    struct rfbEncoderPool* pool;
+    int i;
+
+    pool = (struct rfbEncoderPool*)calloc(1, sizeof(struct rfbEncoderPool));
+    if (pool)
+        pool->threads = (pthread_t*)malloc(screen->encoderThreads *
+                                           sizeof(pthread_t));
+    if (pool == NULL || pool->threads == NULL) {
+        rfbErr("rfbStartEncoderPool: out of memory\n");
+        free(pool);
+        return FALSE;
+    }
+
+    INIT_MUTEX(pool->mutex);
+    INIT_COND(pool->cond);
+    pool->usec = usec;
+    screen->encoderPool = pool;
+
+    for (i = 0; i < screen->encoderThreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, encoderRun, screen))
+            break;
+        pool->threadCount++;
+    }
+
+    if (pool->threadCount == 0) {
+        rfbErr("rfbStartEncoderPool: could not start encoder threads\n");
+        screen->encoderPool = NULL;
+        TINI_COND(pool->cond);
+        TINI_MUTEX(pool->mutex);
+        free(pool->threads);
+        free(pool);
+        return FALSE;
+    }
+
+    rfbLog("Serving clients with %d encoder threads\n", pool->threadCount);
+    return TRUE;
+}
+
+static void
+rfbStopEncoderPool(rfbScreenInfoPtr screen)
+{
+    struct rfbEncoderPool* pool = screen->encoderPool;
+    int i;
+
+    LOCK(pool->mutex);
+    pool->stop = TRUE;
+    pthread_cond_broadcast(&pool->cond);
+    UNLOCK(pool->mutex);
+
+    for (i = 0; i < pool->threadCount; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    screen->encoderPool = NULL;
+    TINI_COND(pool->cond);
+    TINI_MUTEX(pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+/* the I/O thread shrinks the updateBuf of a client no encoder has */
+static void
+rfbReclaimPoolClient(struct rfbEncoderPool* pool, rfbClientPtr cl)
+{
+    if (cl->updateBufSize <= UPDATE_BUF_SIZE)
+        return;
+
+    LOCK(pool->mutex);
+    if (!cl->updateQueued && !cl->updateBusy) {
+        LOCK(cl->outputMutex);
+        rfbReclaimUpdateBuf(cl);
+        UNLOCK(cl->outputMutex);
+    }
+    UNLOCK(pool->mutex);
+}
+
+/* the I/O thread of the encoder pool */
+static void*
+reactorRun(void *data)
+{
+    rfbScreenInfoPtr screen=(rfbScreenInfoPtr)data;
+    long usec=screen->encoderPool->usec;
+    rfbClientIteratorPtr i;
+    rfbClientPtr cl,clPrev;
+    extern rfbClientIteratorPtr
+      rfbGetClientIteratorWithClosed(rfbScreenInfoPtr rfbScreen);
+
+    while(rfbIsActive(screen)) {
+        rfbCheckFds(screen,usec);
+        rfbHttpCheckFds(screen);
+
+        /* rfbClientConnectionGone waits for the encoders to let go */
+        i = rfbGetClientIteratorWithClosed(screen);
+        cl=rfbClientIteratorHead(i);
+        while(cl) {
+            clPrev=cl;
+            cl=rfbClientIteratorNext(i);
+            if(clPrev->sock==-1)
+                rfbClientConnectionGone(clPrev);
+            else
+                rfbReclaimPoolClient(screen->encoderPool, clPrev);
+        }
+        rfbReleaseClientIterator(i);
+    }
+
+    rfbStopEncoderPool(screen);
+    return NULL;
+}
+
 void 
 rfbStartOnHoldClient(rfbClientPtr cl)
 {
+    if (cl->screen->encoderPool) {
+        /* the I/O thread picks it up from here */
+        cl->onHold = FALSE;
+        return;
+    }
     pthread_create(&cl->client_thread, NULL, clientInput, (void *)cl);
 }
 
@@ -583,6 +846,11 @@ rfbStartOnHoldClient(rfbClientPtr cl)
 	cl->onHold = FALSE;
 }
 
+void
+rfbSignalClientUpdate(rfbClientPtr cl)
+{
+}
+
 #endif
 
 void 
@@ -802,6 +1070,10 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
 
    screen->maxFd=0;
    screen->listenSock=-1;
+#ifdef LIBVNCSERVER_WITH_EPOLL
+   screen->epollFd=-1;
+   screen->epollReadyHead=NULL;
+#endif
 
    screen->httpInitDone=FALSE;
    screen->httpEnableProxyConnect=FALSE;
@@ -840,6 +1112,20 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
 
    screen->permitFileTransfer = FALSE;
 
+   screen->encodeCacheSize = 0;
+   screen->encodeCache = NULL;
+   screen->translateTables = NULL;
+   IF_PTHREADS(INIT_MUTEX(screen->translateTablesMutex));
+   screen->maxOutputQueue = 0;
+   screen->maxUpdateBufSize = 256*1024;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+   screen->encoderThreads = 0;
+   screen->encoderPool = NULL;
+   screen->parallelEncodeThreads = 0;
+   screen->parallelPool = NULL;
+#endif
+
    if(!rfbProcessArguments(screen,argc,argv)) {
      free(screen);
      return NULL;
@@ -934,6 +1220,8 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
   if (screen->cursorY >= height)
     screen->cursorY = height - 1;
 
+  rfbInvalidateEncodeCache(screen);
+
   /* For each client: */
   iterator = rfbGetClientIterator(screen);
   while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
@@ -949,6 +1237,7 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
     LOCK(cl->updateMutex);
     sraRgnDestroy(cl->modifiedRegion);
     cl->modifiedRegion = sraRgnCreateRect(0, 0, width, height);
+    sraRgnAllowTiles(cl->modifiedRegion, width, height);
     sraRgnMakeEmpty(cl->copyRegion);
     cl->copyDX = 0;
     cl->copyDY = 0;
@@ -956,7 +1245,7 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
     if (cl->useNewFBSize)
       cl->newFBSizePending = TRUE;
 
-    TSIGNAL(cl->updateCond);
+    rfbSignalClientUpdate(cl);
     UNLOCK(cl->updateMutex);
   }
   rfbReleaseClientIterator(iterator);
@@ -985,12 +1274,12 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
   rfbRRECleanup(screen);
   rfbCoRRECleanup(screen);
   rfbUltraCleanup(screen);
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-  rfbZlibCleanup(screen);
-#ifdef LIBVNCSERVER_HAVE_LIBJPEG
-  rfbTightCleanup(screen);
+  rfbFreeEncodeCache(screen);
+  IF_PTHREADS(TINI_MUTEX(screen->translateTablesMutex));
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  rfbStopParallelPool(screen);
 #endif
-
+#ifdef LIBVNCSERVER_HAVE_LIBZ
   /* free all 'scaled' versions of this screen */
   while (screen->scaledScreenNext!=NULL)
   {
@@ -1013,6 +1302,10 @@ void rfbInitServer(rfbScreenInfoPtr screen)
 #endif
   rfbInitSockets(screen);
   rfbHttpInitSockets(screen);
+  rfbInitEncodeCache(screen);
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  rfbStartParallelPool(screen);
+#endif
 #ifndef __MINGW32__
   if(screen->ignoreSIGPIPE)
     signal(SIGPIPE,SIG_IGN);
@@ -1070,8 +1363,9 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
   i = rfbGetClientIteratorWithClosed(screen);
   cl=rfbClientIteratorHead(i);
   while(cl) {
-    if (cl->sock >= 0 && !cl->onHold && FB_UPDATE_PENDING(cl) &&
-        !sraRgnEmpty(cl->requestedRegion)) {
+    /* a client which is behind gets its changes once it has caught up */
+    if (cl->sock >= 0 && !cl->onHold && !cl->outputBacklogged &&
+        FB_UPDATE_PENDING(cl) && !sraRgnEmpty(cl->requestedRegion)) {
       result=TRUE;
       if(screen->deferUpdateTime == 0) {
 	  rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
@@ -1089,6 +1383,10 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
 	  rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
 	}
       }
+    } else if (cl->sock >= 0) {
+      LOCK(cl->outputMutex);
+      rfbReclaimUpdateBuf(cl);
+      UNLOCK(cl->outputMutex);
     }
 
     if (!cl->viewOnly && cl->lastPtrX >= 0) {
@@ -1135,6 +1433,15 @@ void rfbRunEventLoop(rfbScreenInfoPtr screen, long usec, rfbBool runInBackground
 
        screen->backgroundLoop = TRUE;
 
+       if(screen->encoderThreads > 0) {
+         if(usec<0)
+           usec=screen->deferUpdateTime*1000;
+         if(rfbStartEncoderPool(screen, usec)) {
+           pthread_create(&listener_thread, NULL, reactorRun, screen);
+           return;
+         }
+       }
+
        pthread_create(&listener_thread, NULL, listenerRun, screen);
     return;
 #else
@@ -0,0 +1,460 @@
+/*
+ * parallel.c - encode the rectangles of one update on several threads.
+ *
+ * A large update is cut into bands of whole ZRLE tile rows.  The client's
+ * own thread encodes the first band while a pool of worker threads
+ * encodes the others, each into a buffer of its own; the buffers are then
+ * sent in order.  A worker encodes in a context of its own, a client
+ * record which only borrows the settings of the real client, so no
+ * encoder state is ever shared between threads.
+ *
+ * Only encodings which keep their state in the client record take part.
+ * RRE, CoRRE and Ultra encode into static buffers and are always sent by
+ * the client's thread alone.  While the pool is running, the zlib based
+ * encoders restart their streams for every rectangle (see zlib.c, zrle.c
+ * and tight.c), so the client can decode a band whichever context
+ * compressed it.  The first zlib or ZRLE rectangle of a client, which
+ * sets up its stream, is never encoded in parallel.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+#include "scale.h"
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+
+/* the height of a band; a multiple of the ZRLE tile height */
+#define PARALLEL_BAND_HEIGHT 64
+
+/* smaller updates are sent faster than they are handed around */
+#define PARALLEL_MIN_PIXELS (4 * 64 * 64)
+
+/* leave room in the update header for the pseudo rectangles */
+#define PARALLEL_MAX_RECTS 0xFF00
+
+typedef struct rfbEncodeJob {
+    rfbClientPtr cl;
+    unsigned long generation;
+    int x, y, w, h;
+    char *buf;			/* what the encoder sent */
+    int len, size;
+    rfbBool done, ok;
+    struct rfbEncodeJob *next;	/* in the pool's queue */
+} rfbEncodeJob;
+
+struct rfbParallelUpdate {
+    int count;
+    rfbEncodeJob *jobs;
+};
+
+struct rfbParallelPool {
+    MUTEX(mutex);
+    COND(work);			/* a job was queued, or the pool stops */
+    COND(done);			/* a job was finished */
+    rfbEncodeJob *head, *tail;
+    rfbBool stop;
+    int threadCount;
+    pthread_t *threads;
+};
+
+static rfbClientPtr
+NewContext(void)
+{
+    rfbClientPtr ctx = (rfbClientPtr)calloc(1, sizeof(rfbClientRec));
+
+    if (ctx)
+        ctx->updateBuf = (char *)calloc(UPDATE_BUF_SIZE, 1);
+    if (!ctx || !ctx->updateBuf) {
+        rfbErr("parallel encoder: out of memory\n");
+        free(ctx);
+        return NULL;
+    }
+    ctx->updateBufSize = UPDATE_BUF_SIZE;
+    ctx->sock = -1;
+    ctx->captureStart = -1;
+    return ctx;
+}
+
+static void
+FreeContext(rfbClientPtr ctx)
+{
+    if (!ctx)
+        return;
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    rfbFreeZrleData(ctx);
+    if (ctx->compStreamInited)
+        deflateEnd(&ctx->compStream);
+    rfbFreeZlibData(ctx);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    {
+        int i;
+        for (i = 0; i < 4; i++) {
+            if (ctx->zsActive[i])
+                deflateEnd(&ctx->zsStruct[i]);
+        }
+    }
+    rfbFreeTightData(ctx);
+#endif
+#endif
+    free(ctx->captureBuf);
+    free(ctx->updateBuf);
+    rfbResetStats(ctx);
+    free(ctx);
+}
+
+/* encode a band in ctx with the settings of the client it is for */
+static rfbBool
+EncodeJob(rfbClientPtr ctx, rfbEncodeJob *job)
+{
+    rfbClientPtr cl = job->cl;
+    rfbBool result;
+
+    ctx->screen = cl->screen;
+    ctx->scaledScreen = cl->scaledScreen;
+    ctx->format = cl->format;
+    ctx->translateFn = cl->translateFn;
+    ctx->translateLookupTable = cl->translateLookupTable;
+    ctx->preferredEncoding = cl->preferredEncoding;
+    ctx->enableCursorShapeUpdates = cl->enableCursorShapeUpdates;
+    ctx->enableLastRectEncoding = cl->enableLastRectEncoding;
+    ctx->zlibCompressLevel = cl->zlibCompressLevel;
+    ctx->tightCompressLevel = cl->tightCompressLevel;
+    ctx->tightQualityLevel = cl->tightQualityLevel;
+
+    ctx->ublen = 0;
+    ctx->encodeJob = job;
+    result = rfbEncodeCacheSendRect(ctx, job->generation,
+                                    job->x, job->y, job->w, job->h) &&
+        rfbCollectEncodeJob(ctx);
+    ctx->encodeJob = NULL;
+    return result;
+}
+
+/*
+ * Called by rfbSendUpdateBuf for a parallel encoder's context: keep what
+ * is in updateBuf for the client's thread to send.
+ */
+
+rfbBool
+rfbCollectEncodeJob(rfbClientPtr cl)
+{
+    rfbEncodeJob *job = cl->encodeJob;
+
+    if (job->len + cl->ublen > job->size) {
+        int size = job->size ? job->size : UPDATE_BUF_SIZE;
+        char *buf;
+
+        while (size < job->len + cl->ublen)
+            size *= 2;
+        buf = (char *)realloc(job->buf, size);
+        if (!buf) {
+            rfbErr("rfbCollectEncodeJob: out of memory\n");
+            return FALSE;
+        }
+        job->buf = buf;
+        job->size = size;
+    }
+
+    memcpy(job->buf + job->len, cl->updateBuf, cl->ublen);
+    job->len += cl->ublen;
+    cl->ublen = 0;
+    return TRUE;
+}
+
+static void *
+parallelEncoderRun(void *data)
+{
+    struct rfbParallelPool *pool = (struct rfbParallelPool *)data;
+    rfbClientPtr ctx = NewContext();
+    rfbEncodeJob *job;
+
+    LOCK(pool->mutex);
+    while (!pool->stop) {
+        if ((job = pool->head) == NULL) {
+            WAIT(pool->work, pool->mutex);
+            continue;
+        }
+        pool->head = job->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        UNLOCK(pool->mutex);
+
+        job->ok = ctx != NULL && EncodeJob(ctx, job);
+
+        LOCK(pool->mutex);
+        job->done = TRUE;
+        pthread_cond_broadcast(&pool->done);
+    }
+    UNLOCK(pool->mutex);
+
+    FreeContext(ctx);
+    return NULL;
+}
+
+void
+rfbStartParallelPool(rfbScreenInfoPtr screen)
+{
+    struct rfbParallelPool *pool;
+    int i;
+
+    if (screen->parallelEncodeThreads <= 0 || screen->parallelPool)
+        return;
+
+    pool = (struct rfbParallelPool *)calloc(1, sizeof(struct rfbParallelPool));
+    if (pool)
+        pool->threads = (pthread_t *)malloc(screen->parallelEncodeThreads *
+                                            sizeof(pthread_t));
+    if (pool == NULL || pool->threads == NULL) {
+        rfbErr("rfbStartParallelPool: out of memory\n");
+        free(pool);
+        return;
+    }
+
+    INIT_MUTEX(pool->mutex);
+    INIT_COND(pool->work);
+    INIT_COND(pool->done);
+
+    for (i = 0; i < screen->parallelEncodeThreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, parallelEncoderRun, pool))
+            break;
+        pool->threadCount++;
+    }
+
+    if (pool->threadCount == 0) {
+        rfbErr("rfbStartParallelPool: could not start encoder threads\n");
+        TINI_COND(pool->done);
+        TINI_COND(pool->work);
+        TINI_MUTEX(pool->mutex);
+        free(pool->threads);
+        free(pool);
+        return;
+    }
+
+    screen->parallelPool = pool;
+    rfbLog("Encoding large updates with %d threads\n", pool->threadCount);
+}
+
+void
+rfbStopParallelPool(rfbScreenInfoPtr screen)
+{
+    struct rfbParallelPool *pool = screen->parallelPool;
+    int i;
+
+    if (!pool)
+        return;
+
+    LOCK(pool->mutex);
+    pool->stop = TRUE;
+    pthread_cond_broadcast(&pool->work);
+    UNLOCK(pool->mutex);
+
+    for (i = 0; i < pool->threadCount; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    screen->parallelPool = NULL;
+    TINI_COND(pool->done);
+    TINI_COND(pool->work);
+    TINI_MUTEX(pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+static rfbBool
+CanEncodeInParallel(rfbClientPtr cl)
+{
+    switch (cl->preferredEncoding) {
+    case -1:
+    case rfbEncodingRaw:
+    case rfbEncodingHextile:
+        return TRUE;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    case rfbEncodingZlib:
+        return cl->compStreamInited;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    case rfbEncodingTight:
+        return TRUE;
+#endif
+    case rfbEncodingZRLE:
+    case rfbEncodingZYWRLE:
+        return cl->zrleData != NULL;
+#endif
+    default:
+        return FALSE;
+    }
+}
+
+/*
+ * Cut updateRegion into bands if cl's update is worth encoding in
+ * parallel, and count the rectangles the bands are sent as into *nRects
+ * (0xFFFF if a LastRect marker ends the update).  Returns NULL if the
+ * update should be sent as usual.
+ */
+
+struct rfbParallelUpdate *
+rfbPrepareParallelUpdate(rfbClientPtr cl, sraRegionPtr updateRegion,
+                         int *nRects)
+{
+    struct rfbParallelUpdate *update;
+    sraRectangleIterator *i;
+    sraRect rect;
+    int count = 0, pixels = 0, total = 0, k = 0;
+
+    if (!cl->screen->parallelPool || cl->encodeJob || !CanEncodeInParallel(cl))
+        return NULL;
+
+    for (i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i, &rect);) {
+        int x = rect.x1, y = rect.y1, w = rect.x2 - x, h = rect.y2 - y;
+
+        if (cl->screen != cl->scaledScreen)
+            rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h,
+                                "rfbPrepareParallelUpdate");
+        if (w <= 0 || h <= 0)
+            continue;
+        pixels += w * h;
+        count += (h - 1) / PARALLEL_BAND_HEIGHT + 1;
+    }
+    sraRgnReleaseIterator(i);
+
+    if (count < 2 || pixels < PARALLEL_MIN_PIXELS)
+        return NULL;
+
+    update = (struct rfbParallelUpdate *)malloc(sizeof(*update));
+    if (update)
+        update->jobs = (rfbEncodeJob *)calloc(count, sizeof(rfbEncodeJob));
+    if (!update || !update->jobs) {
+        free(update);
+        return NULL;
+    }
+    update->count = count;
+
+    for (i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i, &rect);) {
+        int x = rect.x1, y = rect.y1, w = rect.x2 - x, h = rect.y2 - y, y1;
+
+        if (cl->screen != cl->scaledScreen)
+            rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h,
+                                "rfbPrepareParallelUpdate");
+        if (w <= 0 || h <= 0)
+            continue;
+
+        for (y1 = y; y1 < y + h; y1 += PARALLEL_BAND_HEIGHT, k++) {
+            rfbEncodeJob *job = &update->jobs[k];
+            int n;
+
+            job->x = x;
+            job->y = y1;
+            job->w = w;
+            job->h = y + h - y1;
+            if (job->h > PARALLEL_BAND_HEIGHT)
+                job->h = PARALLEL_BAND_HEIGHT;
+
+            n = rfbNumCodedRects(cl, job->x, job->y, job->w, job->h);
+            if (n == 0 || total == 0xFFFF)
+                total = 0xFFFF;
+            else
+                total += n;
+        }
+    }
+    sraRgnReleaseIterator(i);
+
+    if (total != 0xFFFF && total > PARALLEL_MAX_RECTS) {
+        rfbFreeParallelUpdate(update);
+        return NULL;
+    }
+
+    *nRects = total;
+    return update;
+}
+
+/*
+ * Send the bands of update to cl.  The first one is encoded right here,
+ * the others by the pool; every band is waited for, even if sending
+ * failed, as the workers use cl.
+ */
+
+rfbBool
+rfbSendParallelUpdate(rfbClientPtr cl, struct rfbParallelUpdate *update,
+                      unsigned long generation)
+{
+    struct rfbParallelPool *pool = cl->screen->parallelPool;
+    int encoding = (cl->preferredEncoding == -1 ? rfbEncodingRaw
+                                                : cl->preferredEncoding);
+    rfbEncodeJob *job;
+    rfbBool result;
+    int k;
+
+    LOCK(pool->mutex);
+    for (k = 1; k < update->count; k++) {
+        job = &update->jobs[k];
+        job->cl = cl;
+        job->generation = generation;
+        job->next = NULL;
+        if (pool->tail)
+            pool->tail->next = job;
+        else
+            pool->head = job;
+        pool->tail = job;
+    }
+    pthread_cond_broadcast(&pool->work);
+    UNLOCK(pool->mutex);
+
+    job = &update->jobs[0];
+    result = rfbEncodeCacheSendRect(cl, generation,
+                                    job->x, job->y, job->w, job->h);
+
+    for (k = 1; k < update->count; k++) {
+        job = &update->jobs[k];
+
+        LOCK(pool->mutex);
+        while (!job->done)
+            WAIT(pool->done, pool->mutex);
+        UNLOCK(pool->mutex);
+
+        if (!result)
+            continue;
+        if (!job->ok) {
+            /* part of the update is missing; the client cannot go on */
+            rfbErr("rfbSendParallelUpdate: could not encode a band\n");
+            rfbCloseClient(cl);
+            result = FALSE;
+            continue;
+        }
+
+        result = rfbSendUpdateBytes(cl, job->buf, job->len);
+        rfbStatRecordEncodingSent(cl, encoding, job->len,
+            job->w * job->h * (cl->format.bitsPerPixel / 8));
+    }
+
+    return result;
+}
+
+void
+rfbFreeParallelUpdate(struct rfbParallelUpdate *update)
+{
+    int k;
+
+    for (k = 0; k < update->count; k++)
+        free(update->jobs[k].buf);
+    free(update->jobs);
+    free(update);
+}
+
+#endif
@@ -11,15 +11,91 @@ void rfbRedrawAfterHideCursor(rfbClientPtr cl,sraRegionPtr updateRegion);
 
 rfbClientPtr rfbClientIteratorHead(rfbClientIteratorPtr i);
 
+/* from sockets.c */
+
+#ifdef WIN32
+struct iovec { void *iov_base; size_t iov_len; };
+#else
+#include <sys/uio.h>
+#endif
+
+void rfbFlushClientOutput(rfbClientPtr cl);
+void rfbFreeClientOutput(rfbClientPtr cl);
+int rfbWriteExactV(rfbClientPtr cl, struct iovec *iov, int count);
+void rfbCorkClient(rfbClientPtr cl, rfbBool cork);
+
+/* from encodecache.c */
+
+extern void rfbInitEncodeCache(rfbScreenInfoPtr screen);
+extern void rfbFreeEncodeCache(rfbScreenInfoPtr screen);
+extern void rfbInvalidateEncodeCache(rfbScreenInfoPtr screen);
+extern unsigned long rfbEncodeCacheGeneration(rfbScreenInfoPtr screen);
+extern rfbBool rfbEncodeCacheSendRect(rfbClientPtr cl, unsigned long generation,
+                                      int x, int y, int w, int h);
+extern void rfbEncodeCacheCapture(rfbClientPtr cl);
+
+/* from parallel.c */
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+struct rfbParallelUpdate;
+extern void rfbStartParallelPool(rfbScreenInfoPtr screen);
+extern void rfbStopParallelPool(rfbScreenInfoPtr screen);
+extern struct rfbParallelUpdate* rfbPrepareParallelUpdate(rfbClientPtr cl,
+                                    sraRegionPtr updateRegion, int* nRects);
+extern rfbBool rfbSendParallelUpdate(rfbClientPtr cl,
+                                     struct rfbParallelUpdate* update,
+                                     unsigned long generation);
+extern void rfbFreeParallelUpdate(struct rfbParallelUpdate* update);
+extern rfbBool rfbCollectEncodeJob(rfbClientPtr cl);
+#endif
+
+/* from rfbserver.c */
+
+extern int rfbNumCodedRects(rfbClientPtr cl, int x, int y, int w, int h);
+extern rfbBool rfbSendUpdateBytes(rfbClientPtr cl, const char* data, int len);
+extern void rfbReclaimUpdateBuf(rfbClientPtr cl);
+
+/* seconds a client's updateBuf stays bigger than needed */
+#define UPDATE_BUF_IDLE_TIME 10
+
+/* for the vector code of translate.c and scale.c */
+
+/* GCC's vector types, which clang has too, and a way to shuffle them that
+   works with both: the result takes its elements from a and b at the
+   constant indices given, mask being an integer vector type as wide as a */
+#if defined(__clang__) || (defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)))
+#define RFB_HAVE_VECTORS
+#ifdef __clang__
+#define SHUFFLE(mask,a,b,...) __builtin_shufflevector(a, b, __VA_ARGS__)
+#else
+#define SHUFFLE(mask,a,b,...) __builtin_shuffle(a, b, (mask){ __VA_ARGS__ })
+#endif
+#endif
+
 /* from tight.c */
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
-extern void rfbTightCleanup(rfbScreenInfoPtr screen);
+extern void rfbFreeTightData(rfbClientPtr cl);
 #endif
 
 /* from zlib.c */
-extern void rfbZlibCleanup(rfbScreenInfoPtr screen);
+extern void rfbFreeZlibData(rfbClientPtr cl);
+
+/* deflate puts this many bytes in front of a stream without a preset
+   dictionary; restarted streams leave them out */
+#define ZLIB_HEADER_SIZE 2
+
+/* The zlib streams of cl start over for every rectangle, so that the
+   rectangle can be sent to other clients (encodecache.c) or encoded out
+   of order (parallel.c). */
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+#define RESTART_STREAMS(cl) \
+    ((cl)->screen->encodeCache != NULL || (cl)->screen->parallelPool != NULL)
+#else
+#define RESTART_STREAMS(cl) ((cl)->screen->encodeCache != NULL)
+#endif
 
 /* from zrle.c */
 void rfbFreeZrleData(rfbClientPtr cl);
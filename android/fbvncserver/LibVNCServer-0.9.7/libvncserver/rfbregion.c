@@ -3,6 +3,15 @@
  *
  * A general purpose region clipping library
  * Only deals with rectangular regions, though.
+ *
+ * Every region keeps the spans and span lists it is made of in a pool of
+ * its own.  The region itself and its first few spans are one allocation,
+ * spans which are no longer needed go to the pool's free lists, and
+ * destroying or emptying a region gives back all of its memory at once.
+ * Since a pool only ever belongs to one region, it needs no locking.
+ *
+ * A region may also be allowed to turn into a bitmap of tiles when it
+ * breaks up into many rectangles; see "Tiles" below.
  */
 
 #include <rfb/rfb.h>
@@ -11,6 +20,7 @@
 /* -=- Internal Span structure */
 
 struct sraRegion;
+struct sraSpanPool;
 
 typedef struct sraSpan {
   struct sraSpan *_next;
@@ -23,31 +33,127 @@ typedef struct sraSpan {
 typedef struct sraRegion {
   sraSpan front;
   sraSpan back;
+  struct sraSpanPool *pool;	/* where the spans of this list come from */
 } sraSpanList;
 
+/* -=- Span pool */
+
+/* how many spans fit into the allocation of a new region */
+#define SRA_FIRST_SPANS 16
+/* later chunks double in size up to this many bytes */
+#define SRA_MIN_CHUNK 1024
+#define SRA_MAX_CHUNK 16384
+
+typedef struct sraSpanChunk {
+  struct sraSpanChunk *next;
+  sraSpan spans[1];		/* sized at allocation */
+} sraSpanChunk;
+
+typedef struct sraSpanPool {
+  sraSpan *freeSpans;		/* chained through _next */
+  sraSpanList *freeLists;	/* chained through front._next */
+  char *unused, *end;		/* what is left of the newest chunk */
+  sraSpanChunk *chunks;		/* all but the first, which is inline */
+  int chunkSize;
+  int spans;			/* in use, never fewer than rectangles */
+} sraSpanPool;
+
+struct sraTiles;
+
+/* what an sraRegion* of a whole region points to */
+typedef struct sraRegionHead {
+  sraSpanList list;
+  sraSpanPool pool;
+  int tilesWidth, tilesHeight;	/* 0 unless it may be tiled */
+  struct sraTiles *tiles;	/* allocated when it is tiled first */
+  sraSpan first[SRA_FIRST_SPANS];
+} sraRegionHead;
+
+static void *
+sraPoolCarve(sraSpanPool *pool, size_t size) {
+  void *item;
+
+  if (pool->unused + size > pool->end) {
+    sraSpanChunk *chunk;
+
+    if (pool->chunkSize < SRA_MAX_CHUNK)
+      pool->chunkSize = pool->chunkSize ? pool->chunkSize * 2 : SRA_MIN_CHUNK;
+    chunk = (sraSpanChunk*)malloc(sizeof(sraSpanChunk) - sizeof(sraSpan) +
+				  pool->chunkSize);
+    if (!chunk)
+      return NULL;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->unused = (char*)chunk->spans;
+    pool->end = pool->unused + pool->chunkSize;
+  }
+  item = pool->unused;
+  pool->unused += size;
+  return item;
+}
+
+static sraSpan *
+sraPoolGetSpan(sraSpanPool *pool) {
+  sraSpan *span = pool->freeSpans;
+
+  pool->spans++;
+  if (span) {
+    pool->freeSpans = span->_next;
+    return span;
+  }
+  return (sraSpan*)sraPoolCarve(pool, sizeof(sraSpan));
+}
+
+static sraSpanList *
+sraPoolGetList(sraSpanPool *pool) {
+  sraSpanList *list = pool->freeLists;
+
+  if (list) {
+    pool->freeLists = (sraSpanList*)list->front._next;
+    return list;
+  }
+  return (sraSpanList*)sraPoolCarve(pool, sizeof(sraSpanList));
+}
+
+static void
+sraPoolPutSpan(sraSpanPool *pool, sraSpan *span) {
+  pool->spans--;
+  span->_next = pool->freeSpans;
+  pool->freeSpans = span;
+}
+
+static void
+sraPoolPutList(sraSpanPool *pool, sraSpanList *list) {
+  list->front._next = (sraSpan*)pool->freeLists;
+  pool->freeLists = list;
+}
+
+static void
+sraPoolFreeChunks(sraSpanPool *pool) {
+  sraSpanChunk *chunk, *next;
+
+  for (chunk = pool->chunks; chunk; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+}
+
 /* -=- Span routines */
 
-sraSpanList *sraSpanListDup(const sraSpanList *src);
-void sraSpanListDestroy(sraSpanList *list);
+static void sraSpanListInit(sraSpanList *list, sraSpanPool *pool);
+static sraSpanList *sraSpanListDup(sraSpanPool *pool, const sraSpanList *src);
+static void sraSpanListDestroy(sraSpanList *list);
 
 static sraSpan *
-sraSpanCreate(int start, int end, const sraSpanList *subspan) {
-  sraSpan *item = (sraSpan*)malloc(sizeof(sraSpan));
+sraSpanCreate(sraSpanPool *pool, int start, int end, const sraSpanList *subspan) {
+  sraSpan *item = sraPoolGetSpan(pool);
   item->_next = item->_prev = NULL;
   item->start = start;
   item->end = end;
-  item->subspan = sraSpanListDup(subspan);
+  item->subspan = sraSpanListDup(pool, subspan);
   return item;
 }
 
-static sraSpan *
-sraSpanDup(const sraSpan *src) {
-  sraSpan *span;
-  if (!src) return NULL;
-  span = sraSpanCreate(src->start, src->end, src->subspan);
-  return span;
-}
-
 static void
 sraSpanInsertAfter(sraSpan *newspan, sraSpan *after) {
   newspan->_next = after->_next;
@@ -71,9 +177,9 @@ sraSpanRemove(sraSpan *span) {
 }
 
 static void
-sraSpanDestroy(sraSpan *span) {
+sraSpanDestroy(sraSpanPool *pool, sraSpan *span) {
   if (span->subspan) sraSpanListDestroy(span->subspan);
-  free(span);
+  sraPoolPutSpan(pool, span);
 }
 
 #ifdef DEBUG
@@ -114,26 +220,26 @@ sraSpanPrint(const sraSpan *s) {
     sraSpanListPrint(s->subspan);
 }
 
-static sraSpanList *
-sraSpanListCreate(void) {
-  sraSpanList *item = (sraSpanList*)malloc(sizeof(sraSpanList));
-  item->front._next = &(item->back);
-  item->front._prev = NULL;
-  item->back._prev = &(item->front);
-  item->back._next = NULL;
-  return item;
+static void
+sraSpanListInit(sraSpanList *list, sraSpanPool *pool) {
+  list->front._next = &(list->back);
+  list->front._prev = NULL;
+  list->back._prev = &(list->front);
+  list->back._next = NULL;
+  list->pool = pool;
 }
 
-sraSpanList *
-sraSpanListDup(const sraSpanList *src) {
+static sraSpanList *
+sraSpanListDup(sraSpanPool *pool, const sraSpanList *src) {
   sraSpanList *newlist;
   sraSpan *newspan, *curr;
 
   if (!src) return NULL;
-  newlist = sraSpanListCreate();
+  newlist = sraPoolGetList(pool);
+  sraSpanListInit(newlist, pool);
   curr = src->front._next;
   while (curr != &(src->back)) {
-    newspan = sraSpanDup(curr);
+    newspan = sraSpanCreate(pool, curr->start, curr->end, curr->subspan);
     sraSpanInsertBefore(newspan, &(newlist->back));
     curr = curr->_next;
   }
@@ -141,33 +247,21 @@ sraSpanListDup(const sraSpanList *src) {
   return newlist;
 }
 
-void
-sraSpanListDestroy(sraSpanList *list) {
-  sraSpan *curr, *next;
+static void
+sraSpanListMakeEmpty(sraSpanList *list) {
+  sraSpan *curr;
   while (list->front._next != &(list->back)) {
     curr = list->front._next;
-    next = curr->_next;
     sraSpanRemove(curr);
-    sraSpanDestroy(curr);
-    curr = next;
+    sraSpanDestroy(list->pool, curr);
   }
-  free(list);
 }
 
+/* only for the lists of a region's spans; see sraRgnDestroy */
 static void
-sraSpanListMakeEmpty(sraSpanList *list) {
-  sraSpan *curr, *next;
-  while (list->front._next != &(list->back)) {
-    curr = list->front._next;
-    next = curr->_next;
-    sraSpanRemove(curr);
-    sraSpanDestroy(curr);
-    curr = next;
-  }
-  list->front._next = &(list->back);
-  list->front._prev = NULL;
-  list->back._prev = &(list->front);
-  list->back._next = NULL;
+sraSpanListDestroy(sraSpanList *list) {
+  sraSpanListMakeEmpty(list);
+  sraPoolPutList(list->pool, list);
 }
 
 static rfbBool
@@ -224,7 +318,7 @@ sraSpanListCount(const sraSpanList *list) {
 }
 
 static void
-sraSpanMergePrevious(sraSpan *dest) {
+sraSpanMergePrevious(sraSpanPool *pool, sraSpan *dest) {
   sraSpan *prev = dest->_prev;
  
   while ((prev->_prev) &&
@@ -239,13 +333,13 @@ sraSpanMergePrevious(sraSpan *dest) {
     */
     dest->start = prev->start;
     sraSpanRemove(prev);
-    sraSpanDestroy(prev);
+    sraSpanDestroy(pool, prev);
     prev = dest->_prev;
   }
 }    
 
 static void
-sraSpanMergeNext(sraSpan *dest) {
+sraSpanMergeNext(sraSpanPool *pool, sraSpan *dest) {
   sraSpan *next = dest->_next;
   while ((next->_next) &&
 	 (next->start == dest->end) &&
@@ -259,7 +353,7 @@ sraSpanMergeNext(sraSpan *dest) {
 	*/
     dest->end = next->end;
     sraSpanRemove(next);
-    sraSpanDestroy(next);
+    sraSpanDestroy(pool, next);
     next = dest->_next;
   }
 }
@@ -289,11 +383,11 @@ sraSpanListOr(sraSpanList *dest, const sraSpanList *src) {
     if ((d_curr == &(dest->back)) ||
 		(d_curr->start >= s_end)) {
       /* - Add the span */
-      sraSpanInsertBefore(sraSpanCreate(s_start, s_end,
+      sraSpanInsertBefore(sraSpanCreate(dest->pool, s_start, s_end,
 					s_curr->subspan),
 			  d_curr);
       if (d_curr != &(dest->back))
-	sraSpanMergePrevious(d_curr);
+	sraSpanMergePrevious(dest->pool, d_curr);
       s_curr = s_curr->_next;
       s_start = s_curr->start;
       s_end = s_curr->end;
@@ -305,23 +399,23 @@ sraSpanListOr(sraSpanList *dest, const sraSpanList *src) {
 
 	/* - Insert new span before the existing destination one? */
 	if (s_start < d_curr->start) {
-	  sraSpanInsertBefore(sraSpanCreate(s_start,
+	  sraSpanInsertBefore(sraSpanCreate(dest->pool, s_start,
 					    d_curr->start,
 					    s_curr->subspan),
 			      d_curr);
-	  sraSpanMergePrevious(d_curr);
+	  sraSpanMergePrevious(dest->pool, d_curr);
 	}
 
 	/* Split the existing span if necessary */
 	if (s_end < d_curr->end) {
-	  sraSpanInsertAfter(sraSpanCreate(s_end,
+	  sraSpanInsertAfter(sraSpanCreate(dest->pool, s_end,
 					   d_curr->end,
 					   d_curr->subspan),
 			     d_curr);
 	  d_curr->end = s_end;
 	}
 	if (s_start > d_curr->start) {
-	  sraSpanInsertBefore(sraSpanCreate(d_curr->start,
+	  sraSpanInsertBefore(sraSpanCreate(dest->pool, d_curr->start,
 					    s_start,
 					    d_curr->subspan),
 			      d_curr);
@@ -333,9 +427,9 @@ sraSpanListOr(sraSpanList *dest, const sraSpanList *src) {
 
 	/* Merge this span with previous or next? */
 	if (d_curr->_prev != &(dest->front))
-	  sraSpanMergePrevious(d_curr);
+	  sraSpanMergePrevious(dest->pool, d_curr);
 	if (d_curr->_next != &(dest->back))
-	  sraSpanMergeNext(d_curr);
+	  sraSpanMergeNext(dest->pool, d_curr);
 
 	/* Move onto the next pair to compare */
 	if (s_end > d_curr->end) {
@@ -381,7 +475,7 @@ sraSpanListAnd(sraSpanList *dest, const sraSpanList *src) {
     if (d_curr->end <= s_curr->start) {
       sraSpan *next = d_curr->_next;
       sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
+      sraSpanDestroy(dest->pool, d_curr);
       d_curr = next;
       continue;
     }
@@ -393,7 +487,7 @@ sraSpanListAnd(sraSpanList *dest, const sraSpanList *src) {
     }
     if (s_curr->end < d_curr->end) {
       /* - The end of the span does not match */
-      sraSpanInsertAfter(sraSpanCreate(s_curr->end,
+      sraSpanInsertAfter(sraSpanCreate(dest->pool, s_curr->end,
 				       d_curr->end,
 				       d_curr->subspan),
 			 d_curr);
@@ -405,12 +499,12 @@ sraSpanListAnd(sraSpanList *dest, const sraSpanList *src) {
       /* - The destination subspan is now empty, so we should remove it */
 		sraSpan *next = d_curr->_next;
       sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
+      sraSpanDestroy(dest->pool, d_curr);
       d_curr = next;
     } else {
       /* Merge this span with previous or next? */
       if (d_curr->_prev != &(dest->front))
-	sraSpanMergePrevious(d_curr);
+	sraSpanMergePrevious(dest->pool, d_curr);
 
       /* - Move on to the next span */
       d_next = d_curr;
@@ -427,7 +521,7 @@ sraSpanListAnd(sraSpanList *dest, const sraSpanList *src) {
   while (d_curr != &(dest->back)) {
     sraSpan *next = d_curr->_next;
     sraSpanRemove(d_curr);
-    sraSpanDestroy(d_curr);
+    sraSpanDestroy(dest->pool, d_curr);
     d_curr=next;
   }
 
@@ -465,14 +559,14 @@ sraSpanListSubtract(sraSpanList *dest, const sraSpanList *src) {
 
     /* - If we partially overlap the current span then split it up */
     if (s_curr->start > d_curr->start) {
-      sraSpanInsertBefore(sraSpanCreate(d_curr->start,
+      sraSpanInsertBefore(sraSpanCreate(dest->pool, d_curr->start,
 					s_curr->start,
 					d_curr->subspan),
 			  d_curr);
       d_curr->start = s_curr->start;
     }
     if (s_curr->end < d_curr->end) {
-      sraSpanInsertAfter(sraSpanCreate(s_curr->end,
+      sraSpanInsertAfter(sraSpanCreate(dest->pool, s_curr->end,
 				       d_curr->end,
 				       d_curr->subspan),
 			 d_curr);
@@ -484,14 +578,14 @@ sraSpanListSubtract(sraSpanList *dest, const sraSpanList *src) {
       /* - The destination subspan is now empty, so we should remove it */
       sraSpan *next = d_curr->_next;
       sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
+      sraSpanDestroy(dest->pool, d_curr);
       d_curr = next;
     } else {
       /* Merge this span with previous or next? */
       if (d_curr->_prev != &(dest->front))
-	sraSpanMergePrevious(d_curr);
+	sraSpanMergePrevious(dest->pool, d_curr);
       if (d_curr->_next != &(dest->back))
-	sraSpanMergeNext(d_curr);
+	sraSpanMergeNext(dest->pool, d_curr);
 
       /* - Move on to the next span */
       if (s_curr->end > d_curr->end) {
@@ -505,11 +599,284 @@ sraSpanListSubtract(sraSpanList *dest, const sraSpanList *src) {
   return !sraSpanListEmpty(dest);
 }
 
+/* -=- Tiles
+ *
+ * A region which is allowed to (see sraRgnAllowTiles) turns into a bitmap
+ * of square tiles once it breaks up into more than SRA_TILE_RECTS
+ * rectangles, and back into spans when at most SRA_SPAN_TILES tiles are
+ * left.  While it is tiled, its span list is empty and the region is
+ * exactly the set tiles, cut off at tilesWidth x tilesHeight.  Whatever is
+ * combined with it is rounded to whole tiles such that the region can only
+ * grow: outwards for sraRgnOr and sraRgnAnd, inwards for sraRgnSubtract.
+ * Tiled regions of the same size combine a word of tiles at a time.
+ */
+
+#define SRA_TILE_SIZE 16
+#define SRA_TILE_RECTS 128
+#define SRA_SPAN_TILES 16
+
+typedef unsigned long sraTileWord;
+#define SRA_WORD_BITS (8 * (int)sizeof(sraTileWord))
+
+typedef struct sraTiles {
+  int size;			/* of a tile, in pixels */
+  int columns, rows, words;	/* words per row */
+  rfbBool active;		/* the region is in bits, not in its spans */
+  sraTileWord *bits, *scratch;	/* rows * words each */
+} sraTiles;
+
+/* the size of new tiles; the self test uses others */
+static int sraTileSize = SRA_TILE_SIZE;
+
+static sraTiles *
+sraActiveTiles(const sraRegion *rgn) {
+  sraTiles *tiles = ((const sraRegionHead*)rgn)->tiles;
+  return tiles && tiles->active ? tiles : NULL;
+}
+
+static sraTiles *
+sraTilesGet(sraRegionHead *head, int size) {
+  sraTiles *t = head->tiles;
+  int columns, rows, words;
+
+  if (t && t->size == size)
+    return t;
+  free(t);
+  columns = (head->tilesWidth + size - 1) / size;
+  rows = (head->tilesHeight + size - 1) / size;
+  words = (columns + SRA_WORD_BITS - 1) / SRA_WORD_BITS;
+  t = (sraTiles*)malloc(sizeof(sraTiles) + 2 * sizeof(sraTileWord) * rows * words);
+  if ((head->tiles = t) == NULL)
+    return NULL;
+  t->size = size;
+  t->columns = columns;
+  t->rows = rows;
+  t->words = words;
+  t->active = FALSE;
+  t->bits = (sraTileWord*)(t + 1);
+  t->scratch = t->bits + rows * words;
+  return t;
+}
+
+static void
+sraTilesFill(sraTiles *t, sraTileWord *bits, int c1, int r1, int c2, int r2) {
+  int w1 = c1 / SRA_WORD_BITS, w2 = (c2 - 1) / SRA_WORD_BITS, w;
+  sraTileWord m1 = ~(sraTileWord)0 << (c1 % SRA_WORD_BITS);
+  sraTileWord m2 = ~(sraTileWord)0 >> (SRA_WORD_BITS - 1 - (c2 - 1) % SRA_WORD_BITS);
+  sraTileWord *row;
+
+  for (row = bits + r1 * t->words; r1 < r2; r1++, row += t->words) {
+    if (w1 == w2) {
+      row[w1] |= m1 & m2;
+      continue;
+    }
+    row[w1] |= m1;
+    for (w = w1 + 1; w < w2; w++)
+      row[w] = ~(sraTileWord)0;
+    row[w2] |= m2;
+  }
+}
+
+static void
+sraTilesAddRect(const sraRegionHead *head, sraTileWord *bits,
+		int x1, int y1, int x2, int y2, rfbBool inner) {
+  sraTiles *t = head->tiles;
+  int size = t->size, c1, r1, c2, r2;
+
+  if (x1 < 0) x1 = 0;
+  if (y1 < 0) y1 = 0;
+  if (x2 > head->tilesWidth) x2 = head->tilesWidth;
+  if (y2 > head->tilesHeight) y2 = head->tilesHeight;
+  if (x1 >= x2 || y1 >= y2)
+    return;
+
+  if (inner) {
+    /* only the tiles the rectangle covers, up to the edge */
+    c1 = (x1 + size - 1) / size;
+    r1 = (y1 + size - 1) / size;
+    c2 = x2 == head->tilesWidth ? t->columns : x2 / size;
+    r2 = y2 == head->tilesHeight ? t->rows : y2 / size;
+  } else {
+    c1 = x1 / size;
+    r1 = y1 / size;
+    c2 = (x2 + size - 1) / size;
+    r2 = (y2 + size - 1) / size;
+  }
+  if (c1 < c2 && r1 < r2)
+    sraTilesFill(t, bits, c1, r1, c2, r2);
+}
+
+static void
+sraTilesAddRegion(const sraRegionHead *head, sraTileWord *bits,
+		  const sraRegion *src, rfbBool inner) {
+  const sraRegionHead *shead = (const sraRegionHead*)src;
+  sraTiles *t = head->tiles, *s = sraActiveTiles(src);
+  sraRectangleIterator *i;
+  sraRect rect;
+  int n;
+
+  if (s && s->size == t->size && shead->tilesWidth == head->tilesWidth &&
+      shead->tilesHeight == head->tilesHeight) {
+    for (n = 0; n < t->rows * t->words; n++)
+      bits[n] |= s->bits[n];
+    return;
+  }
+
+  i = sraRgnGetIterator((sraRegion*)src);
+  while (sraRgnIteratorNext(i, &rect))
+    sraTilesAddRect(head, bits, rect.x1, rect.y1, rect.x2, rect.y2, inner);
+  sraRgnReleaseIterator(i);
+}
+
+static int
+sraBitCount(sraTileWord word) {
+#ifdef __GNUC__
+  return __builtin_popcountl(word);
+#else
+  int count = 0;
+  for (; word; word &= word - 1)
+    count++;
+  return count;
+#endif
+}
+
+static unsigned long
+sraTilesCount(const sraTiles *t) {
+  unsigned long count = 0;
+  int n;
+
+  for (n = 0; n < t->rows * t->words; n++)
+    if (t->bits[n])
+      count += sraBitCount(t->bits[n]);
+  return count;
+}
+
+/* finds the run of set tiles in row starting at or after column c */
+static rfbBool
+sraTilesNextRun(const sraTiles *t, const sraTileWord *row, int c, int *c1, int *c2) {
+  while (c < t->columns && !(row[c / SRA_WORD_BITS] >> (c % SRA_WORD_BITS)))
+    c = (c / SRA_WORD_BITS + 1) * SRA_WORD_BITS;
+  while (c < t->columns && !(row[c / SRA_WORD_BITS] >> (c % SRA_WORD_BITS) & 1))
+    c++;
+  if (c >= t->columns)
+    return FALSE;
+  *c1 = c;
+  while (c < t->columns && (row[c / SRA_WORD_BITS] >> (c % SRA_WORD_BITS) & 1))
+    c++;
+  *c2 = c;
+  return TRUE;
+}
+
+/* Rows of tiles become bands of spans; equal rows share a band, so every
+   rectangle is as high as it can be. */
+static void
+sraTilesToSpans(const sraRegionHead *head, sraSpanList *list) {
+  const sraTiles *t = head->tiles;
+  const sraTileWord *row = t->bits, *prev = NULL;
+  sraSpan *band = NULL;
+  sraSpanList *hlist;
+  int r, c, c1, c2, y1, y2;
+
+  for (r = 0; r < t->rows; r++, prev = row, row += t->words) {
+    y1 = r * t->size;
+    y2 = y1 + t->size > head->tilesHeight ? head->tilesHeight : y1 + t->size;
+    if (band && !memcmp(row, prev, t->words * sizeof(sraTileWord))) {
+      band->end = y2;
+      continue;
+    }
+    band = NULL;
+    for (c = 0, hlist = NULL; sraTilesNextRun(t, row, c, &c1, &c2); c = c2) {
+      if (!hlist) {
+	hlist = sraPoolGetList(list->pool);
+	sraSpanListInit(hlist, list->pool);
+      }
+      sraSpanInsertBefore(sraSpanCreate(list->pool, c1 * t->size,
+					c2 * t->size > head->tilesWidth ?
+					head->tilesWidth : c2 * t->size, NULL),
+			  &(hlist->back));
+    }
+    if (hlist) {
+      band = sraSpanCreate(list->pool, y1, y2, NULL);
+      band->subspan = hlist;
+      sraSpanInsertBefore(band, &(list->back));
+    }
+  }
+}
+
+/* the same as sraSpanListCount of what sraTilesToSpans makes */
+static unsigned long
+sraTilesCountRects(const sraTiles *t) {
+  const sraTileWord *row = t->bits, *prev = NULL;
+  unsigned long count = 0;
+  int r, c, c1, c2;
+
+  for (r = 0; r < t->rows; r++, prev = row, row += t->words) {
+    if (prev && !memcmp(row, prev, t->words * sizeof(sraTileWord)))
+      continue;
+    for (c = 0; sraTilesNextRun(t, row, c, &c1, &c2); c = c2)
+      count++;
+  }
+  return count;
+}
+
+static void sraRgnResetSpans(sraRegionHead *head);
+
+static void
+sraTilesFromSpans(sraRegionHead *head) {
+  sraTiles *t = sraTilesGet(head, sraTileSize);
+  sraSpan *vcurr, *hcurr;
+
+  /* without the memory, it stays in spans */
+  if (!t)
+    return;
+
+  memset(t->bits, 0, sizeof(sraTileWord) * t->rows * t->words);
+  for (vcurr = head->list.front._next; vcurr != &(head->list.back);
+       vcurr = vcurr->_next)
+    for (hcurr = vcurr->subspan->front._next; hcurr != &(vcurr->subspan->back);
+	 hcurr = hcurr->_next)
+      sraTilesAddRect(head, t->bits, hcurr->start, vcurr->start,
+		      hcurr->end, vcurr->end, FALSE);
+  sraRgnResetSpans(head);
+  t->active = TRUE;
+}
+
+static void
+sraTilesEnd(sraRegionHead *head) {
+  sraTilesToSpans(head, &head->list);
+  head->tiles->active = FALSE;
+}
+
+/* after tiles were taken away */
+static void
+sraTilesSettle(sraRegionHead *head) {
+  if (sraTilesCount(head->tiles) <= SRA_SPAN_TILES)
+    sraTilesEnd(head);
+}
+
+/* a region of spans with the same rectangles as a tiled one */
+static sraRegion *
+sraTilesCopySpans(const sraRegion *rgn) {
+  sraRegion *copy = sraRgnCreate();
+  if (copy)
+    sraTilesToSpans((const sraRegionHead*)rgn, copy);
+  return copy;
+}
+
 /* -=- Region routines */
 
 sraRegion *
 sraRgnCreate(void) {
-  return (sraRegion*)sraSpanListCreate();
+  sraRegionHead *head = (sraRegionHead*)malloc(sizeof(sraRegionHead));
+  if (!head)
+    return NULL;
+  memset(&head->pool, 0, sizeof(head->pool));
+  head->pool.unused = (char*)head->first;
+  head->pool.end = (char*)(head->first + SRA_FIRST_SPANS);
+  sraSpanListInit(&head->list, &head->pool);
+  head->tilesWidth = head->tilesHeight = 0;
+  head->tiles = NULL;
+  return &head->list;
 }
 
 sraRegion *
@@ -517,57 +884,182 @@ sraRgnCreateRect(int x1, int y1, int x2, int y2) {
   sraSpanList *vlist, *hlist;
   sraSpan *vspan, *hspan;
 
+  vlist = sraRgnCreate();
+  if (!vlist)
+    return NULL;
+
   /* - Build the horizontal portion of the span */
-  hlist = sraSpanListCreate();
-  hspan = sraSpanCreate(x1, x2, NULL);
+  hlist = sraPoolGetList(vlist->pool);
+  sraSpanListInit(hlist, vlist->pool);
+  hspan = sraSpanCreate(vlist->pool, x1, x2, NULL);
   sraSpanInsertAfter(hspan, &(hlist->front));
 
   /* - Build the vertical portion of the span */
-  vlist = sraSpanListCreate();
-  vspan = sraSpanCreate(y1, y2, hlist);
+  vspan = sraSpanCreate(vlist->pool, y1, y2, NULL);
+  vspan->subspan = hlist;
   sraSpanInsertAfter(vspan, &(vlist->front));
 
-  sraSpanListDestroy(hlist);
-
   return (sraRegion*)vlist;
 }
 
 sraRegion *
 sraRgnCreateRgn(const sraRegion *src) {
-  return (sraRegion*)sraSpanListDup((sraSpanList*)src);
+  const sraRegionHead *shead = (const sraRegionHead*)src;
+  sraRegionHead *head;
+  sraSpanList *newlist;
+  sraSpan *curr;
+  sraTiles *s, *t;
+
+  if (!src || !(newlist = sraRgnCreate()))
+    return NULL;
+  head = (sraRegionHead*)newlist;
+  head->tilesWidth = shead->tilesWidth;
+  head->tilesHeight = shead->tilesHeight;
+  if ((s = sraActiveTiles(src)) != NULL) {
+    if ((t = sraTilesGet(head, s->size)) != NULL) {
+      memcpy(t->bits, s->bits, sizeof(sraTileWord) * t->rows * t->words);
+      t->active = TRUE;
+    } else
+      sraTilesToSpans(shead, newlist);
+    return newlist;
+  }
+  curr = src->front._next;
+  while (curr != &(src->back)) {
+    sraSpanInsertBefore(sraSpanCreate(newlist->pool, curr->start, curr->end,
+				      curr->subspan),
+			&(newlist->back));
+    curr = curr->_next;
+  }
+  return (sraRegion*)newlist;
 }
 
 void
 sraRgnDestroy(sraRegion *rgn) {
-  sraSpanListDestroy((sraSpanList*)rgn);
+  /* every span is in the pool */
+  sraPoolFreeChunks(rgn->pool);
+  free(((sraRegionHead*)rgn)->tiles);
+  free(rgn);
+}
+
+static void
+sraRgnResetSpans(sraRegionHead *head) {
+  sraPoolFreeChunks(&head->pool);
+  memset(&head->pool, 0, sizeof(head->pool));
+  head->pool.unused = (char*)head->first;
+  head->pool.end = (char*)(head->first + SRA_FIRST_SPANS);
+  sraSpanListInit(&head->list, &head->pool);
 }
 
 void
 sraRgnMakeEmpty(sraRegion *rgn) {
-  sraSpanListMakeEmpty((sraSpanList*)rgn);
+  sraRegionHead *head = (sraRegionHead*)rgn;
+
+  sraRgnResetSpans(head);
+  if (head->tiles)
+    head->tiles->active = FALSE;
+}
+
+void
+sraRgnAllowTiles(sraRegion *rgn, int width, int height) {
+  sraRegionHead *head = (sraRegionHead*)rgn;
+
+  if (head->tiles) {
+    if (head->tiles->active)
+      sraTilesEnd(head);
+    free(head->tiles);
+    head->tiles = NULL;
+  }
+  head->tilesWidth = width > 0 && height > 0 ? width : 0;
+  head->tilesHeight = width > 0 && height > 0 ? height : 0;
 }
 
 /* -=- Boolean Region ops */
 
 rfbBool
 sraRgnAnd(sraRegion *dst, const sraRegion *src) {
-  return sraSpanListAnd((sraSpanList*)dst, (sraSpanList*)src);
+  sraRegionHead *head = (sraRegionHead*)dst;
+  sraTiles *t = sraActiveTiles(dst);
+  sraRegion *tmp = NULL;
+  rfbBool result;
+  int n;
+
+  if (t) {
+    memset(t->scratch, 0, sizeof(sraTileWord) * t->rows * t->words);
+    sraTilesAddRegion(head, t->scratch, src, FALSE);
+    for (n = 0; n < t->rows * t->words; n++)
+      t->bits[n] &= t->scratch[n];
+    sraTilesSettle(head);
+    return sraRgnEmpty(dst) ? FALSE : TRUE;
+  }
+
+  if (sraActiveTiles(src))
+    src = tmp = sraTilesCopySpans(src);
+  result = sraSpanListAnd((sraSpanList*)dst, (sraSpanList*)src);
+  if (tmp)
+    sraRgnDestroy(tmp);
+  if (result)
+    return TRUE;
+  sraRgnMakeEmpty(dst);
+  return FALSE;
 }
 
 void
 sraRgnOr(sraRegion *dst, const sraRegion *src) {
+  sraRegionHead *head = (sraRegionHead*)dst;
+  sraTiles *t = sraActiveTiles(dst);
+  sraRegion *tmp = NULL;
+
+  if (t) {
+    sraTilesAddRegion(head, t->bits, src, FALSE);
+    return;
+  }
+
+  if (sraActiveTiles(src))
+    src = tmp = sraTilesCopySpans(src);
   sraSpanListOr((sraSpanList*)dst, (sraSpanList*)src);
+  if (tmp)
+    sraRgnDestroy(tmp);
+  if (head->tilesWidth && head->pool.spans > SRA_TILE_RECTS &&
+      sraSpanListCount(dst) > SRA_TILE_RECTS)
+    sraTilesFromSpans(head);
 }
 
 rfbBool
 sraRgnSubtract(sraRegion *dst, const sraRegion *src) {
-  return sraSpanListSubtract((sraSpanList*)dst, (sraSpanList*)src);
+  sraRegionHead *head = (sraRegionHead*)dst;
+  sraTiles *t = sraActiveTiles(dst);
+  sraRegion *tmp = NULL;
+  rfbBool result;
+  int n;
+
+  if (t) {
+    memset(t->scratch, 0, sizeof(sraTileWord) * t->rows * t->words);
+    sraTilesAddRegion(head, t->scratch, src, TRUE);
+    for (n = 0; n < t->rows * t->words; n++)
+      t->bits[n] &= ~t->scratch[n];
+    sraTilesSettle(head);
+    return sraRgnEmpty(dst) ? FALSE : TRUE;
+  }
+
+  if (sraActiveTiles(src))
+    src = tmp = sraTilesCopySpans(src);
+  result = sraSpanListSubtract((sraSpanList*)dst, (sraSpanList*)src);
+  if (tmp)
+    sraRgnDestroy(tmp);
+  if (result)
+    return TRUE;
+  sraRgnMakeEmpty(dst);
+  return FALSE;
 }
 
 void
 sraRgnOffset(sraRegion *dst, int dx, int dy) {
   sraSpan *vcurr, *hcurr;
 
+  /* tiles only move by whole tiles */
+  if (sraActiveTiles(dst))
+    sraTilesEnd((sraRegionHead*)dst);
+
   vcurr = ((sraSpanList*)dst)->front._next;
   while (vcurr != &(((sraSpanList*)dst)->back)) {
     vcurr->start += dy;
@@ -591,6 +1083,12 @@ sraRegion *sraRgnBBox(const sraRegion *src) {
   if(!src)
     return sraRgnCreate();
 
+  if(sraActiveTiles(src)) {
+    sraRegion *tmp = sraTilesCopySpans(src), *bbox = sraRgnBBox(tmp);
+    sraRgnDestroy(tmp);
+    return bbox;
+  }
+
   vcurr = ((sraSpanList*)src)->front._next;
   while (vcurr != &(((sraSpanList*)src)->back)) {
     if(vcurr->start<ymin)
@@ -623,6 +1121,9 @@ sraRgnPopRect(sraRegion *rgn, sraRect *rect, unsigned long flags) {
   rfbBool right2left = (flags & 2) == 2;
   rfbBool bottom2top = (flags & 1) == 1;
 
+  if (sraActiveTiles(rgn))
+    sraTilesEnd((sraRegionHead*)rgn);
+
   /* - Pick correct order */
   if (bottom2top) {
     vcurr = ((sraSpanList*)rgn)->back._prev;
@@ -650,11 +1151,13 @@ sraRgnPopRect(sraRegion *rgn, sraRect *rect, unsigned long flags) {
       rect->x2 = hcurr->end;
 
       sraSpanRemove(hcurr);
-      sraSpanDestroy(hcurr);
+      sraSpanDestroy(rgn->pool, hcurr);
       
       if (sraSpanListEmpty(vcurr->subspan)) {
 	sraSpanRemove(vcurr);
-	sraSpanDestroy(vcurr);
+	sraSpanDestroy(rgn->pool, vcurr);
+	if (sraSpanListEmpty(rgn))
+	  sraRgnMakeEmpty(rgn);
       }
 
 #if 0
@@ -670,12 +1173,25 @@ sraRgnPopRect(sraRegion *rgn, sraRect *rect, unsigned long flags) {
 
 unsigned long
 sraRgnCountRects(const sraRegion *rgn) {
-  unsigned long count = sraSpanListCount((sraSpanList*)rgn);
+  unsigned long count;
+  sraTiles *t = sraActiveTiles(rgn);
+  if (t)
+    return sraTilesCountRects(t);
+  count = sraSpanListCount((sraSpanList*)rgn);
   return count;
 }
 
 rfbBool
 sraRgnEmpty(const sraRegion *rgn) {
+  sraTiles *t = sraActiveTiles(rgn);
+  int n;
+
+  if (t) {
+    for (n = 0; n < t->rows * t->words; n++)
+      if (t->bits[n])
+	return FALSE;
+    return TRUE;
+  }
   return sraSpanListEmpty((sraSpanList*)rgn);
 }
 
@@ -685,8 +1201,10 @@ sraRectangleIterator *sraRgnGetIterator(sraRegion *s)
   /* these values have to be multiples of 4 */
 #define DEFSIZE 4
 #define DEFSTEP 8
+  /* the first DEFSIZE sPtrs come with the iterator */
   sraRectangleIterator *i =
-    (sraRectangleIterator*)malloc(sizeof(sraRectangleIterator));
+    (sraRectangleIterator*)malloc(sizeof(sraRectangleIterator)+
+				  sizeof(sraSpan*)*DEFSIZE);
   if(!i)
     return NULL;
 
@@ -694,12 +1212,14 @@ sraRectangleIterator *sraRgnGetIterator(sraRegion *s)
      the sraSpan in the first level. the second sPtr is the pointer to
      the sraRegion.back. The third and fourth sPtr are for the second
      recursion level and so on. */
-  i->sPtrs = (sraSpan**)malloc(sizeof(sraSpan*)*DEFSIZE);
-  if(!i->sPtrs) {
-    free(i);
-    return NULL;
-  }
+  i->sPtrs = (sraSpan**)(i+1);
   i->ptrSize = DEFSIZE;
+
+  /* tiles are handed out as the spans they make up */
+  i->copy = NULL;
+  if(sraActiveTiles(s))
+    s = i->copy = sraTilesCopySpans(s);
+
   i->sPtrs[0] = &(s->front);
   i->sPtrs[1] = &(s->back);
   i->ptrPos = 0;
@@ -711,6 +1231,8 @@ sraRectangleIterator *sraRgnGetIterator(sraRegion *s)
 sraRectangleIterator *sraRgnGetReverseIterator(sraRegion *s,rfbBool reverseX,rfbBool reverseY)
 {
   sraRectangleIterator *i = sraRgnGetIterator(s);
+  if(i->copy)
+    s = i->copy;
   if(reverseY) {
     i->sPtrs[1] = &(s->front);
     i->sPtrs[0] = &(s->back);
@@ -748,8 +1270,12 @@ rfbBool sraRgnIteratorNext(sraRectangleIterator* i,sraRect* r)
   /* is this a new subspan? */
   while(i->sPtrs[i->ptrPos]->subspan) {
     if(i->ptrPos+2 > i->ptrSize) { /* array is too small */
+      sraSpan** sPtrs = (sraSpan**)malloc(sizeof(sraSpan*)*(i->ptrSize+DEFSTEP));
+      memcpy(sPtrs, i->sPtrs, sizeof(sraSpan*)*i->ptrSize);
+      if(i->sPtrs != (sraSpan**)(i+1))
+        free(i->sPtrs);
+      i->sPtrs = sPtrs;
       i->ptrSize += DEFSTEP;
-      i->sPtrs = (sraSpan**)realloc(i->sPtrs, sizeof(sraSpan*)*i->ptrSize);
     }
     i->ptrPos =+ 2;
     if(sraReverse(i)) {
@@ -776,13 +1302,22 @@ rfbBool sraRgnIteratorNext(sraRectangleIterator* i,sraRect* r)
 
 void sraRgnReleaseIterator(sraRectangleIterator* i)
 {
-  free(i->sPtrs);
+  if(i->copy)
+    sraRgnDestroy(i->copy);
+  if(i->sPtrs != (sraSpan**)(i+1))
+    free(i->sPtrs);
   free(i);
 }
 
 void
 sraRgnPrint(const sraRegion *rgn) {
-	sraSpanListPrint((sraSpanList*)rgn);
+	if (sraActiveTiles(rgn)) {
+		sraRegion *tmp = sraTilesCopySpans(rgn);
+		printf("tiles");
+		sraSpanListPrint((sraSpanList*)tmp);
+		sraRgnDestroy(tmp);
+	} else
+		sraSpanListPrint((sraSpanList*)rgn);
 }
 
 rfbBool
@@ -830,7 +1365,259 @@ sraClipRect2(int *x, int *y, int *x2, int *y2,
 /* test */
 
 #ifdef SRA_TEST
-/* pipe the output to sort|uniq -u and you'll get the errors. */
+#include <sys/time.h>
+
+/* -=- random regions, checked against a bitmap */
+
+#define TEST_SIZE 80
+
+typedef unsigned char sraTestMap[TEST_SIZE][TEST_SIZE];
+
+static sraRegion *
+randomRegion(sraTestMap map) {
+  sraRegion *region = sraRgnCreate(), *rect;
+  int n = rand() % 6, x1, y1, x2, y2, x, y;
+
+  memset(map, 0, sizeof(sraTestMap));
+  while (n-- > 0) {
+    x1 = rand() % TEST_SIZE; x2 = x1 + 1 + rand() % (TEST_SIZE - x1);
+    y1 = rand() % TEST_SIZE; y2 = y1 + 1 + rand() % (TEST_SIZE - y1);
+    rect = sraRgnCreateRect(x1, y1, x2, y2);
+    sraRgnOr(region, rect);
+    sraRgnDestroy(rect);
+    for (y = y1; y < y2; y++)
+      for (x = x1; x < x2; x++)
+	map[y][x] = 1;
+  }
+  return region;
+}
+
+/* turn region into tiles, as if it had broken up, and tell what it is now */
+static void
+makeTiled(sraRegion *region, sraTestMap map) {
+  sraRectangleIterator *i;
+  sraRect rect;
+  int x, y;
+
+  sraRgnAllowTiles(region, TEST_SIZE, TEST_SIZE);
+  sraTilesFromSpans((sraRegionHead*)region);
+  memset(map, 0, sizeof(sraTestMap));
+  i = sraRgnGetIterator(region);
+  while (sraRgnIteratorNext(i, &rect))
+    for (y = rect.y1; y < rect.y2; y++)
+      for (x = rect.x1; x < rect.x2; x++)
+	map[y][x] = 1;
+  sraRgnReleaseIterator(i);
+}
+
+/* the rectangles have to cover at least lower and at most upper, and
+   nothing twice */
+static rfbBool
+coversMap(sraRegion *region, sraTestMap lower, sraTestMap upper) {
+  sraTestMap seen;
+  sraRectangleIterator *i;
+  sraRect rect;
+  rfbBool empty = TRUE;
+  unsigned long count = 0;
+  int x, y;
+
+  memset(seen, 0, sizeof(seen));
+  i = sraRgnGetIterator(region);
+  while (sraRgnIteratorNext(i, &rect)) {
+    count++;
+    for (y = rect.y1; y < rect.y2; y++)
+      for (x = rect.x1; x < rect.x2; x++) {
+	if (x < 0 || y < 0 || x >= TEST_SIZE || y >= TEST_SIZE || seen[y][x]++) {
+	  sraRgnReleaseIterator(i);
+	  return FALSE;
+	}
+      }
+  }
+  sraRgnReleaseIterator(i);
+  for (y = 0; y < TEST_SIZE; y++)
+    for (x = 0; x < TEST_SIZE; x++) {
+      if (seen[y][x] < lower[y][x] || seen[y][x] > upper[y][x])
+	return FALSE;
+      if (seen[y][x])
+	empty = FALSE;
+    }
+  return !sraRgnEmpty(region) == !empty && sraRgnCountRects(region) == count;
+}
+
+/* what adding map to a tiled region gives */
+static void
+roundOut(sraTestMap map) {
+  int size = sraTileSize, tx, ty, x, y, set;
+
+  for (ty = 0; ty < TEST_SIZE; ty += size)
+    for (tx = 0; tx < TEST_SIZE; tx += size) {
+      for (set = 0, y = ty; y < ty + size && y < TEST_SIZE; y++)
+	for (x = tx; x < tx + size && x < TEST_SIZE; x++)
+	  set |= map[y][x];
+      for (y = ty; y < ty + size && y < TEST_SIZE; y++)
+	for (x = tx; x < tx + size && x < TEST_SIZE; x++)
+	  map[y][x] = set;
+    }
+}
+
+/* Combines random regions, some of them tiled, with tiles of random sizes.
+   A tiled result may cover more than it should, but only within the tiles
+   it is allowed to grow to. */
+static int
+randomTest(int rounds) {
+  sraTestMap a, b, expected, upper;
+  sraRegion *ra, *rb, *copy;
+  sraRect rect;
+  int errors = 0, op, x, y;
+  rfbBool result, tiled;
+
+  while (rounds-- > 0) {
+    sraTileSize = 1 + rand() % 20;
+    ra = randomRegion(a);
+    rb = randomRegion(b);
+    if ((tiled = rand() % 3 == 0))
+      makeTiled(ra, a);
+    if (rand() % 3 == 0)
+      makeTiled(rb, b);
+    op = rand() % 5;
+    result = TRUE;
+    for (y = 0; y < TEST_SIZE; y++)
+      for (x = 0; x < TEST_SIZE; x++)
+	switch (op) {
+	case 0: expected[y][x] = a[y][x] | b[y][x]; break;
+	case 1: expected[y][x] = a[y][x] & b[y][x]; break;
+	case 2: expected[y][x] = a[y][x] & !b[y][x]; break;
+	default: expected[y][x] = a[y][x]; break;
+	}
+    memcpy(upper, expected, sizeof(upper));
+    switch (op) {
+    case 0:
+      sraRgnOr(ra, rb);
+      if (tiled)
+	roundOut(upper);
+      break;
+    case 1:
+      result = sraRgnAnd(ra, rb);
+      if (tiled)
+	memcpy(upper, a, sizeof(upper));
+      break;
+    case 2:
+      result = sraRgnSubtract(ra, rb);
+      if (tiled)
+	memcpy(upper, a, sizeof(upper));
+      break;
+    case 3:
+      /* a copy has to be the same, and independent of the original */
+      copy = sraRgnCreateRgn(ra);
+      sraRgnOr(ra, rb);
+      sraRgnDestroy(ra);
+      ra = copy;
+      break;
+    case 4:
+      /* popping every rectangle leaves an empty region */
+      while (sraRgnPopRect(ra, &rect, rand() % 4))
+	for (y = rect.y1; y < rect.y2; y++)
+	  for (x = rect.x1; x < rect.x2; x++)
+	    expected[y][x]--;
+      memcpy(upper, expected, sizeof(upper));
+      break;
+    }
+    if (!coversMap(ra, expected, upper) ||
+	((op == 1 || op == 2) && !result == !sraRgnEmpty(ra)))
+      errors++;
+    sraRgnDestroy(ra);
+    sraRgnDestroy(rb);
+  }
+  sraTileSize = SRA_TILE_SIZE;
+  return errors;
+}
+
+/* a region which breaks up turns into tiles, and back once it is sent */
+static int
+switchTest(void) {
+  sraRegion *region = sraRgnCreate(), *rect;
+  int n, result = 0;
+
+  sraRgnAllowTiles(region, 1024, 768);
+  for (n = 0; n < 2 * SRA_TILE_RECTS; n++) {
+    rect = sraRgnCreateRect(n * 37 % 1000, n * 101 % 760,
+			    n * 37 % 1000 + 3, n * 101 % 760 + 3);
+    sraRgnOr(region, rect);
+    sraRgnDestroy(rect);
+  }
+  if (sraActiveTiles(region))
+    result |= 1;
+  rect = sraRgnCreateRect(0, 0, 1024, 768);
+  sraRgnSubtract(region, rect);
+  sraRgnDestroy(rect);
+  if (!sraActiveTiles(region) && sraRgnEmpty(region))
+    result |= 2;
+  sraRgnDestroy(region);
+  return result;
+}
+
+/* -=- what rfbSendFramebufferUpdate does to the regions of a client */
+
+static void
+benchmark(int frames, int rects, rfbBool tiles) {
+  const int width = 1024, height = 768;
+  sraRegion *modified = sraRgnCreate(), *copy = sraRgnCreate();
+  sraRegion *requested = sraRgnCreateRect(0, 0, width, height);
+  sraRegion *update, *updateCopy, *tmp;
+  sraRectangleIterator *i;
+  sraRect rect;
+  struct timeval start, end;
+  unsigned long total = 0;
+  double us;
+  int frame, n, x, y;
+
+  if (tiles)
+    sraRgnAllowTiles(modified, width, height);
+  gettimeofday(&start, NULL);
+  for (frame = 0; frame < frames; frame++) {
+    for (n = 0; n < rects; n++) {
+      x = rand() % (width - 32);
+      y = rand() % (height - 32);
+      tmp = sraRgnCreateRect(x, y, x + 1 + rand() % 32, y + 1 + rand() % 32);
+      sraRgnOr(modified, tmp);
+      sraRgnDestroy(tmp);
+    }
+
+    update = sraRgnCreateRgn(modified);
+    sraRgnOr(update, copy);
+    sraRgnAnd(update, requested);
+    updateCopy = sraRgnCreateRgn(copy);
+    sraRgnAnd(updateCopy, requested);
+    tmp = sraRgnCreateRgn(requested);
+    sraRgnOffset(tmp, 0, 0);
+    sraRgnAnd(updateCopy, tmp);
+    sraRgnDestroy(tmp);
+    sraRgnSubtract(update, updateCopy);
+    sraRgnOr(modified, copy);
+    sraRgnSubtract(modified, update);
+    sraRgnSubtract(modified, updateCopy);
+    sraRgnMakeEmpty(copy);
+
+    total += sraRgnCountRects(update);
+    for (i = sraRgnGetIterator(update); sraRgnIteratorNext(i, &rect);)
+      ;
+    sraRgnReleaseIterator(i);
+    sraRgnDestroy(update);
+    sraRgnDestroy(updateCopy);
+  }
+  gettimeofday(&end, NULL);
+
+  us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec);
+  printf("%s: %d frames of %d dirty rectangles: %.1f us per frame, %.1f rectangles per update\n",
+	 tiles ? "tiles" : "spans", frames, rects, us / frames, (double)total / frames);
+
+  sraRgnDestroy(modified);
+  sraRgnDestroy(copy);
+  sraRgnDestroy(requested);
+}
+
+/* pipe the output to sort|uniq -u and you'll get the errors.
+   With -bench [frames] it times a client's updates instead. */
 int main(int argc, char** argv)
 {
   sraRegionPtr region, region1, region2;
@@ -838,6 +1625,20 @@ int main(int argc, char** argv)
   sraRect rect;
   rfbBool b;
 
+  if (argc > 1 && !strcmp(argv[1], "-bench")) {
+    int frames = argc > 2 ? atoi(argv[2]) : 100000;
+    rfbBool tiles;
+    for (tiles = FALSE; ; tiles = TRUE) {
+      benchmark(frames, 1, tiles);
+      benchmark(frames / 10, 20, tiles);
+      benchmark(frames / 100, 200, tiles);
+      benchmark(frames / 1000, 2000, tiles);
+      if (tiles)
+        break;
+    }
+    return(0);
+  }
+
   region = sraRgnCreateRect(10, 10, 600, 300);
   region1 = sraRgnCreateRect(40, 50, 350, 200);
   region2 = sraRgnCreateRect(0, 0, 20, 40);
@@ -877,6 +1678,9 @@ int main(int argc, char** argv)
   sraRgnReleaseIterator(i);
   printf("\n590x100+10+200 250x150+350+50 30x150+10+50 590x10+10+40 600x30+0+10 20x10+0+0 \n\n");
 
+  printf("random: %d errors\nrandom: 0 errors\n\n", randomTest(20000));
+  printf("tiles: %d\ntiles: 3\n\n", switchTest());
+
   sraRgnDestroy(region);
   sraRgnDestroy(region1);
   sraRgnDestroy(region2);
@@ -88,6 +88,9 @@ static int compat_mkdir(const char *path, int mode)
 static void rfbProcessClientProtocolVersion(rfbClientPtr cl);
 static void rfbProcessClientNormalMessage(rfbClientPtr cl);
 static void rfbProcessClientInitMessage(rfbClientPtr cl);
+static rfbBool rfbWritesDirectly(rfbClientPtr cl);
+static rfbBool rfbWriteUpdateBuf(rfbClientPtr cl, struct iovec *iov, int count);
+static void rfbTuneUpdateBuf(rfbClientPtr cl);
 
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
 void rfbIncrClientRef(rfbClientPtr cl)
@@ -280,6 +283,10 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 
     cl = (rfbClientPtr)calloc(sizeof(rfbClientRec),1);
 
+    cl->updateBuf = (char *)calloc(UPDATE_BUF_SIZE, 1);
+    cl->updateBufSize = UPDATE_BUF_SIZE;
+    cl->updateBufUsed = time(NULL);
+
     cl->screen = rfbScreen;
     cl->sock = sock;
     cl->viewOnly = FALSE;
@@ -324,6 +331,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 
       FD_SET(sock,&(rfbScreen->allFds));
 		rfbScreen->maxFd = max(sock,rfbScreen->maxFd);
+      rfbWatchSocket(rfbScreen, sock, cl, TRUE);
 
       INIT_MUTEX(cl->outputMutex);
       INIT_MUTEX(cl->refCountMutex);
@@ -340,6 +348,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 #ifdef LIBVNCSERVER_HAVE_LIBZ
       cl->zrleData = NULL;
 #endif
+      cl->captureStart = -1;
 
       cl->copyRegion = sraRgnCreate();
       cl->copyDX = 0;
@@ -347,9 +356,16 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
    
       cl->modifiedRegion =
 	sraRgnCreateRect(0,0,rfbScreen->width,rfbScreen->height);
+      /* sending a little more than was modified does no harm */
+      sraRgnAllowTiles(cl->modifiedRegion,rfbScreen->width,rfbScreen->height);
 
       INIT_MUTEX(cl->updateMutex);
       INIT_COND(cl->updateCond);
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+      cl->updateQueued = FALSE;
+      cl->updateBusy = FALSE;
+      cl->nextQueued = NULL;
+#endif
 
       cl->requestedRegion = sraRgnCreate();
 
@@ -377,6 +393,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 	for (i = 0; i < 4; i++)
           cl->zsActive[i] = FALSE;
       }
+      cl->tightData = NULL;
 #endif
 #endif
 
@@ -404,6 +421,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       cl->compStream.opaque = Z_NULL;
 
       cl->zlibCompressLevel = 5;
+      cl->zlibData = NULL;
 #endif
 
       cl->progressiveSliceY = 0;
@@ -514,6 +532,15 @@ rfbClientConnectionGone(rfbClientPtr cl)
     if(cl->sock>=0)
        FD_CLR(cl->sock,&(cl->screen->allFds));
 
+#ifdef LIBVNCSERVER_WITH_EPOLL
+    if(cl->epollReady) {
+       rfbClientPtr *link = &cl->screen->epollReadyHead;
+       while(*link != cl)
+	  link = &(*link)->epollNextReady;
+       *link = cl->epollNextReady;
+    }
+#endif
+
     cl->clientGoneHook(cl);
 
     rfbLog("Client %s gone\n",cl->host);
@@ -524,12 +551,14 @@ rfbClientConnectionGone(rfbClientPtr cl)
     if ( cl->compStreamInited ) {
 	deflateEnd( &(cl->compStream) );
     }
+    rfbFreeZlibData(cl);
 
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
     for (i = 0; i < 4; i++) {
 	if (cl->zsActive[i])
 	    deflateEnd(&cl->zsStruct[i]);
     }
+    rfbFreeTightData(cl);
 #endif
 #endif
 
@@ -540,13 +569,15 @@ rfbClientConnectionGone(rfbClientPtr cl)
     sraRgnDestroy(cl->requestedRegion);
     sraRgnDestroy(cl->copyRegion);
 
-    if (cl->translateLookupTable) free(cl->translateLookupTable);
+    rfbReleaseTranslateTable(cl);
+    free(cl->captureBuf);
 
     TINI_COND(cl->updateCond);
     TINI_MUTEX(cl->updateMutex);
 
     /* make sure outputMutex is unlocked before destroying */
     LOCK(cl->outputMutex);
+    rfbFreeClientOutput(cl);
     UNLOCK(cl->outputMutex);
     TINI_MUTEX(cl->outputMutex);
 
@@ -556,6 +587,7 @@ rfbClientConnectionGone(rfbClientPtr cl)
 
     rfbPrintStats(cl);
 
+    free(cl->updateBuf);
     free(cl);
 }
 
@@ -817,7 +849,7 @@ rfbSendKeyboardLedState(rfbClientPtr cl)
 {
     rfbFramebufferUpdateRectHeader rect;
 
-    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->updateBufSize) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
@@ -854,7 +886,7 @@ rfbSendSupportedMessages(rfbClientPtr cl)
     rfbSupportedMessages msgs;
 
     if (cl->ublen + sz_rfbFramebufferUpdateRectHeader
-                  + sz_rfbSupportedMessages > UPDATE_BUF_SIZE) {
+                  + sz_rfbSupportedMessages > cl->updateBufSize) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
@@ -946,7 +978,7 @@ rfbSendSupportedEncodings(rfbClientPtr cl)
     /* think rfbSetEncodingsMsg */
 
     if (cl->ublen + sz_rfbFramebufferUpdateRectHeader
-                  + (nEncodings * sizeof(uint32_t)) > UPDATE_BUF_SIZE) {
+                  + (nEncodings * sizeof(uint32_t)) > cl->updateBufSize) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
@@ -1008,7 +1040,7 @@ rfbSendServerIdentity(rfbClientPtr cl)
         LIBVNCSERVER_PACKAGE_STRING);
 
     if (cl->ublen + sz_rfbFramebufferUpdateRectHeader
-                  + (strlen(buffer)+1) > UPDATE_BUF_SIZE) {
+                  + (strlen(buffer)+1) > cl->updateBufSize) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
@@ -1058,7 +1090,7 @@ rfbBool rfbSendTextChatMessage(rfbClientPtr cl, uint32_t length, char *buffer)
             bytesToSend=rfbTextMaxSize;
     }
 
-    if (cl->ublen + sz_rfbTextChatMsg + bytesToSend > UPDATE_BUF_SIZE) {
+    if (cl->ublen + sz_rfbTextChatMsg + bytesToSend > cl->updateBufSize) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
@@ -2132,7 +2164,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 	    sraRgnOr(cl->modifiedRegion,tmpRegion);
 	    sraRgnSubtract(cl->copyRegion,tmpRegion);
        }
-       TSIGNAL(cl->updateCond);
+       rfbSignalClientUpdate(cl);
        UNLOCK(cl->updateMutex);
 
        sraRgnDestroy(tmpRegion);
@@ -2415,6 +2447,10 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     rfbBool sendSupportedEncodings = FALSE;
     rfbBool sendServerIdentity = FALSE;
     rfbBool result = TRUE;
+    unsigned long generation;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    struct rfbParallelUpdate* parallelUpdate = NULL;
+#endif
     
 
     if(cl->screen->displayHook)
@@ -2430,6 +2466,7 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
       cl->newFBSizePending = FALSE;
       UNLOCK(cl->updateMutex);
       fu->type = rfbFramebufferUpdate;
+      fu->pad = 0;
       fu->nRects = Swap16IfLE(1);
       cl->ublen = sz_rfbFramebufferUpdateMsg;
       if (!rfbSendNewFBSize(cl, cl->scaledScreen->width, cl->scaledScreen->height)) {
@@ -2615,80 +2652,28 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      */
     
     rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, 0, 0);
-    if (cl->preferredEncoding == rfbEncodingCoRRE) {
-        nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-	    int rectsPerRow, rows;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    rectsPerRow = (w-1)/cl->correMaxWidth+1;
-	    rows = (h-1)/cl->correMaxHeight+1;
-	    nUpdateRegionRects += rectsPerRow*rows;
+    nUpdateRegionRects = 0;
+
+    for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
+        int x = rect.x1;
+        int y = rect.y1;
+        int w = rect.x2 - x;
+        int h = rect.y2 - y;
+        int n;
+        /* We need to count the number of rects in the scaled screen */
+        if (cl->screen!=cl->scaledScreen)
+            rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+        n = rfbNumCodedRects(cl, x, y, w, h);
+        if (n == 0) {
+            nUpdateRegionRects = 0xFFFF;
+            break;
         }
-	sraRgnReleaseIterator(i); i=NULL;
-    } else if (cl->preferredEncoding == rfbEncodingUltra) {
-        nUpdateRegionRects = 0;
-        
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-            nUpdateRegionRects += (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
-          }
-        sraRgnReleaseIterator(i); i=NULL;
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-    } else if (cl->preferredEncoding == rfbEncodingZlib) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    nUpdateRegionRects += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
-	}
-	sraRgnReleaseIterator(i); i=NULL;
-#ifdef LIBVNCSERVER_HAVE_LIBJPEG
-    } else if (cl->preferredEncoding == rfbEncodingTight) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            int n;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
-	    if (n == 0) {
-		nUpdateRegionRects = 0xFFFF;
-		break;
-	    }
-	    nUpdateRegionRects += n;
-	}
-	sraRgnReleaseIterator(i); i=NULL;
-#endif
-#endif
-    } else {
-        nUpdateRegionRects = sraRgnCountRects(updateRegion);
+        nUpdateRegionRects += n;
     }
+    sraRgnReleaseIterator(i); i=NULL;
 
     fu->type = rfbFramebufferUpdate;
+    fu->pad = 0;
     if (nUpdateRegionRects != 0xFFFF) {
 	if(cl->screen->maxRectsPerUpdate>0
 	   /* CoRRE splits the screen into smaller squares */
@@ -2709,6 +2694,12 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	    updateRegion = newUpdateRegion;
 	    nUpdateRegionRects = sraRgnCountRects(updateRegion);
 	}
+    }
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    /* this may cut the update into more rectangles */
+    parallelUpdate = rfbPrepareParallelUpdate(cl, updateRegion, &nUpdateRegionRects);
+#endif
+    if (nUpdateRegionRects != 0xFFFF) {
 	fu->nRects = Swap16IfLE((uint16_t)(sraRgnCountRects(updateCopyRegion) +
 					   nUpdateRegionRects +
 					   !!sendCursorShape + !!sendCursorPos + !!sendKeyboardLedState +
@@ -2717,6 +2708,8 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	fu->nRects = 0xFFFF;
     }
     cl->ublen = sz_rfbFramebufferUpdateMsg;
+    cl->updateInProgress = TRUE;
+    cl->updateBufBytes = 0;
 
    if (sendCursorShape) {
 	cl->cursorWasChanged = FALSE;
@@ -2753,6 +2746,18 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	        goto updateFailed;
     }
 
+    /*
+     * Read after updateRegion was taken: whoever marked it modified moved
+     * the encode cache on to a new generation first.
+     */
+    generation = rfbEncodeCacheGeneration(cl->screen);
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    if (parallelUpdate) {
+        if (!rfbSendParallelUpdate(cl, parallelUpdate, generation))
+            goto updateFailed;
+    } else
+#endif
     for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
         int x = rect.x1;
         int y = rect.y1;
@@ -2763,48 +2768,8 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
         if (cl->screen!=cl->scaledScreen)
             rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
 
-        switch (cl->preferredEncoding) {
-	case -1:
-        case rfbEncodingRaw:
-            if (!rfbSendRectEncodingRaw(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingRRE:
-            if (!rfbSendRectEncodingRRE(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingCoRRE:
-            if (!rfbSendRectEncodingCoRRE(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-        case rfbEncodingHextile:
-            if (!rfbSendRectEncodingHextile(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingUltra:
-            if (!rfbSendRectEncodingUltra(cl, x, y, w, h))
-                goto updateFailed;
-            break;
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-	case rfbEncodingZlib:
-	    if (!rfbSendRectEncodingZlib(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-#ifdef LIBVNCSERVER_HAVE_LIBJPEG
-	case rfbEncodingTight:
-	    if (!rfbSendRectEncodingTight(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-#endif
-#endif
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-       case rfbEncodingZRLE:
-       case rfbEncodingZYWRLE:
-           if (!rfbSendRectEncodingZRLE(cl, x, y, w, h))
-	       goto updateFailed;
-           break;
-#endif
-        }
+        if (!rfbEncodeCacheSendRect(cl, generation, x, y, w, h))
+            goto updateFailed;
     }
     if (i) {
         sraRgnReleaseIterator(i);
@@ -2815,10 +2780,16 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	 !rfbSendLastRectMarker(cl) )
 	    goto updateFailed;
 
+    /* the last write of the update leaves the socket uncorked */
+    cl->updateInProgress = FALSE;
     if (!rfbSendUpdateBuf(cl)) {
 updateFailed:
 	result = FALSE;
     }
+    cl->updateInProgress = FALSE;
+    rfbCorkClient(cl, FALSE);
+    if (result)
+        rfbTuneUpdateBuf(cl);
 
     if (!cl->enableCursorShapeUpdates) {
       rfbHideCursor(cl);
@@ -2826,12 +2797,82 @@ updateFailed:
 
     if(i)
         sraRgnReleaseIterator(i);
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    if (parallelUpdate)
+        rfbFreeParallelUpdate(parallelUpdate);
+#endif
     sraRgnDestroy(updateRegion);
     sraRgnDestroy(updateCopyRegion);
     return result;
 }
 
 
+/*
+ * Count the rectangles cl's preferred encoding sends for a rectangle of
+ * the update.  0 means that the encoding sends a LastRect marker instead.
+ */
+
+int
+rfbNumCodedRects(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    switch (cl->preferredEncoding) {
+    case rfbEncodingCoRRE:
+        return ((w-1)/cl->correMaxWidth+1) * ((h-1)/cl->correMaxHeight+1);
+    case rfbEncodingUltra:
+        return (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    case rfbEncodingZlib:
+        return (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    case rfbEncodingTight:
+        return rfbNumCodedRectsTight(cl, x, y, w, h);
+#endif
+#endif
+    default:
+        return 1;
+    }
+}
+
+
+/*
+ * Send a given rectangle in the client's preferred encoding.
+ */
+
+rfbBool
+rfbSendRectEncoding(rfbClientPtr cl,
+                    int x,
+                    int y,
+                    int w,
+                    int h)
+{
+    switch (cl->preferredEncoding) {
+    case -1:
+    case rfbEncodingRaw:
+        return rfbSendRectEncodingRaw(cl, x, y, w, h);
+    case rfbEncodingRRE:
+        return rfbSendRectEncodingRRE(cl, x, y, w, h);
+    case rfbEncodingCoRRE:
+        return rfbSendRectEncodingCoRRE(cl, x, y, w, h);
+    case rfbEncodingHextile:
+        return rfbSendRectEncodingHextile(cl, x, y, w, h);
+    case rfbEncodingUltra:
+        return rfbSendRectEncodingUltra(cl, x, y, w, h);
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    case rfbEncodingZlib:
+        return rfbSendRectEncodingZlib(cl, x, y, w, h);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    case rfbEncodingTight:
+        return rfbSendRectEncodingTight(cl, x, y, w, h);
+#endif
+    case rfbEncodingZRLE:
+    case rfbEncodingZYWRLE:
+        return rfbSendRectEncodingZRLE(cl, x, y, w, h);
+#endif
+    }
+    return TRUE;
+}
+
+
 /*
  * Send the copy region as a string of CopyRect encoded rectangles.
  * The only slightly tricky thing is that we should send the messages in
@@ -2891,6 +2932,40 @@ rfbSendCopyRegion(rfbClientPtr cl,
     return TRUE;
 }
 
+/*
+ * Send h lines of bytesPerLine bytes each from the framebuffer as they
+ * are, after what is in updateBuf.  The lines are gathered straight from
+ * the framebuffer, RAW_LINES_PER_WRITE at a time.
+ */
+
+#define RAW_LINES_PER_WRITE 64
+
+static rfbBool
+SendRawLines(rfbClientPtr cl, char *fbptr, int bytesPerLine, int h)
+{
+    struct iovec iov[RAW_LINES_PER_WRITE + 1];
+    int stride = cl->scaledScreen->paddedWidthInBytes;
+    int count;
+
+    /* the lines are contiguous if they span the whole framebuffer */
+    if (stride == bytesPerLine) {
+        iov[1].iov_base = fbptr;
+        iov[1].iov_len = bytesPerLine * h;
+        return rfbWriteUpdateBuf(cl, iov, 2);
+    }
+
+    while (h > 0) {
+        for (count = 1; count <= RAW_LINES_PER_WRITE && h > 0; count++, h--) {
+            iov[count].iov_base = fbptr;
+            iov[count].iov_len = bytesPerLine;
+            fbptr += stride;
+        }
+        if (!rfbWriteUpdateBuf(cl, iov, count))
+            return FALSE;
+    }
+    return TRUE;
+}
+
 /*
  * Send a given rectangle in raw encoding (rfbEncodingRaw).
  */
@@ -2927,7 +3002,10 @@ rfbSendRectEncodingRaw(rfbClientPtr cl,
     rfbStatRecordEncodingSent(cl, rfbEncodingRaw, sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h,
         sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h);
 
-    nlines = (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine;
+    if (cl->translateFn == rfbTranslateNone && rfbWritesDirectly(cl))
+        return SendRawLines(cl, fbptr, bytesPerLine, h);
+
+    nlines = (cl->updateBufSize - cl->ublen) / bytesPerLine;
 
     while (TRUE) {
         if (nlines > h)
@@ -2951,7 +3029,7 @@ rfbSendRectEncodingRaw(rfbClientPtr cl,
 
         fbptr += (cl->scaledScreen->paddedWidthInBytes * nlines);
 
-        nlines = (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine;
+        nlines = (cl->updateBufSize - cl->ublen) / bytesPerLine;
         if (nlines == 0) {
             rfbErr("rfbSendRectEncodingRaw: send buffer too small for %d "
                    "bytes per line\n", bytesPerLine);
@@ -2975,7 +3053,7 @@ rfbSendLastRectMarker(rfbClientPtr cl)
 {
     rfbFramebufferUpdateRectHeader rect;
 
-    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->updateBufSize) {
 	if (!rfbSendUpdateBuf(cl))
 	    return FALSE;
     }
@@ -3008,7 +3086,7 @@ rfbSendNewFBSize(rfbClientPtr cl,
 {
     rfbFramebufferUpdateRectHeader rect;
 
-    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->updateBufSize) {
 	if (!rfbSendUpdateBuf(cl))
 	    return FALSE;
     }
@@ -3034,6 +3112,107 @@ rfbSendNewFBSize(rfbClientPtr cl,
 }
 
 
+/*
+ * Is what cl sends written to its socket, rather than kept by the encode
+ * cache or a parallel encoder?
+ */
+
+static rfbBool
+rfbWritesDirectly(rfbClientPtr cl)
+{
+    if (cl->captureStart >= 0)
+        return FALSE;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    if (cl->encodeJob)
+        return FALSE;
+#endif
+    return cl->sock >= 0;
+}
+
+/*
+ * Write cl->updateBuf, followed by the data in iov[1] to iov[count-1], with
+ * one gathered write.  iov[0] is filled in here.  Every write but the last
+ * of a framebuffer update corks the socket.
+ */
+
+static rfbBool
+rfbWriteUpdateBuf(rfbClientPtr cl, struct iovec *iov, int count)
+{
+    iov[0].iov_base = cl->updateBuf;
+    iov[0].iov_len = cl->ublen;
+
+    if (cl->updateInProgress)
+        rfbCorkClient(cl, TRUE);
+    cl->updateBufBytes += cl->ublen;
+
+    if (rfbWriteExactV(cl, iov, count) < 0) {
+        rfbLogPerror("rfbSendUpdateBuf: write");
+        rfbCloseClient(cl);
+        return FALSE;
+    }
+
+    cl->ublen = 0;
+    return TRUE;
+}
+
+/*
+ * Give cl->updateBuf size bytes.  It has to be empty.  Like the first
+ * buffer, a grown one starts out zeroed, so that padding the encoders do
+ * not fill in is always sent the same.
+ */
+
+static void
+rfbResizeUpdateBuf(rfbClientPtr cl, int size)
+{
+    char *buf = (char *)realloc(cl->updateBuf, size);
+
+    /* the old buffer does as well */
+    if (buf) {
+        if (size > cl->updateBufSize)
+            memset(buf + cl->updateBufSize, 0, size - cl->updateBufSize);
+        cl->updateBuf = buf;
+        cl->updateBufSize = size;
+    }
+}
+
+/*
+ * Called after a framebuffer update was sent.  If it did not fit into
+ * updateBuf, the buffer grows so that the next one like it does.
+ */
+
+static void
+rfbTuneUpdateBuf(rfbClientPtr cl)
+{
+    int size = cl->updateBufSize;
+
+    if (cl->updateBufBytes > cl->updateBufPeak)
+        cl->updateBufPeak = cl->updateBufBytes;
+    if (cl->updateBufBytes > UPDATE_BUF_SIZE)
+        cl->updateBufUsed = time(NULL);
+
+    while (size < cl->updateBufBytes && size < cl->screen->maxUpdateBufSize)
+        size *= 2;
+    if (size > cl->screen->maxUpdateBufSize)
+        size = cl->screen->maxUpdateBufSize;
+    if (size > cl->updateBufSize && cl->ublen == 0)
+        rfbResizeUpdateBuf(cl, size);
+}
+
+/*
+ * Shrink the updateBuf of a client that has not needed more than
+ * UPDATE_BUF_SIZE for UPDATE_BUF_IDLE_TIME seconds.  The caller makes sure
+ * that nothing is sending to cl at the same time, and holds cl->outputMutex
+ * against the other threads that write to it.
+ */
+
+void
+rfbReclaimUpdateBuf(rfbClientPtr cl)
+{
+    if (cl->updateBufSize > UPDATE_BUF_SIZE && cl->ublen == 0 &&
+        time(NULL) - cl->updateBufUsed >= UPDATE_BUF_IDLE_TIME)
+        rfbResizeUpdateBuf(cl, UPDATE_BUF_SIZE);
+}
+
 /*
  * Send the contents of cl->updateBuf.  Returns 1 if successful, -1 if
  * not (errno should be set).
@@ -3042,16 +3221,53 @@ rfbSendNewFBSize(rfbClientPtr cl,
 rfbBool
 rfbSendUpdateBuf(rfbClientPtr cl)
 {
+    struct iovec iov;
+
+    if (cl->captureStart >= 0)
+        rfbEncodeCacheCapture(cl);
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    /* a parallel encoder only collects the bytes */
+    if (cl->encodeJob)
+        return rfbCollectEncodeJob(cl);
+#endif
+
     if(cl->sock<0)
       return FALSE;
 
-    if (rfbWriteExact(cl, cl->updateBuf, cl->ublen) < 0) {
-        rfbLogPerror("rfbSendUpdateBuf: write");
-        rfbCloseClient(cl);
-        return FALSE;
+    return rfbWriteUpdateBuf(cl, &iov, 1);
+}
+
+/*
+ * Append len bytes to cl->updateBuf, sending it whenever it gets full.
+ * Data that does not fit is written together with updateBuf instead of
+ * being copied, unless it has to be kept.
+ */
+
+rfbBool
+rfbSendUpdateBytes(rfbClientPtr cl, const char *data, int len)
+{
+    int i, bytesToCopy;
+
+    if (cl->ublen + len > cl->updateBufSize && rfbWritesDirectly(cl)) {
+        struct iovec iov[2];
+
+        iov[1].iov_base = (char *)data;
+        iov[1].iov_len = len;
+        return rfbWriteUpdateBuf(cl, iov, 2);
     }
 
-    cl->ublen = 0;
+    for (i = 0; i < len; i += bytesToCopy) {
+        bytesToCopy = cl->updateBufSize - cl->ublen;
+        if (i + bytesToCopy > len)
+            bytesToCopy = len - i;
+
+        memcpy(&cl->updateBuf[cl->ublen], data + i, bytesToCopy);
+        cl->ublen += bytesToCopy;
+
+        if (cl->ublen == cl->updateBufSize && !rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
     return TRUE;
 }
 
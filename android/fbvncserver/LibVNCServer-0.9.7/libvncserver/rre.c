@@ -130,7 +130,7 @@ rfbSendRectEncodingRRE(rfbClientPtr cl,
                               sz_rfbFramebufferUpdateRectHeader + w * h * (cl->format.bitsPerPixel / 8));
 
     if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbRREHeader
-        > UPDATE_BUF_SIZE)
+        > cl->updateBufSize)
     {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
@@ -153,7 +153,7 @@ rfbSendRectEncodingRRE(rfbClientPtr cl,
 
     for (i = 0; i < rreAfterBufLen;) {
 
-        int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
+        int bytesToCopy = cl->updateBufSize - cl->ublen;
 
         if (i + bytesToCopy > rreAfterBufLen) {
             bytesToCopy = rreAfterBufLen - i;
@@ -164,7 +164,7 @@ rfbSendRectEncodingRRE(rfbClientPtr cl,
         cl->ublen += bytesToCopy;
         i += bytesToCopy;
 
-        if (cl->ublen == UPDATE_BUF_SIZE) {
+        if (cl->ublen == cl->updateBufSize) {
             if (!rfbSendUpdateBuf(cl))
                 return FALSE;
         }
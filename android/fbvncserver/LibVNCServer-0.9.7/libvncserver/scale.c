@@ -135,127 +135,492 @@ void rfbScaledCorrection(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int *x, int
     if (*y+*h > to->height) *h=to->height - *y;
 }
 
+/*
+ * The scaled copies are made with a box filter: a scaled pixel is the
+ * average of the screen pixels under it, each weighted by how much of it
+ * is covered, so the ratio need not be an integer.  The filter is done in
+ * two passes.  For each scaled row, the screen rows under it are first
+ * added up column by column, and then the columns under each scaled pixel
+ * are added up.  Along either axis the weights are 8 bit fixed point
+ * numbers which add up to 256.
+ *
+ * All of this works on bytes.  True colour pixels whose channels are
+ * whole bytes are scaled byte by byte as they are; others are unpacked
+ * into four bytes a pixel first and packed again at the end.  Colour
+ * mapped pixels cannot be mixed, so they are taken from the middle of the
+ * area instead.
+ */
+
+#define SCALE_BITS 8
+
+#ifdef RFB_HAVE_VECTORS
+#define RFB_SCALE_VECTORS
+typedef uint8_t rfbScaleVector8 __attribute__ ((vector_size (16)));
+typedef uint16_t rfbScaleVector16 __attribute__ ((vector_size (16)));
+typedef uint64_t rfbScaleVector64 __attribute__ ((vector_size (16)));
+
+/* where the first and second byte of a 16 bit number are */
+#ifdef LIBVNCSERVER_WORDS_BIGENDIAN
+#define SCALE_BYTE0 8
+#define SCALE_BYTE1 0
+#else
+#define SCALE_BYTE0 0
+#define SCALE_BYTE1 8
+#endif
+
+/* which bytes of v and zero make up the first and last eight bytes of v
+   as 16 bit numbers */
+#ifdef LIBVNCSERVER_WORDS_BIGENDIAN
+#define SCALE_LOW_BYTES \
+        16, 0, 17, 1, 18, 2, 19, 3, 20, 4, 21, 5, 22, 6, 23, 7
+#define SCALE_HIGH_BYTES \
+        24, 8, 25, 9, 26, 10, 27, 11, 28, 12, 29, 13, 30, 14, 31, 15
+#else
+#define SCALE_LOW_BYTES \
+        0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23
+#define SCALE_HIGH_BYTES \
+        8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31
+#endif
+
+/* the low bytes of eight 16 bit numbers, at the start of the vector */
+#ifdef LIBVNCSERVER_WORDS_BIGENDIAN
+#define SCALE_NARROW_BYTES \
+        1, 3, 5, 7, 9, 11, 13, 15, 1, 3, 5, 7, 9, 11, 13, 15
+#else
+#define SCALE_NARROW_BYTES \
+        0, 2, 4, 6, 8, 10, 12, 14, 0, 2, 4, 6, 8, 10, 12, 14
+#endif
+#endif
+
+/* the weights of the source pixels under each of n scaled pixels */
+typedef struct {
+    int taps;			/* source pixels per scaled pixel */
+    int *first;			/* the first source pixel under each */
+    uint16_t *weights;		/* taps weights for each */
+} rfbScaleFilter;
+
+/* how the colour channels of a true colour pixel turn into bytes */
+typedef struct {
+    int shift[3];
+    uint32_t max[3];
+    int loss[3];		/* low bits dropped from wider channels */
+} rfbScaleChannels;
+
+/*
+ * ScaleArea finds the scaled pixels from *d to *d + *n which cover any
+ * part of the n source pixels from s on, the same way rfbScaledCorrection
+ * does.
+ */
+
+static void
+ScaleArea(int s, int n, int from, int to, int *d, int *dn)
+{
+    int end = (int)(((uint64_t)(s + n) * to + from - 1) / from);
+
+    *d = (int)((uint64_t)s * to / from);
+    if (end > to)
+        end = to;
+    *dn = end - *d;
+}
+
+static int
+ScaleTaps(int from, int to, int d, int n)
+{
+    int taps = 1, count;
+
+    for (; n > 0; d++, n--) {
+        count = (int)(((uint64_t)(d + 1) * from - 1) / to -
+                      (uint64_t)d * from / to) + 1;
+        if (count > taps)
+            taps = count;
+    }
+    return taps;
+}
+
+/*
+ * ScaleFilterInit works out the weights for the scaled pixels from d on.
+ * Scaled pixel d covers the source from d * from to (d + 1) * from in
+ * units of 1/to source pixels.
+ */
+
+static void
+ScaleFilterInit(rfbScaleFilter *f, int from, int to, int d, int n)
+{
+    uint64_t a, b, lo, hi, covered;
+    int i, t, first, weight, last;
+
+    for (i = 0; i < n; i++) {
+        a = (uint64_t)(d + i) * from;
+        b = a + from;
+        first = (int)(a / to);
+        if (first > from - f->taps)
+            first = from - f->taps;
+        f->first[i] = first;
+
+        covered = 0;
+        last = 0;
+        for (t = 0; t < f->taps; t++) {
+            lo = (uint64_t)(first + t) * to;
+            hi = lo + to;
+            if (lo < a)
+                lo = a;
+            if (hi > b)
+                hi = b;
+            if (hi > lo)
+                covered += hi - lo;
+            /* rounding the running total keeps the sum at exactly 256 */
+            weight = (int)(((covered << SCALE_BITS) + from / 2) / from);
+            f->weights[i * f->taps + t] = weight - last;
+            last = weight;
+        }
+    }
+}
+
+static rfbBool
+ScaleBytewise(rfbPixelFormat *f)
+{
+    return ((f->bitsPerPixel == 32 || f->bitsPerPixel == 24) &&
+            f->redMax == 255 && f->greenMax == 255 && f->blueMax == 255 &&
+            f->redShift % 8 == 0 && f->greenShift % 8 == 0 &&
+            f->blueShift % 8 == 0);
+}
+
+static void
+ScaleChannelsInit(rfbScaleChannels *c, rfbPixelFormat *f)
+{
+    int i;
+
+    c->shift[0] = f->redShift;
+    c->shift[1] = f->greenShift;
+    c->shift[2] = f->blueShift;
+    c->max[0] = f->redMax;
+    c->max[1] = f->greenMax;
+    c->max[2] = f->blueMax;
+    for (i = 0; i < 3; i++)
+        for (c->loss[i] = 0; (c->max[i] >> c->loss[i]) > 255; c->loss[i]++)
+            ;
+}
+
+#define UNPACK_PIXELS(read)                                             \
+    for (i = 0; i < n; i++, src += bytesPerPixel, out += 4) {          \
+        p = (read);                                                     \
+        out[0] = ((p >> c.shift[0]) & c.max[0]) >> c.loss[0];          \
+        out[1] = ((p >> c.shift[1]) & c.max[1]) >> c.loss[1];          \
+        out[2] = ((p >> c.shift[2]) & c.max[2]) >> c.loss[2];          \
+        out[3] = 0;                                                     \
+    }
+
+static void
+ScaleUnpackRow(rfbScaleChannels *channels, rfbPixelFormat *f,
+               const unsigned char *src, uint8_t *out, int n)
+{
+    /* a copy, so that the compiler need not reload it after every store */
+    rfbScaleChannels c = *channels;
+    int bytesPerPixel = f->bitsPerPixel / 8, i;
+    uint32_t p;
+#ifdef RFB_SCALE_VECTORS
+    rfbScaleVector16 v, r, g, b;
+#endif
+
+    switch (f->bitsPerPixel) {
+    case 8:
+        UNPACK_PIXELS(*src);
+        break;
+    case 16:
+#ifdef RFB_SCALE_VECTORS
+        /* eight pixels at a time, as red and green, and blue and zero */
+        for (; n >= 8 && !(c.loss[0] | c.loss[1] | c.loss[2]);
+             n -= 8, src += 16, out += 32) {
+            memcpy(&v, src, 16);
+            r = (v >> c.shift[0]) & (uint16_t)c.max[0];
+            g = (v >> c.shift[1]) & (uint16_t)c.max[1];
+            b = (v >> c.shift[2]) & (uint16_t)c.max[2];
+            r = (r << SCALE_BYTE0) | (g << SCALE_BYTE1);
+            b = b << SCALE_BYTE0;
+            v = SHUFFLE(rfbScaleVector16, r, b, 0, 8, 1, 9, 2, 10, 3, 11);
+            memcpy(out, &v, 16);
+            v = SHUFFLE(rfbScaleVector16, r, b, 4, 12, 5, 13, 6, 14, 7, 15);
+            memcpy(out + 16, &v, 16);
+        }
+#endif
+        UNPACK_PIXELS(*(const uint16_t *)src);
+        break;
+    case 24:
+        if (f->bigEndian)
+            UNPACK_PIXELS(src[0] << 16 | src[1] << 8 | src[2])
+        else
+            UNPACK_PIXELS(src[0] | src[1] << 8 | src[2] << 16)
+        break;
+    default:
+        UNPACK_PIXELS(*(const uint32_t *)src);
+        break;
+    }
+}
+
+#define PACK_PIXELS(write)                                              \
+    for (i = 0; i < n; i++, in += 4, dst += bytesPerPixel) {            \
+        p = ((uint32_t)in[0] << c.loss[0] << c.shift[0] |               \
+             (uint32_t)in[1] << c.loss[1] << c.shift[1] |               \
+             (uint32_t)in[2] << c.loss[2] << c.shift[2]);               \
+        write;                                                          \
+    }
+
+static void
+ScalePackRow(rfbScaleChannels *channels, rfbPixelFormat *f,
+             const uint8_t *in, unsigned char *dst, int n)
+{
+    rfbScaleChannels c = *channels;
+    int bytesPerPixel = f->bitsPerPixel / 8, i;
+    uint32_t p;
+#ifdef RFB_SCALE_VECTORS
+    rfbScaleVector16 lo, hi, r, g, b;
+#endif
+
+    switch (f->bitsPerPixel) {
+    case 8:
+        PACK_PIXELS(*dst = p);
+        break;
+    case 16:
+#ifdef RFB_SCALE_VECTORS
+        for (; n >= 8 && !(c.loss[0] | c.loss[1] | c.loss[2]);
+             n -= 8, in += 32, dst += 16) {
+            memcpy(&lo, in, 16);
+            memcpy(&hi, in + 16, 16);
+            r = SHUFFLE(rfbScaleVector16, lo, hi, 0, 2, 4, 6, 8, 10, 12, 14);
+            b = SHUFFLE(rfbScaleVector16, lo, hi, 1, 3, 5, 7, 9, 11, 13, 15);
+            g = (r >> SCALE_BYTE1) & 0xff;
+            r = (r >> SCALE_BYTE0) & 0xff;
+            b = (b >> SCALE_BYTE0) & 0xff;
+            r = ((r << c.shift[0]) | (g << c.shift[1]) | (b << c.shift[2]));
+            memcpy(dst, &r, 16);
+        }
+#endif
+        PACK_PIXELS(*(uint16_t *)dst = p);
+        break;
+    case 24:
+        if (f->bigEndian)
+            PACK_PIXELS(dst[0] = p >> 16; dst[1] = p >> 8; dst[2] = p)
+        else
+            PACK_PIXELS(dst[0] = p; dst[1] = p >> 8; dst[2] = p >> 16)
+        break;
+    default:
+        PACK_PIXELS(*(uint32_t *)dst = p);
+        break;
+    }
+}
+
+/*
+ * ScaleAddRow adds weight times the n bytes at src to the sums in acc,
+ * or starts them if first is set.  The sums fit into 16 bits because the
+ * weights of a scaled pixel add up to 256.
+ */
+
+static void
+ScaleAddRow(uint16_t *acc, const uint8_t *src, int n, uint16_t weight,
+            rfbBool first)
+{
+    int i = 0;
+#ifdef RFB_SCALE_VECTORS
+    rfbScaleVector8 v, zero = { 0 };
+    rfbScaleVector16 lo, hi, sum;
+
+    for (; i + 16 <= n; i += 16) {
+        memcpy(&v, src + i, 16);
+        lo = (rfbScaleVector16)SHUFFLE(rfbScaleVector8, v, zero,
+                                       SCALE_LOW_BYTES) * weight;
+        hi = (rfbScaleVector16)SHUFFLE(rfbScaleVector8, v, zero,
+                                       SCALE_HIGH_BYTES) * weight;
+        if (!first) {
+            memcpy(&sum, acc + i, 16);
+            lo += sum;
+            memcpy(&sum, acc + i + 8, 16);
+            hi += sum;
+        }
+        memcpy(acc + i, &lo, 16);
+        memcpy(acc + i + 8, &hi, 16);
+    }
+#endif
+    if (first)
+        for (; i < n; i++)
+            acc[i] = weight * src[i];
+    else
+        for (; i < n; i++)
+            acc[i] += weight * src[i];
+}
+
+/*
+ * ScaleRow adds up the columns of acc, which starts at source column sx,
+ * under each of the n scaled pixels fx is for, and writes their bytes to
+ * out.  Pixels are lanes bytes long, three or four.  The four sums of a
+ * pixel are worked on at once as 16 bit numbers in a 64 bit one; their
+ * high and low bytes are weighed separately so that no product spills
+ * over into the next number.  For three byte pixels the fourth number is
+ * the next pixel's first, and is thrown away.
+ */
+
+#define SCALE_LANE_ONES (((uint64_t)0x00010001 << 32) | 0x00010001)
+#define SCALE_LANE_BYTES (((uint64_t)0x00ff00ff << 32) | 0x00ff00ff)
+#define SCALE_LANE_HALF (((uint64_t)0x00800080 << 32) | 0x00800080)
+#define SCALE_LANE_PAIRS (((uint64_t)0x0000ffff << 32) | 0x0000ffff)
+
+static void
+ScaleRow(const uint16_t *acc, int sx, rfbScaleFilter *fx, int lanes,
+         uint8_t *out, int n)
+{
+    const uint16_t *col, *weights = fx->weights;
+    const int *first = fx->first;
+    int taps = fx->taps, x = 0, t;
+    uint64_t a, lo, hi;
+    uint32_t p;
+#ifdef RFB_SCALE_VECTORS
+    const uint16_t *col2;
+    rfbScaleVector16 v, w, vlo, vhi;
+    rfbScaleVector8 bytes;
+
+    /* two pixels of four bytes at a time, one in each half of a vector */
+    for (; lanes == 4 && x + 2 <= n; x += 2, out += 8, weights += 2 * taps) {
+        col = acc + (first[x] - sx) * 4;
+        col2 = acc + (first[x + 1] - sx) * 4;
+        vlo = vhi = (rfbScaleVector16){ 0 };
+        for (t = 0; t < taps; t++) {
+            memcpy(&a, col + 4 * t, 8);
+            memcpy(&hi, col2 + 4 * t, 8);
+            v = (rfbScaleVector16)(rfbScaleVector64){ a, hi };
+            w = (rfbScaleVector16)(rfbScaleVector64){
+                    weights[t] * SCALE_LANE_ONES,
+                    weights[taps + t] * SCALE_LANE_ONES };
+            vlo += (v & 0xff) * w;
+            vhi += (v >> 8) * w;
+        }
+        v = (vhi + (vlo >> 8) + 0x80) >> 8;
+        bytes = (rfbScaleVector8)v;
+        bytes = SHUFFLE(rfbScaleVector8, bytes, bytes, SCALE_NARROW_BYTES);
+        memcpy(out, &bytes, 8);
+    }
+#endif
+
+    for (; x < n; x++, out += lanes) {
+        col = acc + (first[x] - sx) * lanes;
+        lo = hi = 0;
+        for (t = 0; t < taps; t++, col += lanes, weights++) {
+            memcpy(&a, col, 8);
+            lo += (a & SCALE_LANE_BYTES) * *weights;
+            hi += ((a >> 8) & SCALE_LANE_BYTES) * *weights;
+        }
+        /* (256 * hi + lo + 32768) >> 16, give or take the low byte of lo */
+        a = ((hi + ((lo >> 8) & SCALE_LANE_BYTES) + SCALE_LANE_HALF) >> 8) &
+            SCALE_LANE_BYTES;
+        a = (a | a >> 8) & SCALE_LANE_PAIRS;
+        p = (uint32_t)(a | a >> 16);
+        if (lanes == 4)
+            memcpy(out, &p, 4);
+        else
+            memcpy(out, &p, 3);
+    }
+}
+
+/* colour mapped pixels are taken from the middle of the area */
+static void
+ScaleNearest(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr,
+             int x1, int y1, int w1, int h1)
+{
+    int bytesPerPixel = screen->bitsPerPixel / 8, x, y, sx, sy;
+
+    for (y = y1; y < y1 + h1; y++) {
+        sy = (int)((2 * (uint64_t)y + 1) * screen->height / (2 * ptr->height));
+        for (x = x1; x < x1 + w1; x++) {
+            sx = (int)((2 * (uint64_t)x + 1) * screen->width / (2 * ptr->width));
+            memcpy(&ptr->frameBuffer[y * ptr->paddedWidthInBytes + x * bytesPerPixel],
+                   &screen->frameBuffer[sy * screen->paddedWidthInBytes + sx * bytesPerPixel],
+                   bytesPerPixel);
+        }
+    }
+}
+
 void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, int x0, int y0, int w0, int h0)
 {
-    int x,y,w,v,z;
-    int x1, y1, w1, h1;
-    int bitsPerPixel, bytesPerPixel, bytesPerLine, areaX, areaY, area2;
-    unsigned char *srcptr, *dstptr;
+    rfbPixelFormat *format = &screen->serverFormat;
+    int bytesPerPixel = screen->bitsPerPixel / 8;
+    rfbBool bytewise = ScaleBytewise(format);
+    int lanes = (bytewise ? bytesPerPixel : 4);
+    rfbScaleChannels channels;
+    rfbScaleFilter fx, fy;
+    int x1, y1, w1, h1, sx, span, y, t;
+    rfbBool first;
+    uint16_t *acc, weight;
+    uint8_t *unpacked, *scaled;
+    const unsigned char *src;
+    unsigned char *dst;
+    char *buf;
 
     /* Nothing to do!!! */
     if (screen==ptr) return;
 
-    x1 = x0;
-    y1 = y0;
-    w1 = w0;
-    h1 = h0;
-
-    rfbScaledCorrection(screen, ptr, &x1, &y1, &w1, &h1, "rfbScaledScreenUpdateRect");
-    x0 = ScaleX(ptr, screen, x1);
-    y0 = ScaleY(ptr, screen, y1);
-    w0 = ScaleX(ptr, screen, w1);
-    h0 = ScaleY(ptr, screen, h1);
-
-    bitsPerPixel = screen->bitsPerPixel;
-    bytesPerPixel = bitsPerPixel / 8;
-    bytesPerLine = w1 * bytesPerPixel;
-    srcptr = (unsigned char *)(screen->frameBuffer +
-     (y0 * screen->paddedWidthInBytes + x0 * bytesPerPixel));
-    dstptr = (unsigned char *)(ptr->frameBuffer +
-     ( y1 * ptr->paddedWidthInBytes + x1 * bytesPerPixel));
-    /* The area of the source framebuffer for each destination pixel */
-    areaX = ScaleX(ptr,screen,1);
-    areaY = ScaleY(ptr,screen,1);
-    area2 = areaX*areaY;
-
-
-    /* Ensure that we do not go out of bounds */
-    if ((x1+w1) > (ptr->width))
-    {
-      if (x1==0) w1=ptr->width; else x1 = ptr->width - w1;
+    ScaleArea(x0, w0, screen->width, ptr->width, &x1, &w1);
+    ScaleArea(y0, h0, screen->height, ptr->height, &y1, &h1);
+    if (w1 <= 0 || h1 <= 0)
+        return;
+
+    if (!format->trueColour) {
+        ScaleNearest(screen, ptr, x1, y1, w1, h1);
+        return;
     }
-    if ((y1+h1) > (ptr->height))
-    {
-      if (y1==0) h1=ptr->height; else y1 = ptr->height - h1;
+
+    fx.taps = ScaleTaps(screen->width, ptr->width, x1, w1);
+    fy.taps = ScaleTaps(screen->height, ptr->height, y1, h1);
+    /* ScaleRow reads a little beyond the last pixel of acc */
+    buf = (char *)malloc((w1 + h1) * sizeof(int) +
+                         (w1 * fx.taps + h1 * fy.taps) * sizeof(uint16_t) +
+                         (screen->width + 1) * lanes * sizeof(uint16_t) +
+                         screen->width * 4 + w1 * 4);
+    if (!buf) {
+        rfbErr("rfbScaledScreenUpdateRect: out of memory\n");
+        return;
+    }
+    fx.first = (int *)buf;
+    fy.first = fx.first + w1;
+    fx.weights = (uint16_t *)(fy.first + h1);
+    fy.weights = fx.weights + w1 * fx.taps;
+    acc = fy.weights + h1 * fy.taps;
+    unpacked = (uint8_t *)(acc + (screen->width + 1) * lanes);
+    scaled = unpacked + screen->width * 4;
+
+    ScaleFilterInit(&fx, screen->width, ptr->width, x1, w1);
+    ScaleFilterInit(&fy, screen->height, ptr->height, y1, h1);
+    ScaleChannelsInit(&channels, format);
+
+    /* the source columns under the scaled rectangle */
+    sx = fx.first[0];
+    span = fx.first[w1 - 1] + fx.taps - sx;
+    memset(acc + span * lanes, 0, lanes * sizeof(uint16_t));
+
+    for (y = 0; y < h1; y++) {
+        first = TRUE;
+        for (t = 0; t < fy.taps; t++) {
+            weight = fy.weights[y * fy.taps + t];
+            if (weight == 0)
+                continue;
+            src = (unsigned char *)screen->frameBuffer +
+                (fy.first[y] + t) * screen->paddedWidthInBytes + sx * bytesPerPixel;
+            if (!bytewise) {
+                ScaleUnpackRow(&channels, format, src, unpacked, span);
+                src = unpacked;
+            }
+            ScaleAddRow(acc, src, span * lanes, weight, first);
+            first = FALSE;
+        }
+
+        dst = (unsigned char *)ptr->frameBuffer +
+            (y1 + y) * ptr->paddedWidthInBytes + x1 * bytesPerPixel;
+        if (bytewise)
+            ScaleRow(acc, sx, &fx, lanes, dst, w1);
+        else {
+            ScaleRow(acc, sx, &fx, lanes, scaled, w1);
+            ScalePackRow(&channels, format, scaled, dst, w1);
+        }
     }
-    /*
-     * rfbLog("rfbScaledScreenUpdateRect(%dXx%dY-%dWx%dH  ->  %dXx%dY-%dWx%dH <%dx%d>) {%dWx%dH -> %dWx%dH} 0x%p\n",
-     *    x0, y0, w0, h0, x1, y1, w1, h1, areaX, areaY,
-     *    screen->width, screen->height, ptr->width, ptr->height, ptr->frameBuffer);
-     */
 
-    if (screen->serverFormat.trueColour) { /* Blend neighbouring pixels together */
-      unsigned char *srcptr2;
-      unsigned long pixel_value, red, green, blue;
-      unsigned int redShift = screen->serverFormat.redShift;
-      unsigned int greenShift = screen->serverFormat.greenShift;
-      unsigned int blueShift = screen->serverFormat.blueShift;
-      unsigned long redMax = screen->serverFormat.redMax;
-      unsigned long greenMax = screen->serverFormat.greenMax;
-      unsigned long blueMax = screen->serverFormat.blueMax;
-
-     /* for each *destination* pixel... */
-     for (y = 0; y < h1; y++) {
-       for (x = 0; x < w1; x++) {
-         red = green = blue = 0;
-         /* Get the totals for rgb from the source grid... */
-         for (w = 0; w < areaX; w++) {
-           for (v = 0; v < areaY; v++) {
-             srcptr2 = &srcptr[(((x * areaX) + w) * bytesPerPixel) +
-                               (v * screen->paddedWidthInBytes)];
-             pixel_value = 0;
-
-
-             switch (bytesPerPixel) {
-             case 4: pixel_value = *((unsigned int *)srcptr2);   break;
-             case 2: pixel_value = *((unsigned short *)srcptr2); break;
-             case 1: pixel_value = *((unsigned char *)srcptr2);  break;
-             default:
-               /* fixme: endianess problem? */
-               for (z = 0; z < bytesPerPixel; z++)
-                 pixel_value += (srcptr2[z] << (8 * z));
-                break;
-              }
-              /*
-              srcptr2 += bytesPerPixel;
-              */
-
-            red += ((pixel_value >> redShift) & redMax);
-            green += ((pixel_value >> greenShift) & greenMax);
-            blue += ((pixel_value >> blueShift) & blueMax);
-
-           }
-         }
-         /* We now have a total for all of the colors, find the average! */
-         red /= area2;
-         green /= area2;
-         blue /= area2;
-          /* Stuff the new value back into memory */
-         pixel_value = ((red & redMax) << redShift) | ((green & greenMax) << greenShift) | ((blue & blueMax) << blueShift);
-
-         switch (bytesPerPixel) {
-         case 4: *((unsigned int *)dstptr)   = (unsigned int)   pixel_value; break;
-         case 2: *((unsigned short *)dstptr) = (unsigned short) pixel_value; break;
-         case 1: *((unsigned char *)dstptr)  = (unsigned char)  pixel_value; break;
-         default:
-           /* fixme: endianess problem? */
-           for (z = 0; z < bytesPerPixel; z++)
-             dstptr[z]=(pixel_value >> (8 * z)) & 0xff;
-            break;
-          }
-          dstptr += bytesPerPixel;
-       }
-       srcptr += (screen->paddedWidthInBytes * areaY);
-       dstptr += (ptr->paddedWidthInBytes - bytesPerLine);
-     }
-   } else
-   { /* Not truecolour, so we can't blend. Just use the top-left pixel instead */
-     for (y = y1; y < (y1+h1); y++) {
-       for (x = x1; x < (x1+w1); x++)
-         memcpy (&ptr->frameBuffer[(y *ptr->paddedWidthInBytes) + (x * bytesPerPixel)],
-                 &screen->frameBuffer[(y * areaY * screen->paddedWidthInBytes) + (x *areaX * bytesPerPixel)], bytesPerPixel);
-     }
-  }
+    free(buf);
 }
 
 void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2)
@@ -0,0 +1,223 @@
+/*
+ * shifttranstemplate.c - template for true colour translation without
+ * lookup tables.
+ *
+ * This file shouldn't be compiled.  It is included multiple times by
+ * translate.c, each time with different definitions of the macros IN and OUT.
+ *
+ * For each pair of values IN and OUT, this file defines a function which
+ * translates a rectangle of pixel data by shifting, masking and scaling
+ * each colour channel with the constants rfbInitTrueColourShifts worked
+ * out, eight pixels at a time in vector registers.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#if !defined(IN) || !defined(OUT)
+#error "This file shouldn't be compiled."
+#error "It is included as part of translate.c"
+#endif
+
+#define IN_T CONCAT3E(uint,IN,_t)
+#if OUT == 24
+#define OUT_T uint8_t
+#define OUT_BYTES 3
+#else
+#define OUT_T CONCAT3E(uint,OUT,_t)
+#define OUT_BYTES 1
+#endif
+#define SwapOUT(x) CONCAT2E(Swap,OUT(x))
+#define rfbTranslateWithShiftsINtoOUT \
+                                CONCAT4E(rfbTranslateWithShifts,IN,to,OUT)
+
+/*
+ * The vector loop keeps eight pixels in two vectors a and b.  Where 16 bit
+ * pixels are read or written, a holds the even pixels and b the odd ones,
+ * so that two of them share 32 bits the way they do in memory; otherwise
+ * a holds the first four and b the last four.
+ */
+#if IN == 16 || OUT == 16
+#define EVEN_ODD
+#endif
+#ifdef LIBVNCSERVER_WORDS_BIGENDIAN
+#define FIRST_HALF 16
+#else
+#define FIRST_HALF 0
+#endif
+
+/*
+ * rfbTranslateWithShiftsINtoOUT translates a rectangle of true colour pixel
+ * data, giving the same result as the lookup tables would.
+ */
+
+static void
+rfbTranslateWithShiftsINtoOUT (char *table, rfbPixelFormat *in,
+                               rfbPixelFormat *out,
+                               char *iptr, char *optr,
+                               int bytesBetweenInputLines,
+                               int width, int height)
+{
+    /* a copy, so that the compiler need not reload it after every store */
+    rfbShiftTable t = *(rfbShiftTable *)table;
+    IN_T *ip = (IN_T *)iptr;
+    OUT_T *op = (OUT_T *)optr;
+    int ipextra = bytesBetweenInputLines / sizeof(IN_T) - width;
+    uint32_t p, o;
+    int x;
+    rfbPixelVector16 mul16[3];
+    rfbPixelVector a, b;
+#ifdef EVEN_ODD
+    rfbPixelVector w;
+#endif
+    int k;
+#if IN == 16
+    rfbPixelVector16 v, c0, c1, c2;
+    uint16_t s0 = t.outShift[0] & 15, s1 = t.outShift[1] & 15,
+             s2 = t.outShift[2] & 15;
+#if OUT == 32
+    rfbPixelVector16 lo, hi, lo0, lo1, lo2;
+
+    /* which channels go into the lower 16 bits of a pixel */
+    lo0 = (rfbPixelVector16){ 0 } + (uint16_t)(t.outShift[0] < 16 ? 0xffff : 0);
+    lo1 = (rfbPixelVector16){ 0 } + (uint16_t)(t.outShift[1] < 16 ? 0xffff : 0);
+    lo2 = (rfbPixelVector16){ 0 } + (uint16_t)(t.outShift[2] < 16 ? 0xffff : 0);
+#endif
+#endif
+
+    for (k = 0; k < 3; k++)
+        mul16[k] = (rfbPixelVector16)(t.mul[k] + (rfbPixelVector){ 0, 0, 0, 0 });
+
+    while (height > 0) {
+        x = 0;
+
+#if IN == 16
+        for (; t.halves && x + 8 <= width; x += 8) {
+            memcpy(&v, ip, 16);
+            c0 = rfbShiftChannelVector16(&t, v, 0) << s0;
+            c1 = rfbShiftChannelVector16(&t, v, 1) << s1;
+            c2 = rfbShiftChannelVector16(&t, v, 2) << s2;
+#if OUT == 16
+            v = c0 | c1 | c2;
+            if (t.swap)
+                v = Swap16(v);
+            memcpy(op, &v, 16);
+#else
+            lo = (c0 & lo0) | (c1 & lo1) | (c2 & lo2);
+            hi = (c0 & ~lo0) | (c1 & ~lo1) | (c2 & ~lo2);
+            if (t.swap) {
+                v = Swap16(lo);
+                lo = Swap16(hi);
+                hi = v;
+            }
+#ifdef LIBVNCSERVER_WORDS_BIGENDIAN
+            v = lo;
+            lo = hi;
+            hi = v;
+#endif
+            v = SHUFFLE(rfbPixelVector16, lo, hi,
+                        0, 8, 1, 9, 2, 10, 3, 11);
+            memcpy(op, &v, 16);
+            v = SHUFFLE(rfbPixelVector16, lo, hi,
+                        4, 12, 5, 13, 6, 14, 7, 15);
+            memcpy(op + 4, &v, 16);
+#endif
+            ip += 8;
+            op += 8;
+        }
+#endif
+
+        for (; x + 8 <= width; x += 8) {
+#if IN == 16
+            memcpy(&w, ip, 16);
+            a = (w >> FIRST_HALF) & 0xffff;
+            b = (w >> (16 - FIRST_HALF)) & 0xffff;
+#else
+            memcpy(&a, ip, 16);
+            memcpy(&b, ip + 4, 16);
+#ifdef EVEN_ODD
+            w = a;
+            a = SHUFFLE(rfbPixelVector, w, b, 0, 2, 4, 6);
+            b = SHUFFLE(rfbPixelVector, w, b, 1, 3, 5, 7);
+#endif
+#endif
+
+            a = (rfbShiftChannelVector(&t, mul16, a, 0) |
+                 rfbShiftChannelVector(&t, mul16, a, 1) |
+                 rfbShiftChannelVector(&t, mul16, a, 2));
+            b = (rfbShiftChannelVector(&t, mul16, b, 0) |
+                 rfbShiftChannelVector(&t, mul16, b, 1) |
+                 rfbShiftChannelVector(&t, mul16, b, 2));
+            if (t.swap) {
+                a = SwapOUT(a);
+                b = SwapOUT(b);
+            }
+
+#if OUT == 16
+            w = (a << FIRST_HALF) | (b << (16 - FIRST_HALF));
+            memcpy(op, &w, 16);
+#elif OUT == 32 && defined(EVEN_ODD)
+            w = SHUFFLE(rfbPixelVector, a, b, 0, 4, 1, 5);
+            memcpy(op, &w, 16);
+            w = SHUFFLE(rfbPixelVector, a, b, 2, 6, 3, 7);
+            memcpy(op + 4, &w, 16);
+#elif OUT == 32
+            memcpy(op, &a, 16);
+            memcpy(op + 4, &b, 16);
+#else
+            for (k = 0; k < 4; k++) {
+                op[3 * k] = a[k];
+                op[3 * k + 1] = a[k] >> 8;
+                op[3 * k + 2] = a[k] >> 16;
+                op[3 * k + 12] = b[k];
+                op[3 * k + 13] = b[k] >> 8;
+                op[3 * k + 14] = b[k] >> 16;
+            }
+#endif
+            ip += 8;
+            op += 8 * OUT_BYTES;
+        }
+
+        for (; x < width; x++) {
+            p = *(ip++);
+            o = (rfbShiftChannel(&t, p, 0) |
+                 rfbShiftChannel(&t, p, 1) |
+                 rfbShiftChannel(&t, p, 2));
+            if (t.swap)
+                o = SwapOUT(o);
+#if OUT == 24
+            op[0] = o;
+            op[1] = o >> 8;
+            op[2] = o >> 16;
+#else
+            *op = o;
+#endif
+            op += OUT_BYTES;
+        }
+
+        ip += ipextra;
+        height--;
+    }
+}
+
+#undef IN_T
+#undef OUT_T
+#undef OUT_BYTES
+#undef SwapOUT
+#undef rfbTranslateWithShiftsINtoOUT
+#undef EVEN_ODD
+#undef FIRST_HALF
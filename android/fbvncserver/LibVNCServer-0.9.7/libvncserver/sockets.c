@@ -41,6 +41,7 @@
  */
 
 #include <rfb/rfb.h>
+#include "private.h"
 
 #ifdef LIBVNCSERVER_HAVE_SYS_TYPES_H
 #include <sys/types.h>
@@ -75,6 +76,17 @@ struct timeval
 #endif
 
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
+
+#ifndef IOV_MAX
+/* as on Linux and the BSDs */
+#define IOV_MAX 1024
+#endif
+
+#ifdef LIBVNCSERVER_WITH_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #ifdef USE_LIBWRAP
 #include <syslog.h>
@@ -113,6 +125,12 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 
     rfbScreen->socketState = RFB_SOCKET_READY;
 
+#ifdef LIBVNCSERVER_WITH_EPOLL
+    /* on failure rfbCheckFds falls back to select() */
+    if ((rfbScreen->epollFd = epoll_create(64)) < 0)
+	rfbLogPerror("rfbInitSockets: epoll_create");
+#endif
+
     if (rfbScreen->inetdSock != -1) {
 	const int one = 1;
 
@@ -154,6 +172,8 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
         FD_ZERO(&(rfbScreen->allFds));
         FD_SET(rfbScreen->listenSock, &(rfbScreen->allFds));
         rfbScreen->maxFd = rfbScreen->listenSock;
+        rfbWatchSocket(rfbScreen, rfbScreen->listenSock,
+                       &rfbScreen->listenSock, FALSE);
     }
     else if(rfbScreen->port>0) {
       rfbLog("Listening for VNC connections on TCP port %d\n", rfbScreen->port);
@@ -166,6 +186,8 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
       FD_ZERO(&(rfbScreen->allFds));
       FD_SET(rfbScreen->listenSock, &(rfbScreen->allFds));
       rfbScreen->maxFd = rfbScreen->listenSock;
+      rfbWatchSocket(rfbScreen, rfbScreen->listenSock,
+                     &rfbScreen->listenSock, FALSE);
     }
 
     if (rfbScreen->udpPort != 0) {
@@ -177,6 +199,8 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 	}
 	FD_SET(rfbScreen->udpSock, &(rfbScreen->allFds));
 	rfbScreen->maxFd = max((int)rfbScreen->udpSock,rfbScreen->maxFd);
+	rfbWatchSocket(rfbScreen, rfbScreen->udpSock,
+		       &rfbScreen->udpSock, FALSE);
     }
 }
 
@@ -204,6 +228,318 @@ void rfbShutdownSockets(rfbScreenInfoPtr rfbScreen)
 	FD_CLR(rfbScreen->udpSock,&rfbScreen->allFds);
 	rfbScreen->udpSock=-1;
     }
+
+#ifdef LIBVNCSERVER_WITH_EPOLL
+    if(rfbScreen->epollFd>-1) {
+	close(rfbScreen->epollFd);
+	rfbScreen->epollFd=-1;
+	rfbScreen->epollReadyHead=NULL;
+    }
+#endif
+}
+
+/*
+ * rfbWatchSocket adds a socket to the epoll set rfbCheckFds waits on;
+ * 'data' is handed back with its events.  Client sockets are watched edge
+ * triggered, the listening sockets level triggered.  The HTTP sockets are
+ * left to rfbHttpCheckFds.  Without epoll this and rfbUnwatchSocket do
+ * nothing: select() works from allFds.
+ */
+
+void
+rfbWatchSocket(rfbScreenInfoPtr rfbScreen, int sock, void* data, rfbBool edge)
+{
+#ifdef LIBVNCSERVER_WITH_EPOLL
+    struct epoll_event ev;
+
+    if (rfbScreen->epollFd < 0 || sock < 0)
+	return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (edge ? EPOLLET : 0);
+    ev.data.ptr = data;
+
+    if (epoll_ctl(rfbScreen->epollFd, EPOLL_CTL_ADD, sock, &ev) < 0 &&
+	(errno != EEXIST ||
+	 epoll_ctl(rfbScreen->epollFd, EPOLL_CTL_MOD, sock, &ev) < 0))
+	rfbLogPerror("rfbWatchSocket: epoll_ctl");
+#endif
+}
+
+void
+rfbUnwatchSocket(rfbScreenInfoPtr rfbScreen, int sock)
+{
+#ifdef LIBVNCSERVER_WITH_EPOLL
+    struct epoll_event ev;	/* ignored, but old kernels want it */
+
+    if (rfbScreen->epollFd >= 0 && sock >= 0)
+	epoll_ctl(rfbScreen->epollFd, EPOLL_CTL_DEL, sock, &ev);
+#endif
+}
+
+/*
+ * Have rfbCheckFds report when a client's socket takes output again, for
+ * as long as output is queued.  select() is told about it in rfbCheckFds
+ * itself.  Caller holds cl->outputMutex.
+ */
+
+static void
+rfbWatchClientOutput(rfbClientPtr cl, rfbBool on)
+{
+#ifdef LIBVNCSERVER_WITH_EPOLL
+    struct epoll_event ev;
+
+    if (cl->screen->epollFd < 0 || cl->sock < 0)
+	return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET | (on ? EPOLLOUT : 0);
+    ev.data.ptr = cl;
+
+    if (epoll_ctl(cl->screen->epollFd, EPOLL_CTL_MOD, cl->sock, &ev) < 0)
+	rfbLogPerror("rfbWatchClientOutput: epoll_ctl");
+#endif
+}
+
+/*
+ * rfbAcceptClient takes a new connection on the listening socket.
+ */
+
+static int
+rfbAcceptClient(rfbScreenInfoPtr rfbScreen)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    const int one = 1;
+    int sock;
+
+    if ((sock = accept(rfbScreen->listenSock,
+		    (struct sockaddr *)&addr, &addrlen)) < 0) {
+	rfbLogPerror("rfbCheckFds: accept");
+	return -1;
+    }
+
+#ifndef WIN32
+    if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+	rfbLogPerror("rfbCheckFds: fcntl");
+	closesocket(sock);
+	return -1;
+    }
+#endif
+
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+		(char *)&one, sizeof(one)) < 0) {
+	rfbLogPerror("rfbCheckFds: setsockopt");
+	closesocket(sock);
+	return -1;
+    }
+
+#ifdef USE_LIBWRAP
+    if(!hosts_ctl("vnc",STRING_UNKNOWN,inet_ntoa(addr.sin_addr),
+		STRING_UNKNOWN)) {
+	rfbLog("Rejected connection from client %s\n",
+		inet_ntoa(addr.sin_addr));
+	closesocket(sock);
+	return -1;
+    }
+#endif
+
+    rfbLog("Got connection from client %s\n", inet_ntoa(addr.sin_addr));
+
+    rfbNewClient(rfbScreen,sock);
+    return 0;
+}
+
+/*
+ * rfbCheckUDPSock handles input on the UDP socket.
+ */
+
+static int
+rfbCheckUDPSock(rfbScreenInfoPtr rfbScreen)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    char buf[6];
+
+    if(!rfbScreen->udpClient)
+	rfbNewUDPClient(rfbScreen);
+    if (recvfrom(rfbScreen->udpSock, buf, 1, MSG_PEEK,
+		(struct sockaddr *)&addr, &addrlen) < 0) {
+	rfbLogPerror("rfbCheckFds: UDP: recvfrom");
+	rfbDisconnectUDPSock(rfbScreen);
+	rfbScreen->udpSockConnected = FALSE;
+    } else {
+	if (!rfbScreen->udpSockConnected ||
+		(memcmp(&addr, &rfbScreen->udpRemoteAddr, addrlen) != 0))
+	{
+	    /* new remote end */
+	    rfbLog("rfbCheckFds: UDP: got connection\n");
+
+	    memcpy(&rfbScreen->udpRemoteAddr, &addr, addrlen);
+	    rfbScreen->udpSockConnected = TRUE;
+
+	    if (connect(rfbScreen->udpSock,
+			(struct sockaddr *)&addr, addrlen) < 0) {
+		rfbLogPerror("rfbCheckFds: UDP: connect");
+		rfbDisconnectUDPSock(rfbScreen);
+		return -1;
+	    }
+
+	    rfbNewUDPConnection(rfbScreen,rfbScreen->udpSock);
+	}
+
+	rfbProcessUDPInput(rfbScreen);
+    }
+    return 0;
+}
+
+#ifdef LIBVNCSERVER_WITH_EPOLL
+#define RFB_EPOLL_EVENTS 64
+
+/*
+ * Returns TRUE unless the client's socket has been drained.  End of file
+ * counts as input, so that rfbProcessClientMessage gets to see it.
+ */
+
+static rfbBool
+rfbClientHasInput(rfbClientPtr cl)
+{
+    char c;
+
+    if (recv(cl->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0)
+	return TRUE;
+    return errno != EAGAIN && errno != EWOULDBLOCK;
+}
+
+/*
+ * The epoll flavour of rfbCheckFds.  Client sockets are edge triggered, so
+ * a wakeup costs O(ready sockets) instead of O(clients).  As with select(),
+ * each pass reads one message per client; a client stays on the ready list
+ * until its socket has been drained, because no new edge is reported for
+ * data that was already queued.
+ */
+
+static int
+rfbCheckFdsEpoll(rfbScreenInfoPtr rfbScreen,long usec)
+{
+    struct epoll_event events[RFB_EPOLL_EVENTS];
+    rfbClientIteratorPtr i;
+    rfbClientPtr cl, *link;
+    int nfds, n, timeout;
+    int result = 0;
+
+    do {
+	timeout = (usec + 999) / 1000;
+	for (cl = rfbScreen->epollReadyHead; cl; cl = cl->epollNextReady)
+	    if (!cl->onHold) {
+		timeout = 0;
+		break;
+	    }
+
+	nfds = epoll_wait(rfbScreen->epollFd, events, RFB_EPOLL_EVENTS, timeout);
+	if (nfds < 0) {
+	    if (errno != EINTR)
+		rfbLogPerror("rfbCheckFds: epoll_wait");
+	    return -1;
+	}
+
+	result += nfds;
+
+	for (n = 0; n < nfds; n++) {
+	    void *data = events[n].data.ptr;
+
+	    if (data == &rfbScreen->listenSock) {
+		if (rfbAcceptClient(rfbScreen) < 0)
+		    return -1;
+	    } else if (data == &rfbScreen->udpSock) {
+		if (rfbCheckUDPSock(rfbScreen) < 0)
+		    return -1;
+	    } else {
+		cl = (rfbClientPtr)data;
+		if (events[n].events & EPOLLOUT)
+		    rfbFlushClientOutput(cl);
+		if ((events[n].events & ~EPOLLOUT) && !cl->epollReady) {
+		    cl->epollReady = TRUE;
+		    cl->epollNextReady = rfbScreen->epollReadyHead;
+		    rfbScreen->epollReadyHead = cl;
+		}
+	    }
+	}
+
+	link = &rfbScreen->epollReadyHead;
+	while ((cl = *link) != NULL) {
+	    if (cl->sock >= 0 && !cl->onHold)
+		rfbProcessClientMessage(cl);
+
+	    if (cl->sock < 0 || (!cl->onHold && !rfbClientHasInput(cl))) {
+		*link = cl->epollNextReady;
+		cl->epollReady = FALSE;
+	    } else
+		link = &cl->epollNextReady;
+	}
+
+	/* rfbSendFileTransferChunk only does something if this is set */
+	if (rfbScreen->permitFileTransfer) {
+	    i = rfbGetClientIterator(rfbScreen);
+	    while((cl = rfbClientIteratorNext(i)))
+		if (!cl->onHold && !cl->epollReady)
+		    rfbSendFileTransferChunk(cl);
+	    rfbReleaseClientIterator(i);
+	}
+
+	if (nfds == 0)
+	    return result;
+    } while(rfbScreen->handleEventsEagerly);
+    return result;
+}
+#endif
+
+/*
+ * Output is queued when one thread serves many clients.  With a thread
+ * per client, only that client's threads wait for it.
+ */
+
+static rfbBool
+rfbClientQueuesOutput(rfbClientPtr cl)
+{
+    if (cl->screen->maxOutputQueue <= 0)
+	return FALSE;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    if (cl->screen->backgroundLoop && !cl->screen->encoderPool)
+	return FALSE;
+#endif
+    return TRUE;
+}
+
+/*
+ * rfbExpireClientOutput closes the clients whose output queue has not
+ * moved for rfbMaxClientWait.  A client that stopped reading never gets
+ * new output queued, because it is not sent updates while backlogged, so
+ * rfbQueueOutput alone would never notice.
+ */
+
+static void
+rfbExpireClientOutput(rfbScreenInfoPtr rfbScreen)
+{
+    rfbClientIteratorPtr i;
+    rfbClientPtr cl;
+    rfbBool stalled;
+
+    i = rfbGetClientIterator(rfbScreen);
+    while((cl = rfbClientIteratorNext(i))) {
+	/* the others wait in rfbWriteExact, holding outputMutex */
+	if (cl->sock < 0 || !rfbClientQueuesOutput(cl))
+	    continue;
+	LOCK(cl->outputMutex);
+	stalled = (cl->outputHead != NULL &&
+		   (time(NULL) - cl->outputProgress) * 1000 >= rfbMaxClientWait);
+	UNLOCK(cl->outputMutex);
+	if (stalled) {
+	    rfbLog("Client %s stopped reading, closing it\n", cl->host);
+	    rfbCloseClient(cl);
+	}
+    }
+    rfbReleaseClientIterator(i);
 }
 
 /*
@@ -217,13 +553,8 @@ int
 rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 {
     int nfds;
-    fd_set fds;
+    fd_set fds, wfds;
     struct timeval tv;
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
-    char buf[6];
-    const int one = 1;
-    int sock;
     rfbClientIteratorPtr i;
     rfbClientPtr cl;
     int result = 0;
@@ -233,11 +564,27 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 	rfbScreen->inetdInitDone = TRUE;
     }
 
+    if (rfbScreen->maxOutputQueue > 0)
+	rfbExpireClientOutput(rfbScreen);
+
+#ifdef LIBVNCSERVER_WITH_EPOLL
+    if (rfbScreen->epollFd >= 0)
+	return rfbCheckFdsEpoll(rfbScreen, usec);
+#endif
+
     do {
 	memcpy((char *)&fds, (char *)&(rfbScreen->allFds), sizeof(fd_set));
+	FD_ZERO(&wfds);
+	if (rfbScreen->maxOutputQueue > 0) {
+	    i = rfbGetClientIterator(rfbScreen);
+	    while((cl = rfbClientIteratorNext(i)))
+		if (cl->outputQueued > 0 && cl->sock >= 0)
+		    FD_SET(cl->sock, &wfds);
+	    rfbReleaseClientIterator(i);
+	}
 	tv.tv_sec = 0;
 	tv.tv_usec = usec;
-	nfds = select(rfbScreen->maxFd + 1, &fds, NULL, NULL /* &fds */, &tv);
+	nfds = select(rfbScreen->maxFd + 1, &fds, &wfds, NULL /* &fds */, &tv);
 	if (nfds == 0) {
 	    /* timed out, check for async events */
             i = rfbGetClientIterator(rfbScreen);
@@ -263,41 +610,8 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 	result += nfds;
 
 	if (rfbScreen->listenSock != -1 && FD_ISSET(rfbScreen->listenSock, &fds)) {
-
-	    if ((sock = accept(rfbScreen->listenSock,
-			    (struct sockaddr *)&addr, &addrlen)) < 0) {
-		rfbLogPerror("rfbCheckFds: accept");
+	    if (rfbAcceptClient(rfbScreen) < 0)
 		return -1;
-	    }
-
-#ifndef WIN32
-	    if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
-		rfbLogPerror("rfbCheckFds: fcntl");
-		closesocket(sock);
-		return -1;
-	    }
-#endif
-
-	    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
-			(char *)&one, sizeof(one)) < 0) {
-		rfbLogPerror("rfbCheckFds: setsockopt");
-		closesocket(sock);
-		return -1;
-	    }
-
-#ifdef USE_LIBWRAP
-	    if(!hosts_ctl("vnc",STRING_UNKNOWN,inet_ntoa(addr.sin_addr),
-			STRING_UNKNOWN)) {
-		rfbLog("Rejected connection from client %s\n",
-			inet_ntoa(addr.sin_addr));
-		closesocket(sock);
-		return -1;
-	    }
-#endif
-
-	    rfbLog("Got connection from client %s\n", inet_ntoa(addr.sin_addr));
-
-	    rfbNewClient(rfbScreen,sock);
 
 	    FD_CLR(rfbScreen->listenSock, &fds);
 	    if (--nfds == 0)
@@ -305,35 +619,8 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 	}
 
 	if ((rfbScreen->udpSock != -1) && FD_ISSET(rfbScreen->udpSock, &fds)) {
-	    if(!rfbScreen->udpClient)
-		rfbNewUDPClient(rfbScreen);
-	    if (recvfrom(rfbScreen->udpSock, buf, 1, MSG_PEEK,
-			(struct sockaddr *)&addr, &addrlen) < 0) {
-		rfbLogPerror("rfbCheckFds: UDP: recvfrom");
-		rfbDisconnectUDPSock(rfbScreen);
-		rfbScreen->udpSockConnected = FALSE;
-	    } else {
-		if (!rfbScreen->udpSockConnected ||
-			(memcmp(&addr, &rfbScreen->udpRemoteAddr, addrlen) != 0))
-		{
-		    /* new remote end */
-		    rfbLog("rfbCheckFds: UDP: got connection\n");
-
-		    memcpy(&rfbScreen->udpRemoteAddr, &addr, addrlen);
-		    rfbScreen->udpSockConnected = TRUE;
-
-		    if (connect(rfbScreen->udpSock,
-				(struct sockaddr *)&addr, addrlen) < 0) {
-			rfbLogPerror("rfbCheckFds: UDP: connect");
-			rfbDisconnectUDPSock(rfbScreen);
-			return -1;
-		    }
-
-		    rfbNewUDPConnection(rfbScreen,rfbScreen->udpSock);
-		}
-
-		rfbProcessUDPInput(rfbScreen);
-	    }
+	    if (rfbCheckUDPSock(rfbScreen) < 0)
+		return -1;
 
 	    FD_CLR(rfbScreen->udpSock, &fds);
 	    if (--nfds == 0)
@@ -343,7 +630,10 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 	i = rfbGetClientIterator(rfbScreen);
 	while((cl = rfbClientIteratorNext(i))) {
 
-	    if (cl->onHold)
+	    if (cl->sock >= 0 && FD_ISSET(cl->sock, &wfds))
+		rfbFlushClientOutput(cl);
+
+	    if (cl->onHold || cl->sock < 0)
 		continue;
 
             if (FD_ISSET(cl->sock, &(rfbScreen->allFds)))
@@ -382,6 +672,7 @@ rfbCloseClient(rfbClientPtr cl)
     if (cl->sock != -1)
 #endif
       {
+	rfbUnwatchSocket(cl->screen, cl->sock);
 	FD_CLR(cl->sock,&(cl->screen->allFds));
 	if(cl->sock==cl->screen->maxFd)
 	  while(cl->screen->maxFd>0
@@ -511,10 +802,218 @@ int rfbReadExact(rfbClientPtr cl,char* buf,int len)
   return(rfbReadExactTimeout(cl,buf,len,rfbMaxClientWait));
 }
 
+/*
+ * A piece of output waiting for the client's socket.
+ */
+
+struct rfbOutputChunk {
+    struct rfbOutputChunk *next;
+    int len, sent;
+    char data[1];
+};
+
+/*
+ * Write as much of the queue as the socket takes.  Returns -1 if an error
+ * occurred, 0 otherwise.  Caller holds cl->outputMutex.
+ */
+
+static int
+rfbWriteOutputQueue(rfbClientPtr cl)
+{
+    struct rfbOutputChunk *chunk;
+    int n;
+
+    if (cl->outputHead == NULL)
+	return 0;
+
+    while ((chunk = cl->outputHead) != NULL) {
+	n = write(cl->sock, chunk->data + chunk->sent, chunk->len - chunk->sent);
+	if (n <= 0) {
+#ifdef WIN32
+	    errno = WSAGetLastError();
+#endif
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n < 0 && errno != EWOULDBLOCK && errno != EAGAIN)
+		return -1;
+	    return 0;
+	}
+
+	cl->outputProgress = time(NULL);
+	cl->outputQueued -= n;
+	chunk->sent += n;
+	if (chunk->sent == chunk->len) {
+	    cl->outputHead = chunk->next;
+	    free(chunk);
+	}
+    }
+
+    cl->outputTail = NULL;
+    rfbWatchClientOutput(cl, FALSE);
+    return 0;
+}
+
+/*
+ * Write as much of iov as the socket takes with one system call, and move
+ * iov and count past what was written.  Empty pieces are skipped.
+ */
+
+static int
+rfbWriteV(int sock, struct iovec **iov, int *count)
+{
+    int n, done;
+
+    while (*count > 0 && (*iov)->iov_len == 0) {
+	(*iov)++;
+	(*count)--;
+    }
+    if (*count == 0)
+	return 0;
+
+#ifdef WIN32
+    n = write(sock, (*iov)->iov_base, (*iov)->iov_len);
+#else
+    n = writev(sock, *iov, *count > IOV_MAX ? IOV_MAX : *count);
+#endif
+    if (n <= 0)
+	return n;
+
+    for (done = n; done > 0 && *count > 0; ) {
+	if ((size_t)done < (*iov)->iov_len) {
+	    (*iov)->iov_base = (char *)(*iov)->iov_base + done;
+	    (*iov)->iov_len -= done;
+	    break;
+	}
+	done -= (*iov)->iov_len;
+	(*iov)++;
+	(*count)--;
+    }
+    return n;
+}
+
+static int
+rfbQueueOutput(rfbClientPtr cl, struct iovec *iov, int count)
+{
+    struct rfbOutputChunk *chunk;
+    int i, n, len;
+
+    LOCK(cl->outputMutex);
+    if (rfbWriteOutputQueue(cl) < 0)
+	goto failed;
+
+    /* nothing is waiting, so this may go out right away */
+    while (cl->outputHead == NULL && count > 0) {
+	n = rfbWriteV(cl->sock, &iov, &count);
+	if (n > 0 || count == 0)
+	    continue;
+#ifdef WIN32
+	errno = WSAGetLastError();
+#endif
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && errno != EWOULDBLOCK && errno != EAGAIN)
+	    goto failed;
+	break;
+    }
+
+    for (len = 0, i = 0; i < count; i++)
+	len += iov[i].iov_len;
+
+    if (len > 0) {
+	if (cl->outputHead == NULL) {
+	    cl->outputProgress = time(NULL);
+	} else if ((time(NULL) - cl->outputProgress) * 1000 >= rfbMaxClientWait) {
+	    errno = ETIMEDOUT;
+	    goto failed;
+	}
+
+	chunk = (struct rfbOutputChunk *)malloc(sizeof(*chunk) + len);
+	if (chunk == NULL) {
+	    rfbErr("rfbWriteExact: out of memory\n");
+	    errno = ENOMEM;
+	    goto failed;
+	}
+	chunk->next = NULL;
+	chunk->len = len;
+	chunk->sent = 0;
+	for (len = 0, i = 0; i < count; i++) {
+	    memcpy(chunk->data + len, iov[i].iov_base, iov[i].iov_len);
+	    len += iov[i].iov_len;
+	}
+
+	if (cl->outputTail) {
+	    cl->outputTail->next = chunk;
+	} else {
+	    cl->outputHead = chunk;
+	    rfbWatchClientOutput(cl, TRUE);
+	}
+	cl->outputTail = chunk;
+
+	cl->outputQueued += len;
+	if (cl->outputQueued > cl->outputQueuePeak)
+	    cl->outputQueuePeak = cl->outputQueued;
+	/* the update being sent still goes out whole, so the queue can go
+	   over maxOutputQueue by that much */
+	if (cl->outputQueued >= cl->screen->maxOutputQueue)
+	    cl->outputBacklogged = TRUE;
+    }
+    UNLOCK(cl->outputMutex);
+    return 1;
+
+failed:
+    UNLOCK(cl->outputMutex);
+    return -1;
+}
+
+/*
+ * rfbFlushClientOutput is called by rfbCheckFds when a client's socket
+ * takes output again.  Once the queue is down to half its size, the
+ * client is sent updates again.
+ */
+
+void
+rfbFlushClientOutput(rfbClientPtr cl)
+{
+    rfbBool resume = FALSE;
+    int result;
+
+    LOCK(cl->outputMutex);
+    result = rfbWriteOutputQueue(cl);
+    if (result == 0 && cl->outputBacklogged &&
+	cl->outputQueued <= cl->screen->maxOutputQueue / 2) {
+	cl->outputBacklogged = FALSE;
+	resume = TRUE;
+    }
+    UNLOCK(cl->outputMutex);
+
+    if (result < 0) {
+	rfbLogPerror("rfbFlushClientOutput: write");
+	rfbCloseClient(cl);
+    } else if (resume) {
+	LOCK(cl->updateMutex);
+	rfbSignalClientUpdate(cl);
+	UNLOCK(cl->updateMutex);
+    }
+}
+
+void
+rfbFreeClientOutput(rfbClientPtr cl)
+{
+    struct rfbOutputChunk *chunk;
+
+    while ((chunk = cl->outputHead) != NULL) {
+	cl->outputHead = chunk->next;
+	free(chunk);
+    }
+    cl->outputTail = NULL;
+    cl->outputQueued = 0;
+}
+
 /*
  * WriteExact writes an exact number of bytes to a client.  Returns 1 if
  * those bytes have been written, or -1 if an error occurred (errno is set to
- * ETIMEDOUT if it timed out).
+ * ETIMEDOUT if it timed out).  If the screen has a maxOutputQueue, what the
+ * socket does not take at once is queued, and 1 means it was.
  */
 
 int
@@ -522,32 +1021,53 @@ rfbWriteExact(rfbClientPtr cl,
               const char *buf,
               int len)
 {
-    int sock = cl->sock;
-    int n;
-    fd_set fds;
-    struct timeval tv;
-    int totalTimeWaited = 0;
+    struct iovec iov;
 
 #undef DEBUG_WRITE_EXACT
 #ifdef DEBUG_WRITE_EXACT
+    int n;
     rfbLog("WriteExact %d bytes\n",len);
     for(n=0;n<len;n++)
 	    fprintf(stderr,"%02x ",(unsigned char)buf[n]);
     fprintf(stderr,"\n");
 #endif
 
+    iov.iov_base = (char *)buf;
+    iov.iov_len = len;
+    return rfbWriteExactV(cl, &iov, 1);
+}
+
+/*
+ * rfbWriteExactV is rfbWriteExact for count pieces of data, which are
+ * gathered into as few writes as the socket allows.  iov is used up.
+ */
+
+int
+rfbWriteExactV(rfbClientPtr cl,
+               struct iovec *iov,
+               int count)
+{
+    int sock = cl->sock;
+    int n;
+    fd_set fds;
+    struct timeval tv;
+    int totalTimeWaited = 0;
+
+    if (rfbClientQueuesOutput(cl))
+	return rfbQueueOutput(cl, iov, count);
+
     LOCK(cl->outputMutex);
-    while (len > 0) {
-        n = write(sock, buf, len);
+    while (count > 0) {
+        n = rfbWriteV(sock, &iov, &count);
 
-        if (n > 0) {
+        if (n > 0 || count == 0) {
 
-            buf += n;
-            len -= n;
+            continue;
 
         } else if (n == 0) {
 
             rfbErr("WriteExact: write returned 0?\n");
+            UNLOCK(cl->outputMutex);
             return 0;
 
         } else {
@@ -594,6 +1114,25 @@ rfbWriteExact(rfbClientPtr cl,
     return 1;
 }
 
+/*
+ * While a framebuffer update takes more than one write, the socket is
+ * corked, so that the pieces leave in full packets despite TCP_NODELAY.
+ */
+
+void
+rfbCorkClient(rfbClientPtr cl, rfbBool cork)
+{
+#ifdef TCP_CORK
+    int on = cork ? 1 : 0;
+
+    if (cl->sock >= 0 && cl->corked != cork) {
+	/* fails for sockets other than TCP, which do not need it */
+	setsockopt(cl->sock, IPPROTO_TCP, TCP_CORK, (char *)&on, sizeof(on));
+	cl->corked = cork;
+    }
+#endif
+}
+
 /* currently private, called by rfbProcessArguments() */
 int
 rfbStringToAddr(char *str, in_addr_t *addr)  {
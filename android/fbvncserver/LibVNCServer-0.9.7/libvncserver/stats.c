@@ -428,6 +428,8 @@ void rfbPrintStats(rfbClientPtr cl)
         savings = 100.0 - ((totalBytes/totalBytesIfRaw)*100.0);
     rfbLog(" %-20.20s: %6d | %9.0f/%9.0f (%5.1f%%)\n",
             "TOTALS", totalRects, totalBytes,totalBytesIfRaw, savings);
+    rfbLog(" %-20.20s: %d bytes, largest update %d bytes\n",
+            "update buffer", cl->updateBufSize, cl->updateBufPeak);
 
     totalRects=0.0;
     totalBytes=0.0;
@@ -107,9 +107,10 @@ rfbTranslateWithRGBTables24to24 (char *table, rfbPixelFormat *in,
 
         while (op < opLineEnd) {
 	    inValue = ((*(uint32_t *)ip)>>shift)&0x00ffffff;
-            outValue = (redTable[(inValue >> in->redShift) & in->redMax] |
-                       greenTable[(inValue >> in->greenShift) & in->greenMax] |
-                       blueTable[(inValue >> in->blueShift) & in->blueMax]);
+            /* each table entry is three bytes long */
+            outValue = (*(uint32_t *)&redTable[3*((inValue >> in->redShift) & in->redMax)] |
+                       *(uint32_t *)&greenTable[3*((inValue >> in->greenShift) & in->greenMax)] |
+                       *(uint32_t *)&blueTable[3*((inValue >> in->blueShift) & in->blueMax)]);
 	    memcpy(op,&outValue,3);
 	    op += 3;
             ip+=3;
@@ -259,9 +260,10 @@ rfbTranslateWithRGBTablesINto24 (char *table, rfbPixelFormat *in,
         opLineEnd = op+3*width;
 
         while (op < opLineEnd) {
-            outValue = (redTable[(*ip >> in->redShift) & in->redMax] |
-                       greenTable[(*ip >> in->greenShift) & in->greenMax] |
-                       blueTable[(*ip >> in->blueShift) & in->blueMax]);
+            /* each table entry is three bytes long */
+            outValue = (*(uint32_t *)&redTable[3*((*ip >> in->redShift) & in->redMax)] |
+                       *(uint32_t *)&greenTable[3*((*ip >> in->greenShift) & in->greenMax)] |
+                       *(uint32_t *)&blueTable[3*((*ip >> in->blueShift) & in->blueMax)]);
 	    memcpy(op,&outValue,3);
 	    op += 3;
             ip++;
@@ -39,6 +39,13 @@
 /* Note: The following constant should not be changed. */
 #define TIGHT_MIN_TO_COMPRESS 12
 
+/* Bit of the compression control byte telling the client to reset a zlib
+   stream.  Every rectangle restarts its stream while the encode cache or
+   the parallel encoders are on, so that the rectangle does not depend on
+   what the client was sent before. */
+#define STREAM_RESET_FLAG(cl, streamId) \
+    (RESTART_STREAMS(cl) ? (1 << (streamId)) : 0)
+
 /* The parameters below may be adjusted. */
 #define MIN_SPLIT_RECT_SIZE     4096
 #define MIN_SOLID_SUBRECT_SIZE  2048
@@ -47,10 +54,6 @@
 /* May be set to TRUE with "-lazytight" Xvnc option. */
 rfbBool rfbTightDisableGradient = FALSE;
 
-/* This variable is set on every rfbSendRectEncodingTight() call. */
-static rfbBool usePixelFormat24;
-
-
 /* Compression level stuff. The following array contains various
    encoder parameters for each of 10 compression levels (0..9).
    Last three parameters correspond to JPEG quality levels (0..9). */
@@ -77,9 +80,6 @@ static TIGHT_CONF tightConf[10] = {
     { 65536, 2048,  32,  8192, 9, 9, 9, 6, 200, 500,  96, 80,   200,   500 }
 };
 
-static int compressLevel;
-static int qualityLevel;
-
 /* Stuff dealing with palettes. */
 
 typedef struct COLOR_LIST_s {
@@ -99,31 +99,44 @@ typedef struct PALETTE_s {
     COLOR_LIST list[256];
 } PALETTE;
 
-/* TODO: move into rfbScreen struct */
-static int paletteNumColors, paletteMaxColors;
-static uint32_t monoBackground, monoForeground;
-static PALETTE palette;
-
-/* Pointers to dynamically-allocated buffers. */
-
-static int tightBeforeBufSize = 0;
-static char *tightBeforeBuf = NULL;
-
-static int tightAfterBufSize = 0;
-static char *tightAfterBuf = NULL;
-
-static int *prevRowBuf = NULL;
-
-void rfbTightCleanup(rfbScreenInfoPtr screen)
+/* Per-client encoder state.  Everything the encoder keeps between calls
+   lives here rather than in statics, so that different clients can be
+   encoded on different threads at the same time. */
+
+typedef struct rfbTightData_s {
+    /* These are set on every rfbSendRectEncodingTight() call. */
+    rfbBool usePixelFormat24;
+    int compressLevel;
+    int qualityLevel;
+
+    int paletteNumColors, paletteMaxColors;
+    uint32_t monoBackground, monoForeground;
+    PALETTE palette;
+
+    /* Pointers to dynamically-allocated buffers. */
+    int beforeBufSize;
+    char *beforeBuf;
+    int afterBufSize;
+    char *afterBuf;
+    int *prevRowBuf;
+
+    /* JPEG destination manager state. */
+    struct jpeg_destination_mgr jpegDstManager;
+    rfbBool jpegError;
+    int jpegDstDataLen;
+} rfbTightData;
+
+void rfbFreeTightData(rfbClientPtr cl)
 {
-  if(tightBeforeBufSize) {
-    free(tightBeforeBuf);
-    tightBeforeBufSize=0;
-  }
-  if(tightAfterBufSize) {
-    free(tightAfterBuf);
-    tightAfterBufSize=0;
+  rfbTightData *tight = cl->tightData;
+
+  if (tight) {
+    free(tight->beforeBuf);
+    free(tight->afterBuf);
+    free(tight->prevRowBuf);
+    free(tight);
   }
+  cl->tightData = NULL;
 }
 
 /* Prototypes for static functions. */
@@ -156,21 +169,22 @@ static rfbBool CompressData(rfbClientPtr cl, int streamId, int dataLen,
                          int zlibLevel, int zlibStrategy);
 static rfbBool SendCompressedData(rfbClientPtr cl, int compressedLen);
 
-static void FillPalette8(int count);
-static void FillPalette16(int count);
-static void FillPalette32(int count);
+static void FillPalette8(rfbTightData *tight, int count);
+static void FillPalette16(rfbTightData *tight, int count);
+static void FillPalette32(rfbTightData *tight, int count);
 
-static void PaletteReset(void);
-static int PaletteInsert(uint32_t rgb, int numPixels, int bpp);
+static void PaletteReset(rfbTightData *tight);
+static int PaletteInsert(rfbTightData *tight, uint32_t rgb, int numPixels,
+                         int bpp);
 
 static void Pack24(rfbClientPtr cl, char *buf, rfbPixelFormat *fmt, int count);
 
-static void EncodeIndexedRect16(uint8_t *buf, int count);
-static void EncodeIndexedRect32(uint8_t *buf, int count);
+static void EncodeIndexedRect16(rfbTightData *tight, uint8_t *buf, int count);
+static void EncodeIndexedRect32(rfbTightData *tight, uint8_t *buf, int count);
 
-static void EncodeMonoRect8(uint8_t *buf, int w, int h);
-static void EncodeMonoRect16(uint8_t *buf, int w, int h);
-static void EncodeMonoRect32(uint8_t *buf, int w, int h);
+static void EncodeMonoRect8(rfbTightData *tight, uint8_t *buf, int w, int h);
+static void EncodeMonoRect16(rfbTightData *tight, uint8_t *buf, int w, int h);
+static void EncodeMonoRect32(rfbTightData *tight, uint8_t *buf, int w, int h);
 
 static void FilterGradient24(rfbClientPtr cl, char *buf, rfbPixelFormat *fmt, int w, int h);
 static void FilterGradient16(rfbClientPtr cl, uint16_t *buf, rfbPixelFormat *fmt, int w, int h);
@@ -238,31 +252,41 @@ rfbSendRectEncodingTight(rfbClientPtr cl,
     int dx, dy, dw, dh;
     int x_best, y_best, w_best, h_best;
     char *fbptr;
+    rfbTightData *tight;
 
     rfbSendUpdateBuf(cl);
 
-    compressLevel = cl->tightCompressLevel;
-    qualityLevel = cl->tightQualityLevel;
+    if (cl->tightData == NULL) {
+        cl->tightData = calloc(1, sizeof(rfbTightData));
+        if (cl->tightData == NULL) {
+            rfbErr("rfbSendRectEncodingTight: out of memory\n");
+            return FALSE;
+        }
+    }
+    tight = cl->tightData;
+
+    tight->compressLevel = cl->tightCompressLevel;
+    tight->qualityLevel = cl->tightQualityLevel;
 
     if ( cl->format.depth == 24 && cl->format.redMax == 0xFF &&
          cl->format.greenMax == 0xFF && cl->format.blueMax == 0xFF ) {
-        usePixelFormat24 = TRUE;
+        tight->usePixelFormat24 = TRUE;
     } else {
-        usePixelFormat24 = FALSE;
+        tight->usePixelFormat24 = FALSE;
     }
 
     if (!cl->enableLastRectEncoding || w * h < MIN_SPLIT_RECT_SIZE)
         return SendRectSimple(cl, x, y, w, h);
 
-    /* Make sure we can write at least one pixel into tightBeforeBuf. */
+    /* Make sure we can write at least one pixel into beforeBuf. */
 
-    if (tightBeforeBufSize < 4) {
-        tightBeforeBufSize = 4;
-        if (tightBeforeBuf == NULL)
-            tightBeforeBuf = (char *)malloc(tightBeforeBufSize);
+    if (tight->beforeBufSize < 4) {
+        tight->beforeBufSize = 4;
+        if (tight->beforeBuf == NULL)
+            tight->beforeBuf = (char *)malloc(tight->beforeBufSize);
         else
-            tightBeforeBuf = (char *)realloc(tightBeforeBuf,
-                                              tightBeforeBufSize);
+            tight->beforeBuf = (char *)realloc(tight->beforeBuf,
+                                              tight->beforeBufSize);
     }
 
     /* Calculate maximum number of rows in one non-solid rectangle. */
@@ -270,8 +294,8 @@ rfbSendRectEncodingTight(rfbClientPtr cl,
     {
         int maxRectSize, maxRectWidth, nMaxWidth;
 
-        maxRectSize = tightConf[compressLevel].maxRectSize;
-        maxRectWidth = tightConf[compressLevel].maxRectWidth;
+        maxRectSize = tightConf[tight->compressLevel].maxRectSize;
+        maxRectWidth = tightConf[tight->compressLevel].maxRectWidth;
         nMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
         nMaxRows = maxRectSize / nMaxWidth;
     }
@@ -337,7 +361,7 @@ rfbSendRectEncodingTight(rfbClientPtr cl,
                          (x_best * (cl->scaledScreen->bitsPerPixel / 8)));
 
                 (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-                                   &cl->format, fbptr, tightBeforeBuf,
+                                   &cl->format, fbptr, tight->beforeBuf,
                                    cl->scaledScreen->paddedWidthInBytes, 1, 1);
 
                 if (!SendSolidRect(cl))
@@ -511,34 +535,35 @@ DEFINE_CHECK_SOLID_FUNCTION(32)
 static rfbBool
 SendRectSimple(rfbClientPtr cl, int x, int y, int w, int h)
 {
+    rfbTightData *tight = cl->tightData;
     int maxBeforeSize, maxAfterSize;
     int maxRectSize, maxRectWidth;
     int subrectMaxWidth, subrectMaxHeight;
     int dx, dy;
     int rw, rh;
 
-    maxRectSize = tightConf[compressLevel].maxRectSize;
-    maxRectWidth = tightConf[compressLevel].maxRectWidth;
+    maxRectSize = tightConf[tight->compressLevel].maxRectSize;
+    maxRectWidth = tightConf[tight->compressLevel].maxRectWidth;
 
     maxBeforeSize = maxRectSize * (cl->format.bitsPerPixel / 8);
     maxAfterSize = maxBeforeSize + (maxBeforeSize + 99) / 100 + 12;
 
-    if (tightBeforeBufSize < maxBeforeSize) {
-        tightBeforeBufSize = maxBeforeSize;
-        if (tightBeforeBuf == NULL)
-            tightBeforeBuf = (char *)malloc(tightBeforeBufSize);
+    if (tight->beforeBufSize < maxBeforeSize) {
+        tight->beforeBufSize = maxBeforeSize;
+        if (tight->beforeBuf == NULL)
+            tight->beforeBuf = (char *)malloc(tight->beforeBufSize);
         else
-            tightBeforeBuf = (char *)realloc(tightBeforeBuf,
-                                              tightBeforeBufSize);
+            tight->beforeBuf = (char *)realloc(tight->beforeBuf,
+                                              tight->beforeBufSize);
     }
 
-    if (tightAfterBufSize < maxAfterSize) {
-        tightAfterBufSize = maxAfterSize;
-        if (tightAfterBuf == NULL)
-            tightAfterBuf = (char *)malloc(tightAfterBufSize);
+    if (tight->afterBufSize < maxAfterSize) {
+        tight->afterBufSize = maxAfterSize;
+        if (tight->afterBuf == NULL)
+            tight->afterBuf = (char *)malloc(tight->afterBufSize);
         else
-            tightAfterBuf = (char *)realloc(tightAfterBuf,
-                                             tightAfterBufSize);
+            tight->afterBuf = (char *)realloc(tight->afterBuf,
+                                             tight->afterBufSize);
     }
 
     if (w > maxRectWidth || w * h > maxRectSize) {
@@ -568,6 +593,7 @@ SendSubrect(rfbClientPtr cl,
             int w,
             int h)
 {
+    rfbTightData *tight = cl->tightData;
     char *fbptr;
     rfbBool success = FALSE;
 
@@ -584,32 +610,32 @@ SendSubrect(rfbClientPtr cl,
              + (x * (cl->scaledScreen->bitsPerPixel / 8)));
 
     (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-                       &cl->format, fbptr, tightBeforeBuf,
+                       &cl->format, fbptr, tight->beforeBuf,
                        cl->scaledScreen->paddedWidthInBytes, w, h);
 
-    paletteMaxColors = w * h / tightConf[compressLevel].idxMaxColorsDivisor;
-    if ( paletteMaxColors < 2 &&
-         w * h >= tightConf[compressLevel].monoMinRectSize ) {
-        paletteMaxColors = 2;
+    tight->paletteMaxColors = w * h / tightConf[tight->compressLevel].idxMaxColorsDivisor;
+    if ( tight->paletteMaxColors < 2 &&
+         w * h >= tightConf[tight->compressLevel].monoMinRectSize ) {
+        tight->paletteMaxColors = 2;
     }
     switch (cl->format.bitsPerPixel) {
     case 8:
-        FillPalette8(w * h);
+        FillPalette8(tight, w * h);
         break;
     case 16:
-        FillPalette16(w * h);
+        FillPalette16(tight, w * h);
         break;
     default:
-        FillPalette32(w * h);
+        FillPalette32(tight, w * h);
     }
 
-    switch (paletteNumColors) {
+    switch (tight->paletteNumColors) {
     case 0:
         /* Truecolor image */
         if (DetectSmoothImage(cl, &cl->format, w, h)) {
-            if (qualityLevel != -1) {
+            if (tight->qualityLevel != -1) {
                 success = SendJpegRect(cl, x, y, w, h,
-                                       tightConf[qualityLevel].jpegQuality);
+                                       tightConf[tight->qualityLevel].jpegQuality);
             } else {
                 success = SendGradientRect(cl, w, h);
             }
@@ -627,11 +653,11 @@ SendSubrect(rfbClientPtr cl,
         break;
     default:
         /* Up to 256 different colors */
-        if ( paletteNumColors > 96 &&
-             qualityLevel != -1 && qualityLevel <= 3 &&
+        if ( tight->paletteNumColors > 96 &&
+             tight->qualityLevel != -1 && tight->qualityLevel <= 3 &&
              DetectSmoothImage(cl, &cl->format, w, h) ) {
             success = SendJpegRect(cl, x, y, w, h,
-                                   tightConf[qualityLevel].jpegQuality);
+                                   tightConf[tight->qualityLevel].jpegQuality);
         } else {
             success = SendIndexedRect(cl, w, h);
         }
@@ -648,7 +674,7 @@ SendTightHeader(rfbClientPtr cl,
 {
     rfbFramebufferUpdateRectHeader rect;
 
-    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->updateBufSize) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
@@ -676,21 +702,22 @@ SendTightHeader(rfbClientPtr cl,
 static rfbBool
 SendSolidRect(rfbClientPtr cl)
 {
+    rfbTightData *tight = cl->tightData;
     int len;
 
-    if (usePixelFormat24) {
-        Pack24(cl, tightBeforeBuf, &cl->format, 1);
+    if (tight->usePixelFormat24) {
+        Pack24(cl, tight->beforeBuf, &cl->format, 1);
         len = 3;
     } else
         len = cl->format.bitsPerPixel / 8;
 
-    if (cl->ublen + 1 + len > UPDATE_BUF_SIZE) {
+    if (cl->ublen + 1 + len > cl->updateBufSize) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
 
     cl->updateBuf[cl->ublen++] = (char)(rfbTightFill << 4);
-    memcpy (&cl->updateBuf[cl->ublen], tightBeforeBuf, len);
+    memcpy (&cl->updateBuf[cl->ublen], tight->beforeBuf, len);
     cl->ublen += len;
 
     rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, len+1);
@@ -703,11 +730,12 @@ SendMonoRect(rfbClientPtr cl,
              int w,
              int h)
 {
+    rfbTightData *tight = cl->tightData;
     int streamId = 1;
     int paletteLen, dataLen;
 
     if ( cl->ublen + TIGHT_MIN_TO_COMPRESS + 6 +
-	 2 * cl->format.bitsPerPixel / 8 > UPDATE_BUF_SIZE ) {
+	 2 * cl->format.bitsPerPixel / 8 > cl->updateBufSize ) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
@@ -716,7 +744,8 @@ SendMonoRect(rfbClientPtr cl,
     dataLen = (w + 7) / 8;
     dataLen *= h;
 
-    cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
+    cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4 |
+        STREAM_RESET_FLAG(cl, streamId);
     cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
     cl->updateBuf[cl->ublen++] = 1;
 
@@ -724,42 +753,42 @@ SendMonoRect(rfbClientPtr cl,
     switch (cl->format.bitsPerPixel) {
 
     case 32:
-        EncodeMonoRect32((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect32(tight, (uint8_t *)tight->beforeBuf, w, h);
 
-        ((uint32_t *)tightAfterBuf)[0] = monoBackground;
-        ((uint32_t *)tightAfterBuf)[1] = monoForeground;
-        if (usePixelFormat24) {
-            Pack24(cl, tightAfterBuf, &cl->format, 2);
+        ((uint32_t *)tight->afterBuf)[0] = tight->monoBackground;
+        ((uint32_t *)tight->afterBuf)[1] = tight->monoForeground;
+        if (tight->usePixelFormat24) {
+            Pack24(cl, tight->afterBuf, &cl->format, 2);
             paletteLen = 6;
         } else
             paletteLen = 8;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteLen);
+        memcpy(&cl->updateBuf[cl->ublen], tight->afterBuf, paletteLen);
         cl->ublen += paletteLen;
         rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 3 + paletteLen);
         break;
 
     case 16:
-        EncodeMonoRect16((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect16(tight, (uint8_t *)tight->beforeBuf, w, h);
 
-        ((uint16_t *)tightAfterBuf)[0] = (uint16_t)monoBackground;
-        ((uint16_t *)tightAfterBuf)[1] = (uint16_t)monoForeground;
+        ((uint16_t *)tight->afterBuf)[0] = (uint16_t)tight->monoBackground;
+        ((uint16_t *)tight->afterBuf)[1] = (uint16_t)tight->monoForeground;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, 4);
+        memcpy(&cl->updateBuf[cl->ublen], tight->afterBuf, 4);
         cl->ublen += 4;
         rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 7);
         break;
 
     default:
-        EncodeMonoRect8((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect8(tight, (uint8_t *)tight->beforeBuf, w, h);
 
-        cl->updateBuf[cl->ublen++] = (char)monoBackground;
-        cl->updateBuf[cl->ublen++] = (char)monoForeground;
+        cl->updateBuf[cl->ublen++] = (char)tight->monoBackground;
+        cl->updateBuf[cl->ublen++] = (char)tight->monoForeground;
         rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 5);
     }
 
     return CompressData(cl, streamId, dataLen,
-                        tightConf[compressLevel].monoZlibLevel,
+                        tightConf[tight->compressLevel].monoZlibLevel,
                         Z_DEFAULT_STRATEGY);
 }
 
@@ -768,53 +797,55 @@ SendIndexedRect(rfbClientPtr cl,
                 int w,
                 int h)
 {
+    rfbTightData *tight = cl->tightData;
     int streamId = 2;
     int i, entryLen;
 
     if ( cl->ublen + TIGHT_MIN_TO_COMPRESS + 6 +
-	 paletteNumColors * cl->format.bitsPerPixel / 8 >
-         UPDATE_BUF_SIZE ) {
+	 tight->paletteNumColors * cl->format.bitsPerPixel / 8 >
+         cl->updateBufSize ) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
 
     /* Prepare tight encoding header. */
-    cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
+    cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4 |
+        STREAM_RESET_FLAG(cl, streamId);
     cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
-    cl->updateBuf[cl->ublen++] = (char)(paletteNumColors - 1);
+    cl->updateBuf[cl->ublen++] = (char)(tight->paletteNumColors - 1);
 
     /* Prepare palette, convert image. */
     switch (cl->format.bitsPerPixel) {
 
     case 32:
-        EncodeIndexedRect32((uint8_t *)tightBeforeBuf, w * h);
+        EncodeIndexedRect32(tight, (uint8_t *)tight->beforeBuf, w * h);
 
-        for (i = 0; i < paletteNumColors; i++) {
-            ((uint32_t *)tightAfterBuf)[i] =
-                palette.entry[i].listNode->rgb;
+        for (i = 0; i < tight->paletteNumColors; i++) {
+            ((uint32_t *)tight->afterBuf)[i] =
+                tight->palette.entry[i].listNode->rgb;
         }
-        if (usePixelFormat24) {
-            Pack24(cl, tightAfterBuf, &cl->format, paletteNumColors);
+        if (tight->usePixelFormat24) {
+            Pack24(cl, tight->afterBuf, &cl->format, tight->paletteNumColors);
             entryLen = 3;
         } else
             entryLen = 4;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteNumColors * entryLen);
-        cl->ublen += paletteNumColors * entryLen;
-        rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 3 + paletteNumColors * entryLen);
+        memcpy(&cl->updateBuf[cl->ublen], tight->afterBuf, tight->paletteNumColors * entryLen);
+        cl->ublen += tight->paletteNumColors * entryLen;
+        rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 3 + tight->paletteNumColors * entryLen);
         break;
 
     case 16:
-        EncodeIndexedRect16((uint8_t *)tightBeforeBuf, w * h);
+        EncodeIndexedRect16(tight, (uint8_t *)tight->beforeBuf, w * h);
 
-        for (i = 0; i < paletteNumColors; i++) {
-            ((uint16_t *)tightAfterBuf)[i] =
-                (uint16_t)palette.entry[i].listNode->rgb;
+        for (i = 0; i < tight->paletteNumColors; i++) {
+            ((uint16_t *)tight->afterBuf)[i] =
+                (uint16_t)tight->palette.entry[i].listNode->rgb;
         }
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteNumColors * 2);
-        cl->ublen += paletteNumColors * 2;
-        rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 3 + paletteNumColors * 2);
+        memcpy(&cl->updateBuf[cl->ublen], tight->afterBuf, tight->paletteNumColors * 2);
+        cl->ublen += tight->paletteNumColors * 2;
+        rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 3 + tight->paletteNumColors * 2);
         break;
 
     default:
@@ -822,7 +853,7 @@ SendIndexedRect(rfbClientPtr cl,
     }
 
     return CompressData(cl, streamId, w * h,
-                        tightConf[compressLevel].idxZlibLevel,
+                        tightConf[tight->compressLevel].idxZlibLevel,
                         Z_DEFAULT_STRATEGY);
 }
 
@@ -831,25 +862,27 @@ SendFullColorRect(rfbClientPtr cl,
                   int w,
                   int h)
 {
+    rfbTightData *tight = cl->tightData;
     int streamId = 0;
     int len;
 
-    if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > UPDATE_BUF_SIZE) {
+    if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > cl->updateBufSize) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
 
-    cl->updateBuf[cl->ublen++] = 0x00;  /* stream id = 0, no flushing, no filter */
+    /* stream id = 0, no filter */
+    cl->updateBuf[cl->ublen++] = STREAM_RESET_FLAG(cl, streamId);
     rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 1);
 
-    if (usePixelFormat24) {
-        Pack24(cl, tightBeforeBuf, &cl->format, w * h);
+    if (tight->usePixelFormat24) {
+        Pack24(cl, tight->beforeBuf, &cl->format, w * h);
         len = 3;
     } else
         len = cl->format.bitsPerPixel / 8;
 
     return CompressData(cl, streamId, w * h * len,
-                        tightConf[compressLevel].rawZlibLevel,
+                        tightConf[tight->compressLevel].rawZlibLevel,
                         Z_DEFAULT_STRATEGY);
 }
 
@@ -858,37 +891,39 @@ SendGradientRect(rfbClientPtr cl,
                  int w,
                  int h)
 {
+    rfbTightData *tight = cl->tightData;
     int streamId = 3;
     int len;
 
     if (cl->format.bitsPerPixel == 8)
         return SendFullColorRect(cl, w, h);
 
-    if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 2 > UPDATE_BUF_SIZE) {
+    if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 2 > cl->updateBufSize) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
 
-    if (prevRowBuf == NULL)
-        prevRowBuf = (int *)malloc(2048 * 3 * sizeof(int));
+    if (tight->prevRowBuf == NULL)
+        tight->prevRowBuf = (int *)malloc(2048 * 3 * sizeof(int));
 
-    cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
+    cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4 |
+        STREAM_RESET_FLAG(cl, streamId);
     cl->updateBuf[cl->ublen++] = rfbTightFilterGradient;
     rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 2);
 
-    if (usePixelFormat24) {
-        FilterGradient24(cl, tightBeforeBuf, &cl->format, w, h);
+    if (tight->usePixelFormat24) {
+        FilterGradient24(cl, tight->beforeBuf, &cl->format, w, h);
         len = 3;
     } else if (cl->format.bitsPerPixel == 32) {
-        FilterGradient32(cl, (uint32_t *)tightBeforeBuf, &cl->format, w, h);
+        FilterGradient32(cl, (uint32_t *)tight->beforeBuf, &cl->format, w, h);
         len = 4;
     } else {
-        FilterGradient16(cl, (uint16_t *)tightBeforeBuf, &cl->format, w, h);
+        FilterGradient16(cl, (uint16_t *)tight->beforeBuf, &cl->format, w, h);
         len = 2;
     }
 
     return CompressData(cl, streamId, w * h * len,
-                        tightConf[compressLevel].gradientZlibLevel,
+                        tightConf[tight->compressLevel].gradientZlibLevel,
                         Z_FILTERED);
 }
 
@@ -899,18 +934,23 @@ CompressData(rfbClientPtr cl,
              int zlibLevel,
              int zlibStrategy)
 {
+    rfbTightData *tight = cl->tightData;
     z_streamp pz;
     int err;
 
+    pz = &cl->zsStruct[streamId];
+
+    /* The client has been told to reset this stream. */
+    if (RESTART_STREAMS(cl) && cl->zsActive[streamId])
+        deflateReset(pz);
+
     if (dataLen < TIGHT_MIN_TO_COMPRESS) {
-        memcpy(&cl->updateBuf[cl->ublen], tightBeforeBuf, dataLen);
+        memcpy(&cl->updateBuf[cl->ublen], tight->beforeBuf, dataLen);
         cl->ublen += dataLen;
         rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, dataLen);
         return TRUE;
     }
 
-    pz = &cl->zsStruct[streamId];
-
     /* Initialize compression stream if needed. */
     if (!cl->zsActive[streamId]) {
         pz->zalloc = Z_NULL;
@@ -927,10 +967,10 @@ CompressData(rfbClientPtr cl,
     }
 
     /* Prepare buffer pointers. */
-    pz->next_in = (Bytef *)tightBeforeBuf;
+    pz->next_in = (Bytef *)tight->beforeBuf;
     pz->avail_in = dataLen;
-    pz->next_out = (Bytef *)tightAfterBuf;
-    pz->avail_out = tightAfterBufSize;
+    pz->next_out = (Bytef *)tight->afterBuf;
+    pz->avail_out = tight->afterBufSize;
 
     /* Change compression parameters if needed. */
     if (zlibLevel != cl->zsLevel[streamId]) {
@@ -946,13 +986,13 @@ CompressData(rfbClientPtr cl,
         return FALSE;
     }
 
-    return SendCompressedData(cl, tightAfterBufSize - pz->avail_out);
+    return SendCompressedData(cl, tight->afterBufSize - pz->avail_out);
 }
 
 static rfbBool SendCompressedData(rfbClientPtr cl,
                                   int compressedLen)
 {
-    int i, portionLen;
+    rfbTightData *tight = cl->tightData;
 
     cl->updateBuf[cl->ublen++] = compressedLen & 0x7F;
     rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 1);
@@ -967,21 +1007,9 @@ static rfbBool SendCompressedData(rfbClientPtr cl,
         }
     }
 
-    portionLen = UPDATE_BUF_SIZE;
-    for (i = 0; i < compressedLen; i += portionLen) {
-        if (i + portionLen > compressedLen) {
-            portionLen = compressedLen - i;
-        }
-        if (cl->ublen + portionLen > UPDATE_BUF_SIZE) {
-            if (!rfbSendUpdateBuf(cl))
-                return FALSE;
-        }
-        memcpy(&cl->updateBuf[cl->ublen], &tightAfterBuf[i], portionLen);
-        cl->ublen += portionLen;
-    }
     rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, compressedLen);
 
-    return TRUE;
+    return rfbSendUpdateBytes(cl, tight->afterBuf, compressedLen);
 }
 
 /*
@@ -989,22 +1017,22 @@ static rfbBool SendCompressedData(rfbClientPtr cl,
  */
 
 static void
-FillPalette8(int count)
+FillPalette8(rfbTightData *tight, int count)
 {
-    uint8_t *data = (uint8_t *)tightBeforeBuf;
+    uint8_t *data = (uint8_t *)tight->beforeBuf;
     uint8_t c0, c1;
     int i, n0, n1;
 
-    paletteNumColors = 0;
+    tight->paletteNumColors = 0;
 
     c0 = data[0];
     for (i = 1; i < count && data[i] == c0; i++);
     if (i == count) {
-        paletteNumColors = 1;
+        tight->paletteNumColors = 1;
         return;                 /* Solid rectangle */
     }
 
-    if (paletteMaxColors < 2)
+    if (tight->paletteMaxColors < 2)
         return;
 
     n0 = i;
@@ -1020,33 +1048,33 @@ FillPalette8(int count)
     }
     if (i == count) {
         if (n0 > n1) {
-            monoBackground = (uint32_t)c0;
-            monoForeground = (uint32_t)c1;
+            tight->monoBackground = (uint32_t)c0;
+            tight->monoForeground = (uint32_t)c1;
         } else {
-            monoBackground = (uint32_t)c1;
-            monoForeground = (uint32_t)c0;
+            tight->monoBackground = (uint32_t)c1;
+            tight->monoForeground = (uint32_t)c0;
         }
-        paletteNumColors = 2;   /* Two colors */
+        tight->paletteNumColors = 2;   /* Two colors */
     }
 }
 
 #define DEFINE_FILL_PALETTE_FUNCTION(bpp)                               \
                                                                         \
 static void                                                             \
-FillPalette##bpp(int count) {                                           \
-    uint##bpp##_t *data = (uint##bpp##_t *)tightBeforeBuf;              \
+FillPalette##bpp(rfbTightData *tight, int count) {                      \
+    uint##bpp##_t *data = (uint##bpp##_t *)tight->beforeBuf;            \
     uint##bpp##_t c0, c1, ci;                                           \
     int i, n0, n1, ni;                                                  \
                                                                         \
     c0 = data[0];                                                       \
     for (i = 1; i < count && data[i] == c0; i++);                       \
     if (i >= count) {                                                   \
-        paletteNumColors = 1;   /* Solid rectangle */                   \
+        tight->paletteNumColors = 1;   /* Solid rectangle */            \
         return;                                                         \
     }                                                                   \
                                                                         \
-    if (paletteMaxColors < 2) {                                         \
-        paletteNumColors = 0;   /* Full-color encoding preferred */     \
+    if (tight->paletteMaxColors < 2) {                                  \
+        tight->paletteNumColors = 0;   /* Full-color encoding preferred */ \
         return;                                                         \
     }                                                                   \
                                                                         \
@@ -1064,32 +1092,32 @@ FillPalette##bpp(int count) {                                           \
     }                                                                   \
     if (i >= count) {                                                   \
         if (n0 > n1) {                                                  \
-            monoBackground = (uint32_t)c0;                              \
-            monoForeground = (uint32_t)c1;                              \
+            tight->monoBackground = (uint32_t)c0;                       \
+            tight->monoForeground = (uint32_t)c1;                       \
         } else {                                                        \
-            monoBackground = (uint32_t)c1;                              \
-            monoForeground = (uint32_t)c0;                              \
+            tight->monoBackground = (uint32_t)c1;                       \
+            tight->monoForeground = (uint32_t)c0;                       \
         }                                                               \
-        paletteNumColors = 2;   /* Two colors */                        \
+        tight->paletteNumColors = 2;   /* Two colors */                 \
         return;                                                         \
     }                                                                   \
                                                                         \
-    PaletteReset();                                                     \
-    PaletteInsert (c0, (uint32_t)n0, bpp);                              \
-    PaletteInsert (c1, (uint32_t)n1, bpp);                              \
+    PaletteReset(tight);                                                \
+    PaletteInsert (tight, c0, (uint32_t)n0, bpp);                       \
+    PaletteInsert (tight, c1, (uint32_t)n1, bpp);                       \
                                                                         \
     ni = 1;                                                             \
     for (i++; i < count; i++) {                                         \
         if (data[i] == ci) {                                            \
             ni++;                                                       \
         } else {                                                        \
-            if (!PaletteInsert (ci, (uint32_t)ni, bpp))                 \
+            if (!PaletteInsert (tight, ci, (uint32_t)ni, bpp))          \
                 return;                                                 \
             ci = data[i];                                               \
             ni = 1;                                                     \
         }                                                               \
     }                                                                   \
-    PaletteInsert (ci, (uint32_t)ni, bpp);                              \
+    PaletteInsert (tight, ci, (uint32_t)ni, bpp);                       \
 }
 
 DEFINE_FILL_PALETTE_FUNCTION(16)
@@ -1104,14 +1132,15 @@ DEFINE_FILL_PALETTE_FUNCTION(32)
 #define HASH_FUNC32(rgb) ((int)(((rgb >> 16) + (rgb >> 8)) & 0xFF))
 
 static void
-PaletteReset(void)
+PaletteReset(rfbTightData *tight)
 {
-    paletteNumColors = 0;
-    memset(palette.hash, 0, 256 * sizeof(COLOR_LIST *));
+    tight->paletteNumColors = 0;
+    memset(tight->palette.hash, 0, 256 * sizeof(COLOR_LIST *));
 }
 
 static int
-PaletteInsert(uint32_t rgb,
+PaletteInsert(rfbTightData *tight,
+              uint32_t rgb,
               int numPixels,
               int bpp)
 {
@@ -1121,58 +1150,58 @@ PaletteInsert(uint32_t rgb,
 
     hash_key = (bpp == 16) ? HASH_FUNC16(rgb) : HASH_FUNC32(rgb);
 
-    pnode = palette.hash[hash_key];
+    pnode = tight->palette.hash[hash_key];
 
     while (pnode != NULL) {
         if (pnode->rgb == rgb) {
             /* Such palette entry already exists. */
             new_idx = idx = pnode->idx;
-            count = palette.entry[idx].numPixels + numPixels;
-            if (new_idx && palette.entry[new_idx-1].numPixels < count) {
+            count = tight->palette.entry[idx].numPixels + numPixels;
+            if (new_idx && tight->palette.entry[new_idx-1].numPixels < count) {
                 do {
-                    palette.entry[new_idx] = palette.entry[new_idx-1];
-                    palette.entry[new_idx].listNode->idx = new_idx;
+                    tight->palette.entry[new_idx] = tight->palette.entry[new_idx-1];
+                    tight->palette.entry[new_idx].listNode->idx = new_idx;
                     new_idx--;
                 }
-                while (new_idx && palette.entry[new_idx-1].numPixels < count);
-                palette.entry[new_idx].listNode = pnode;
+                while (new_idx && tight->palette.entry[new_idx-1].numPixels < count);
+                tight->palette.entry[new_idx].listNode = pnode;
                 pnode->idx = new_idx;
             }
-            palette.entry[new_idx].numPixels = count;
-            return paletteNumColors;
+            tight->palette.entry[new_idx].numPixels = count;
+            return tight->paletteNumColors;
         }
         prev_pnode = pnode;
         pnode = pnode->next;
     }
 
     /* Check if palette is full. */
-    if (paletteNumColors == 256 || paletteNumColors == paletteMaxColors) {
-        paletteNumColors = 0;
+    if (tight->paletteNumColors == 256 || tight->paletteNumColors == tight->paletteMaxColors) {
+        tight->paletteNumColors = 0;
         return 0;
     }
 
     /* Move palette entries with lesser pixel counts. */
-    for ( idx = paletteNumColors;
-          idx > 0 && palette.entry[idx-1].numPixels < numPixels;
+    for ( idx = tight->paletteNumColors;
+          idx > 0 && tight->palette.entry[idx-1].numPixels < numPixels;
           idx-- ) {
-        palette.entry[idx] = palette.entry[idx-1];
-        palette.entry[idx].listNode->idx = idx;
+        tight->palette.entry[idx] = tight->palette.entry[idx-1];
+        tight->palette.entry[idx].listNode->idx = idx;
     }
 
     /* Add new palette entry into the freed slot. */
-    pnode = &palette.list[paletteNumColors];
+    pnode = &tight->palette.list[tight->paletteNumColors];
     if (prev_pnode != NULL) {
         prev_pnode->next = pnode;
     } else {
-        palette.hash[hash_key] = pnode;
+        tight->palette.hash[hash_key] = pnode;
     }
     pnode->next = NULL;
     pnode->idx = idx;
     pnode->rgb = rgb;
-    palette.entry[idx].listNode = pnode;
-    palette.entry[idx].numPixels = numPixels;
+    tight->palette.entry[idx].listNode = pnode;
+    tight->palette.entry[idx].numPixels = numPixels;
 
-    return (++paletteNumColors);
+    return (++tight->paletteNumColors);
 }
 
 
@@ -1219,7 +1248,7 @@ static void Pack24(rfbClientPtr cl,
 #define DEFINE_IDX_ENCODE_FUNCTION(bpp)                                 \
                                                                         \
 static void                                                             \
-EncodeIndexedRect##bpp(uint8_t *buf, int count) {                       \
+EncodeIndexedRect##bpp(rfbTightData *tight, uint8_t *buf, int count) {  \
     COLOR_LIST *pnode;                                                  \
     uint##bpp##_t *src;                                                 \
     uint##bpp##_t rgb;                                                  \
@@ -1232,7 +1261,7 @@ EncodeIndexedRect##bpp(uint8_t *buf, int count) {                       \
         while (count && *src == rgb) {                                  \
             rep++, src++, count--;                                      \
         }                                                               \
-        pnode = palette.hash[HASH_FUNC##bpp(rgb)];                      \
+        pnode = tight->palette.hash[HASH_FUNC##bpp(rgb)];               \
         while (pnode != NULL) {                                         \
             if ((uint##bpp##_t)pnode->rgb == rgb) {                     \
                 *buf++ = (uint8_t)pnode->idx;                           \
@@ -1253,7 +1282,7 @@ DEFINE_IDX_ENCODE_FUNCTION(32)
 #define DEFINE_MONO_ENCODE_FUNCTION(bpp)                                \
                                                                         \
 static void                                                             \
-EncodeMonoRect##bpp(uint8_t *buf, int w, int h) {                       \
+EncodeMonoRect##bpp(rfbTightData *tight, uint8_t *buf, int w, int h) {  \
     uint##bpp##_t *ptr;                                                 \
     uint##bpp##_t bg;                                                   \
     unsigned int value, mask;                                           \
@@ -1261,7 +1290,7 @@ EncodeMonoRect##bpp(uint8_t *buf, int w, int h) {                       \
     int x, y, bg_bits;                                                  \
                                                                         \
     ptr = (uint##bpp##_t *) buf;                                        \
-    bg = (uint##bpp##_t) monoBackground;                                \
+    bg = (uint##bpp##_t) tight->monoBackground;                         \
     aligned_width = w - w % 8;                                          \
                                                                         \
     for (y = 0; y < h; y++) {                                           \
@@ -1314,6 +1343,7 @@ DEFINE_MONO_ENCODE_FUNCTION(32)
 static void
 FilterGradient24(rfbClientPtr cl, char *buf, rfbPixelFormat *fmt, int w, int h)
 {
+    rfbTightData *tight = cl->tightData;
     uint32_t *buf32;
     uint32_t pix32;
     int *prevRowPtr;
@@ -1323,7 +1353,7 @@ FilterGradient24(rfbClientPtr cl, char *buf, rfbPixelFormat *fmt, int w, int h)
     int x, y, c;
 
     buf32 = (uint32_t *)buf;
-    memset (prevRowBuf, 0, w * 3 * sizeof(int));
+    memset (tight->prevRowBuf, 0, w * 3 * sizeof(int));
 
     if (!cl->screen->serverFormat.bigEndian == !fmt->bigEndian) {
         shiftBits[0] = fmt->redShift;
@@ -1340,7 +1370,7 @@ FilterGradient24(rfbClientPtr cl, char *buf, rfbPixelFormat *fmt, int w, int h)
             pixUpper[c] = 0;
             pixHere[c] = 0;
         }
-        prevRowPtr = prevRowBuf;
+        prevRowPtr = tight->prevRowBuf;
         for (x = 0; x < w; x++) {
             pix32 = *buf32++;
             for (c = 0; c < 3; c++) {
@@ -1372,6 +1402,7 @@ FilterGradient24(rfbClientPtr cl, char *buf, rfbPixelFormat *fmt, int w, int h)
 static void                                                              \
 FilterGradient##bpp(rfbClientPtr cl, uint##bpp##_t *buf,                 \
 		rfbPixelFormat *fmt, int w, int h) {                     \
+    rfbTightData *tight = cl->tightData;                                 \
     uint##bpp##_t pix, diff;                                             \
     rfbBool endianMismatch;                                              \
     int *prevRowPtr;                                                     \
@@ -1380,7 +1411,7 @@ FilterGradient##bpp(rfbClientPtr cl, uint##bpp##_t *buf,                 \
     int prediction;                                                      \
     int x, y, c;                                                         \
                                                                          \
-    memset (prevRowBuf, 0, w * 3 * sizeof(int));                         \
+    memset (tight->prevRowBuf, 0, w * 3 * sizeof(int));                  \
                                                                          \
     endianMismatch = (!cl->screen->serverFormat.bigEndian != !fmt->bigEndian);    \
                                                                          \
@@ -1396,7 +1427,7 @@ FilterGradient##bpp(rfbClientPtr cl, uint##bpp##_t *buf,                 \
             pixUpper[c] = 0;                                             \
             pixHere[c] = 0;                                              \
         }                                                                \
-        prevRowPtr = prevRowBuf;                                         \
+        prevRowPtr = tight->prevRowBuf;                                  \
         for (x = 0; x < w; x++) {                                        \
             pix = *buf;                                                  \
             if (endianMismatch) {                                        \
@@ -1445,6 +1476,7 @@ DEFINE_GRADIENT_FILTER_FUNCTION(32)
 static int
 DetectSmoothImage (rfbClientPtr cl, rfbPixelFormat *fmt, int w, int h)
 {
+    rfbTightData *tight = cl->tightData;
     long avgError;
 
     if ( cl->screen->serverFormat.bitsPerPixel == 8 || fmt->bitsPerPixel == 8 ||
@@ -1452,34 +1484,34 @@ DetectSmoothImage (rfbClientPtr cl, rfbPixelFormat *fmt, int w, int h)
         return 0;
     }
 
-    if (qualityLevel != -1) {
+    if (tight->qualityLevel != -1) {
         if (w * h < JPEG_MIN_RECT_SIZE) {
             return 0;
         }
     } else {
         if ( rfbTightDisableGradient ||
-             w * h < tightConf[compressLevel].gradientMinRectSize ) {
+             w * h < tightConf[tight->compressLevel].gradientMinRectSize ) {
             return 0;
         }
     }
 
     if (fmt->bitsPerPixel == 32) {
-        if (usePixelFormat24) {
+        if (tight->usePixelFormat24) {
             avgError = DetectSmoothImage24(cl, fmt, w, h);
-            if (qualityLevel != -1) {
-                return (avgError < tightConf[qualityLevel].jpegThreshold24);
+            if (tight->qualityLevel != -1) {
+                return (avgError < tightConf[tight->qualityLevel].jpegThreshold24);
             }
-            return (avgError < tightConf[compressLevel].gradientThreshold24);
+            return (avgError < tightConf[tight->compressLevel].gradientThreshold24);
         } else {
             avgError = DetectSmoothImage32(cl, fmt, w, h);
         }
     } else {
         avgError = DetectSmoothImage16(cl, fmt, w, h);
     }
-    if (qualityLevel != -1) {
-        return (avgError < tightConf[qualityLevel].jpegThreshold);
+    if (tight->qualityLevel != -1) {
+        return (avgError < tightConf[tight->qualityLevel].jpegThreshold);
     }
-    return (avgError < tightConf[compressLevel].gradientThreshold);
+    return (avgError < tightConf[tight->compressLevel].gradientThreshold);
 }
 
 static unsigned long
@@ -1488,6 +1520,7 @@ DetectSmoothImage24 (rfbClientPtr cl,
                      int w,
                      int h)
 {
+    rfbTightData *tight = cl->tightData;
     int off;
     int x, y, d, dx, c;
     int diffStat[256];
@@ -1505,11 +1538,11 @@ DetectSmoothImage24 (rfbClientPtr cl,
     while (y < h && x < w) {
         for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) {
             for (c = 0; c < 3; c++) {
-                left[c] = (int)tightBeforeBuf[((y+d)*w+x+d)*4+off+c] & 0xFF;
+                left[c] = (int)tight->beforeBuf[((y+d)*w+x+d)*4+off+c] & 0xFF;
             }
             for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {
                 for (c = 0; c < 3; c++) {
-                    pix = (int)tightBeforeBuf[((y+d)*w+x+d+dx)*4+off+c] & 0xFF;
+                    pix = (int)tight->beforeBuf[((y+d)*w+x+d+dx)*4+off+c] & 0xFF;
                     diffStat[abs(pix - left[c])]++;
                     left[c] = pix;
                 }
@@ -1546,6 +1579,7 @@ DetectSmoothImage24 (rfbClientPtr cl,
                                                                              \
 static unsigned long                                                         \
 DetectSmoothImage##bpp (rfbClientPtr cl, rfbPixelFormat *fmt, int w, int h) {\
+    rfbTightData *tight = cl->tightData;                                     \
     rfbBool endianMismatch;                                                  \
     uint##bpp##_t pix;                                                       \
     int maxColor[3], shiftBits[3];                                           \
@@ -1569,7 +1603,7 @@ DetectSmoothImage##bpp (rfbClientPtr cl, rfbPixelFormat *fmt, int w, int h) {\
     y = 0, x = 0;                                                            \
     while (y < h && x < w) {                                                 \
         for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) {     \
-            pix = ((uint##bpp##_t *)tightBeforeBuf)[(y+d)*w+x+d];            \
+            pix = ((uint##bpp##_t *)tight->beforeBuf)[(y+d)*w+x+d];          \
             if (endianMismatch) {                                            \
                 pix = Swap##bpp(pix);                                        \
             }                                                                \
@@ -1577,7 +1611,7 @@ DetectSmoothImage##bpp (rfbClientPtr cl, rfbPixelFormat *fmt, int w, int h) {\
                 left[c] = (int)(pix >> shiftBits[c] & maxColor[c]);          \
             }                                                                \
             for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {                  \
-                pix = ((uint##bpp##_t *)tightBeforeBuf)[(y+d)*w+x+d+dx];     \
+                pix = ((uint##bpp##_t *)tight->beforeBuf)[(y+d)*w+x+d+dx];   \
                 if (endianMismatch) {                                        \
                     pix = Swap##bpp(pix);                                    \
                 }                                                            \
@@ -1627,13 +1661,10 @@ DEFINE_DETECT_FUNCTION(32)
  * JPEG compression stuff.
  */
 
-static struct jpeg_destination_mgr jpegDstManager;
-static rfbBool jpegError;
-static int jpegDstDataLen;
-
 static rfbBool
 SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
 {
+    rfbTightData *tight = cl->tightData;
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
     uint8_t *srcBuf;
@@ -1660,6 +1691,7 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, quality, TRUE);
 
+    cinfo.client_data = tight;
     JpegSetDstManager (&cinfo);
 
     jpeg_start_compress(&cinfo, TRUE);
@@ -1667,20 +1699,20 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
     for (dy = 0; dy < h; dy++) {
         PrepareRowForJpeg(cl, srcBuf, x, y + dy, w);
         jpeg_write_scanlines(&cinfo, rowPointer, 1);
-        if (jpegError)
+        if (tight->jpegError)
             break;
     }
 
-    if (!jpegError)
+    if (!tight->jpegError)
         jpeg_finish_compress(&cinfo);
 
     jpeg_destroy_compress(&cinfo);
     free(srcBuf);
 
-    if (jpegError)
+    if (tight->jpegError)
         return SendFullColorRect(cl, w, h);
 
-    if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > UPDATE_BUF_SIZE) {
+    if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > cl->updateBufSize) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
@@ -1688,7 +1720,7 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
     cl->updateBuf[cl->ublen++] = (char)(rfbTightJpeg << 4);
     rfbStatRecordEncodingSentAdd(cl, rfbEncodingTight, 1);
 
-    return SendCompressedData(cl, jpegDstDataLen);
+    return SendCompressedData(cl, tight->jpegDstDataLen);
 }
 
 static void
@@ -1774,17 +1806,19 @@ DEFINE_JPEG_GET_ROW_FUNCTION(32)
 static void
 JpegInitDestination(j_compress_ptr cinfo)
 {
-    jpegError = FALSE;
-    jpegDstManager.next_output_byte = (JOCTET *)tightAfterBuf;
-    jpegDstManager.free_in_buffer = (size_t)tightAfterBufSize;
+    rfbTightData *tight = (rfbTightData *)cinfo->client_data;
+    tight->jpegError = FALSE;
+    tight->jpegDstManager.next_output_byte = (JOCTET *)tight->afterBuf;
+    tight->jpegDstManager.free_in_buffer = (size_t)tight->afterBufSize;
 }
 
 static boolean
 JpegEmptyOutputBuffer(j_compress_ptr cinfo)
 {
-    jpegError = TRUE;
-    jpegDstManager.next_output_byte = (JOCTET *)tightAfterBuf;
-    jpegDstManager.free_in_buffer = (size_t)tightAfterBufSize;
+    rfbTightData *tight = (rfbTightData *)cinfo->client_data;
+    tight->jpegError = TRUE;
+    tight->jpegDstManager.next_output_byte = (JOCTET *)tight->afterBuf;
+    tight->jpegDstManager.free_in_buffer = (size_t)tight->afterBufSize;
 
     return TRUE;
 }
@@ -1792,15 +1826,17 @@ JpegEmptyOutputBuffer(j_compress_ptr cinfo)
 static void
 JpegTermDestination(j_compress_ptr cinfo)
 {
-    jpegDstDataLen = tightAfterBufSize - jpegDstManager.free_in_buffer;
+    rfbTightData *tight = (rfbTightData *)cinfo->client_data;
+    tight->jpegDstDataLen = tight->afterBufSize - tight->jpegDstManager.free_in_buffer;
 }
 
 static void
 JpegSetDstManager(j_compress_ptr cinfo)
 {
-    jpegDstManager.init_destination = JpegInitDestination;
-    jpegDstManager.empty_output_buffer = JpegEmptyOutputBuffer;
-    jpegDstManager.term_destination = JpegTermDestination;
-    cinfo->dest = &jpegDstManager;
+    rfbTightData *tight = (rfbTightData *)cinfo->client_data;
+    tight->jpegDstManager.init_destination = JpegInitDestination;
+    tight->jpegDstManager.empty_output_buffer = JpegEmptyOutputBuffer;
+    tight->jpegDstManager.term_destination = JpegTermDestination;
+    cinfo->dest = &tight->jpegDstManager;
 }
 
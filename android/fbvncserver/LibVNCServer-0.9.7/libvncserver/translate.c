@@ -25,11 +25,13 @@
 
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
+#include "private.h"
 
 static void PrintPixelFormat(rfbPixelFormat *pf);
 static rfbBool rfbSetClientColourMapBGR233(rfbClientPtr cl);
 
 rfbBool rfbEconomicTranslate = FALSE;
+rfbBool rfbShiftTranslate = TRUE;
 
 /*
  * Some standard pixel formats.
@@ -63,6 +65,50 @@ static const rfbPixelFormat BGR233Format = {
 #define CONCAT4(a,b,c,d) a##b##c##d
 #define CONCAT4E(a,b,c,d) CONCAT4(a,b,c,d)
 
+/*
+ * Instead of a lookup table, a true colour pixel p can be translated by
+ * turning each of its colour channels c into
+ *
+ *   ((((p >> inShift) & inMax) * mul + add) >> down) << outShift
+ *
+ * rfbInitTrueColourShifts only uses this where it rounds exactly like the
+ * tables do, and where inMax * mul fits into 16 bits.  Eight pixels at a
+ * time are translated in vector registers; the 16 bit limit lets them be
+ * multiplied 16 bits at a time, which SSE2 and NEON can do in one
+ * instruction.  One pixel at a time, the tables are faster, so without
+ * the vector types of GCC and clang all this is left out.
+ */
+
+#ifdef RFB_HAVE_VECTORS
+#define RFB_SHIFT_TRANSLATE
+
+typedef struct {
+    uint32_t inShift[3], inMax[3], mul[3], add[3], down[3], outShift[3];
+    rfbBool swap;
+    /* the sums fit into 16 bits, and no channel straddles two halves */
+    rfbBool halves;
+} rfbShiftTable;
+
+typedef uint32_t rfbPixelVector __attribute__ ((vector_size (16)));
+typedef uint16_t rfbPixelVector16 __attribute__ ((vector_size (16)));
+
+#define rfbShiftChannel(t,p,c) \
+        (((((p) >> (t)->inShift[c]) & (t)->inMax[c]) * (t)->mul[c] +    \
+          (t)->add[c]) >> (t)->down[c] << (t)->outShift[c])
+
+/* mul16 is the multiplier of each channel as 16 bit vector */
+#define rfbShiftChannelVector(t,mul16,p,c) \
+        (((rfbPixelVector)((rfbPixelVector16)(((p) >> (t)->inShift[c]) &    \
+                                              (t)->inMax[c]) * mul16[c]) + \
+          (t)->add[c]) >> (t)->down[c] << (t)->outShift[c])
+
+/* 16 bit pixels with halves set can be worked on 16 bits at a time */
+#define rfbShiftChannelVector16(t,p,c) \
+        (((((p) >> (uint16_t)(t)->inShift[c]) & (uint16_t)(t)->inMax[c]) * \
+          (uint16_t)(t)->mul[c] + (uint16_t)(t)->add[c]) >>               \
+         (uint16_t)(t)->down[c])
+#endif
+
 #undef OUT
 #undef IN
 
@@ -129,6 +175,31 @@ static const rfbPixelFormat BGR233Format = {
 #define BPP2OFFSET(bpp) ((int)(bpp)/16)
 #endif
 
+#ifdef RFB_SHIFT_TRANSLATE
+#define IN 16
+#define OUT 16
+#include "shifttranstemplate.c"
+#undef OUT
+#define OUT 32
+#include "shifttranstemplate.c"
+#undef OUT
+#undef IN
+
+#define IN 32
+#define OUT 16
+#include "shifttranstemplate.c"
+#undef OUT
+#define OUT 32
+#include "shifttranstemplate.c"
+#undef OUT
+#ifdef LIBVNCSERVER_ALLOW24BPP
+#define OUT 24
+#include "shifttranstemplate.c"
+#undef OUT
+#endif
+#undef IN
+#endif
+
 typedef void (*rfbInitCMTableFnType)(char **table, rfbPixelFormat *in,
                                    rfbPixelFormat *out,rfbColourMap* cm);
 typedef void (*rfbInitTableFnType)(char **table, rfbPixelFormat *in,
@@ -215,6 +286,123 @@ static rfbTranslateFnType rfbTranslateWithRGBTablesFns[COUNT_OFFSETS][COUNT_OFFS
       rfbTranslateWithRGBTables32to32 }
 };
 
+#ifdef RFB_SHIFT_TRANSLATE
+
+/*
+ * 8 bit pixels, and 16 bit ones packed into 24 bits, are quicker to look up
+ * in a single table; 24 bit input is read bytewise.
+ */
+static rfbTranslateFnType rfbTranslateWithShiftsFns[COUNT_OFFSETS][COUNT_OFFSETS] = {
+    { NULL, NULL,
+#ifdef LIBVNCSERVER_ALLOW24BPP
+      NULL,
+#endif
+      NULL },
+    { NULL,
+      rfbTranslateWithShifts16to16,
+#ifdef LIBVNCSERVER_ALLOW24BPP
+      NULL,
+#endif
+      rfbTranslateWithShifts16to32 },
+#ifdef LIBVNCSERVER_ALLOW24BPP
+    { NULL, NULL, NULL, NULL },
+#endif
+    { NULL,
+      rfbTranslateWithShifts32to16,
+#ifdef LIBVNCSERVER_ALLOW24BPP
+      rfbTranslateWithShifts32to24,
+#endif
+      rfbTranslateWithShifts32to32 }
+};
+
+
+/*
+ * rfbInitShiftChannel finds the constants which scale one colour channel
+ * from inMax to outMax with the same rounding as the lookup tables.
+ */
+
+static rfbBool
+rfbInitShiftChannel(rfbShiftTable *s, int c, int inMax, int inShift,
+                    int outMax, int outShift)
+{
+    uint32_t down, v;
+    uint64_t mul, add, firstMul, firstAdd;
+
+    if (inMax <= 0 || outMax <= 0)
+        return FALSE;
+
+    for (down = 0; down < 20; down++) {
+        firstMul = ((uint64_t)outMax << down) / inMax;
+        firstAdd = ((uint64_t)(inMax / 2) << down) / inMax;
+        for (mul = firstMul; mul <= firstMul + 1; mul++) {
+            for (add = firstAdd > 2 ? firstAdd - 2 : 0; add <= firstAdd + 3; add++) {
+                if ((uint64_t)inMax * mul > 0xffff)
+                    continue;
+                for (v = 0; v <= (uint32_t)inMax; v++)
+                    if ((v * mul + add) >> down !=
+                        (v * outMax + inMax / 2) / inMax)
+                        break;
+                if (v > (uint32_t)inMax) {
+                    s->inShift[c] = inShift;
+                    s->inMax[c] = inMax;
+                    s->mul[c] = (uint32_t)mul;
+                    s->add[c] = (uint32_t)add;
+                    s->down[c] = down;
+                    s->outShift[c] = outShift;
+                    return TRUE;
+                }
+            }
+        }
+    }
+    return FALSE;
+}
+
+
+/*
+ * rfbInitTrueColourShifts sets up the constants for rfbTranslateWithShifts
+ * in place of a lookup table.  It fails if a channel cannot be scaled
+ * exactly, in which case the tables have to be used.
+ */
+
+static rfbBool
+rfbInitTrueColourShifts(char **table, rfbPixelFormat *in, rfbPixelFormat *out)
+{
+    rfbShiftTable s;
+    int outMax[3], c, bits;
+
+    if (!rfbInitShiftChannel(&s, 0, in->redMax, in->redShift,
+                             out->redMax, out->redShift) ||
+        !rfbInitShiftChannel(&s, 1, in->greenMax, in->greenShift,
+                             out->greenMax, out->greenShift) ||
+        !rfbInitShiftChannel(&s, 2, in->blueMax, in->blueShift,
+                             out->blueMax, out->blueShift))
+        return FALSE;
+
+    outMax[0] = out->redMax;
+    outMax[1] = out->greenMax;
+    outMax[2] = out->blueMax;
+    s.halves = TRUE;
+    for (c = 0; c < 3; c++) {
+        for (bits = 0; (1 << bits) <= outMax[c]; bits++)
+            ;
+        if (s.inMax[c] * s.mul[c] + s.add[c] > 0xffff ||
+            (s.outShift[c] & 15) + bits > 16)
+            s.halves = FALSE;
+    }
+
+    s.swap = (out->bigEndian != in->bigEndian);
+    /* 24 bit pixels are written least significant byte first */
+    if (out->bitsPerPixel == 24 && !rfbEndianTest)
+        s.swap = !s.swap;
+
+    if (*table) free(*table);
+    *table = (char *)malloc(sizeof(s));
+    memcpy(*table, &s, sizeof(s));
+    return TRUE;
+}
+
+#endif
+
 
 
 /*
@@ -237,6 +425,184 @@ rfbTranslateNone(char *table, rfbPixelFormat *in, rfbPixelFormat *out,
 }
 
 
+/*
+ * Clients with the same pixel format need the same translation table, so
+ * the tables are kept in a list on the screen and shared.  Each client
+ * holds one reference to the table in its translateLookupTable, and the
+ * last client to let go of a table frees it.  Tables made from the colour
+ * map keep a copy of it, and are only handed out while the screen's colour
+ * map is still the same; however it was changed, clients that set it again
+ * move on to new ones.
+ */
+
+enum {
+    TABLE_SHIFTS,
+    TABLE_TRUE_COLOUR,		/* single table for <= 16 bpp */
+    TABLE_COLOUR_MAP,		/* single table from the colour map */
+    TABLE_RGB			/* three tables for red, green and blue */
+};
+
+typedef struct rfbTranslateTableKey {
+    rfbPixelFormat in, out;
+    int kind;
+} rfbTranslateTableKey;
+
+struct rfbTranslateTable {
+    rfbTranslateTableKey key;
+    int refCount;
+    char *colourMap;		/* what TABLE_COLOUR_MAP was made from */
+    int colourMapCount;
+    rfbBool colourMapIs16;
+    char *table;
+    struct rfbTranslateTable *next;
+};
+
+static void
+MakeTableKey(rfbTranslateTableKey *key, rfbPixelFormat *in,
+             rfbPixelFormat *out, int kind)
+{
+    memset(key, 0, sizeof(*key));
+    key->in = *in;
+    key->in.pad1 = key->in.pad2 = 0;
+    key->out = *out;
+    key->out.pad1 = key->out.pad2 = 0;
+    key->kind = kind;
+}
+
+/* the bytes of a colour map's entries */
+static size_t
+ColourMapSize(rfbColourMap *map)
+{
+    return (size_t)map->count * 3 * (map->is16 ? 2 : 1);
+}
+
+/*
+ * rfbGetTranslateTable returns a reference to the table of the given kind
+ * for translating the screen's pixels into cl's, making it if no other
+ * client has.  It returns NULL if there can be no such table.
+ */
+
+static char *
+rfbGetTranslateTable(rfbClientPtr cl, int kind)
+{
+    rfbScreenInfoPtr s = cl->screen;
+    rfbPixelFormat *in = &s->serverFormat, *out = &cl->format;
+    struct rfbTranslateTable *t;
+    rfbTranslateTableKey key;
+    char *table = NULL, *colourMap = NULL;
+    size_t colourMapSize = ColourMapSize(&s->colourMap);
+
+    MakeTableKey(&key, in, out, kind);
+
+    LOCK(s->translateTablesMutex);
+    for (t = s->translateTables; t; t = t->next) {
+        if (!memcmp(&t->key, &key, sizeof(key)) &&
+            (kind != TABLE_COLOUR_MAP ||
+             (t->colourMapCount == s->colourMap.count &&
+              t->colourMapIs16 == s->colourMap.is16 &&
+              !memcmp(t->colourMap, s->colourMap.data.bytes,
+                      colourMapSize)))) {
+            t->refCount++;
+            UNLOCK(s->translateTablesMutex);
+            return t->table;
+        }
+    }
+
+    switch (kind) {
+#ifdef RFB_SHIFT_TRANSLATE
+    case TABLE_SHIFTS:
+        /* leaves table NULL if a channel cannot be shifted exactly */
+        rfbInitTrueColourShifts(&table, in, out);
+        break;
+#endif
+    case TABLE_TRUE_COLOUR:
+        (*rfbInitTrueColourSingleTableFns
+            [BPP2OFFSET(out->bitsPerPixel)]) (&table, in, out);
+        break;
+    case TABLE_COLOUR_MAP:
+        colourMap = (char *)malloc(colourMapSize);
+        if (!colourMap)
+            break;
+        memcpy(colourMap, s->colourMap.data.bytes, colourMapSize);
+        (*rfbInitColourMapSingleTableFns
+            [BPP2OFFSET(out->bitsPerPixel)]) (&table, in, out, &s->colourMap);
+        break;
+    case TABLE_RGB:
+        (*rfbInitTrueColourRGBTablesFns
+            [BPP2OFFSET(out->bitsPerPixel)]) (&table, in, out);
+        break;
+    }
+
+    /* without an entry the table is not shared, and is simply freed */
+    if (table && (t = (struct rfbTranslateTable *)malloc(sizeof(*t)))) {
+        t->key = key;
+        t->refCount = 1;
+        t->colourMap = colourMap;
+        t->colourMapCount = s->colourMap.count;
+        t->colourMapIs16 = s->colourMap.is16;
+        t->table = table;
+        t->next = s->translateTables;
+        s->translateTables = t;
+    } else {
+        free(colourMap);
+    }
+    UNLOCK(s->translateTablesMutex);
+    return table;
+}
+
+/*
+ * rfbReleaseTranslateTable lets go of cl's translation table.  Tables an
+ * application's own setTranslateFunction made are not in the list, and
+ * are freed straight away.
+ */
+
+void
+rfbReleaseTranslateTable(rfbClientPtr cl)
+{
+    rfbScreenInfoPtr s = cl->screen;
+    struct rfbTranslateTable **p, *t;
+    char *table = cl->translateLookupTable;
+
+    if (!table)
+        return;
+    cl->translateLookupTable = NULL;
+
+    LOCK(s->translateTablesMutex);
+    for (p = &s->translateTables; *p && (*p)->table != table; p = &(*p)->next)
+        ;
+    t = *p;
+    if (t && --t->refCount > 0) {
+        UNLOCK(s->translateTablesMutex);
+        return;
+    }
+    if (t) {
+        *p = t->next;
+        free(t->colourMap);
+        free(t);
+    }
+    UNLOCK(s->translateTablesMutex);
+    free(table);
+}
+
+/*
+ * rfbUseTranslateTable switches cl over to the table of the given kind.
+ * The new table is taken before the old one is let go of, so that it is
+ * not made again if it is the same.
+ */
+
+static rfbBool
+rfbUseTranslateTable(rfbClientPtr cl, int kind)
+{
+    char *table = rfbGetTranslateTable(cl, kind);
+
+    if (!table)
+        return FALSE;
+    rfbReleaseTranslateTable(cl);
+    cl->translateLookupTable = table;
+    return TRUE;
+}
+
+
 /*
  * rfbSetTranslateFunction sets the translation function.
  */
@@ -244,6 +610,8 @@ rfbTranslateNone(char *table, rfbPixelFormat *in, rfbPixelFormat *out,
 rfbBool
 rfbSetTranslateFunction(rfbClientPtr cl)
 {
+    int kind;
+
     rfbLog("Pixel format for client %s:\n",cl->host);
     PrintPixelFormat(&cl->format);
 
@@ -312,8 +680,25 @@ rfbSetTranslateFunction(rfbClientPtr cl)
 
         rfbLog("no translation needed\n");
         cl->translateFn = rfbTranslateNone;
+        rfbReleaseTranslateTable(cl);
+        return TRUE;
+    }
+
+#ifdef RFB_SHIFT_TRANSLATE
+    if (rfbShiftTranslate && cl->screen->serverFormat.trueColour &&
+        rfbTranslateWithShiftsFns
+            [BPP2OFFSET(cl->screen->serverFormat.bitsPerPixel)]
+                [BPP2OFFSET(cl->format.bitsPerPixel)] &&
+        rfbUseTranslateTable(cl, TABLE_SHIFTS)) {
+
+        /* no table needed, each channel is shifted and scaled */
+
+        cl->translateFn = rfbTranslateWithShiftsFns
+                              [BPP2OFFSET(cl->screen->serverFormat.bitsPerPixel)]
+                                  [BPP2OFFSET(cl->format.bitsPerPixel)];
         return TRUE;
     }
+#endif
 
     if ((cl->screen->serverFormat.bitsPerPixel < 16) ||
         ((!cl->screen->serverFormat.trueColour || !rfbEconomicTranslate) &&
@@ -325,14 +710,8 @@ rfbSetTranslateFunction(rfbClientPtr cl)
                               [BPP2OFFSET(cl->screen->serverFormat.bitsPerPixel)]
                                   [BPP2OFFSET(cl->format.bitsPerPixel)];
 
-	if(cl->screen->serverFormat.trueColour)
-	  (*rfbInitTrueColourSingleTableFns
-	   [BPP2OFFSET(cl->format.bitsPerPixel)]) (&cl->translateLookupTable,
-						   &(cl->screen->serverFormat), &cl->format);
-	else
-	  (*rfbInitColourMapSingleTableFns
-	   [BPP2OFFSET(cl->format.bitsPerPixel)]) (&cl->translateLookupTable,
-						   &(cl->screen->serverFormat), &cl->format,&cl->screen->colourMap);
+        kind = (cl->screen->serverFormat.trueColour ?
+                TABLE_TRUE_COLOUR : TABLE_COLOUR_MAP);
 
     } else {
 
@@ -342,9 +721,13 @@ rfbSetTranslateFunction(rfbClientPtr cl)
                               [BPP2OFFSET(cl->screen->serverFormat.bitsPerPixel)]
                                   [BPP2OFFSET(cl->format.bitsPerPixel)];
 
-        (*rfbInitTrueColourRGBTablesFns
-            [BPP2OFFSET(cl->format.bitsPerPixel)]) (&cl->translateLookupTable,
-                                             &(cl->screen->serverFormat), &cl->format);
+        kind = TABLE_RGB;
+    }
+
+    if (!rfbUseTranslateTable(cl, kind)) {
+        rfbErr("rfbSetTranslateFunction: out of memory\n");
+        rfbCloseClient(cl);
+        return FALSE;
     }
 
     return TRUE;
@@ -423,13 +806,22 @@ rfbSetClientColourMap(rfbClientPtr cl, int firstColour, int nColours)
     }
 
     if (cl->format.trueColour) {
-	(*rfbInitColourMapSingleTableFns
-	    [BPP2OFFSET(cl->format.bitsPerPixel)]) (&cl->translateLookupTable,
-					     &cl->screen->serverFormat, &cl->format,&cl->screen->colourMap);
+	char *table = cl->translateLookupTable;
+
+	if (!rfbUseTranslateTable(cl, TABLE_COLOUR_MAP)) {
+	    rfbErr("rfbSetClientColourMap: out of memory\n");
+	    rfbCloseClient(cl);
+	    return FALSE;
+	}
+	/* a new table means the colour map changed, so rectangles encoded
+	   with the old one are stale */
+	if (cl->translateLookupTable != table)
+	    rfbInvalidateEncodeCache(cl->screen);
 
 	sraRgnDestroy(cl->modifiedRegion);
 	cl->modifiedRegion =
 	  sraRgnCreateRect(0,0,cl->screen->width,cl->screen->height);
+	sraRgnAllowTiles(cl->modifiedRegion,cl->screen->width,cl->screen->height);
 
 	return TRUE;
     }
@@ -448,6 +840,9 @@ rfbSetClientColourMaps(rfbScreenInfoPtr rfbScreen, int firstColour, int nColours
     rfbClientIteratorPtr i;
     rfbClientPtr cl;
 
+    /* rectangles encoded with the old colour map are stale */
+    rfbInvalidateEncodeCache(rfbScreen);
+
     i = rfbGetClientIterator(rfbScreen);
     while((cl = rfbClientIteratorNext(i)))
       rfbSetClientColourMap(cl, firstColour, nColours);
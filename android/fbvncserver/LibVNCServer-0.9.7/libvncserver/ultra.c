@@ -8,6 +8,7 @@
  */
 
 #include <rfb/rfb.h>
+#include "private.h"
 #include "minilzo.h"
 
 /*
@@ -62,7 +63,6 @@ rfbSendOneRectEncodingUltra(rfbClientPtr cl,
     rfbFramebufferUpdateRectHeader rect;
     rfbZlibHeader hdr;
     int deflateResult;
-    int i;
     char *fbptr = (cl->scaledScreen->frameBuffer + (cl->scaledScreen->paddedWidthInBytes * y)
     	   + (x * (cl->scaledScreen->bitsPerPixel / 8)));
 
@@ -124,7 +124,7 @@ rfbSendOneRectEncodingUltra(rfbClientPtr cl,
     rfbStatRecordEncodingSent(cl, rfbEncodingUltra, sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader + lzoAfterBufLen, maxRawSize);
 
     if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader
-	> UPDATE_BUF_SIZE)
+	> cl->updateBufSize)
     {
 	if (!rfbSendUpdateBuf(cl))
 	    return FALSE;
@@ -145,27 +145,7 @@ rfbSendOneRectEncodingUltra(rfbClientPtr cl,
     memcpy(&cl->updateBuf[cl->ublen], (char *)&hdr, sz_rfbZlibHeader);
     cl->ublen += sz_rfbZlibHeader;
 
-    /* We might want to try sending the data directly... */
-    for (i = 0; i < lzoAfterBufLen;) {
-
-	int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
-
-	if (i + bytesToCopy > lzoAfterBufLen) {
-	    bytesToCopy = lzoAfterBufLen - i;
-	}
-
-	memcpy(&cl->updateBuf[cl->ublen], &lzoAfterBuf[i], bytesToCopy);
-
-	cl->ublen += bytesToCopy;
-	i += bytesToCopy;
-
-	if (cl->ublen == UPDATE_BUF_SIZE) {
-	    if (!rfbSendUpdateBuf(cl))
-		return FALSE;
-	}
-    }
-
-    return TRUE;
+    return rfbSendUpdateBytes(cl, lzoAfterBuf, lzoAfterBufLen);
 
 }
 
@@ -31,32 +31,36 @@
  */
 
 #include <rfb/rfb.h>
+#include "private.h"
 
 /*
- * zlibBeforeBuf contains pixel data in the client's format.
- * zlibAfterBuf contains the zlib (deflated) encoding version.
+ * Per-client zlib state, kept in cl->zlibData so that clients can be
+ * encoded from several threads at once.
+ *
+ * beforeBuf contains pixel data in the client's format.
+ * afterBuf contains the zlib (deflated) encoding version.
  * If the zlib compressed/encoded version is
- * larger than the raw data or if it exceeds zlibAfterBufSize then
+ * larger than the raw data or if it exceeds afterBufSize then
  * raw encoding is used instead.
  */
 
-static int zlibBeforeBufSize = 0;
-static char *zlibBeforeBuf = NULL;
-
-static int zlibAfterBufSize = 0;
-static char *zlibAfterBuf = NULL;
-static int zlibAfterBufLen;
+typedef struct rfbZlibData_s {
+    int beforeBufSize;
+    char *beforeBuf;
+    int afterBufSize;
+    char *afterBuf;
+} rfbZlibData;
 
-void rfbZlibCleanup(rfbScreenInfoPtr screen)
+void rfbFreeZlibData(rfbClientPtr cl)
 {
-  if (zlibBeforeBufSize) {
-    free(zlibBeforeBuf);
-    zlibBeforeBufSize=0;
-  }
-  if (zlibAfterBufSize) {
-    zlibAfterBufSize=0;
-    free(zlibAfterBuf);
-  }
+    rfbZlibData *zlib = cl->zlibData;
+
+    if (zlib) {
+        free(zlib->beforeBuf);
+        free(zlib->afterBuf);
+        free(zlib);
+    }
+    cl->zlibData = NULL;
 }
 
 
@@ -76,22 +80,31 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
     rfbZlibHeader hdr;
     int deflateResult;
     int previousOut;
-    int i;
     char *fbptr = (cl->scaledScreen->frameBuffer + (cl->scaledScreen->paddedWidthInBytes * y)
     	   + (x * (cl->scaledScreen->bitsPerPixel / 8)));
 
     int maxRawSize;
     int maxCompSize;
+    rfbZlibData *zlib;
+    int zlibAfterBufLen;
+    int skip = 0;
+
+    if (cl->zlibData == NULL) {
+        cl->zlibData = calloc(1, sizeof(rfbZlibData));
+        if (cl->zlibData == NULL)
+            return FALSE;
+    }
+    zlib = cl->zlibData;
 
     maxRawSize = (cl->scaledScreen->width * cl->scaledScreen->height
                   * (cl->format.bitsPerPixel / 8));
 
-    if (zlibBeforeBufSize < maxRawSize) {
-	zlibBeforeBufSize = maxRawSize;
-	if (zlibBeforeBuf == NULL)
-	    zlibBeforeBuf = (char *)malloc(zlibBeforeBufSize);
+    if (zlib->beforeBufSize < maxRawSize) {
+	zlib->beforeBufSize = maxRawSize;
+	if (zlib->beforeBuf == NULL)
+	    zlib->beforeBuf = (char *)malloc(zlib->beforeBufSize);
 	else
-	    zlibBeforeBuf = (char *)realloc(zlibBeforeBuf, zlibBeforeBufSize);
+	    zlib->beforeBuf = (char *)realloc(zlib->beforeBuf, zlib->beforeBufSize);
     }
 
     /* zlib compression is not useful for very small data sets.
@@ -126,12 +139,12 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
      */
     maxCompSize = maxRawSize + (( maxRawSize + 99 ) / 100 ) + 12;
 
-    if (zlibAfterBufSize < maxCompSize) {
-	zlibAfterBufSize = maxCompSize;
-	if (zlibAfterBuf == NULL)
-	    zlibAfterBuf = (char *)malloc(zlibAfterBufSize);
+    if (zlib->afterBufSize < maxCompSize) {
+	zlib->afterBufSize = maxCompSize;
+	if (zlib->afterBuf == NULL)
+	    zlib->afterBuf = (char *)malloc(zlib->afterBufSize);
 	else
-	    zlibAfterBuf = (char *)realloc(zlibAfterBuf, zlibAfterBufSize);
+	    zlib->afterBuf = (char *)realloc(zlib->afterBuf, zlib->afterBufSize);
     }
 
 
@@ -139,12 +152,12 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
      * Convert pixel data to client format.
      */
     (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-		       &cl->format, fbptr, zlibBeforeBuf,
+		       &cl->format, fbptr, zlib->beforeBuf,
 		       cl->scaledScreen->paddedWidthInBytes, w, h);
 
-    cl->compStream.next_in = ( Bytef * )zlibBeforeBuf;
+    cl->compStream.next_in = ( Bytef * )zlib->beforeBuf;
     cl->compStream.avail_in = w * h * (cl->format.bitsPerPixel / 8);
-    cl->compStream.next_out = ( Bytef * )zlibAfterBuf;
+    cl->compStream.next_out = ( Bytef * )zlib->afterBuf;
     cl->compStream.avail_out = maxCompSize;
     cl->compStream.data_type = Z_BINARY;
 
@@ -167,6 +180,17 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
         /* deflateInit( &(cl->compStream), Z_BEST_SPEED ); */
         cl->compStreamInited = TRUE;
 
+        /* a parallel encoder continues the client's stream; see
+           parallel.c */
+        if (cl->encodeJob)
+            skip = ZLIB_HEADER_SIZE;
+
+    } else if (RESTART_STREAMS(cl)) {
+        /* the rectangle must not refer back to earlier ones.  The
+           restarted stream begins with a new zlib header, which the
+           client already has. */
+        deflateReset( &(cl->compStream) );
+        skip = ZLIB_HEADER_SIZE;
     }
 
     previousOut = cl->compStream.total_out;
@@ -175,7 +199,7 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
     deflateResult = deflate( &(cl->compStream), Z_SYNC_FLUSH );
 
     /* Find the total size of the resulting compressed data. */
-    zlibAfterBufLen = cl->compStream.total_out - previousOut;
+    zlibAfterBufLen = cl->compStream.total_out - previousOut - skip;
 
     if ( deflateResult != Z_OK ) {
         rfbErr("zlib deflation error: %s\n", cl->compStream.msg);
@@ -194,7 +218,7 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
         + w * (cl->format.bitsPerPixel / 8) * h);
 
     if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader
-	> UPDATE_BUF_SIZE)
+	> cl->updateBufSize)
     {
 	if (!rfbSendUpdateBuf(cl))
 	    return FALSE;
@@ -215,26 +239,7 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
     memcpy(&cl->updateBuf[cl->ublen], (char *)&hdr, sz_rfbZlibHeader);
     cl->ublen += sz_rfbZlibHeader;
 
-    for (i = 0; i < zlibAfterBufLen;) {
-
-	int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
-
-	if (i + bytesToCopy > zlibAfterBufLen) {
-	    bytesToCopy = zlibAfterBufLen - i;
-	}
-
-	memcpy(&cl->updateBuf[cl->ublen], &zlibAfterBuf[i], bytesToCopy);
-
-	cl->ublen += bytesToCopy;
-	i += bytesToCopy;
-
-	if (cl->ublen == UPDATE_BUF_SIZE) {
-	    if (!rfbSendUpdateBuf(cl))
-		return FALSE;
-	}
-    }
-
-    return TRUE;
+    return rfbSendUpdateBytes(cl, &zlib->afterBuf[skip], zlibAfterBufLen);
 
 }
 
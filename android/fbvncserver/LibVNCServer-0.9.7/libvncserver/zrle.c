@@ -27,6 +27,7 @@
 #include "rfb/rfb.h"
 #include "private.h"
 #include "zrleoutstream.h"
+#include "zrlepalettehelper.h"
 
 
 #define GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf)                                \
@@ -90,14 +91,20 @@
 
 
 /*
- * zrleBeforeBuf contains pixel data in the client's format.  It must be at
+ * Per-client ZRLE state, kept in cl->zrleData so that clients can be
+ * encoded from several threads at once.
+ *
+ * beforeBuf contains pixel data in the client's format.  It must be at
  * least one pixel bigger than the largest tile of pixel data, since the
  * ZRLE encoding algorithm writes to the position one past the end of the pixel
  * data.
  */
 
-/* TODO: put into rfbClient struct */
-static char zrleBeforeBuf[rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4];
+typedef struct rfbZrleData_s {
+  zrleOutStream* os;
+  zrlePaletteHelper paletteHelper;
+  char beforeBuf[rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4];
+} rfbZrleData;
 
 
 
@@ -108,10 +115,15 @@ static char zrleBeforeBuf[rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4];
 
 rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
 {
+  rfbZrleData* zrle;
   zrleOutStream* zos;
+  zrlePaletteHelper* ph;
+  char* zrleBeforeBuf;
   rfbFramebufferUpdateRectHeader rect;
   rfbZRLEHeader hdr;
-  int i;
+  uint8_t* out;
+  int outLen;
+  rfbBool skipHeader = FALSE;
 
   if (cl->preferredEncoding == rfbEncodingZYWRLE) {
 	  if (cl->tightQualityLevel < 0) {
@@ -126,29 +138,48 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   } else
 	  cl->zywrleLevel = 0;
 
-  if (!cl->zrleData)
-    cl->zrleData = zrleOutStreamNew();
-  zos = cl->zrleData;
+  if (!cl->zrleData) {
+    zrle = (rfbZrleData*)malloc(sizeof(rfbZrleData));
+    if (!zrle)
+      return FALSE;
+    zrle->os = zrleOutStreamNew();
+    if (!zrle->os) {
+      free(zrle);
+      return FALSE;
+    }
+    cl->zrleData = zrle;
+    /* a parallel encoder continues the client's stream; see parallel.c */
+    skipHeader = (cl->encodeJob != NULL);
+  } else if (RESTART_STREAMS(cl)) {
+    /* the rectangle must not refer back to earlier ones.  The restarted
+       stream begins with a new zlib header, which the client already has. */
+    deflateReset(&((rfbZrleData*)cl->zrleData)->os->zs);
+    skipHeader = TRUE;
+  }
+  zrle = cl->zrleData;
+  zos = zrle->os;
+  ph = &zrle->paletteHelper;
+  zrleBeforeBuf = zrle->beforeBuf;
   zos->in.ptr = zos->in.start;
   zos->out.ptr = zos->out.start;
 
   switch (cl->format.bitsPerPixel) {
 
   case 8:
-    zrleEncode8NE(x, y, w, h, zos, zrleBeforeBuf, cl);
+    zrleEncode8NE(x, y, w, h, zos, ph, zrleBeforeBuf, cl);
     break;
 
   case 16:
 	if (cl->format.greenMax > 0x1F) {
 		if (cl->format.bigEndian)
-		  zrleEncode16BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  zrleEncode16BE(x, y, w, h, zos, ph, zrleBeforeBuf, cl);
 		else
-		  zrleEncode16LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  zrleEncode16LE(x, y, w, h, zos, ph, zrleBeforeBuf, cl);
 	} else {
 		if (cl->format.bigEndian)
-		  zrleEncode15BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  zrleEncode15BE(x, y, w, h, zos, ph, zrleBeforeBuf, cl);
 		else
-		  zrleEncode15LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  zrleEncode15LE(x, y, w, h, zos, ph, zrleBeforeBuf, cl);
 	}
     break;
 
@@ -165,32 +196,39 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
     if ((fitsInLS3Bytes && !cl->format.bigEndian) ||
         (fitsInMS3Bytes && cl->format.bigEndian)) {
 	if (cl->format.bigEndian)
-		zrleEncode24ABE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode24ABE(x, y, w, h, zos, ph, zrleBeforeBuf, cl);
 	else
-		zrleEncode24ALE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode24ALE(x, y, w, h, zos, ph, zrleBeforeBuf, cl);
     }
     else if ((fitsInLS3Bytes && cl->format.bigEndian) ||
              (fitsInMS3Bytes && !cl->format.bigEndian)) {
 	if (cl->format.bigEndian)
-		zrleEncode24BBE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode24BBE(x, y, w, h, zos, ph, zrleBeforeBuf, cl);
 	else
-		zrleEncode24BLE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode24BLE(x, y, w, h, zos, ph, zrleBeforeBuf, cl);
     }
     else {
 	if (cl->format.bigEndian)
-		zrleEncode32BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode32BE(x, y, w, h, zos, ph, zrleBeforeBuf, cl);
 	else
-		zrleEncode32LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode32LE(x, y, w, h, zos, ph, zrleBeforeBuf, cl);
     }
   }
     break;
   }
 
-  rfbStatRecordEncodingSent(cl, rfbEncodingZRLE, sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader + ZRLE_BUFFER_LENGTH(&zos->out),
+  out = zos->out.start;
+  outLen = ZRLE_BUFFER_LENGTH(&zos->out);
+  if (skipHeader) {
+    out += ZLIB_HEADER_SIZE;
+    outLen -= ZLIB_HEADER_SIZE;
+  }
+
+  rfbStatRecordEncodingSent(cl, rfbEncodingZRLE, sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader + outLen,
       + w * (cl->format.bitsPerPixel / 8) * h);
 
   if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader
-      > UPDATE_BUF_SIZE)
+      > cl->updateBufSize)
     {
       if (!rfbSendUpdateBuf(cl))
         return FALSE;
@@ -206,40 +244,23 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
          sz_rfbFramebufferUpdateRectHeader);
   cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
-  hdr.length = Swap32IfLE(ZRLE_BUFFER_LENGTH(&zos->out));
+  hdr.length = Swap32IfLE(outLen);
 
   memcpy(cl->updateBuf+cl->ublen, (char *)&hdr, sz_rfbZRLEHeader);
   cl->ublen += sz_rfbZRLEHeader;
 
-  /* copy into updateBuf and send from there.  Maybe should send directly? */
-
-  for (i = 0; i < ZRLE_BUFFER_LENGTH(&zos->out);) {
-
-    int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
-
-    if (i + bytesToCopy > ZRLE_BUFFER_LENGTH(&zos->out)) {
-      bytesToCopy = ZRLE_BUFFER_LENGTH(&zos->out) - i;
-    }
-
-    memcpy(cl->updateBuf+cl->ublen, (uint8_t*)zos->out.start + i, bytesToCopy);
-
-    cl->ublen += bytesToCopy;
-    i += bytesToCopy;
-
-    if (cl->ublen == UPDATE_BUF_SIZE) {
-      if (!rfbSendUpdateBuf(cl))
-        return FALSE;
-    }
-  }
-
-  return TRUE;
+  return rfbSendUpdateBytes(cl, (char *)out, outLen);
 }
 
 
 void rfbFreeZrleData(rfbClientPtr cl)
 {
-  if (cl->zrleData)
-    zrleOutStreamFree(cl->zrleData);
+  rfbZrleData* zrle = cl->zrleData;
+
+  if (zrle) {
+    zrleOutStreamFree(zrle->os);
+    free(zrle);
+  }
   cl->zrleData = NULL;
 }
 
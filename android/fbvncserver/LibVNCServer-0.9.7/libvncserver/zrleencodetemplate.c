@@ -84,12 +84,10 @@ static const int bitsPerPackedPixel[] = {
   0, 1, 2, 2, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
 };
 
-static zrlePaletteHelper paletteHelper;
-
 #endif /* ZRLE_ONCE */
 
 void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, zrleOutStream* os,
-		int zywrle_level, int *zywrleBuf);
+		zrlePaletteHelper *ph, int zywrle_level, int *zywrleBuf);
 
 #if BPP!=8
 #define ZYWRLE_ENCODE
@@ -97,7 +95,7 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, zrleOutStream* os,
 #endif
 
 static void ZRLE_ENCODE (int x, int y, int w, int h,
-		  zrleOutStream* os, void* buf
+		  zrleOutStream* os, zrlePaletteHelper *ph, void* buf
                   EXTRA_ARGS
                   )
 {
@@ -111,7 +109,7 @@ static void ZRLE_ENCODE (int x, int y, int w, int h,
 
       GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf);
 
-      ZRLE_ENCODE_TILE((PIXEL_T*)buf, tw, th, os,
+      ZRLE_ENCODE_TILE((PIXEL_T*)buf, tw, th, os, ph,
 		      cl->zywrleLevel, cl->zywrleBuf);
     }
   }
@@ -120,12 +118,10 @@ static void ZRLE_ENCODE (int x, int y, int w, int h,
 
 
 void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
-	int zywrle_level, int *zywrleBuf)
+	zrlePaletteHelper *ph, int zywrle_level, int *zywrleBuf)
 {
   /* First find the palette and the number of runs */
 
-  zrlePaletteHelper *ph;
-
   int runs = 0;
   int singlePixels = 0;
 
@@ -140,7 +136,6 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
   PIXEL_T* end = ptr + h * w;
   *end = ~*(end-1); /* one past the end is different so the while loop ends */
 
-  ph = &paletteHelper;
   zrlePaletteHelperInit(ph);
 
   while (ptr < end) {
@@ -289,7 +284,7 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 #if BPP!=8
       if (zywrle_level > 0 && !(zywrle_level & 0x80)) {
         ZYWRLE_ANALYZE(data, data, w, h, w, zywrle_level, zywrleBuf);
-	ZRLE_ENCODE_TILE(data, w, h, os, zywrle_level | 0x80, zywrleBuf);
+	ZRLE_ENCODE_TILE(data, w, h, os, ph, zywrle_level | 0x80, zywrleBuf);
       }
       else
 #endif
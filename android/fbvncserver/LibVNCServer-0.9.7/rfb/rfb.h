@@ -331,6 +331,15 @@ typedef struct _rfbScreenInfo
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
     MUTEX(cursorMutex);
     rfbBool backgroundLoop;
+    /* if not zero, rfbRunEventLoop(...,TRUE) serves all clients from one
+     * I/O thread and this many encoder threads, instead of starting two
+     * threads per client */
+    int encoderThreads;
+    struct rfbEncoderPool* encoderPool;
+    /* if not zero, large updates are cut into bands which this many
+     * threads encode at the same time (see parallel.c) */
+    int parallelEncodeThreads;
+    struct rfbParallelPool* parallelPool;
 #endif
 
     /* if TRUE, an ignoring signal handler is installed for SIGPIPE */
@@ -356,6 +365,39 @@ typedef struct _rfbScreenInfo
 
     /* command line authorization of file transfers */
     rfbBool permitFileTransfer;
+
+    /* if not zero, up to this many bytes of encoded rectangles are kept
+     * and handed to other clients asking for the same rectangle in the
+     * same encoding and pixel format, see encodecache.c */
+    int encodeCacheSize;
+    struct rfbEncodeCache* encodeCache;
+
+    /* translation tables in use, shared by all clients which need the
+     * same one, see translate.c */
+    struct rfbTranslateTable* translateTables;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    MUTEX(translateTablesMutex);
+#endif
+
+    /* if not zero, what a client's socket does not take at once is queued
+     * and written by rfbCheckFds later, instead of waiting for the client.
+     * No updates are started for a client with this many bytes queued;
+     * its changes are sent together once the queue has drained.  This is
+     * a soft limit: the update that fills the queue is queued whole, so
+     * the queue can exceed it by one update, up to maxUpdateBufSize per
+     * write. */
+    int maxOutputQueue;
+
+    /* how far a client's updateBuf may grow; it does not grow if this is
+     * UPDATE_BUF_SIZE or less */
+    int maxUpdateBufSize;
+
+#ifdef LIBVNCSERVER_WITH_EPOLL
+    /* epoll set rfbCheckFds waits on, -1 to use select() */
+    int epollFd;
+    /* clients which may have more input queued, see rfbCheckFds */
+    struct _rfbClientRec* epollReadyHead;
+#endif
 } rfbScreenInfo, *rfbScreenInfoPtr;
 
 
@@ -511,12 +553,31 @@ typedef struct _rfbClientRec {
      * UPDATE_BUF_SIZE must be big enough to send at least one whole line of the
      * framebuffer.  So for a max screen width of say 2K with 32-bit pixels this
      * means 8K minimum.
+     *
+     * updateBuf starts out with UPDATE_BUF_SIZE bytes.  It grows when an
+     * update does not fit into it, up to screen->maxUpdateBufSize, and goes
+     * back to UPDATE_BUF_SIZE once no update needed more for a while.
      */
 
 #define UPDATE_BUF_SIZE 30000
 
-    char updateBuf[UPDATE_BUF_SIZE];
+    char *updateBuf;
+    int updateBufSize;
     int ublen;
+    int updateBufBytes;		/* written from updateBuf in this update */
+    int updateBufPeak;		/* most bytes one update wrote from it */
+    time_t updateBufUsed;	/* when an update last needed a bigger one */
+
+    /* while a rectangle is encoded for the encode cache, everything from
+       updateBuf[captureStart] on is also collected in captureBuf;
+       captureStart is -1 otherwise */
+    char *captureBuf;
+    int captureLen, captureSize;
+    int captureStart;
+
+    /* set while this is one of the parallel encoders' contexts, which
+       collect what they encode for a band of another client's update */
+    struct rfbEncodeJob* encodeJob;
 
     /* statistics */
     struct _rfbStatList *statEncList;
@@ -530,6 +591,7 @@ typedef struct _rfbClientRec {
     struct z_stream_s compStream;
     rfbBool compStreamInited;
     uint32_t zlibCompressLevel;
+    void* zlibData;
     /* the quality level is also used by ZYWRLE */
     int tightQualityLevel;
 
@@ -539,6 +601,7 @@ typedef struct _rfbClientRec {
     rfbBool zsActive[4];
     int zsLevel[4];
     int tightCompressLevel;
+    void* tightData;
 #endif
 #endif
 
@@ -581,6 +644,14 @@ typedef struct _rfbClientRec {
     MUTEX(outputMutex);
     MUTEX(updateMutex);
     COND(updateCond);
+
+    /* encoder pool state, protected by the pool's mutex.  A client is
+       either waiting in the run queue or being sent to by one encoder
+       thread, never both, so its updates stay in order. */
+    rfbBool updateQueued;
+    rfbBool updateBusy;
+    struct _rfbClientRec *nextQueued;
+    struct timeval queuedTime;
 #endif
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
@@ -594,6 +665,22 @@ typedef struct _rfbClientRec {
     int progressiveSliceY;
 
     rfbExtensionData* extensions;
+
+#ifdef LIBVNCSERVER_WITH_EPOLL
+    rfbBool epollReady;
+    struct _rfbClientRec *epollNextReady;
+#endif
+
+    /* output the socket did not take yet, protected by outputMutex;
+       see rfbWriteExact */
+    struct rfbOutputChunk *outputHead, *outputTail;
+    int outputQueued;			/* bytes waiting */
+    int outputQueuePeak;		/* most bytes ever waiting */
+    rfbBool outputBacklogged;		/* no updates until it drains */
+    time_t outputProgress;		/* when the queue last moved */
+
+    rfbBool updateInProgress;		/* a FramebufferUpdate is being sent */
+    rfbBool corked;			/* TCP_CORK is set on sock */
 } rfbClientRec, *rfbClientPtr;
 
 /*
@@ -648,6 +735,8 @@ extern int rfbReadExact(rfbClientPtr cl, char *buf, int len);
 extern int rfbReadExactTimeout(rfbClientPtr cl, char *buf, int len,int timeout);
 extern int rfbWriteExact(rfbClientPtr cl, const char *buf, int len);
 extern int rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec);
+extern void rfbWatchSocket(rfbScreenInfoPtr rfbScreen, int sock, void* data, rfbBool edge);
+extern void rfbUnwatchSocket(rfbScreenInfoPtr rfbScreen, int sock);
 extern int rfbConnect(rfbScreenInfoPtr rfbScreen, char* host, int port);
 extern int rfbConnectToTcpAddr(char* host, int port);
 extern int rfbListenOnTCPPort(int port, in_addr_t iface);
@@ -678,6 +767,7 @@ extern void rfbNewUDPConnection(rfbScreenInfoPtr rfbScreen,int sock);
 extern void rfbProcessUDPInput(rfbScreenInfoPtr rfbScreen);
 extern rfbBool rfbSendFramebufferUpdate(rfbClientPtr cl, sraRegionPtr updateRegion);
 extern rfbBool rfbSendRectEncodingRaw(rfbClientPtr cl, int x,int y,int w,int h);
+extern rfbBool rfbSendRectEncoding(rfbClientPtr cl, int x,int y,int w,int h);
 extern rfbBool rfbSendUpdateBuf(rfbClientPtr cl);
 extern void rfbSendServerCutText(rfbScreenInfoPtr rfbScreen,char *str, int len);
 extern rfbBool rfbSendCopyRegion(rfbClientPtr cl,sraRegionPtr reg,int dx,int dy);
@@ -698,6 +788,8 @@ void rfbGotXCutText(rfbScreenInfoPtr rfbScreen, char *str, int len);
 /* translate.c */
 
 extern rfbBool rfbEconomicTranslate;
+/* translate true colour by shifting instead of looking up tables where exact */
+extern rfbBool rfbShiftTranslate;
 
 extern void rfbTranslateNone(char *table, rfbPixelFormat *in,
                              rfbPixelFormat *out,
@@ -707,6 +799,7 @@ extern void rfbTranslateNone(char *table, rfbPixelFormat *in,
 extern rfbBool rfbSetTranslateFunction(rfbClientPtr cl);
 extern rfbBool rfbSetClientColourMap(rfbClientPtr cl, int firstColour, int nColours);
 extern void rfbSetClientColourMaps(rfbScreenInfoPtr rfbScreen, int firstColour, int nColours);
+extern void rfbReleaseTranslateTable(rfbClientPtr cl);
 
 /* httpd.c */
 
@@ -823,6 +916,11 @@ extern rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w,int
 extern void rfbResetStats(rfbClientPtr cl);
 extern void rfbPrintStats(rfbClientPtr cl);
 
+/* encodecache.c */
+
+extern void rfbEncodeCacheStats(rfbScreenInfoPtr screen,
+                                unsigned long* hits, unsigned long* misses);
+
 /* font.c */
 
 typedef struct rfbFontData {
@@ -935,6 +1033,10 @@ extern void rfbRunEventLoop(rfbScreenInfoPtr screenInfo, long usec, rfbBool runI
 extern rfbBool rfbProcessEvents(rfbScreenInfoPtr screenInfo,long usec);
 extern rfbBool rfbIsActive(rfbScreenInfoPtr screenInfo);
 
+/* wakes whatever sends updates to cl; call with cl->updateMutex held
+   after changing its modified or requested region */
+extern void rfbSignalClientUpdate(rfbClientPtr cl);
+
 /* TightVNC file transfer extension */
 void rfbRegisterTightVNCFileTransferExtension();
 void rfbUnregisterTightVNCFileTransferExtension(); 
@@ -472,6 +472,11 @@
 #define LIBVNCSERVER_VERSION  "0.9.7" 
 #endif
 
+/* Use epoll instead of select to wait for clients */
+#ifndef LIBVNCSERVER_WITH_EPOLL 
+#define LIBVNCSERVER_WITH_EPOLL  1 
+#endif
+
 /* Disable TightVNCFileTransfer protocol */
 #ifndef LIBVNCSERVER_WITH_TIGHTVNC_FILETRANSFER 
 #define LIBVNCSERVER_WITH_TIGHTVNC_FILETRANSFER  1 
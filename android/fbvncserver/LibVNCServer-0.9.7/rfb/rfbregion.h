@@ -39,12 +39,20 @@ extern rfbBool sraRgnEmpty(const sraRegion *rgn);
 
 extern sraRegion *sraRgnBBox(const sraRegion *src);
 
+/* Let rgn, and the regions copied from it, turn into a bitmap of tiles
+   covering (0,0)-(width,height) when it breaks up into many rectangles.
+   Such a region may grow to whole tiles, and loses what lies outside,
+   so only allow it where covering a bit more does no harm.  0x0 turns
+   it back into spans for good. */
+extern void sraRgnAllowTiles(sraRegion *rgn, int width, int height);
+
 /* -=- rectangle iterator */
 
 typedef struct sraRectangleIterator {
   rfbBool reverseX,reverseY;
   int ptrSize,ptrPos;
   struct sraSpan** sPtrs;
+  sraRegion *copy;		/* the spans of a tiled region */
 } sraRectangleIterator;
 
 extern sraRectangleIterator *sraRgnGetIterator(sraRegion *s);
@@ -0,0 +1,80 @@
+/*
+ * Connect two clients for every encoding to a server with the encode cache
+ * switched on, and check that all of them keep up with the framebuffer.
+ * The second client of each pair only connects halfway through and is
+ * then mostly sent what the first one encoded, so this checks that shared
+ * rectangles can be decoded by a client whose zlib streams have seen
+ * different data before.
+ */
+
+#include "harness.h"
+
+#define NUMBER_OF_ROUNDS 40
+
+static const int width=400,height=300;
+
+/* paint a gradient into a random rectangle */
+static void paint(rfbScreenInfo* server)
+{
+	int i;
+	int x1=(rand()%(server->width-1)),x2=(rand()%(server->width-1)),
+	    y1=(rand()%(server->height-1)),y2=(rand()%(server->height-1));
+
+	if(x1>x2) { i=x1; x1=x2; x2=i; }
+	if(y1>y2) { i=y1; y1=y2; y2=i; }
+	x2++; y2++;
+
+	paintGradient(server,x1,y1,x2,y2);
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	testClient* clients;
+	unsigned long hits,misses;
+	unsigned int totalFailed=0,count;
+	int i,numberOfClients=0,rounds;
+
+	clients=calloc(2*numberOfEncodings,sizeof(testClient));
+	server=makeServer(&argc,argv,width,height);
+	if(!server->encodeCacheSize)
+		server->encodeCacheSize=4*1024*1024;
+	rfbInitServer(server);
+
+	/* round 0 is the initial full update */
+	for(rounds=0;rounds<=NUMBER_OF_ROUNDS;rounds++) {
+		if(rounds==0 || rounds==NUMBER_OF_ROUNDS/2) {
+			for(i=0;i<numberOfEncodings;i++,numberOfClients++) {
+				testClient* tc=&clients[numberOfClients];
+
+				tc->index=i;
+				tc->encoding=testEncodings[i].str;
+				tc->maxDelta=testEncodings[i].maxDelta;
+				startClient(tc,server,checkLastRect);
+			}
+			expectUpdate(0,0,width,height);
+			/* so the clients which are already there check again, too */
+			rfbMarkRectAsModified(server,0,0,width,height);
+		} else
+			paint(server);
+		if((count=waitForClients(server,numberOfClients))<numberOfClients) {
+			rfbErr("Only %u of %d clients got the update of round %d\n",
+					count,numberOfClients,rounds);
+			totalFailed++;
+			break;
+		}
+	}
+
+	rfbEncodeCacheStats(server,&hits,&misses);
+	stopServer(server,clients,numberOfClients);
+
+	totalFailed+=reportEncodings(clients,numberOfClients);
+	rfbLog("%lu cache hits, %lu misses\n",hits,misses);
+	if(!hits) {
+		rfbErr("No rectangle was ever shared\n");
+		totalFailed++;
+	}
+	free(clients);
+
+	return totalFailed?1:0;
+}
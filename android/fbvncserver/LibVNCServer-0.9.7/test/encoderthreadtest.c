@@ -0,0 +1,269 @@
+/*
+ * Encode the same updates for many clients at once and check that every
+ * client gets exactly the bytes it gets when it is the only one encoding.
+ * The encoders may keep state between calls, but it has to be per client.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test needs pthread support
+#endif
+#ifndef LIBVNCSERVER_HAVE_LIBZ
+#error This test needs zlib support
+#endif
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static const int width=400,height=300;
+
+#define NUMBER_OF_CLIENTS 27
+#define NUMBER_OF_UPDATES 24
+
+typedef struct {
+	int encoding;
+	char* str;
+	int bitsPerPixel;
+	int compressLevel;
+	int qualityLevel;
+	rfbBool lastRect;
+} config_t;
+
+static config_t testConfigs[]={
+	{ rfbEncodingZlib, "zlib", 32, 0, -1, FALSE },
+	{ rfbEncodingZlib, "zlib/16", 16, 0, -1, FALSE },
+	{ rfbEncodingZRLE, "zrle", 32, 0, -1, FALSE },
+	{ rfbEncodingZRLE, "zrle/16", 16, 0, -1, FALSE },
+	{ rfbEncodingZYWRLE, "zywrle", 32, 0, 4, FALSE },
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	{ rfbEncodingTight, "tight", 32, 6, -1, TRUE },
+	{ rfbEncodingTight, "tight/jpeg", 32, 9, 5, TRUE },
+	{ rfbEncodingTight, "tight/16", 16, 1, -1, FALSE },
+	{ rfbEncodingTight, "tight/16/jpeg", 16, 6, 8, TRUE },
+#endif
+	{ 0, NULL }
+};
+
+#define NUMBER_OF_CONFIGS (sizeof(testConfigs)/sizeof(config_t)-1)
+
+typedef struct {
+	rfbClientPtr cl;
+	config_t* config;
+	int sock;		/* our end of the connection */
+	pthread_t reader;
+	char* buf;		/* everything the server sent */
+	size_t len, size;
+} client_t;
+
+static pthread_mutex_t startMutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startCond=PTHREAD_COND_INITIALIZER;
+static rfbBool started;
+
+/* Something for every subencoding: solid areas, two colour text,
+   small palettes, smooth gradients and noise. */
+static void paint(char* frameBuffer)
+{
+	uint32_t* p=(uint32_t*)frameBuffer;
+	unsigned int seed=1;
+	int x,y;
+
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++,p++) {
+			if(y<60)
+				*p=0x336699;
+			else if(y<120)
+				*p=((x/3+y/5)%7)?0xffffff:0x000000;
+			else if(y<180)
+				*p=0x10101*((x/8+y/8)%11)*20;
+			else if(y<240)
+				*p=(x*255/width)|((y-180)*4<<8)|((x+y)%256<<16);
+			else {
+				seed=seed*1103515245+12345;
+				*p=seed>>8;
+			}
+		}
+}
+
+static void* readAll(void* data)
+{
+	client_t* c=(client_t*)data;
+	int n;
+
+	while(1) {
+		if(c->len==c->size) {
+			c->size=c->size?c->size*2:65536;
+			c->buf=realloc(c->buf,c->size);
+		}
+		n=read(c->sock,c->buf+c->len,c->size-c->len);
+		if(n<=0)
+			break;
+		c->len+=n;
+	}
+	return NULL;
+}
+
+/* rfbNewClient wants a TCP socket */
+static rfbBool connectPair(int* serverSock,int* clientSock)
+{
+	struct sockaddr_in addr;
+	socklen_t len=sizeof(addr);
+	int listenSock;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	listenSock=socket(AF_INET,SOCK_STREAM,0);
+	if(listenSock<0 || bind(listenSock,(struct sockaddr*)&addr,sizeof(addr))<0
+			|| listen(listenSock,1)<0
+			|| getsockname(listenSock,(struct sockaddr*)&addr,&len)<0)
+		return FALSE;
+	*clientSock=socket(AF_INET,SOCK_STREAM,0);
+	if(*clientSock<0 || connect(*clientSock,(struct sockaddr*)&addr,len)<0)
+		return FALSE;
+	*serverSock=accept(listenSock,NULL,NULL);
+	close(listenSock);
+	return *serverSock>=0;
+}
+
+static rfbBool startClient(client_t* c,config_t* config,rfbScreenInfoPtr server)
+{
+	int serverSock;
+
+	memset(c,0,sizeof(*c));
+	c->config=config;
+	if(!connectPair(&serverSock,&c->sock)) {
+		rfbLogPerror("connectPair");
+		return FALSE;
+	}
+	pthread_create(&c->reader,NULL,readAll,c);
+
+	c->cl=rfbNewClient(server,serverSock);
+	if(!c->cl)
+		return FALSE;
+	c->cl->preferredEncoding=config->encoding;
+	c->cl->enableLastRectEncoding=config->lastRect;
+	c->cl->tightCompressLevel=config->compressLevel;
+	c->cl->tightQualityLevel=config->qualityLevel;
+	if(config->bitsPerPixel==16) {
+		c->cl->format.bitsPerPixel=16;
+		c->cl->format.depth=16;
+		c->cl->format.redMax=31;
+		c->cl->format.greenMax=63;
+		c->cl->format.blueMax=31;
+		c->cl->format.redShift=11;
+		c->cl->format.greenShift=5;
+		c->cl->format.blueShift=0;
+	}
+	rfbSetTranslateFunction(c->cl);
+	return TRUE;
+}
+
+static void finishClient(client_t* c)
+{
+	rfbCloseClient(c->cl);
+	pthread_join(c->reader,NULL);
+	close(c->sock);
+	rfbClientConnectionGone(c->cl);
+}
+
+static void* sendUpdates(void* data)
+{
+	client_t* c=(client_t*)data;
+	rfbClientPtr cl=c->cl;
+	sraRegionPtr region;
+	int i,x,y,w,h;
+
+	pthread_mutex_lock(&startMutex);
+	while(!started)
+		pthread_cond_wait(&startCond,&startMutex);
+	pthread_mutex_unlock(&startMutex);
+
+	for(i=0;i<NUMBER_OF_UPDATES;i++) {
+		/* the whole screen first, then strips and blocks */
+		x=i?(i*37)%(width-64):0;
+		y=i?(i*53)%(height-48):0;
+		w=i?64+(i*29)%(width-x-63):width;
+		h=i?48+(i*41)%(height-y-47):height;
+
+		region=sraRgnCreateRect(x,y,x+w,y+h);
+		LOCK(cl->updateMutex);
+		sraRgnOr(cl->modifiedRegion,region);
+		sraRgnOr(cl->requestedRegion,region);
+		UNLOCK(cl->updateMutex);
+		sraRgnDestroy(region);
+
+		if(!rfbSendFramebufferUpdate(cl,cl->modifiedRegion))
+			break;
+	}
+	return NULL;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	client_t reference[NUMBER_OF_CONFIGS];
+	client_t clients[NUMBER_OF_CLIENTS];
+	pthread_t threads[NUMBER_OF_CLIENTS];
+	unsigned int i;
+	int failed=0;
+
+	server=rfbGetScreen(&argc,argv,width,height,8,3,4);
+	server->frameBuffer=malloc(width*height*4);
+	server->cursor=NULL;
+	paint(server->frameBuffer);
+	rfbClientListInit(server);
+	/* quiet, we are going to connect a lot of clients */
+	rfbLogEnable(FALSE);
+
+	/* what each configuration gets when encoded on its own */
+	started=TRUE;
+	for(i=0;i<NUMBER_OF_CONFIGS;i++) {
+		if(!startClient(&reference[i],&testConfigs[i],server))
+			return 1;
+		sendUpdates(&reference[i]);
+		finishClient(&reference[i]);
+	}
+
+	/* now all at once */
+	started=FALSE;
+	for(i=0;i<NUMBER_OF_CLIENTS;i++) {
+		if(!startClient(&clients[i],&testConfigs[i%NUMBER_OF_CONFIGS],server))
+			return 1;
+		pthread_create(&threads[i],NULL,sendUpdates,&clients[i]);
+	}
+	pthread_mutex_lock(&startMutex);
+	started=TRUE;
+	pthread_cond_broadcast(&startCond);
+	pthread_mutex_unlock(&startMutex);
+
+	for(i=0;i<NUMBER_OF_CLIENTS;i++) {
+		client_t* ref=&reference[i%NUMBER_OF_CONFIGS];
+
+		pthread_join(threads[i],NULL);
+		finishClient(&clients[i]);
+		if(clients[i].len!=ref->len
+				|| memcmp(clients[i].buf,ref->buf,ref->len)) {
+			rfbErr("client %d (%s): %lu bytes differ from the %lu "
+					"encoded alone\n",i,clients[i].config->str,
+					(unsigned long)clients[i].len,
+					(unsigned long)ref->len);
+			failed++;
+		}
+		free(clients[i].buf);
+	}
+
+	rfbLogEnable(TRUE);
+	for(i=0;i<NUMBER_OF_CONFIGS;i++) {
+		rfbLog("%s: %lu bytes\n",testConfigs[i].str,
+				(unsigned long)reference[i].len);
+		free(reference[i].buf);
+	}
+	rfbLog("%d of %d clients failed\n",failed,NUMBER_OF_CLIENTS);
+
+	free(server->frameBuffer);
+	rfbScreenCleanup(server);
+
+	return failed?1:0;
+}
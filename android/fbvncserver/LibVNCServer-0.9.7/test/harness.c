@@ -0,0 +1,322 @@
+/*
+ * The server and client side the tests which serve libvncclient clients
+ * share, see harness.h.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "harness.h"
+
+encoding_t testEncodings[]={
+	{ rfbEncodingRaw, "raw", 0 },
+	{ rfbEncodingRRE, "rre", 0 },
+	{ rfbEncodingHextile, "hextile", 0 },
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	{ rfbEncodingZlib, "zlib", 0 },
+	{ rfbEncodingZRLE, "zrle", 0 },
+	/* lossy by design: at the default quality level the wavelet filter
+	   smears the pattern makeServer starts with by about 22 a channel */
+	{ rfbEncodingZYWRLE, "zywrle", 32 },
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	{ rfbEncodingTight, "tight", 5 },
+#endif
+#endif
+	{ 0, NULL }
+};
+
+const int numberOfEncodings=sizeof(testEncodings)/sizeof(encoding_t)-1;
+
+MUTEX(frameBufferMutex);
+MUTEX(statisticsMutex);
+unsigned int generation;
+
+rfbClientPtr serverClients[MAX_SERVER_CLIENTS];
+int numberOfServerClients;
+
+/* what checkLastRect waits for, protected by statisticsMutex */
+static struct { int x1,y1,x2,y2; } lastUpdateRect;
+static unsigned int countGotUpdate;
+
+enum rfbNewClientAction newClient(rfbClientPtr cl)
+{
+	if(numberOfServerClients<MAX_SERVER_CLIENTS)
+		serverClients[numberOfServerClients++]=cl;
+	return RFB_CLIENT_ACCEPT;
+}
+
+rfbScreenInfoPtr makeServer(int* argc,char** argv,int width,int height)
+{
+	rfbScreenInfoPtr server;
+	int i;
+
+	INIT_MUTEX(frameBufferMutex);
+	INIT_MUTEX(statisticsMutex);
+
+	server=rfbGetScreen(argc,argv,width,height,8,3,4);
+	server->frameBuffer=malloc(width*height*4);
+	server->cursor=NULL;
+	server->newClientHook=newClient;
+	for(i=0;i<width*height*4;i++)
+		server->frameBuffer[i]=i;
+	return server;
+}
+
+void stopServer(rfbScreenInfoPtr server,testClient* clients,int n)
+{
+	rfbClientPtr cl;
+	rfbClientIteratorPtr iter;
+	int i;
+
+	for(i=0;i<n;i++)
+		clients[i].quit=TRUE;
+	iter=rfbGetClientIterator(server);
+	while((cl=rfbClientIteratorNext(iter)))
+		rfbCloseClient(cl);
+	rfbReleaseClientIterator(iter);
+	for(i=0;i<n;i++)
+		pthread_join(clients[i].thread,NULL);
+
+	free(server->frameBuffer);
+	rfbScreenCleanup(server);
+}
+
+rfbBool doFramebuffersMatch(rfbScreenInfo* server,rfbClient* client,
+		int maxDelta)
+{
+	int i,j,k;
+	unsigned int total=0,diff[3]={0,0,0};
+
+	if(server->width!=client->width || server->height!=client->height)
+		return FALSE;
+	LOCK(frameBufferMutex);
+	for(j=0;j<server->height;j++)
+		for(i=0;i<server->width;i++)
+			for(k=0;k<3;k++) {
+				unsigned char s=server->frameBuffer[k+i*4+j*server->paddedWidthInBytes];
+				unsigned char cl=client->frameBuffer[k+i*4+j*client->width*4];
+
+				if(maxDelta==0 && s!=cl) {
+					UNLOCK(frameBufferMutex);
+					return FALSE;
+				}
+				diff[k]+=(s>cl?s-cl:cl-s);
+			}
+	UNLOCK(frameBufferMutex);
+	total=server->width*server->height;
+	if(maxDelta>0)
+		for(k=0;k<3;k++)
+			if(diff[k]/total>=maxDelta)
+				return FALSE;
+	return TRUE;
+}
+
+testClient* getTestClient(rfbClient* client) {
+	return (testClient*)rfbClientGetClientData(client,(void*)startClient);
+}
+
+static rfbBool resize(rfbClient* cl) {
+	if(cl->frameBuffer)
+		free(cl->frameBuffer);
+	cl->frameBuffer=(uint8_t*)malloc(cl->width*cl->height*cl->format.bitsPerPixel/8);
+	if(!cl->frameBuffer)
+		return FALSE;
+	SendFramebufferUpdateRequest(cl,0,0,cl->width,cl->height,FALSE);
+	return TRUE;
+}
+
+static void* clientLoop(void* data) {
+	rfbClient* client=(rfbClient*)data;
+	testClient* tc=getTestClient(client);
+
+	client->appData.encodingsString=strdup(tc->encoding);
+	if(!rfbInitClient(client,NULL,NULL)) {
+		rfbClientErr("Had problems starting client %d (encoding %s)\n",
+				tc->index,tc->encoding);
+		LOCK(statisticsMutex);
+		tc->failures++;
+		UNLOCK(statisticsMutex);
+		return NULL;
+	}
+	if(tc->receiveBufferSize)
+		setsockopt(client->sock,SOL_SOCKET,SO_RCVBUF,
+				&tc->receiveBufferSize,sizeof(tc->receiveBufferSize));
+	while(!tc->quit) {
+		if(tc->stalled) {
+			usleep(10000);
+			continue;
+		}
+		if(WaitForMessage(client,50)>=0)
+			if(!HandleRFBServerMessage(client))
+				break;
+	}
+	if(client->frameBuffer)
+		free(client->frameBuffer);
+	rfbClientCleanup(client);
+	return NULL;
+}
+
+void startClient(testClient* tc,rfbScreenInfo* server,
+		GotFrameBufferUpdateProc update) {
+	rfbClient* client=rfbGetClient(8,3,4);
+
+	tc->server=server;
+	rfbClientSetClientData(client,(void*)startClient,tc);
+	client->MallocFrameBuffer=resize;
+	client->GotFrameBufferUpdate=update;
+	client->serverHost=strdup("localhost");
+	client->serverPort=server->port;
+
+	pthread_create(&tc->thread,NULL,clientLoop,(void*)client);
+}
+
+rfbBool connectClient(testClient* tc,rfbScreenInfo* server,
+		GotFrameBufferUpdateProc update) {
+	int connected=numberOfServerClients;
+	long t;
+
+	startClient(tc,server,update);
+	t=now();
+	while(numberOfServerClients==connected && now()-t<CATCH_UP_TIMEOUT*1000)
+		rfbProcessEvents(server,10000);
+	return numberOfServerClients>connected;
+}
+
+void checkLastRect(rfbClient* client,int x,int y,int w,int h) {
+	testClient* tc=getTestClient(client);
+	rfbBool match;
+
+	/* only check if this was the last rectangle of the update */
+	LOCK(statisticsMutex);
+	tc->updates++;
+	if(x+w!=lastUpdateRect.x2 || y+h!=lastUpdateRect.y2) {
+		UNLOCK(statisticsMutex);
+		return;
+	}
+	UNLOCK(statisticsMutex);
+
+	match=doFramebuffersMatch(tc->server,client,tc->maxDelta);
+
+	LOCK(statisticsMutex);
+	if(!match)
+		tc->failures++;
+	countGotUpdate++;
+	UNLOCK(statisticsMutex);
+}
+
+void checkPicture(rfbClient* client,int x,int y,int w,int h) {
+	testClient* tc=getTestClient(client);
+	unsigned int gen;
+	rfbBool match;
+
+	LOCK(statisticsMutex);
+	tc->updates++;
+	gen=generation;
+	UNLOCK(statisticsMutex);
+
+	match=doFramebuffersMatch(tc->server,client,tc->maxDelta);
+
+	LOCK(statisticsMutex);
+	tc->checkedGeneration=gen;
+	tc->matched=match;
+	UNLOCK(statisticsMutex);
+}
+
+void expectUpdate(int x1,int y1,int x2,int y2)
+{
+	LOCK(statisticsMutex);
+	countGotUpdate=0;
+	lastUpdateRect.x1=x1;
+	lastUpdateRect.y1=y1;
+	lastUpdateRect.x2=x2;
+	lastUpdateRect.y2=y2;
+	UNLOCK(statisticsMutex);
+}
+
+void paintGradient(rfbScreenInfo* server,int x1,int y1,int x2,int y2)
+{
+	int i,j,c;
+
+	LOCK(frameBufferMutex);
+	for(c=0;c<3;c++)
+		for(i=x1;i<x2;i++)
+			for(j=y1;j<y2;j++)
+				server->frameBuffer[i*4+c+j*server->paddedWidthInBytes]=
+					255*(i-x1+j-y1)/(x2-x1+y2-y1)+c*40;
+	UNLOCK(frameBufferMutex);
+
+	expectUpdate(x1,y1,x2,y2);
+	rfbMarkRectAsModified(server,x1,y1,x2,y2);
+}
+
+unsigned int waitForClients(rfbScreenInfo* server,unsigned int n)
+{
+	time_t t=time(NULL);
+	unsigned int count;
+
+	do {
+		rfbProcessEvents(server,1000);
+		LOCK(statisticsMutex);
+		count=countGotUpdate;
+		UNLOCK(statisticsMutex);
+		if(count>=n)
+			break;
+	} while(time(NULL)-t<ROUND_TIMEOUT);
+	return count;
+}
+
+rfbBool caughtUp(testClient* tc)
+{
+	rfbBool done;
+
+	LOCK(statisticsMutex);
+	done=(tc->checkedGeneration==generation && tc->matched);
+	UNLOCK(statisticsMutex);
+	return done;
+}
+
+rfbBool catchUp(rfbScreenInfo* server,testClient* clients,int n)
+{
+	long t=now();
+	int i;
+
+	do {
+		rfbProcessEvents(server,10000);
+		for(i=0;i<n && caughtUp(&clients[i]);i++)
+			;
+		if(i==n)
+			return TRUE;
+	} while(now()-t<CATCH_UP_TIMEOUT*1000);
+	return FALSE;
+}
+
+unsigned int reportEncodings(testClient* clients,int n)
+{
+	unsigned int failed,total=0,received=0;
+	int i,j;
+
+	rfbLog("Statistics:\n");
+	for(i=0;i<numberOfEncodings;i++) {
+		failed=0;
+		for(j=0;j<n;j++)
+			if(clients[j].index==i)
+				failed+=clients[j].failures;
+		rfbLog("%s encoding: %u failed\n",testEncodings[i].str,failed);
+		total+=failed;
+	}
+	for(j=0;j<n;j++)
+		received+=clients[j].updates;
+	rfbLog("%u failed, %u rectangles received\n",total,received);
+	return total;
+}
+
+long now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec*1000L+tv.tv_usec/1000;
+}
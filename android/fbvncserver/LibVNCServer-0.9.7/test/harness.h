@@ -0,0 +1,107 @@
+/*
+ * What the tests which serve libvncclient clients have in common: a server
+ * with a 32 bit framebuffer, clients on threads of their own which check
+ * every update they get against it, and ways to wait for them.
+ *
+ * Clients check their picture in one of two ways.  Tests which paint one
+ * rectangle a round announce it with expectUpdate(), and checkLastRect
+ * compares the framebuffers once the last rectangle of its update is in.
+ * Other tests bump generation whenever they paint, and checkPicture
+ * compares after every rectangle, remembering which generation it saw.
+ */
+
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test needs pthread support
+#endif
+
+/* give up waiting for the clients after this many seconds */
+#define CATCH_UP_TIMEOUT 20
+
+typedef struct { int id; char* str; int maxDelta; } encoding_t;
+
+/* every encoding libvncclient can decode, NULL terminated */
+extern encoding_t testEncodings[];
+extern const int numberOfEncodings;
+
+typedef struct testClient {
+	int index;		/* into testEncodings, or the test's own */
+	const char* encoding;
+	int maxDelta;		/* see doFramebuffersMatch */
+	int receiveBufferSize;	/* SO_RCVBUF if not 0 */
+	volatile rfbBool stalled;	/* does not read while set */
+	volatile rfbBool quit;
+	rfbScreenInfo* server;
+	pthread_t thread;
+	/* protected by statisticsMutex */
+	unsigned int updates;	/* rectangles received */
+	unsigned int failures;
+	unsigned int checkedGeneration;
+	rfbBool matched;
+} testClient;
+
+/* held while the server's framebuffer is painted or compared */
+extern MUTEX(frameBufferMutex);
+/* held while the counters are read or written */
+extern MUTEX(statisticsMutex);
+/* bumped by the test, with both mutexes held, whenever it paints */
+extern unsigned int generation;
+
+/* the server side of the clients, in the order they connected */
+#define MAX_SERVER_CLIENTS 32
+extern rfbClientPtr serverClients[MAX_SERVER_CLIENTS];
+extern int numberOfServerClients;
+
+/* a server whose framebuffer is filled with a pattern, not yet started */
+rfbScreenInfoPtr makeServer(int* argc,char** argv,int width,int height);
+/* the newClientHook makeServer sets up; tests with their own call it */
+enum rfbNewClientAction newClient(rfbClientPtr cl);
+/* close all clients, wait for the n client threads and free the server */
+void stopServer(rfbScreenInfoPtr server,testClient* clients,int n);
+
+/* maxDelta=0 means they are expected to match exactly;
+ * maxDelta>0 means that the average difference of each colour channel
+ * must be lower than maxDelta */
+rfbBool doFramebuffersMatch(rfbScreenInfo* server,rfbClient* client,
+		int maxDelta);
+
+/* start tc on a thread of its own; index, encoding, maxDelta and
+   receiveBufferSize have to be set */
+void startClient(testClient* tc,rfbScreenInfo* server,
+		GotFrameBufferUpdateProc update);
+/* the same, then serve until the server has seen it connect */
+rfbBool connectClient(testClient* tc,rfbScreenInfo* server,
+		GotFrameBufferUpdateProc update);
+testClient* getTestClient(rfbClient* client);
+
+/* the update callbacks, see above */
+void checkLastRect(rfbClient* client,int x,int y,int w,int h);
+void checkPicture(rfbClient* client,int x,int y,int w,int h);
+
+/* the next update checkLastRect waits for covers this rectangle */
+void expectUpdate(int x1,int y1,int x2,int y2);
+/* paint a gradient into a rectangle, expect it and mark it as modified */
+void paintGradient(rfbScreenInfo* server,int x1,int y1,int x2,int y2);
+/* serve until n clients have checked the last update, returns how many
+   did before ROUND_TIMEOUT */
+#define ROUND_TIMEOUT 10
+unsigned int waitForClients(rfbScreenInfo* server,unsigned int n);
+
+/* whether tc has seen the latest generation, and got it right */
+rfbBool caughtUp(testClient* tc);
+/* serve until the n clients have caught up, or CATCH_UP_TIMEOUT */
+rfbBool catchUp(rfbScreenInfo* server,testClient* clients,int n);
+
+/* log how many updates the clients of each encoding got wrong, and
+   return the total */
+unsigned int reportEncodings(testClient* clients,int n);
+
+/* milliseconds */
+long now(void);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * Serve two clients from the main loop with an output queue, and stop one
+ * of them from reading for a while.  The other one has to keep getting
+ * updates in the meantime, the stalled client's queue has to stay bounded,
+ * and once it reads again it has to catch up with the framebuffer.  Then
+ * stop it for good; it has to be closed once its queue has not moved for
+ * rfbMaxClientWait, even though nothing new is queued for it.
+ */
+
+#include <sys/socket.h>
+#include "harness.h"
+
+#define MAX_OUTPUT_QUEUE (256*1024)
+/* small socket buffers for the slow client, so that a single update
+   does not fit into them */
+#define SOCKET_BUFFER_SIZE (16*1024)
+/* how long the slow client stops reading, in seconds */
+#define STALL_TIME 3
+/* no rfbProcessEvents() may take longer than this many milliseconds */
+#define MAX_PROCESS_TIME 1000
+/* rfbMaxClientWait while the slow client stops for good, in milliseconds */
+#define MAX_CLIENT_WAIT 2000
+
+static const int width=640,height=480;
+
+static testClient clients[2];
+static rfbBool slowClientGone;
+
+static void clientGone(rfbClientPtr cl)
+{
+	if(cl==serverClients[0])
+		slowClientGone=TRUE;
+}
+
+static enum rfbNewClientAction slowNewClient(rfbClientPtr cl)
+{
+	int size=SOCKET_BUFFER_SIZE;
+
+	if(numberOfServerClients==0)
+		setsockopt(cl->sock,SOL_SOCKET,SO_SNDBUF,&size,sizeof(size));
+	cl->clientGoneHook=clientGone;
+	return newClient(cl);
+}
+
+static unsigned int updatesReceived(int i)
+{
+	unsigned int updates;
+
+	LOCK(statisticsMutex);
+	updates=clients[i].updates;
+	UNLOCK(statisticsMutex);
+	return updates;
+}
+
+/* change every pixel, so that every update is a full screen one */
+static void paint(rfbScreenInfo* server)
+{
+	int j;
+
+	LOCK(frameBufferMutex);
+	for(j=0;j<width*height*4;j++)
+		server->frameBuffer[j]+=rand()%7+1;
+	LOCK(statisticsMutex);
+	generation++;
+	UNLOCK(statisticsMutex);
+	UNLOCK(frameBufferMutex);
+
+	rfbMarkRectAsModified(server,0,0,width,height);
+}
+
+/* returns how long it took, in milliseconds */
+static long processEvents(rfbScreenInfo* server)
+{
+	long t=now();
+	rfbProcessEvents(server,10000);
+	return now()-t;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	long t,longest=0,d;
+	unsigned int fastDuringStall;
+	int failed=0,i,peak;
+	rfbBool done;
+
+	server=makeServer(&argc,argv,width,height);
+	server->deferUpdateTime=0;
+	server->newClientHook=slowNewClient;
+	if(!server->maxOutputQueue)
+		server->maxOutputQueue=MAX_OUTPUT_QUEUE;
+	rfbInitServer(server);
+
+	/* connect them one after the other, so that we know which is which */
+	for(i=0;i<2;i++) {
+		clients[i].index=i;
+		clients[i].encoding="raw";
+		if(i==0)
+			clients[i].receiveBufferSize=SOCKET_BUFFER_SIZE;
+		if(!connectClient(&clients[i],server,checkPicture)) {
+			rfbErr("The clients did not connect\n");
+			return 1;
+		}
+	}
+
+	/* let them get going */
+	t=now();
+	while(now()-t<500)
+		processEvents(server);
+
+	clients[0].stalled=TRUE;
+	fastDuringStall=updatesReceived(1);
+	t=now();
+	while(now()-t<STALL_TIME*1000) {
+		paint(server);
+		d=processEvents(server);
+		if(d>longest)
+			longest=d;
+	}
+	fastDuringStall=updatesReceived(1)-fastDuringStall;
+	peak=serverClients[0]->outputQueuePeak;
+	clients[0].stalled=FALSE;
+
+	/* one last change, then everybody has to catch up with it */
+	paint(server);
+	t=now();
+	do {
+		d=processEvents(server);
+		if(d>longest)
+			longest=d;
+		done=(caughtUp(&clients[0]) && caughtUp(&clients[1]));
+	} while(!done && now()-t<CATCH_UP_TIMEOUT*1000);
+
+	rfbLog("fast client got %u updates while the other one stalled\n",
+			fastDuringStall);
+	rfbLog("stalled client: %d bytes queued at most, %u updates\n",
+			peak,updatesReceived(0));
+	rfbLog("longest rfbProcessEvents(): %ld ms\n",longest);
+
+	if(fastDuringStall<STALL_TIME) {
+		rfbErr("The fast client was held up\n");
+		failed++;
+	}
+	if(peak<server->maxOutputQueue) {
+		rfbErr("The stalled client never fell behind\n");
+		failed++;
+	}
+	/* updates are held back once the queue is full, so at most one
+	   more update can be on top of it */
+	if(peak>server->maxOutputQueue+width*height*4+1024) {
+		rfbErr("The stalled client's queue grew too long\n");
+		failed++;
+	}
+	if(longest>MAX_PROCESS_TIME) {
+		rfbErr("rfbProcessEvents() waited for a client\n");
+		failed++;
+	}
+	if(!done) {
+		rfbErr("The clients did not catch up (%d/%d)\n",
+				caughtUp(&clients[0]),caughtUp(&clients[1]));
+		failed++;
+	}
+
+	/* fill the slow client's queue, then only serve the fast one */
+	rfbMaxClientWait=MAX_CLIENT_WAIT;
+	clients[0].stalled=TRUE;
+	t=now();
+	while(!serverClients[0]->outputBacklogged && now()-t<CATCH_UP_TIMEOUT*1000) {
+		paint(server);
+		processEvents(server);
+	}
+	t=now();
+	while(!slowClientGone && now()-t<MAX_CLIENT_WAIT+CATCH_UP_TIMEOUT*1000)
+		processEvents(server);
+	if(!slowClientGone) {
+		rfbErr("The client which stopped reading was not closed\n");
+		failed++;
+	} else
+		rfbLog("stalled client closed after %ld ms\n",now()-t);
+
+	stopServer(server,clients,2);
+
+	return failed?1:0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Connect a client for every encoding to a server which encodes large
+ * updates on several threads, and check that all of them keep up with the
+ * framebuffer.  The painted rectangles are big enough to be cut into
+ * bands, so the zlib based encodings have to decode bands which were
+ * compressed by different threads.
+ */
+
+#include "harness.h"
+
+#define NUMBER_OF_ROUNDS 40
+
+static const int width=640,height=480;
+/* so that every painted rectangle is cut into a few bands */
+static const int minWidth=128,minHeight=200;
+
+/* paint a gradient into a large random rectangle */
+static void paint(rfbScreenInfo* server)
+{
+	int x1=rand()%(server->width-minWidth),
+	    y1=rand()%(server->height-minHeight),
+	    x2=x1+minWidth+rand()%(server->width-minWidth-x1+1),
+	    y2=y1+minHeight+rand()%(server->height-minHeight-y1+1);
+
+	paintGradient(server,x1,y1,x2,y2);
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	testClient* clients;
+	unsigned int totalFailed=0,count;
+	int i,rounds;
+
+	clients=calloc(numberOfEncodings,sizeof(testClient));
+	server=makeServer(&argc,argv,width,height);
+	if(!server->parallelEncodeThreads)
+		server->parallelEncodeThreads=4;
+	rfbInitServer(server);
+
+	/* round 0 is the initial full update */
+	for(rounds=0;rounds<=NUMBER_OF_ROUNDS;rounds++) {
+		if(rounds==0) {
+			for(i=0;i<numberOfEncodings;i++) {
+				clients[i].index=i;
+				clients[i].encoding=testEncodings[i].str;
+				clients[i].maxDelta=testEncodings[i].maxDelta;
+				startClient(&clients[i],server,checkLastRect);
+			}
+			expectUpdate(0,0,width,height);
+		} else
+			paint(server);
+		if((count=waitForClients(server,numberOfEncodings))<numberOfEncodings) {
+			rfbErr("Only %u of %d clients got the update of round %d\n",
+					count,numberOfEncodings,rounds);
+			totalFailed++;
+			break;
+		}
+	}
+
+	stopServer(server,clients,numberOfEncodings);
+	totalFailed+=reportEncodings(clients,numberOfEncodings);
+	free(clients);
+
+	return totalFailed?1:0;
+}
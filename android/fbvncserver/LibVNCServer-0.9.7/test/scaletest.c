@@ -0,0 +1,234 @@
+/*
+ * Scale a screen of random pixels to several sizes, some of them not an
+ * integer fraction of the screen, and check each scaled pixel against the
+ * average of the screen pixels it covers.  Then change random rectangles
+ * of the screen and check that the scaled copies follow.
+ *
+ * With -bench, also print how many megapixels of the screen per second
+ * are scaled down to a half and a third.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <time.h>
+#include <sys/time.h>
+#include <rfb/rfb.h>
+
+/* how many rectangles to change */
+#define CHANGES 10
+
+static const int width=640,height=480;
+static const int benchWidth=1280,benchHeight=720;
+
+typedef struct {
+	const char* name;
+	rfbPixelFormat format;
+	/* how far a channel may be off the exact average */
+	int tolerance;
+} Format;
+
+/* bitsPerPixel, depth, bigEndian, trueColour, maxes, shifts */
+static const Format formats[]={
+	{ "888", { 32, 24, 0, 1, 255, 255, 255, 16, 8, 0 }, 1 },
+	{ "565", { 16, 16, 0, 1, 31, 63, 31, 11, 5, 0 }, 1 },
+	{ "233", { 8, 8, 0, 1, 7, 7, 3, 0, 3, 6 }, 1 },
+	{ "colour map", { 8, 8, 0, 0, 0, 0, 0, 0, 0, 0 }, 0 },
+#ifdef LIBVNCSERVER_ALLOW24BPP
+	{ "888 24", { 24, 24, 0, 1, 255, 255, 255, 16, 8, 0 }, 1 },
+#endif
+};
+#define FORMATS (int)(sizeof(formats)/sizeof(Format))
+
+static const struct { int width,height; } sizes[]={
+	{ 320, 240 },	/* a half */
+	{ 213, 160 },	/* a third, 640 does not divide by 3 */
+	{ 500, 375 },
+	{ 111, 77 },
+	{ 800, 600 },	/* larger than the screen */
+};
+#define SIZES (int)(sizeof(sizes)/sizeof(sizes[0]))
+
+static uint32_t getPixel(rfbScreenInfoPtr s,int x,int y)
+{
+	unsigned char* p=(unsigned char*)s->frameBuffer+y*s->paddedWidthInBytes+
+		x*(s->bitsPerPixel/8);
+
+	switch(s->bitsPerPixel) {
+	case 8: return *p;
+	case 16: return *(uint16_t*)p;
+	case 24:
+		if(s->serverFormat.bigEndian)
+			return p[0]<<16|p[1]<<8|p[2];
+		return p[0]|p[1]<<8|p[2]<<16;
+	default: return *(uint32_t*)p;
+	}
+}
+
+static int channel(rfbPixelFormat* f,uint32_t p,int c)
+{
+	switch(c) {
+	case 0: return (p>>f->redShift)&f->redMax;
+	case 1: return (p>>f->greenShift)&f->greenMax;
+	default: return (p>>f->blueShift)&f->blueMax;
+	}
+}
+
+/* the part of the source pixel i which destination pixel d covers */
+static double overlap(int i,int d,int from,int to)
+{
+	double a=(double)d*from/to,b=(double)(d+1)*from/to;
+
+	if(a<i) a=i;
+	if(b>i+1) b=i+1;
+	return b>a?b-a:0;
+}
+
+/* compare every pixel of ptr with what it should be; return how many differ */
+static int check(rfbScreenInfoPtr screen,rfbScreenInfoPtr ptr,const Format* f)
+{
+	rfbPixelFormat* format=&screen->serverFormat;
+	int x,y,i,j,c,wrong=0;
+
+	for(y=0;y<ptr->height;y++)
+		for(x=0;x<ptr->width;x++) {
+			uint32_t p=getPixel(ptr,x,y);
+
+			if(!format->trueColour) {
+				/* the pixel in the middle of the area */
+				i=(2*x+1)*screen->width/(2*ptr->width);
+				j=(2*y+1)*screen->height/(2*ptr->height);
+				if(p!=getPixel(screen,i,j))
+					wrong++;
+				continue;
+			}
+
+			for(c=0;c<3;c++) {
+				double sum=0,area=0,w;
+				int i0=x*screen->width/ptr->width,j0=y*screen->height/ptr->height;
+
+				for(j=j0;j<screen->height && j<=(y+1)*screen->height/ptr->height;j++)
+					for(i=i0;i<screen->width && i<=(x+1)*screen->width/ptr->width;i++) {
+						w=overlap(i,x,screen->width,ptr->width)*
+							overlap(j,y,screen->height,ptr->height);
+						sum+=w*channel(format,getPixel(screen,i,j),c);
+						area+=w;
+					}
+				if(abs(channel(format,p,c)-(int)(sum/area+0.5))>f->tolerance) {
+					wrong++;
+					break;
+				}
+			}
+		}
+
+	return wrong;
+}
+
+static rfbScreenInfoPtr newScreen(const Format* f,int w,int h)
+{
+	rfbScreenInfoPtr screen;
+	int argc=0,i;
+
+	screen=rfbGetScreen(&argc,NULL,w,h,8,3,f->format.bitsPerPixel/8);
+	screen->serverFormat=f->format;
+	screen->serverFormat.bigEndian=!rfbEndianTest;
+	screen->cursor=NULL;
+	screen->frameBuffer=malloc(screen->paddedWidthInBytes*h);
+	for(i=0;i<screen->paddedWidthInBytes*h;i++)
+		screen->frameBuffer[i]=rand();
+	return screen;
+}
+
+/* what rfbScalingSetup does for a client, without the client */
+static rfbScreenInfoPtr addScaledScreen(rfbScreenInfoPtr screen,int w,int h)
+{
+	rfbScreenInfoPtr ptr=malloc(sizeof(rfbScreenInfo));
+
+	memcpy(ptr,screen,sizeof(rfbScreenInfo));
+	ptr->width=w;
+	ptr->height=h;
+	ptr->paddedWidthInBytes=w*screen->bitsPerPixel/8;
+	ptr->sizeInBytes=ptr->paddedWidthInBytes*h;
+	ptr->frameBuffer=calloc(1,ptr->sizeInBytes);
+	ptr->scaledScreenRefCount=1;
+	ptr->scaledScreenNext=screen->scaledScreenNext;
+	screen->scaledScreenNext=ptr;
+	return ptr;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+/* megapixels of the screen per second scaled to a 1/divisor copy */
+static double bench(const Format* f,int divisor)
+{
+	rfbScreenInfoPtr screen=newScreen(f,benchWidth,benchHeight);
+	double t,elapsed;
+	int frames=0;
+
+	addScaledScreen(screen,benchWidth/divisor,benchHeight/divisor);
+	t=now();
+	do {
+		rfbMarkRectAsModified(screen,0,0,benchWidth,benchHeight);
+		frames++;
+		elapsed=now()-t;
+	} while(elapsed<0.5);
+
+	free(screen->frameBuffer);
+	rfbScreenCleanup(screen);
+	return (double)frames*benchWidth*benchHeight/elapsed/1e6;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr screen,ptr[SIZES];
+	int doBench=(argc>1 && !strcmp(argv[1],"-bench"));
+	int failed=0,i,j,k,b,x,y,w,h,wrong;
+
+	rfbLogEnable(0);
+
+	for(i=0;i<FORMATS;i++) {
+		screen=newScreen(&formats[i],width,height);
+		for(j=0;j<SIZES;j++)
+			ptr[j]=addScaledScreen(screen,sizes[j].width,sizes[j].height);
+
+		rfbMarkRectAsModified(screen,0,0,width,height);
+		for(k=0;k<=CHANGES;k++) {
+			for(j=0;j<SIZES;j++) {
+				wrong=check(screen,ptr[j],&formats[i]);
+				if(wrong) {
+					fprintf(stderr,"%s scaled to %dx%d: %d pixels wrong %s\n",
+							formats[i].name,sizes[j].width,sizes[j].height,wrong,
+							k?"after a change":"");
+					failed++;
+				}
+			}
+			if(failed)
+				break;
+
+			/* noise in a random rectangle */
+			w=1+rand()%100;
+			h=1+rand()%100;
+			x=rand()%(width-w);
+			y=rand()%(height-h);
+			for(j=y;j<y+h;j++)
+				for(b=x*screen->bitsPerPixel/8;b<(x+w)*screen->bitsPerPixel/8;b++)
+					screen->frameBuffer[j*screen->paddedWidthInBytes+b]=rand();
+			rfbMarkRectAsModified(screen,x,y,x+w,y+h);
+		}
+
+		free(screen->frameBuffer);
+		rfbScreenCleanup(screen);
+	}
+
+	if(doBench)
+		for(i=0;i<2;i++)
+			printf("%-4s 1/2 %7.1f Mpixel/s, 1/3 %7.1f Mpixel/s\n",
+					formats[i].name,bench(&formats[i],2),bench(&formats[i],3));
+
+	return failed?1:0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Change a lot of small, scattered spots of the screen at once, so that
+ * the client's modified region breaks up and turns into tiles.  The
+ * update has to come in far fewer rectangles than there were spots, and
+ * the client has to end up with the right picture all the same.
+ */
+
+#include "harness.h"
+
+/* the spots are SPOT_SIZE pixels square, STEP_X and STEP_Y apart */
+#define SPOT_SIZE 3
+#define STEP_X 21
+#define STEP_Y 17
+
+static const int width=640,height=480;
+
+static testClient client;
+
+/* how many rectangles the client got since the last call */
+static unsigned int takeRects(void)
+{
+	unsigned int rects;
+
+	LOCK(statisticsMutex);
+	rects=client.updates;
+	client.updates=0;
+	UNLOCK(statisticsMutex);
+	return rects;
+}
+
+/* returns how many spots were changed */
+static int paint(rfbScreenInfo* server)
+{
+	int x,y,i,j,spots=0;
+
+	LOCK(frameBufferMutex);
+	for(y=5;y+SPOT_SIZE<=height;y+=STEP_Y)
+		for(x=7;x+SPOT_SIZE<=width;x+=STEP_X) {
+			for(j=y;j<y+SPOT_SIZE;j++)
+				for(i=x*4;i<(x+SPOT_SIZE)*4;i++)
+					server->frameBuffer[i+j*width*4]+=rand()%7+1;
+			spots++;
+		}
+	LOCK(statisticsMutex);
+	generation++;
+	UNLOCK(statisticsMutex);
+	UNLOCK(frameBufferMutex);
+
+	/* all of them before the client gets to see any */
+	for(y=5;y+SPOT_SIZE<=height;y+=STEP_Y)
+		for(x=7;x+SPOT_SIZE<=width;x+=STEP_X)
+			rfbMarkRectAsModified(server,x,y,x+SPOT_SIZE,y+SPOT_SIZE);
+	return spots;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	int failed=0,spots;
+	unsigned int rects;
+
+	server=makeServer(&argc,argv,width,height);
+	server->deferUpdateTime=0;
+	/* do not let the bounding box fallback hide the tiles */
+	server->maxRectsPerUpdate=0x7fff;
+	rfbInitServer(server);
+
+	client.encoding="raw";
+	if(!connectClient(&client,server,checkPicture) ||
+	   !catchUp(server,&client,1)) {
+		rfbErr("The client did not connect\n");
+		return 1;
+	}
+
+	takeRects();
+	spots=paint(server);
+	if(!catchUp(server,&client,1)) {
+		rfbErr("The client did not catch up\n");
+		failed++;
+	}
+	rects=takeRects();
+
+	rfbLog("%d spots changed, sent in %u rectangles\n",spots,rects);
+	if(rects*4>(unsigned int)spots) {
+		rfbErr("The modified region did not turn into tiles\n");
+		failed++;
+	}
+
+	/* and once it is sent, single changes go out as they are again */
+	LOCK(frameBufferMutex);
+	server->frameBuffer[(100+100*width)*4]++;
+	LOCK(statisticsMutex);
+	client.updates=0;
+	generation++;
+	UNLOCK(statisticsMutex);
+	UNLOCK(frameBufferMutex);
+	rfbMarkRectAsModified(server,100,100,101,101);
+	if(!catchUp(server,&client,1)) {
+		rfbErr("The client did not catch up with a single pixel\n");
+		failed++;
+	}
+	rects=takeRects();
+	if(rects!=1) {
+		rfbErr("A single pixel came in %u rectangles\n",rects);
+		failed++;
+	}
+
+	stopServer(server,&client,1);
+
+	return failed?1:0;
+}
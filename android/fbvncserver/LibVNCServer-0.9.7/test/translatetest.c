@@ -0,0 +1,319 @@
+/*
+ * Translate random pixels between common pixel formats, once with the
+ * lookup tables and once with the shift kernels, and check that both give
+ * the same result as translating one pixel at a time, and that the common
+ * true colour pairs do get a shift kernel.  Then check that clients with
+ * the same pixel format share their table, and move on to a new one when
+ * the colour map changes.
+ *
+ * With -bench, also print how many megapixels per second each way
+ * translates for every pair of formats.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <time.h>
+#include <sys/time.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+/* the library has shift kernels only where GCC's vector types are,
+   which clang has too */
+#if defined(__GNUC__)
+#define EXPECT_SHIFTS TRUE
+#else
+#define EXPECT_SHIFTS FALSE
+#endif
+
+static const int width=333,height=97,stride=352;
+static const int benchWidth=1280,benchHeight=720;
+
+typedef struct {
+	const char* name;
+	rfbPixelFormat format;
+	rfbBool common;
+} Format;
+
+/* bitsPerPixel, depth, bigEndian, trueColour, maxes, shifts */
+static const Format formats[]={
+	{ "888", { 32, 24, 0, 1, 255, 255, 255, 16, 8, 0 }, TRUE },
+	{ "888 BGR", { 32, 24, 0, 1, 255, 255, 255, 0, 8, 16 }, TRUE },
+	{ "888 BE", { 32, 24, 1, 1, 255, 255, 255, 16, 8, 0 }, TRUE },
+	{ "565", { 16, 16, 0, 1, 31, 63, 31, 11, 5, 0 }, TRUE },
+	{ "565 BGR", { 16, 16, 0, 1, 31, 63, 31, 0, 5, 11 }, TRUE },
+	{ "565 BE", { 16, 16, 1, 1, 31, 63, 31, 11, 5, 0 }, TRUE },
+	{ "555", { 16, 15, 0, 1, 31, 31, 31, 10, 5, 0 }, TRUE },
+	{ "444", { 16, 12, 0, 1, 15, 15, 15, 8, 4, 0 }, TRUE },
+	{ "233", { 8, 8, 0, 1, 7, 7, 3, 0, 3, 6 }, FALSE },
+#ifdef LIBVNCSERVER_ALLOW24BPP
+	{ "888 24", { 24, 24, 0, 1, 255, 255, 255, 16, 8, 0 }, TRUE },
+	{ "888 24BE", { 24, 24, 1, 1, 255, 255, 255, 16, 8, 0 }, TRUE },
+#endif
+};
+#define FORMATS (int)(sizeof(formats)/sizeof(Format))
+
+static uint32_t scale(uint32_t value,int inMax,int outMax)
+{
+	return (value*outMax+inMax/2)/inMax;
+}
+
+/* translate the way rfbTranslateNone would, if it could */
+static void reference(rfbPixelFormat* in,rfbPixelFormat* out,char* iptr,char* optr,
+		int bytesBetweenInputLines,int width,int height)
+{
+	unsigned char* op=(unsigned char*)optr;
+	uint32_t p,o;
+	int x,y,k,bytes=out->bitsPerPixel/8;
+
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++) {
+			if(in->bitsPerPixel==16)
+				p=((uint16_t*)(iptr+y*bytesBetweenInputLines))[x];
+			else
+				p=((uint32_t*)(iptr+y*bytesBetweenInputLines))[x];
+			o=scale((p>>in->redShift)&in->redMax,in->redMax,out->redMax)<<out->redShift|
+				scale((p>>in->greenShift)&in->greenMax,in->greenMax,out->greenMax)<<out->greenShift|
+				scale((p>>in->blueShift)&in->blueMax,in->blueMax,out->blueMax)<<out->blueShift;
+			for(k=0;k<bytes;k++)
+				*(op++)=o>>8*(out->bigEndian?bytes-1-k:k);
+		}
+}
+
+/* set up cl to translate into the format formats[j] */
+static void setFormat(rfbClientPtr cl,int j)
+{
+	cl->format=formats[j].format;
+	rfbSetTranslateFunction(cl);
+}
+
+static uint32_t translatePixel(rfbClientPtr cl,uint8_t p)
+{
+	uint32_t o=0;
+	cl->translateFn(cl->translateLookupTable,&cl->screen->serverFormat,
+			&cl->format,(char*)&p,(char*)&o,1,1,1);
+	return o;
+}
+
+/* two clients asking for the same translation have to share one table */
+static int checkSharing(rfbScreenInfoPtr screen)
+{
+	rfbClientRec cl1,cl2,cl3;
+	static const rfbPixelFormat colourMapFormat={ 8, 8, 0, 0, 0, 0, 0, 0, 0, 0 };
+	int failed=0,k;
+
+	memset(&cl1,0,sizeof(cl1));
+	cl1.screen=screen;
+	cl1.host="translatetest";
+	cl2=cl1;
+
+	/* 888 -> 565 */
+	screen->serverFormat=formats[0].format;
+	screen->serverFormat.bigEndian=!rfbEndianTest;
+	setFormat(&cl1,3);
+	setFormat(&cl2,3);
+	if(!cl1.translateLookupTable || cl1.translateLookupTable!=cl2.translateLookupTable) {
+		fprintf(stderr,"clients with the same format do not share a table\n");
+		failed++;
+	}
+	setFormat(&cl2,4);
+	if(cl1.translateLookupTable==cl2.translateLookupTable) {
+		fprintf(stderr,"clients with different formats share a table\n");
+		failed++;
+	}
+	rfbReleaseTranslateTable(&cl1);
+	rfbReleaseTranslateTable(&cl2);
+	if(screen->translateTables) {
+		fprintf(stderr,"released tables are kept\n");
+		failed++;
+	}
+
+	/* an 8 bit colour mapped screen, all black */
+	screen->serverFormat=colourMapFormat;
+	screen->colourMap.count=256;
+	screen->colourMap.is16=FALSE;
+	screen->colourMap.data.bytes=calloc(256,3);
+	setFormat(&cl1,0);
+	setFormat(&cl2,0);
+	if(!cl1.translateLookupTable || cl1.translateLookupTable!=cl2.translateLookupTable) {
+		fprintf(stderr,"clients of a colour mapped screen do not share a table\n");
+		failed++;
+	}
+
+	/* colour 1 turns white */
+	for(k=3;k<6;k++)
+		screen->colourMap.data.bytes[k]=255;
+	cl1.readyForSetColourMapEntries=cl2.readyForSetColourMapEntries=TRUE;
+	cl1.modifiedRegion=sraRgnCreate();
+	cl2.modifiedRegion=sraRgnCreate();
+	rfbSetClientColourMaps(screen,1,1);
+	rfbSetClientColourMap(&cl1,1,1);
+	rfbSetClientColourMap(&cl2,1,1);
+	if(translatePixel(&cl1,1)!=0xffffff || translatePixel(&cl2,1)!=0xffffff ||
+	   translatePixel(&cl1,2)!=0) {
+		fprintf(stderr,"the colour map change was not picked up\n");
+		failed++;
+	}
+	if(cl1.translateLookupTable!=cl2.translateLookupTable) {
+		fprintf(stderr,"clients do not share the table of the new colour map\n");
+		failed++;
+	}
+
+	/* colour 2 turns white, and only one client is told */
+	for(k=6;k<9;k++)
+		screen->colourMap.data.bytes[k]=255;
+	rfbSetClientColourMap(&cl1,2,1);
+	cl3=cl2;
+	cl3.translateLookupTable=NULL;
+	setFormat(&cl3,0);
+	if(translatePixel(&cl1,2)!=0xffffff || translatePixel(&cl3,2)!=0xffffff) {
+		fprintf(stderr,"a colour map change set on one client was not picked up\n");
+		failed++;
+	}
+	if(cl1.translateLookupTable!=cl3.translateLookupTable ||
+	   cl1.translateLookupTable==cl2.translateLookupTable) {
+		fprintf(stderr,"a new client does not get the table of the new colour map\n");
+		failed++;
+	}
+
+	/* the same bytes read as 16 bit colours are another colour map */
+	screen->colourMap.is16=TRUE;
+	screen->colourMap.count=128;
+	setFormat(&cl3,0);
+	if(cl3.translateLookupTable==cl1.translateLookupTable) {
+		fprintf(stderr,"a table of 8 bit colours is used for 16 bit ones\n");
+		failed++;
+	}
+	screen->colourMap.is16=FALSE;
+	screen->colourMap.count=256;
+	rfbReleaseTranslateTable(&cl1);
+	rfbReleaseTranslateTable(&cl2);
+	rfbReleaseTranslateTable(&cl3);
+	sraRgnDestroy(cl1.modifiedRegion);
+	sraRgnDestroy(cl2.modifiedRegion);
+	if(screen->translateTables) {
+		fprintf(stderr,"tables of the old colour map are kept\n");
+		failed++;
+	}
+
+	return failed;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+/* megapixels per second translating a benchWidth x benchHeight screen */
+static double bench(rfbClientPtr cl,char* in,char* out)
+{
+	double t=now(),elapsed;
+	int frames=0;
+
+	do {
+		cl->translateFn(cl->translateLookupTable,&cl->screen->serverFormat,
+				&cl->format,in,out,benchWidth*cl->screen->serverFormat.bitsPerPixel/8,
+				benchWidth,benchHeight);
+		frames++;
+		elapsed=now()-t;
+	} while(elapsed<0.2);
+	return (double)frames*benchWidth*benchHeight/elapsed/1e6;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr screen;
+	rfbClientRec cl;
+	rfbTranslateFnType tableFn;
+	char *in,*tableOut,*shiftOut,*referenceOut;
+	int doBench=(argc>1 && !strcmp(argv[1],"-bench"));
+	int failed=0,i,j,k,size;
+
+	rfbLogEnable(0);
+	screen=rfbGetScreen(&argc,argv,benchWidth,benchHeight,8,3,4);
+	size=benchWidth*benchHeight*4+stride*height*4;
+	in=malloc(size);
+	tableOut=malloc(size);
+	shiftOut=malloc(size);
+	referenceOut=malloc(size);
+	for(k=0;k<size;k++)
+		in[k]=rand();
+
+	memset(&cl,0,sizeof(cl));
+	cl.screen=screen;
+	cl.host="translatetest";
+
+	for(i=0;i<FORMATS;i++) {
+		/* no shift kernels for these, and 24 bit input is read bytewise */
+		if(formats[i].format.bitsPerPixel==8 || formats[i].format.bitsPerPixel==24)
+			continue;
+		for(j=0;j<FORMATS;j++) {
+			if(i==j)
+				continue;
+			screen->serverFormat=formats[i].format;
+			screen->serverFormat.bigEndian=!rfbEndianTest;
+			if(!memcmp(&screen->serverFormat,&formats[j].format,sizeof(rfbPixelFormat)))
+				continue;
+			screen->paddedWidthInBytes=stride*formats[i].format.bitsPerPixel/8;
+			cl.format=formats[j].format;
+
+			memset(referenceOut,0,size);
+			reference(&screen->serverFormat,&cl.format,in,referenceOut,
+					screen->paddedWidthInBytes,width,height);
+
+			rfbShiftTranslate=FALSE;
+			rfbSetTranslateFunction(&cl);
+			tableFn=cl.translateFn;
+			memset(tableOut,0,size);
+			cl.translateFn(cl.translateLookupTable,&screen->serverFormat,
+					&cl.format,in,tableOut,screen->paddedWidthInBytes,width,height);
+
+			rfbShiftTranslate=TRUE;
+			rfbSetTranslateFunction(&cl);
+			memset(shiftOut,0,size);
+			cl.translateFn(cl.translateLookupTable,&screen->serverFormat,
+					&cl.format,in,shiftOut,screen->paddedWidthInBytes,width,height);
+
+			if(memcmp(tableOut,referenceOut,size)) {
+				fprintf(stderr,"%s -> %s translates wrongly with tables\n",
+						formats[i].name,formats[j].name);
+				failed++;
+			}
+			if(cl.translateFn==tableFn) {
+				/* 16 bit pixels are packed into 24 bits with a table */
+				if(EXPECT_SHIFTS && formats[i].common && formats[j].common &&
+				   !(formats[i].format.bitsPerPixel==16 && formats[j].format.bitsPerPixel==24)) {
+					fprintf(stderr,"%s -> %s does not use a shift kernel\n",
+							formats[i].name,formats[j].name);
+					failed++;
+				}
+			} else if(memcmp(shiftOut,referenceOut,size)) {
+				fprintf(stderr,"%s -> %s translates wrongly with shifts\n",
+						formats[i].name,formats[j].name);
+				failed++;
+			}
+
+			if(doBench) {
+				double shifts=bench(&cl,in,shiftOut);
+				rfbShiftTranslate=FALSE;
+				rfbSetTranslateFunction(&cl);
+				printf("%-8s -> %-8s tables %7.1f Mpixel/s, shifts %7.1f Mpixel/s\n",
+						formats[i].name,formats[j].name,
+						bench(&cl,in,tableOut),shifts);
+			}
+		}
+	}
+
+	rfbReleaseTranslateTable(&cl);
+	failed+=checkSharing(screen);
+
+	free(in);
+	free(tableOut);
+	free(shiftOut);
+	free(referenceOut);
+	rfbScreenCleanup(screen);
+
+	return failed?1:0;
+}
@@ -0,0 +1,102 @@
+/*
+ * Send full screen hextile updates of noise to one client, so that they
+ * do not fit into the initial update buffer.  The buffer has to grow, but
+ * not beyond the configured maximum, the client has to end up with the
+ * right picture, and once the screen stays still the buffer has to shrink
+ * back to its initial size.
+ */
+
+#include "harness.h"
+
+#define MAX_UPDATE_BUF_SIZE (128*1024)
+/* how many updates to send */
+#define UPDATES 20
+/* the server gives the buffer back after 10 idle seconds; wait a bit longer */
+#define IDLE_TIME 13
+
+static const int width=400,height=300;
+
+/* noise does not compress, so hextile has to send every tile raw */
+static void paint(rfbScreenInfo* server)
+{
+	int j;
+
+	LOCK(frameBufferMutex);
+	for(j=0;j<width*height*4;j++)
+		server->frameBuffer[j]=rand();
+	LOCK(statisticsMutex);
+	generation++;
+	UNLOCK(statisticsMutex);
+	UNLOCK(frameBufferMutex);
+
+	rfbMarkRectAsModified(server,0,0,width,height);
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	testClient client;
+	rfbClientPtr serverClient;
+	int failed=0,i,grown,peak;
+	long t;
+
+	server=makeServer(&argc,argv,width,height);
+	server->deferUpdateTime=0;
+	server->maxUpdateBufSize=MAX_UPDATE_BUF_SIZE;
+	rfbInitServer(server);
+
+	memset(&client,0,sizeof(client));
+	client.encoding="hextile";
+	if(!connectClient(&client,server,checkPicture)) {
+		rfbErr("The client did not connect\n");
+		return 1;
+	}
+	serverClient=serverClients[0];
+
+	for(i=0;i<UPDATES;i++) {
+		paint(server);
+		if(!catchUp(server,&client,1)) {
+			rfbErr("The client did not catch up with update %d\n",i);
+			failed++;
+			break;
+		}
+	}
+	grown=serverClient->updateBufSize;
+	peak=serverClient->updateBufPeak;
+
+	/* nothing changes now, so the buffer is not needed any more */
+	t=now();
+	while(now()-t<IDLE_TIME*1000)
+		rfbProcessEvents(server,100000);
+
+	rfbLog("update buffer: %d bytes after the updates (largest update %d bytes), %d bytes when idle\n",
+			grown,peak,serverClient->updateBufSize);
+
+	if(grown<=UPDATE_BUF_SIZE) {
+		rfbErr("The update buffer did not grow\n");
+		failed++;
+	}
+	if(grown>MAX_UPDATE_BUF_SIZE) {
+		rfbErr("The update buffer grew beyond %d bytes\n",MAX_UPDATE_BUF_SIZE);
+		failed++;
+	}
+	if(peak<width*height*4) {
+		rfbErr("The largest update was only %d bytes\n",peak);
+		failed++;
+	}
+	if(serverClient->updateBufSize!=UPDATE_BUF_SIZE) {
+		rfbErr("The update buffer was not given back\n");
+		failed++;
+	}
+
+	/* and it has to work with the small buffer again */
+	paint(server);
+	if(!catchUp(server,&client,1)) {
+		rfbErr("The client did not catch up after shrinking\n");
+		failed++;
+	}
+
+	stopServer(server,&client,1);
+
+	return failed?1:0;
+}
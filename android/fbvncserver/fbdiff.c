@@ -0,0 +1,611 @@
+/*
+ * fbdiff.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Frame differencing kernels.  Each kernel walks a framebuffer row a vector
+ * block at a time (16 bytes for SSE2 and NEON, 32 bytes for AVX2) and only
+ * copies and converts the blocks that differ from the comparison copy.
+ * Unchanged blocks cost one load/compare pair and no stores.
+ *
+ * Every kernel is written once as an always inlined body taking the
+ * conversion as a constant, and instantiated for each FBDIFF_* mode, so
+ * the copy path carries no conversion code at all.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "fbdiff.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FBDIFF_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FBDIFF_NEON 1
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#define always_inline inline __attribute__((always_inline))
+
+/* Two 16bpp pixels per word: pull 5 bits of each channel down to the
+ * positions used by the RFB server format (5 bits per sample). */
+#define PIXEL_FB_TO_RFB(p,r,g,b) \
+	((p >> r) & 0x1f001f) | \
+	(((p >> g) & 0x1f001f) << 5) | \
+	(((p >> b) & 0x1f001f) << 10)
+
+/* XXX: Undo the checkered pattern to test the efficiency gain using
+ * hextile encoding. */
+#define CHECKER_A	0x18e320e4
+#define CHECKER_B	0x20e418e3
+#define CHECKER_FLAT	0x18e318e3
+
+static always_inline uint32_t convert_word(uint32_t pixel,
+		const struct fbdiff_fmt *fmt, const int convert)
+{
+	if (convert == FBDIFF_COPY)
+		return pixel;
+
+	if (pixel == CHECKER_A || pixel == CHECKER_B)
+		pixel = CHECKER_FLAT;
+
+	return PIXEL_FB_TO_RFB(pixel, fmt->r_shift, fmt->g_shift, fmt->b_shift);
+}
+
+/* Scalar tail shared by the vector kernels, and the whole row for the
+ * portable kernel. */
+static always_inline int diff_words(const uint32_t *src, uint32_t *cmp,
+		uint32_t *dst, int from, int words,
+		const struct fbdiff_fmt *fmt, int *first, int *last,
+		const int convert)
+{
+	int i, changed = 0;
+
+	for (i = from; i < words; i++) {
+		uint32_t pixel = src[i];
+
+		if (pixel == cmp[i])
+			continue;
+
+		cmp[i] = pixel;
+		dst[i] = convert_word(pixel, fmt, convert);
+
+		if (!changed && *first < 0)
+			*first = i;
+		*last = i;
+		changed = 1;
+	}
+
+	return changed;
+}
+
+/*****************************************************************************/
+
+static int scalar_supported(void)
+{
+	return 1;
+}
+
+static int scalar_diff_row(const uint32_t *src, uint32_t *cmp,
+		uint32_t *dst, int words, const struct fbdiff_fmt *fmt,
+		int *first, int *last)
+{
+	*first = *last = -1;
+
+	if (fmt->convert == FBDIFF_COPY)
+		return diff_words(src, cmp, dst, 0, words, fmt, first, last,
+		                  FBDIFF_COPY);
+	return diff_words(src, cmp, dst, 0, words, fmt, first, last,
+	                  FBDIFF_RGB555);
+}
+
+static const struct fbdiff_kernel scalar_kernel = {
+	"scalar", scalar_supported, scalar_diff_row
+};
+
+/*****************************************************************************/
+
+#ifdef FBDIFF_X86
+
+__attribute__((target("sse2")))
+static int sse2_supported(void)
+{
+#ifdef __x86_64__
+	return 1;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+__attribute__((target("sse2")))
+static always_inline __m128i sse2_convert(__m128i p, __m128i rs, __m128i gs,
+		__m128i bs, const int convert)
+{
+	const __m128i mask = _mm_set1_epi32(0x1f001f);
+	__m128i chk, r, g, b;
+
+	if (convert == FBDIFF_COPY)
+		return p;
+
+	chk = _mm_or_si128(_mm_cmpeq_epi32(p, _mm_set1_epi32(CHECKER_A)),
+	                   _mm_cmpeq_epi32(p, _mm_set1_epi32(CHECKER_B)));
+	p = _mm_or_si128(_mm_andnot_si128(chk, p),
+	                 _mm_and_si128(chk, _mm_set1_epi32(CHECKER_FLAT)));
+
+	r = _mm_and_si128(_mm_srl_epi32(p, rs), mask);
+	g = _mm_slli_epi32(_mm_and_si128(_mm_srl_epi32(p, gs), mask), 5);
+	b = _mm_slli_epi32(_mm_and_si128(_mm_srl_epi32(p, bs), mask), 10);
+
+	return _mm_or_si128(r, _mm_or_si128(g, b));
+}
+
+__attribute__((target("sse2")))
+static always_inline int sse2_diff(const uint32_t *src, uint32_t *cmp,
+		uint32_t *dst, int words, const struct fbdiff_fmt *fmt,
+		int *first, int *last, const int convert)
+{
+	const __m128i rs = _mm_cvtsi32_si128(fmt->r_shift);
+	const __m128i gs = _mm_cvtsi32_si128(fmt->g_shift);
+	const __m128i bs = _mm_cvtsi32_si128(fmt->b_shift);
+	int i, changed = 0;
+
+	*first = *last = -1;
+
+	for (i = 0; i + 4 <= words; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i c = _mm_loadu_si128((const __m128i *)(cmp + i));
+		int diff = ~_mm_movemask_ps(_mm_castsi128_ps(
+		                _mm_cmpeq_epi32(s, c))) & 0xf;
+
+		if (!diff)
+			continue;
+
+		_mm_storeu_si128((__m128i *)(cmp + i), s);
+		_mm_storeu_si128((__m128i *)(dst + i),
+		                 sse2_convert(s, rs, gs, bs, convert));
+
+		if (!changed)
+			*first = i + __builtin_ctz(diff);
+		*last = i + 31 - __builtin_clz(diff);
+		changed = 1;
+	}
+
+	return diff_words(src, cmp, dst, i, words, fmt, first, last,
+	                  convert) || changed;
+}
+
+__attribute__((target("sse2")))
+static int sse2_diff_row(const uint32_t *src, uint32_t *cmp,
+		uint32_t *dst, int words, const struct fbdiff_fmt *fmt,
+		int *first, int *last)
+{
+	if (fmt->convert == FBDIFF_COPY)
+		return sse2_diff(src, cmp, dst, words, fmt, first, last,
+		                 FBDIFF_COPY);
+	return sse2_diff(src, cmp, dst, words, fmt, first, last,
+	                 FBDIFF_RGB555);
+}
+
+static const struct fbdiff_kernel sse2_kernel = {
+	"sse2", sse2_supported, sse2_diff_row
+};
+
+static int avx2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static always_inline __m256i avx2_convert(__m256i p, __m128i rs, __m128i gs,
+		__m128i bs, const int convert)
+{
+	const __m256i mask = _mm256_set1_epi32(0x1f001f);
+	__m256i chk, r, g, b;
+
+	if (convert == FBDIFF_COPY)
+		return p;
+
+	chk = _mm256_or_si256(
+	        _mm256_cmpeq_epi32(p, _mm256_set1_epi32(CHECKER_A)),
+	        _mm256_cmpeq_epi32(p, _mm256_set1_epi32(CHECKER_B)));
+	p = _mm256_blendv_epi8(p, _mm256_set1_epi32(CHECKER_FLAT), chk);
+
+	r = _mm256_and_si256(_mm256_srl_epi32(p, rs), mask);
+	g = _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(p, gs), mask), 5);
+	b = _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(p, bs), mask), 10);
+
+	return _mm256_or_si256(r, _mm256_or_si256(g, b));
+}
+
+__attribute__((target("avx2")))
+static always_inline int avx2_diff(const uint32_t *src, uint32_t *cmp,
+		uint32_t *dst, int words, const struct fbdiff_fmt *fmt,
+		int *first, int *last, const int convert)
+{
+	const __m128i rs = _mm_cvtsi32_si128(fmt->r_shift);
+	const __m128i gs = _mm_cvtsi32_si128(fmt->g_shift);
+	const __m128i bs = _mm_cvtsi32_si128(fmt->b_shift);
+	int i, changed = 0;
+
+	*first = *last = -1;
+
+	for (i = 0; i + 8 <= words; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(cmp + i));
+		int diff = ~_mm256_movemask_ps(_mm256_castsi256_ps(
+		                _mm256_cmpeq_epi32(s, c))) & 0xff;
+
+		if (!diff)
+			continue;
+
+		_mm256_storeu_si256((__m256i *)(cmp + i), s);
+		_mm256_storeu_si256((__m256i *)(dst + i),
+		                    avx2_convert(s, rs, gs, bs, convert));
+
+		if (!changed)
+			*first = i + __builtin_ctz(diff);
+		*last = i + 31 - __builtin_clz(diff);
+		changed = 1;
+	}
+
+	return diff_words(src, cmp, dst, i, words, fmt, first, last,
+	                  convert) || changed;
+}
+
+__attribute__((target("avx2")))
+static int avx2_diff_row(const uint32_t *src, uint32_t *cmp,
+		uint32_t *dst, int words, const struct fbdiff_fmt *fmt,
+		int *first, int *last)
+{
+	if (fmt->convert == FBDIFF_COPY)
+		return avx2_diff(src, cmp, dst, words, fmt, first, last,
+		                 FBDIFF_COPY);
+	return avx2_diff(src, cmp, dst, words, fmt, first, last,
+	                 FBDIFF_RGB555);
+}
+
+static const struct fbdiff_kernel avx2_kernel = {
+	"avx2", avx2_supported, avx2_diff_row
+};
+
+#endif /* FBDIFF_X86 */
+
+/*****************************************************************************/
+
+#ifdef FBDIFF_NEON
+
+static int neon_supported(void)
+{
+#ifdef __aarch64__
+	return 1;
+#else
+	return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+}
+
+static always_inline uint32x4_t neon_convert(uint32x4_t p, int32x4_t rs,
+		int32x4_t gs, int32x4_t bs, const int convert)
+{
+	const uint32x4_t mask = vdupq_n_u32(0x1f001f);
+	uint32x4_t chk, r, g, b;
+
+	if (convert == FBDIFF_COPY)
+		return p;
+
+	chk = vorrq_u32(vceqq_u32(p, vdupq_n_u32(CHECKER_A)),
+	                vceqq_u32(p, vdupq_n_u32(CHECKER_B)));
+	p = vbslq_u32(chk, vdupq_n_u32(CHECKER_FLAT), p);
+
+	/* vshlq with a negative count shifts right */
+	r = vandq_u32(vshlq_u32(p, rs), mask);
+	g = vshlq_n_u32(vandq_u32(vshlq_u32(p, gs), mask), 5);
+	b = vshlq_n_u32(vandq_u32(vshlq_u32(p, bs), mask), 10);
+
+	return vorrq_u32(r, vorrq_u32(g, b));
+}
+
+static always_inline int neon_diff(const uint32_t *src, uint32_t *cmp,
+		uint32_t *dst, int words, const struct fbdiff_fmt *fmt,
+		int *first, int *last, const int convert)
+{
+	const int32x4_t rs = vdupq_n_s32(-fmt->r_shift);
+	const int32x4_t gs = vdupq_n_s32(-fmt->g_shift);
+	const int32x4_t bs = vdupq_n_s32(-fmt->b_shift);
+	int i, changed = 0;
+
+	*first = *last = -1;
+
+	for (i = 0; i + 4 <= words; i += 4) {
+		uint32x4_t s = vld1q_u32(src + i);
+		uint32x4_t c = vld1q_u32(cmp + i);
+		/* one 16-bit lane of all ones per differing word */
+		uint64_t diff = vget_lane_u64(vreinterpret_u64_u16(
+		                    vmovn_u32(vmvnq_u32(vceqq_u32(s, c)))), 0);
+
+		if (!diff)
+			continue;
+
+		vst1q_u32(cmp + i, s);
+		vst1q_u32(dst + i, neon_convert(s, rs, gs, bs, convert));
+
+		if (!changed)
+			*first = i + __builtin_ctzll(diff) / 16;
+		*last = i + (63 - __builtin_clzll(diff)) / 16;
+		changed = 1;
+	}
+
+	return diff_words(src, cmp, dst, i, words, fmt, first, last,
+	                  convert) || changed;
+}
+
+static int neon_diff_row(const uint32_t *src, uint32_t *cmp,
+		uint32_t *dst, int words, const struct fbdiff_fmt *fmt,
+		int *first, int *last)
+{
+	if (fmt->convert == FBDIFF_COPY)
+		return neon_diff(src, cmp, dst, words, fmt, first, last,
+		                 FBDIFF_COPY);
+	return neon_diff(src, cmp, dst, words, fmt, first, last,
+	                 FBDIFF_RGB555);
+}
+
+static const struct fbdiff_kernel neon_kernel = {
+	"neon", neon_supported, neon_diff_row
+};
+
+#endif /* FBDIFF_NEON */
+
+/*****************************************************************************/
+
+/* Four independent multiply-rotate lanes over 32-byte stripes, in the style
+ * of xxHash64, then the remaining words one or two at a time. */
+#define HASH_PRIME1	0x9e3779b185ebca87ULL
+#define HASH_PRIME2	0xc2b2ae3d27d4eb4fULL
+
+static inline uint64_t hash_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t in)
+{
+	return hash_rotl(acc + in * HASH_PRIME2, 31) * HASH_PRIME1;
+}
+
+static inline uint64_t hash_load(const uint32_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+uint64_t fbdiff_hash(const uint32_t *p, int words, uint64_t seed)
+{
+	uint64_t h;
+	int i = 0;
+
+	if (words >= 8) {
+		uint64_t a = seed + HASH_PRIME1 + HASH_PRIME2;
+		uint64_t b = seed + HASH_PRIME2;
+		uint64_t c = seed;
+		uint64_t d = seed - HASH_PRIME1;
+
+		for (; i + 8 <= words; i += 8) {
+			a = hash_round(a, hash_load(p + i));
+			b = hash_round(b, hash_load(p + i + 2));
+			c = hash_round(c, hash_load(p + i + 4));
+			d = hash_round(d, hash_load(p + i + 6));
+		}
+		h = hash_rotl(a, 1) + hash_rotl(b, 7) +
+		    hash_rotl(c, 12) + hash_rotl(d, 18);
+	} else {
+		h = seed + HASH_PRIME1;
+	}
+
+	for (; i + 2 <= words; i += 2)
+		h = hash_round(h, hash_load(p + i));
+	if (i < words)
+		h = hash_round(h, p[i]);
+
+	h ^= (uint64_t)words;
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	return h;
+}
+
+void fbdiff_convert(const uint32_t *src, uint32_t *dst, int words,
+		const struct fbdiff_fmt *fmt)
+{
+	int i;
+
+	if (fmt->convert == FBDIFF_COPY) {
+		memcpy(dst, src, words * sizeof(*src));
+		return;
+	}
+
+	for (i = 0; i < words; i++)
+		dst[i] = convert_word(src[i], fmt, FBDIFF_RGB555);
+}
+
+/*****************************************************************************/
+
+/* The 1 to 3 bytes ending a row, at the start of a zeroed word, so they
+ * are hashed and converted like a word of their own. */
+static uint32_t load_tail(const unsigned char *p, int bytes)
+{
+	uint32_t w = 0;
+
+	memcpy(&w, p, bytes);
+	return w;
+}
+
+static uint64_t hash_segment(const unsigned char *p, int bytes,
+		uint64_t seed)
+{
+	int words = bytes / 4;
+	uint64_t h = fbdiff_hash((const uint32_t *)p, words, seed);
+
+	if (bytes % 4) {
+		uint32_t w = load_tail(p + words * 4, bytes % 4);
+
+		h = fbdiff_hash(&w, 1, h);
+	}
+	return h;
+}
+
+static void convert_segment(const unsigned char *src, unsigned char *dst,
+		int bytes, const struct fbdiff_fmt *fmt)
+{
+	int words = bytes / 4;
+
+	fbdiff_convert((const uint32_t *)src, (uint32_t *)dst, words, fmt);
+	if (bytes % 4) {
+		uint32_t w = load_tail(src + words * 4, bytes % 4);
+
+		w = convert_word(w, fmt, fmt->convert);
+		memcpy(dst + words * 4, &w, bytes % 4);
+	}
+}
+
+void fbdiff_diff_rows(const struct fbdiff_kernel *kernel,
+		const struct fbdiff_frame *f, int y, int y2)
+{
+	const unsigned char *s = f->src + (size_t)y * f->src_stride;
+	unsigned char *c = f->cmp + (size_t)y * f->dst_stride;
+	unsigned char *d = f->dst + (size_t)y * f->dst_stride;
+	int x, first, last;
+
+	for (; y < y2; y++) {
+		unsigned char *map = f->map + (y / f->tile_rows) * f->tiles_x;
+
+		for (x = 0; x < f->row_bytes; x += f->seg_bytes) {
+			int n = f->row_bytes - x < f->seg_bytes ?
+			        f->row_bytes - x : f->seg_bytes;
+			int tail = n % 4, end = x + n - tail;
+
+			if (kernel->diff_row((const uint32_t *)(s + x),
+			                     (uint32_t *)(c + x),
+			                     (uint32_t *)(d + x), n / 4,
+			                     f->fmt, &first, &last))
+				map[x / f->seg_bytes] = 1;
+
+			if (tail && memcmp(s + end, c + end, tail)) {
+				memcpy(c + end, s + end, tail);
+				convert_segment(s + end, d + end, tail, f->fmt);
+				map[x / f->seg_bytes] = 1;
+			}
+		}
+
+		s += f->src_stride;
+		c += f->dst_stride;
+		d += f->dst_stride;
+	}
+}
+
+void fbdiff_hash_rows(const struct fbdiff_frame *f, uint64_t *acc,
+		uint64_t *tile_hash, int y, int y2)
+{
+	const unsigned char *s = f->src + (size_t)y * f->src_stride;
+	int x, tx;
+
+	for (; y < y2; y++, s += f->src_stride) {
+		if (y % f->tile_rows == 0)
+			memset(acc, 0, f->tiles_x * sizeof(*acc));
+
+		for (x = 0, tx = 0; x < f->row_bytes; x += f->seg_bytes, tx++) {
+			int n = f->row_bytes - x < f->seg_bytes ?
+			        f->row_bytes - x : f->seg_bytes;
+
+			acc[tx] = hash_segment(s + x, n, acc[tx]);
+		}
+
+		if ((y + 1) % f->tile_rows == 0 || y + 1 == y2) {
+			size_t row = (size_t)(y / f->tile_rows) * f->tiles_x;
+
+			for (tx = 0; tx < f->tiles_x; tx++) {
+				if (tile_hash[row + tx] != acc[tx]) {
+					tile_hash[row + tx] = acc[tx];
+					f->map[row + tx] = 1;
+				}
+			}
+		}
+	}
+}
+
+void fbdiff_hash_diff_rows(const struct fbdiff_frame *f, uint64_t *seg_hash,
+		int y, int y2)
+{
+	const unsigned char *s = f->src + (size_t)y * f->src_stride;
+	unsigned char *d = f->dst + (size_t)y * f->dst_stride;
+	uint64_t *h = seg_hash + (size_t)y * f->tiles_x;
+	int x, tx;
+
+	for (; y < y2; y++) {
+		unsigned char *map = f->map + (y / f->tile_rows) * f->tiles_x;
+
+		for (x = 0, tx = 0; x < f->row_bytes; x += f->seg_bytes, tx++) {
+			int n = f->row_bytes - x < f->seg_bytes ?
+			        f->row_bytes - x : f->seg_bytes;
+			uint64_t v = hash_segment(s + x, n, 0);
+
+			if (h[tx] != v) {
+				h[tx] = v;
+				convert_segment(s + x, d + x, n, f->fmt);
+				map[tx] = 1;
+			}
+		}
+
+		s += f->src_stride;
+		d += f->dst_stride;
+		h += f->tiles_x;
+	}
+}
+
+/*****************************************************************************/
+
+const struct fbdiff_kernel *const fbdiff_kernels[] = {
+#ifdef FBDIFF_X86
+	&avx2_kernel,
+	&sse2_kernel,
+#endif
+#ifdef FBDIFF_NEON
+	&neon_kernel,
+#endif
+	&scalar_kernel,
+	NULL
+};
+
+const struct fbdiff_kernel *fbdiff_select(const char *name)
+{
+	const struct fbdiff_kernel *const *k;
+
+	for (k = fbdiff_kernels; *k; k++) {
+		if (name && strcmp(name, (*k)->name))
+			continue;
+		if ((*k)->supported())
+			return *k;
+		if (name)
+			break;
+	}
+
+	return NULL;
+}
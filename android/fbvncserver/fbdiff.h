@@ -0,0 +1,107 @@
+/*
+ * fbdiff.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Frame differencing kernels used by fbvncserver to find the parts of the
+ * framebuffer that changed since the last pass.
+ */
+
+#ifndef FBDIFF_H
+#define FBDIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* How changed words are written to the remote framebuffer. */
+#define FBDIFF_COPY	0	/* server format is the framebuffer format */
+#define FBDIFF_RGB555	1	/* 16bpp pairs to 5 bits per sample, see
+				 * PIXEL_FB_TO_RFB in fbdiff.c */
+
+struct fbdiff_fmt {
+	int convert;
+	int r_shift;		/* RGB555 only */
+	int g_shift;
+	int b_shift;
+};
+
+/*
+ * Compare 'words' 32-bit words of the live framebuffer 'src' with the
+ * comparison copy 'cmp'.  Every block that differs is copied to 'cmp' and
+ * converted into 'dst'.  Returns non-zero if anything changed, in which case
+ * *first and *last hold the indices of the first and last changed word.
+ */
+typedef int (*fbdiff_row_fn)(const uint32_t *src, uint32_t *cmp,
+		uint32_t *dst, int words, const struct fbdiff_fmt *fmt,
+		int *first, int *last);
+
+struct fbdiff_kernel {
+	const char *name;
+	int (*supported)(void);
+	fbdiff_row_fn diff_row;
+};
+
+/* Fast 64-bit hash of 'words' words.  The result of one call can be passed
+ * as 'seed' to the next, so the rows of a tile hash into one value. */
+uint64_t fbdiff_hash(const uint32_t *p, int words, uint64_t seed);
+
+/* Convert 'words' words from 'src' into 'dst' without comparing. */
+void fbdiff_convert(const uint32_t *src, uint32_t *dst, int words,
+		const struct fbdiff_fmt *fmt);
+
+/*
+ * A framebuffer pass.  Rows of 'row_bytes' bytes are read from the live
+ * framebuffer 'src'; the comparison copy 'cmp' and the remote framebuffer
+ * 'dst' share one layout.  Strides are in bytes and must be multiples of 4,
+ * but row_bytes need not be: the partial word that ends a row at 16bpp
+ * with an odd width, or at 24bpp, is compared and converted on its own.
+ * Each row is split into segments of 'seg_bytes' bytes, a multiple of 4,
+ * one per tile column; 'map' has one byte per tile of 'tile_rows' rows,
+ * 'tiles_x' per tile row, and is set for every tile found changed.
+ */
+struct fbdiff_frame {
+	const unsigned char *src;
+	size_t src_stride;
+	unsigned char *cmp;
+	unsigned char *dst;
+	size_t dst_stride;
+	int row_bytes;
+	int seg_bytes;
+	int tile_rows;
+	int tiles_x;
+	unsigned char *map;
+	const struct fbdiff_fmt *fmt;
+};
+
+/* Compare rows [y, y2) with the comparison copy, copying and converting
+ * the blocks that changed. */
+void fbdiff_diff_rows(const struct fbdiff_kernel *kernel,
+		const struct fbdiff_frame *f, int y, int y2);
+
+/* Hash the tiles of rows [y, y2), where y starts a tile row, building
+ * them in 'acc' (tiles_x entries), and compare each with 'tile_hash'
+ * (one per tile, laid out like the map). */
+void fbdiff_hash_rows(const struct fbdiff_frame *f, uint64_t *acc,
+		uint64_t *tile_hash, int y, int y2);
+
+/* Hash each segment of rows [y, y2) and compare it with 'seg_hash'
+ * (tiles_x per row); only segments whose hash changed are converted. */
+void fbdiff_hash_diff_rows(const struct fbdiff_frame *f, uint64_t *seg_hash,
+		int y, int y2);
+
+/* Kernels built for this target, best first, NULL terminated. */
+extern const struct fbdiff_kernel *const fbdiff_kernels[];
+
+/* Returns the kernel called 'name', or the best one the CPU supports when
+ * 'name' is NULL.  Returns NULL if the requested kernel is unavailable. */
+const struct fbdiff_kernel *fbdiff_select(const char *name);
+
+#endif /* FBDIFF_H */
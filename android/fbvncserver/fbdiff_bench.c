@@ -0,0 +1,256 @@
+/*
+ * fbdiff_bench.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Microbenchmark for the frame differencing kernels.  Two synthetic 16bpp
+ * frames differing in a controlled fraction of 16-byte blocks are fed to
+ * each kernel alternately, so every pass sees the same change density.
+ * Each kernel runs in both conversion modes, and its output is checked
+ * against the scalar kernel.  The "hash" rows time the fbvncserver -H
+ * method, which keeps a hash per 32-pixel row segment instead of a copy.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fbdiff.h"
+
+#define APPNAME "fbdiff_bench"
+
+#define SEG_WORDS 16	/* 32 pixels at 16bpp, TILE_SIZE in fbvncserver */
+
+/* 16bpp RGB565 served natively, or converted to RGB555 */
+static const struct fbdiff_fmt fmts[] = {
+	{ FBDIFF_COPY, 0, 0, 0 },
+	{ FBDIFF_RGB555, 11, 6, 0 },
+};
+static const char *const fmt_names[] = { "copy", "rgb555" };
+
+static const double densities[] = { 0.0, 0.001, 0.01, 0.1, 0.5, 1.0 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t *alloc_words(size_t words)
+{
+	uint32_t *p = calloc(words, sizeof(uint32_t));
+
+	if (p == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/* Build frame 'b' from 'a' with about 'density' of the 4-word blocks
+ * changed. */
+static void make_frames(uint32_t *a, uint32_t *b, size_t words,
+		double density)
+{
+	size_t i;
+
+	for (i = 0; i < words; i++)
+		a[i] = (uint32_t)rand() * 2654435761u;
+
+	memcpy(b, a, words * sizeof(uint32_t));
+
+	for (i = 0; i + 4 <= words; i += 4) {
+		if ((double)rand() / RAND_MAX < density)
+			b[i + rand() % 4] ^= 0x08210821;
+	}
+}
+
+/* Run 'kernel' over the whole frame; returns the number of changed rows. */
+static int run_frame(const struct fbdiff_kernel *kernel,
+		const struct fbdiff_fmt *fmt, const uint32_t *src,
+		uint32_t *cmp, uint32_t *dst, int width, int height)
+{
+	int words = width / 2;
+	int y, first, last, rows = 0;
+
+	for (y = 0; y < height; y++) {
+		rows += kernel->diff_row(src, cmp, dst, words, fmt,
+		                         &first, &last);
+		src += words, cmp += words, dst += words;
+	}
+	return rows;
+}
+
+/* Hash every row segment and convert the ones whose hash changed, as
+ * fbvncserver -H does; returns the number of changed segments. */
+static int run_hash_frame(const struct fbdiff_fmt *fmt, const uint32_t *src,
+		uint64_t *hash, uint32_t *dst, int width, int height)
+{
+	int words = width / 2;
+	int x, y, segs = 0;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < words; x += SEG_WORDS) {
+			int n = words - x < SEG_WORDS ? words - x : SEG_WORDS;
+			uint64_t v = fbdiff_hash(src + x, n, 0);
+
+			if (*hash != v) {
+				*hash = v;
+				fbdiff_convert(src + x, dst + x, n, fmt);
+				segs++;
+			}
+			hash++;
+		}
+		src += words, dst += words;
+	}
+	return segs;
+}
+
+static int verify(const struct fbdiff_kernel *kernel,
+		const struct fbdiff_fmt *fmt, const uint32_t *a,
+		const uint32_t *b, int width, int height)
+{
+	const struct fbdiff_kernel *ref = fbdiff_select("scalar");
+	size_t words = (size_t)width / 2 * height;
+	uint32_t *c1 = alloc_words(words), *d1 = alloc_words(words);
+	uint32_t *c2 = alloc_words(words), *d2 = alloc_words(words);
+	int y, ok = 1;
+
+	run_frame(ref, fmt, a, c1, d1, width, height);
+	run_frame(kernel, fmt, a, c2, d2, width, height);
+
+	/* row ranges must match exactly, not just the pixels */
+	for (y = 0; y < height && ok; y++) {
+		int f1, l1, f2, l2, r1, r2;
+		size_t off = (size_t)y * (width / 2);
+
+		r1 = ref->diff_row(b + off, c1 + off, d1 + off, width / 2,
+		                   fmt, &f1, &l1);
+		r2 = kernel->diff_row(b + off, c2 + off, d2 + off, width / 2,
+		                      fmt, &f2, &l2);
+		if (r1 != r2 || (r1 && (f1 != f2 || l1 != l2)))
+			ok = 0;
+	}
+
+	if (ok && (memcmp(c1, c2, words * 4) || memcmp(d1, d2, words * 4)))
+		ok = 0;
+
+	free(c1), free(d1), free(c2), free(d2);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int width = argc > 1 ? atoi(argv[1]) : 1080;
+	int height = argc > 2 ? atoi(argv[2]) : 1920;
+	int frames = argc > 3 ? atoi(argv[3]) : 100;
+	size_t words;
+	unsigned int d, m;
+	const struct fbdiff_kernel *const *k;
+
+	if (width <= 0 || height <= 0 || frames <= 0 || (width & 1)) {
+		printf("%s [width] [height] [frames]\n", APPNAME);
+		return EXIT_FAILURE;
+	}
+
+	words = (size_t)width / 2 * height;
+	printf("%dx%d 16bpp, %d frames per run\n", width, height, frames);
+	printf("%-8s %-8s %8s %12s %10s\n", "kernel", "mode", "density",
+	       "ms/frame", "MB/s");
+
+	for (d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+		uint32_t *a = alloc_words(words), *b = alloc_words(words);
+
+		srand(d + 1);
+		make_frames(a, b, words, densities[d]);
+
+		for (k = fbdiff_kernels; *k; k++) {
+			if (!(*k)->supported())
+				continue;
+
+			for (m = 0; m < sizeof(fmts) / sizeof(fmts[0]); m++) {
+				uint32_t *cmp, *dst;
+				double t;
+				int i;
+
+				if (!verify(*k, &fmts[m], a, b, width, height)) {
+					printf("%s/%s: output differs from scalar\n",
+					       (*k)->name, fmt_names[m]);
+					return EXIT_FAILURE;
+				}
+
+				cmp = alloc_words(words);
+				dst = alloc_words(words);
+				run_frame(*k, &fmts[m], a, cmp, dst, width, height);
+
+				t = now();
+				for (i = 0; i < frames; i++)
+					run_frame(*k, &fmts[m], (i & 1) ? a : b,
+					          cmp, dst, width, height);
+				t = now() - t;
+
+				printf("%-8s %-8s %7.1f%% %12.3f %10.0f\n",
+				       (*k)->name, fmt_names[m],
+				       densities[d] * 100, t * 1e3 / frames,
+				       words * 4.0 * frames / t / 1e6);
+
+				free(cmp), free(dst);
+			}
+		}
+
+		for (m = 0; m < sizeof(fmts) / sizeof(fmts[0]); m++) {
+			int segs = (width / 2 + SEG_WORDS - 1) / SEG_WORDS * height;
+			const struct fbdiff_kernel *ref = fbdiff_select("scalar");
+			uint64_t *hash = calloc(segs, sizeof(uint64_t));
+			uint32_t *cmp = alloc_words(words);
+			uint32_t *dst = alloc_words(words);
+			uint32_t *ref_dst = alloc_words(words);
+			double t;
+			int i;
+
+			if (hash == NULL) {
+				perror("calloc");
+				return EXIT_FAILURE;
+			}
+
+			/* a hash collision would leave dst stale */
+			run_frame(ref, &fmts[m], a, cmp, ref_dst, width, height);
+			run_frame(ref, &fmts[m], b, cmp, ref_dst, width, height);
+			run_hash_frame(&fmts[m], a, hash, dst, width, height);
+			run_hash_frame(&fmts[m], b, hash, dst, width, height);
+			if (memcmp(dst, ref_dst, words * 4)) {
+				printf("hash/%s: output differs from scalar\n",
+				       fmt_names[m]);
+				return EXIT_FAILURE;
+			}
+
+			t = now();
+			for (i = 0; i < frames; i++)
+				run_hash_frame(&fmts[m], (i & 1) ? b : a,
+				               hash, dst, width, height);
+			t = now() - t;
+
+			printf("%-8s %-8s %7.1f%% %12.3f %10.0f\n",
+			       "hash", fmt_names[m],
+			       densities[d] * 100, t * 1e3 / frames,
+			       words * 4.0 * frames / t / 1e6);
+
+			free(hash), free(cmp), free(dst), free(ref_dst);
+		}
+
+		free(a), free(b);
+	}
+
+	return EXIT_SUCCESS;
+}
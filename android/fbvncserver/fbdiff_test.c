@@ -0,0 +1,193 @@
+/*
+ * fbdiff_test.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Checks the framebuffer passes of fbvncserver on screens whose rows are
+ * not whole words: 16bpp with an odd width and 24bpp at 1366 pixels, next
+ * to the usual widths.  Random pixels of a random frame are changed, the
+ * last pixel of a row among them, and every pass has to bring the served
+ * buffer up to date and mark exactly the tiles that changed.  Padding at
+ * the end of the framebuffer lines changes too and must be ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fbdiff.h"
+
+#define APPNAME "fbdiff_test"
+
+#define TILE_SIZE 32	/* as in fbvncserver */
+#define CHANGES 200
+
+static const struct {
+	int width, height, bytespp;
+	int line_pad;		/* framebuffer line padding, bytes */
+	struct fbdiff_fmt fmt;
+} screens[] = {
+	{ 333, 70, 2, 2, { FBDIFF_COPY, 0, 0, 0 } },
+	{ 333, 70, 2, 26, { FBDIFF_RGB555, 11, 6, 0 } },
+	{ 320, 70, 2, 0, { FBDIFF_RGB555, 11, 6, 0 } },
+	{ 1366, 40, 3, 2, { FBDIFF_COPY, 0, 0, 0 } },
+	{ 1365, 40, 3, 1, { FBDIFF_COPY, 0, 0, 0 } },
+	{ 100, 40, 4, 0, { FBDIFF_COPY, 0, 0, 0 } },
+};
+
+#define DIFF	0	/* compare copy */
+#define HASH	1	/* fbvncserver -H */
+#define TILES	2	/* fbvncserver -z, no served buffer */
+
+static const char *const method_names[] = { "diff", "hash", "tiles" };
+
+static void *alloc(size_t size)
+{
+	void *p = calloc(size, 1);
+
+	if (p == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/* What the served buffer should hold for framebuffer row 'src'. */
+static void reference(const unsigned char *src, unsigned char *dst,
+		int width, int bytespp, const struct fbdiff_fmt *fmt)
+{
+	int x;
+
+	if (fmt->convert == FBDIFF_COPY) {
+		memcpy(dst, src, width * bytespp);
+		return;
+	}
+
+	for (x = 0; x < width; x++) {
+		uint16_t p, o;
+
+		memcpy(&p, src + x * 2, 2);
+		o = ((p >> fmt->r_shift) & 0x1f) |
+		    ((p >> fmt->g_shift) & 0x1f) << 5 |
+		    ((p >> fmt->b_shift) & 0x1f) << 10;
+		memcpy(dst + x * 2, &o, 2);
+	}
+}
+
+/* Run one pass over the frame in two bands, as fbvncserver would. */
+static void pass(const struct fbdiff_kernel *kernel, struct fbdiff_frame *f,
+		int method, uint64_t *acc, uint64_t *hashes, int height)
+{
+	int band = height > TILE_SIZE ? TILE_SIZE : height;
+
+	if (method == TILES) {
+		fbdiff_hash_rows(f, acc, hashes, 0, band);
+		fbdiff_hash_rows(f, acc, hashes, band, height);
+	} else if (method == HASH) {
+		fbdiff_hash_diff_rows(f, hashes, 0, band);
+		fbdiff_hash_diff_rows(f, hashes, band, height);
+	} else {
+		fbdiff_diff_rows(kernel, f, 0, band);
+		fbdiff_diff_rows(kernel, f, band, height);
+	}
+}
+
+static int check(const struct fbdiff_kernel *kernel, int s, int method)
+{
+	int width = screens[s].width, height = screens[s].height;
+	int bytespp = screens[s].bytespp;
+	int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+	struct fbdiff_frame f;
+	unsigned char *src, *expect, *changed;
+	uint64_t *acc, *hashes;
+	int i, x, y, failed = 0;
+
+	memset(&f, 0, sizeof(f));
+	f.row_bytes = width * bytespp;
+	f.src_stride = f.row_bytes + screens[s].line_pad;
+	f.dst_stride = (f.row_bytes + 3) & ~3;
+	f.seg_bytes = TILE_SIZE * bytespp;
+	f.tile_rows = TILE_SIZE;
+	f.tiles_x = tiles_x;
+	f.fmt = &screens[s].fmt;
+
+	src = alloc(f.src_stride * height);
+	f.src = src;
+	f.cmp = alloc(f.dst_stride * height);
+	f.dst = alloc(f.dst_stride * height);
+	f.map = alloc(tiles_x * tiles_y);
+	expect = alloc(f.dst_stride * height);
+	changed = alloc(tiles_x * tiles_y);
+	acc = alloc(tiles_x * sizeof(*acc));
+	hashes = alloc((size_t)tiles_x * (method == HASH ? height : tiles_y) *
+	               sizeof(*hashes));
+
+	for (i = 0; i < (int)f.src_stride * height; i++)
+		src[i] = rand();
+	pass(kernel, &f, method, acc, hashes, height);
+
+	memset(f.map, 0, tiles_x * tiles_y);
+	for (i = 0; i < CHANGES; i++) {
+		x = i % 10 == 0 ? width - 1 : rand() % width;
+		y = rand() % height;
+		src[y * f.src_stride + x * bytespp + rand() % bytespp] ^= 1 + rand() % 255;
+		changed[(y / TILE_SIZE) * tiles_x + x / TILE_SIZE] = 1;
+	}
+	for (y = 0; y < height; y++)
+		for (i = f.row_bytes; i < (int)f.src_stride; i++)
+			src[y * f.src_stride + i] ^= 0xff;
+	pass(kernel, &f, method, acc, hashes, height);
+
+	if (memcmp(f.map, changed, tiles_x * tiles_y)) {
+		printf("%s/%s %dx%d %dbpp: wrong tiles marked\n",
+		       kernel->name, method_names[method], width, height,
+		       bytespp * 8);
+		failed++;
+	}
+
+	if (method != TILES) {
+		for (y = 0; y < height; y++)
+			reference(src + y * f.src_stride,
+			          expect + y * f.dst_stride, width, bytespp,
+			          f.fmt);
+		if (memcmp(f.dst, expect, f.dst_stride * height)) {
+			printf("%s/%s %dx%d %dbpp: served buffer differs\n",
+			       kernel->name, method_names[method], width,
+			       height, bytespp * 8);
+			failed++;
+		}
+	}
+
+	free(src), free(f.cmp), free(f.dst), free(f.map);
+	free(expect), free(changed), free(acc), free(hashes);
+	return failed;
+}
+
+int main(void)
+{
+	const struct fbdiff_kernel *const *k;
+	int s, failed = 0;
+
+	for (s = 0; s < (int)(sizeof(screens) / sizeof(screens[0])); s++) {
+		for (k = fbdiff_kernels; *k; k++)
+			if ((*k)->supported())
+				failed += check(*k, s, DIFF);
+		failed += check(fbdiff_select(NULL), s, HASH);
+		if (screens[s].fmt.convert == FBDIFF_COPY)
+			failed += check(fbdiff_select(NULL), s, TILES);
+	}
+
+	if (failed)
+		return EXIT_FAILURE;
+	printf("%s: all passes correct\n", APPNAME);
+	return EXIT_SUCCESS;
+}
@@ -45,10 +45,15 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 /* libvncserver */
 #include "rfb/rfb.h"
 #include "rfb/keysym.h"
+#include "rfb/rfbregion.h"
+
+#include "fbdiff.h"
 
 #define APPNAME "fbvncserver"
 
@@ -66,10 +71,12 @@ static char KBD_DEVICE[PATH_MAX] = "/dev/input/event2";
 static char TOUCH_DEVICE[PATH_MAX] = "/dev/input/event1";
 
 static struct fb_var_screeninfo scrinfo;
+static struct fb_fix_screeninfo fixinfo;
 static int fbfd = -1;
 static int kbdfd = -1;
 static int touchfd = -1;
 static unsigned short int *fbmmap = MAP_FAILED;
+static size_t fbmmap_size;
 static unsigned short int *vncbuf;
 static unsigned short int *fbbuf;
 
@@ -79,28 +86,167 @@ static rfbScreenInfoPtr vncscr;
 static int xmin, xmax;
 static int ymin, ymax;
 
+/* Injected input is queued per device and written with a single write()
+ * per gesture.  The events of one SYN_REPORT frame share a timestamp. */
+#define INPUT_QUEUE_LEN 64
+
+struct input_queue {
+	int fd;
+	int count;
+	int in_frame;                /* events queued since the last SYN */
+	struct timeval time;         /* timestamp of the open frame */
+	struct input_event ev[INPUT_QUEUE_LEN];
+};
+
+static struct input_queue kbd_queue = { -1 };
+static struct input_queue touch_queue = { -1 };
+
+/* Button 1 drives a single contact: pressing it starts a touch, motion
+ * while it is held moves the contact, releasing it lifts the contact.
+ * Motion is sent at most touch_hz times a second; positions arriving in
+ * between are coalesced into the latest one.  The contact belongs to the
+ * client which pressed, other clients cannot move or lift it. */
+static struct pointer_state {
+	int down;
+	rfbClientPtr owner;          /* client holding the contact */
+	int x, y;                    /* last position sent, device units */
+	int pend_x, pend_y;          /* latest position not sent yet */
+	int pending;
+	int tracking_id;
+	long long next_motion;       /* usec */
+} ptr;
+
+static int touch_mt;                 /* device speaks MT protocol type B */
+static int touch_hz = 60;
+
+/* Define INPUT_DEBUG to log every injected event. */
+#ifdef INPUT_DEBUG
+#define input_log(...) printf(__VA_ARGS__)
+#else
+#define input_log(...) do { } while (0)
+#endif
+
 /* part of the frame differerencing algorithm. */
 static struct varblock_t {
-	int min_i;
-	int min_j;
-	int max_i;
-	int max_j;
-	int r_offset;
-	int g_offset;
-	int b_offset;
+	struct fbdiff_fmt fmt;
 	int rfb_xres;
 	int rfb_maxy;
 } varblock;
 
+static const struct fbdiff_kernel *diff_kernel;
+
+/* Framebuffer layouts served natively: the server pixel format is set to
+ * the framebuffer's own, so changed pixels are copied without conversion
+ * and clients asking for the same format get rfbTranslateNone.  16bpp
+ * names list channels from the top bit down, wider ones in byte order. */
+static const struct fb_layout {
+	const char *name;
+	int bpp;
+	int transp;                  /* alpha bits, 0 if unused */
+	int r_off, r_len;
+	int g_off, g_len;
+	int b_off, b_len;
+} fb_layouts[] = {
+	{ "RGB565",   16, 0, 11, 5,  5, 6,  0, 5 },
+	{ "BGR565",   16, 0,  0, 5,  5, 6, 11, 5 },
+	{ "RGB888",   24, 0,  0, 8,  8, 8, 16, 8 },
+	{ "BGR888",   24, 0, 16, 8,  8, 8,  0, 8 },
+	{ "RGBA8888", 32, 8,  0, 8,  8, 8, 16, 8 },
+	{ "BGRA8888", 32, 8, 16, 8,  8, 8,  0, 8 },
+	{ "RGBX8888", 32, 0,  0, 8,  8, 8, 16, 8 },
+	{ "BGRX8888", 32, 0, 16, 8,  8, 8,  0, 8 },
+	{ NULL }
+};
+static int fb_bytespp;               /* bytes per framebuffer pixel */
+
+/* The buffers of a comparison pass.  Rows of the served buffers are
+ * padded to whole words, which 24bpp rows and 16bpp rows of an odd width
+ * are not. */
+static struct fbdiff_frame frame;
+
+/* Where the remote framebuffer lives.  Converted formats keep a compare
+ * copy plus the converted buffer.  Native formats serve the compare copy
+ * itself, or with -z the framebuffer mapping, diffed through one hash per
+ * tile instead of a copy.  With -H the compare copy is replaced by one
+ * hash per tile-wide row segment, so each pass reads the framebuffer once
+ * instead of reading it and the copy. */
+#define CAPTURE_CONVERT		0
+#define CAPTURE_SNAPSHOT	1
+#define CAPTURE_MMAP		2
+#define CAPTURE_HASH		3
+
+static int capture_mode;
+static int zero_copy;
+static int hash_capture;
+static uint64_t *tile_hash;          /* CAPTURE_MMAP: per tile */
+static uint64_t *seg_hash;           /* CAPTURE_HASH: per row segment */
+
+/* The page currently on display within the (virtual) framebuffer.  Double
+ * buffered drivers flip pages by moving yoffset, so this is looked up again
+ * before every comparison pass. */
+static const uint32_t *fbpage;
+static int fb_vsync = 1;             /* FBIO_WAITFORVSYNC works */
+
+/* Changes are tracked per TILE_SIZE x TILE_SIZE tile, one byte per tile. */
+#define TILE_SIZE 32
+
+static unsigned char *tile_map;
+static int tiles_x, tiles_y;
+
+/* The comparison pass is split into horizontal bands of whole tile rows,
+ * scanned in parallel by a pool of worker threads and the main thread. */
+#define BAND_MIN_PIXELS (64 * 1024)
+
+struct band {
+	int ty1, ty2;                /* tile rows [ty1, ty2) */
+	sraRegionPtr region;         /* dirty tiles found in the last pass */
+	uint64_t *acc;               /* tile hashes being built (mmap mode) */
+};
+
+static struct band *bands;
+static int nbands;                   /* 0: one band per CPU */
+static pthread_mutex_t band_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t band_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t band_done = PTHREAD_COND_INITIALIZER;
+static int band_gen, band_next, band_pending;
+
+/* Scroll detection.  Every tile-wide row segment and tile-high column
+ * segment of the served picture is hashed when its tile changes.  Matching
+ * the hashes of a dirty area against those of the previous frame finds
+ * content that moved, which is then sent as a CopyRect instead of being
+ * encoded again. */
+#define SCROLL_MIN_VOTES	8	/* matching lines needed to take a shift */
+#define SCROLL_MIN_RUN		4	/* shortest run of segments to copy */
+
+static int scroll_detect = 1;
+static uint64_t *row_hash, *row_prev;	/* [y * tiles_x + tx] */
+static uint64_t *col_hash, *col_prev;	/* [ty * xres + x] */
+static uint64_t *line_old, *line_new;	/* one hash per row or column */
+static int *line_table;			/* line_old lookup, -1: empty */
+static int line_table_mask;
+static int *shift_votes;		/* indexed by shift + lines */
+
+/* Capture scheduling: the screen is scanned at up to capture_fps while it
+ * keeps changing, and the interval doubles up to idle_ms while it is
+ * static.  Nothing is scanned unless a client has an update request
+ * outstanding. */
+static int capture_fps = 30;
+static int idle_ms = 500;
+static long long capture_interval;   /* usec */
+static long long next_capture;       /* usec, monotonic */
+
 /* event handler callback */
 static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl);
 static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl);
+static enum rfbNewClientAction newclient(rfbClientPtr cl);
+
+static void init_bands(void);
+static void init_scroll(void);
+static void capture_kick(void);
+static long long now_usec(void);
 
 static void init_fb(void)
 {
-	size_t pixels;
-	size_t bytespp;
-
 	if ((fbfd = open(FB_DEVICE, O_RDONLY)) == -1) {
 		perror("open");
 		exit(EXIT_FAILURE);
@@ -111,19 +257,30 @@ static void init_fb(void)
 		exit(EXIT_FAILURE);
 	}
 
-	pixels = scrinfo.xres * scrinfo.yres;
-	bytespp = scrinfo.bits_per_pixel / 8;
+	if (ioctl(fbfd, FBIOGET_FSCREENINFO, &fixinfo) != 0) {
+		perror("ioctl");
+		exit(EXIT_FAILURE);
+	}
 
 	fprintf(stderr, "xres=%d, yres=%d, "
 			"xresv=%d, yresv=%d, "
 			"xoffs=%d, yoffs=%d, "
-			"bpp=%d\n", 
+			"bpp=%d, line=%d\n", 
 	  (int)scrinfo.xres, (int)scrinfo.yres,
 	  (int)scrinfo.xres_virtual, (int)scrinfo.yres_virtual,
 	  (int)scrinfo.xoffset, (int)scrinfo.yoffset,
-	  (int)scrinfo.bits_per_pixel);
+	  (int)scrinfo.bits_per_pixel, (int)fixinfo.line_length);
 
-	fbmmap = mmap(NULL, pixels * bytespp, PROT_READ, MAP_SHARED, fbfd, 0);
+	if (fixinfo.line_length == 0)
+		fixinfo.line_length = scrinfo.xres_virtual *
+		                      scrinfo.bits_per_pixel / 8;
+
+	/* Map every page, not just the first one. */
+	fbmmap_size = (size_t)fixinfo.line_length * scrinfo.yres_virtual;
+	if (fixinfo.smem_len && fixinfo.smem_len < fbmmap_size)
+		fbmmap_size = fixinfo.smem_len;
+
+	fbmmap = mmap(NULL, fbmmap_size, PROT_READ, MAP_SHARED, fbfd, 0);
 
 	if (fbmmap == MAP_FAILED) {
 		perror("mmap");
@@ -131,6 +288,36 @@ static void init_fb(void)
 	}
 }
 
+/* Wait for the next vertical blank where the driver supports it, then
+ * locate the page being displayed.  The other page may be mid-draw. */
+static void select_page(void)
+{
+	struct fb_var_screeninfo var;
+	size_t offset;
+
+#ifdef FBIO_WAITFORVSYNC
+	if (fb_vsync) {
+		uint32_t crtc = 0;
+
+		if (ioctl(fbfd, FBIO_WAITFORVSYNC, &crtc) != 0)
+			fb_vsync = 0;
+	}
+#endif
+
+	if (fbfd != -1 && ioctl(fbfd, FBIOGET_VSCREENINFO, &var) == 0 &&
+	    (size_t)(var.yoffset + scrinfo.yres) * fixinfo.line_length
+	    <= fbmmap_size &&
+	    var.xoffset + scrinfo.xres <= scrinfo.xres_virtual) {
+		scrinfo.xoffset = var.xoffset;
+		scrinfo.yoffset = var.yoffset;
+	}
+
+	offset = (size_t)scrinfo.yoffset * fixinfo.line_length +
+	         scrinfo.xoffset * scrinfo.bits_per_pixel / 8;
+	fbpage = (const uint32_t *)((const char *)fbmmap + offset);
+	frame.src = (const unsigned char *)fbpage;
+}
+
 static void cleanup_fb(void)
 {
 	if(fbfd != -1)
@@ -146,6 +333,7 @@ static void init_kbd()
 		printf("cannot open kbd device %s\n", KBD_DEVICE);
 		exit(EXIT_FAILURE);
 	}
+	kbd_queue.fd = kbdfd;
 }
 
 static void cleanup_kbd()
@@ -156,6 +344,16 @@ static void cleanup_kbd()
 	}
 }
 
+static int has_abs(int fd, int code)
+{
+    unsigned long bits[ABS_MAX / (8 * sizeof(long)) + 1];
+
+    memset(bits, 0, sizeof(bits));
+    if (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(bits)), bits) < 0)
+        return 0;
+    return (bits[code / (8 * sizeof(long))] >> (code % (8 * sizeof(long)))) & 1;
+}
+
 static void init_touch()
 {
     struct input_absinfo info;
@@ -164,19 +362,27 @@ static void init_touch()
                 printf("cannot open touch device %s\n", TOUCH_DEVICE);
                 exit(EXIT_FAILURE);
         }
+    // Multitouch panels are driven through slot 0, others through ABS_X/Y
+    touch_mt = has_abs(touchfd, ABS_MT_SLOT) &&
+               has_abs(touchfd, ABS_MT_TRACKING_ID) &&
+               has_abs(touchfd, ABS_MT_POSITION_X);
+    printf("Touch device speaks %s\n",
+           touch_mt ? "multitouch protocol B" : "single touch");
+
     // Get the Range of X and Y
-    if(ioctl(touchfd, EVIOCGABS(ABS_X), &info)) {
+    if(ioctl(touchfd, EVIOCGABS(touch_mt ? ABS_MT_POSITION_X : ABS_X), &info)) {
         printf("cannot get ABS_X info, %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
     xmin = info.minimum;
     xmax = info.maximum;
-    if(ioctl(touchfd, EVIOCGABS(ABS_Y), &info)) {
+    if(ioctl(touchfd, EVIOCGABS(touch_mt ? ABS_MT_POSITION_Y : ABS_Y), &info)) {
         printf("cannot get ABS_Y, %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
     ymin = info.minimum;
     ymax = info.maximum;
+    touch_queue.fd = touchfd;
 }
 
 static void cleanup_touch()
@@ -189,23 +395,151 @@ static void cleanup_touch()
 
 /*****************************************************************************/
 
+/* Returns the entry of fb_layouts matching the framebuffer, or NULL. */
+static const struct fb_layout *find_layout(void)
+{
+	const struct fb_layout *l;
+
+	for (l = fb_layouts; l->name; l++) {
+		if (l->bpp == (int)scrinfo.bits_per_pixel &&
+		    l->transp == (int)scrinfo.transp.length &&
+		    l->r_off == (int)scrinfo.red.offset &&
+		    l->r_len == (int)scrinfo.red.length &&
+		    l->g_off == (int)scrinfo.green.offset &&
+		    l->g_len == (int)scrinfo.green.length &&
+		    l->b_off == (int)scrinfo.blue.offset &&
+		    l->b_len == (int)scrinfo.blue.length)
+			return l;
+	}
+
+	return NULL;
+}
+
 static void init_fb_server(int argc, char **argv)
 {
+	const struct fb_layout *layout;
+	size_t fbsize;
+
 	printf("Initializing server...\n");
 
-	/* Allocate the VNC server buffer to be managed (not manipulated) by 
-	 * libvncserver. */
-	vncbuf = calloc(scrinfo.xres * scrinfo.yres, scrinfo.bits_per_pixel / 2);
-	assert(vncbuf != NULL);
+	/* Allocate the dirty tile map filled in by each comparison pass. */
+	tiles_x = (scrinfo.xres + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = (scrinfo.yres + TILE_SIZE - 1) / TILE_SIZE;
+	tile_map = calloc(tiles_x * tiles_y, 1);
+	assert(tile_map != NULL);
+
+	layout = find_layout();
+	fb_bytespp = scrinfo.bits_per_pixel / 8;
+
+	if (layout) {
+		rfbPixelFormat *format;
+
+		printf("Serving %s framebuffer natively\n", layout->name);
+
+		vncscr = rfbGetScreen(&argc, argv, scrinfo.xres, scrinfo.yres,
+		                      8, 3, fb_bytespp);
+		assert(vncscr != NULL);
+
+		format = &vncscr->serverFormat;
+		format->depth = layout->r_len + layout->g_len + layout->b_len;
+		format->redMax = (1 << layout->r_len) - 1;
+		format->greenMax = (1 << layout->g_len) - 1;
+		format->blueMax = (1 << layout->b_len) - 1;
+		format->redShift = layout->r_off;
+		format->greenShift = layout->g_off;
+		format->blueShift = layout->b_off;
+		vncscr->depth = format->depth;
+
+		varblock.fmt.convert = FBDIFF_COPY;
+	} else if (scrinfo.bits_per_pixel == 16) {
+		printf("Converting 16bpp framebuffer to RGB555\n");
+
+		vncscr = rfbGetScreen(&argc, argv, scrinfo.xres, scrinfo.yres,
+		                      5, 2, 2);
+		assert(vncscr != NULL);
+
+		/* Shift each channel so its top 5 bits land at the bottom. */
+		varblock.fmt.convert = FBDIFF_RGB555;
+		varblock.fmt.r_shift = scrinfo.red.offset + scrinfo.red.length - 5;
+		varblock.fmt.g_shift = scrinfo.green.offset + scrinfo.green.length - 5;
+		varblock.fmt.b_shift = scrinfo.blue.offset + scrinfo.blue.length - 5;
+	} else {
+		fprintf(stderr, "Unsupported %dbpp framebuffer layout\n",
+		        (int)scrinfo.bits_per_pixel);
+		exit(EXIT_FAILURE);
+	}
+
+	/* The kernels read the framebuffer a word at a time. */
+	if (fixinfo.line_length % 4 != 0) {
+		fprintf(stderr, "Unsupported framebuffer line length %d\n",
+		        (int)fixinfo.line_length);
+		exit(EXIT_FAILURE);
+	}
+
+	frame.row_bytes = scrinfo.xres * fb_bytespp;
+	frame.dst_stride = (frame.row_bytes + 3) & ~3;
+	frame.src_stride = fixinfo.line_length;
+	frame.seg_bytes = TILE_SIZE * fb_bytespp;
+	frame.tile_rows = TILE_SIZE;
+	frame.tiles_x = tiles_x;
+	frame.map = tile_map;
+	frame.fmt = &varblock.fmt;
+	vncscr->paddedWidthInBytes = frame.dst_stride;
+	fbsize = frame.dst_stride * scrinfo.yres;
+
+	if (zero_copy && varblock.fmt.convert != FBDIFF_COPY)
+		printf("Converted framebuffers cannot be served directly\n");
+
+	if (zero_copy && varblock.fmt.convert == FBDIFF_COPY) {
+		capture_mode = CAPTURE_MMAP;
+
+		/* Serve the displayed page straight from the mapping.  It is
+		 * read-only, so the cursor must not be drawn into it. */
+		tile_hash = calloc(tiles_x * tiles_y, sizeof(*tile_hash));
+		assert(tile_hash != NULL);
+
+		select_page();
+		vncbuf = (unsigned short int *)fbpage;
+		vncscr->paddedWidthInBytes = fixinfo.line_length;
+		vncscr->cursor = NULL;
+	} else if (hash_capture) {
+		capture_mode = CAPTURE_HASH;
+
+		vncbuf = calloc(fbsize, 1);
+		assert(vncbuf != NULL);
+
+		seg_hash = calloc((size_t)tiles_x * scrinfo.yres,
+		                  sizeof(*seg_hash));
+		assert(seg_hash != NULL);
+	} else if (varblock.fmt.convert != FBDIFF_COPY) {
+		capture_mode = CAPTURE_CONVERT;
+
+		/* Allocate the VNC server buffer to be managed (not
+		 * manipulated) by libvncserver, 2 bytes per RGB555 pixel
+		 * like the 16bpp framebuffer. */
+		vncbuf = calloc(fbsize, 1);
+		assert(vncbuf != NULL);
+
+		/* Allocate the comparison buffer for detecting drawing
+		 * updates from frame to frame. */
+		fbbuf = calloc(fbsize, 1);
+		assert(fbbuf != NULL);
+	} else {
+		capture_mode = CAPTURE_SNAPSHOT;
+
+		/* The comparison buffer holds exactly what clients should
+		 * see, so it doubles as the VNC server buffer. */
+		fbbuf = calloc(fbsize, 1);
+		assert(fbbuf != NULL);
+		vncbuf = fbbuf;
+	}
 
-	/* Allocate the comparison buffer for detecting drawing updates from frame
-	 * to frame. */
-	fbbuf = calloc(scrinfo.xres * scrinfo.yres, scrinfo.bits_per_pixel / 2);
-	assert(fbbuf != NULL);
+	frame.cmp = (unsigned char *)fbbuf;
+	frame.dst = (unsigned char *)vncbuf;
 
-	/* FIXME: This assumes scrinfo.bits_per_pixel is 16. */
-	vncscr = rfbGetScreen(&argc, argv, scrinfo.xres, scrinfo.yres, 5, 2, 2);
-	assert(vncscr != NULL);
+	if (scroll_detect)
+		init_scroll();
+	init_bands();
 
 	vncscr->desktopName = "Android";
 	vncscr->frameBuffer = (char *)vncbuf;
@@ -215,35 +549,76 @@ static void init_fb_server(int argc, char **argv)
 
 	vncscr->kbdAddEvent = keyevent;
 	vncscr->ptrAddEvent = ptrevent;
+	vncscr->newClientHook = newclient;
+
+	/* Updates are already paced by the capture scheduler. */
+	vncscr->deferUpdateTime = 0;
 
 	rfbInitServer(vncscr);
 
 	/* Mark as dirty since we haven't sent any updates at all yet. */
 	rfbMarkRectAsModified(vncscr, 0, 0, scrinfo.xres, scrinfo.yres);
 
-	/* No idea. */
-	varblock.r_offset = scrinfo.red.offset + scrinfo.red.length - 5;
-	varblock.g_offset = scrinfo.green.offset + scrinfo.green.length - 5;
-	varblock.b_offset = scrinfo.blue.offset + scrinfo.blue.length - 5;
 	varblock.rfb_xres = scrinfo.yres;
 	varblock.rfb_maxy = scrinfo.xres - 1;
 }
 
 /*****************************************************************************/
+
+/* Write out everything queued so far. */
+static void input_flush(struct input_queue *q)
+{
+	const char *p = (const char *)q->ev;
+	size_t len = q->count * sizeof(q->ev[0]);
+
+	while (len > 0) {
+		ssize_t n = write(q->fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("write event failed, %s\n", strerror(errno));
+			break;
+		}
+		p += n, len -= n;
+	}
+
+	q->count = 0;
+}
+
+static void input_add(struct input_queue *q, int type, int code, int value)
+{
+	struct input_event *ev;
+
+	if (q->count == INPUT_QUEUE_LEN)
+		input_flush(q);
+
+	if (!q->in_frame) {
+		gettimeofday(&q->time, NULL);
+		q->in_frame = 1;
+	}
+
+	ev = &q->ev[q->count++];
+	ev->time = q->time;
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+}
+
+/* Close the current frame. */
+static void input_sync(struct input_queue *q)
+{
+	input_add(q, EV_SYN, SYN_REPORT, 0);
+	q->in_frame = 0;
+}
+
 void injectKeyEvent(uint16_t code, uint16_t value)
 {
-    struct input_event ev;
-    memset(&ev, 0, sizeof(ev));
-    gettimeofday(&ev.time,0);
-    ev.type = EV_KEY;
-    ev.code = code;
-    ev.value = value;
-    if(write(kbdfd, &ev, sizeof(ev)) < 0)
-    {
-        printf("write event failed, %s\n", strerror(errno));
-    }
+    input_add(&kbd_queue, EV_KEY, code, value);
+    input_sync(&kbd_queue);
+    input_flush(&kbd_queue);
 
-    printf("injectKey (%d, %d)\n", code , value);    
+    input_log("injectKey (%d, %d)\n", code , value);
 }
 
 /* device independent */
@@ -312,65 +687,90 @@ static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl)
 {
 	int scancode;
 
-	printf("Got keysym: %04x (down=%d)\n", (unsigned int)key, (int)down);
+	input_log("Got keysym: %04x (down=%d)\n", (unsigned int)key, (int)down);
 
 	if ((scancode = keysym2scancode(down, key, cl)))
 	{
 		injectKeyEvent(scancode, down);
 	}
+
+	capture_kick();
 }
 
-void injectTouchEvent(int down, int x, int y)
+/* Queue the axes of a new contact position that changed. */
+static void touch_position(int x, int y)
 {
-    struct input_event ev;
-    
-    // Calculate the final x and y
-    x = xmin + (x * (xmax - xmin)) / (scrinfo.xres);
-    y = ymin + (y * (ymax - ymin)) / (scrinfo.yres);
-    
-    memset(&ev, 0, sizeof(ev));
+    if (x != ptr.x)
+        input_add(&touch_queue, EV_ABS, touch_mt ? ABS_MT_POSITION_X : ABS_X, x);
+    if (y != ptr.y)
+        input_add(&touch_queue, EV_ABS, touch_mt ? ABS_MT_POSITION_Y : ABS_Y, y);
+    ptr.x = x;
+    ptr.y = y;
+}
 
-    // Then send a BTN_TOUCH
-    gettimeofday(&ev.time,0);
-    ev.type = EV_KEY;
-    ev.code = BTN_TOUCH;
-    ev.value = down;
-    if(write(touchfd, &ev, sizeof(ev)) < 0)
-    {
-        printf("write event failed, %s\n", strerror(errno));
+static void touch_down(int x, int y)
+{
+    if (touch_mt) {
+        input_add(&touch_queue, EV_ABS, ABS_MT_SLOT, 0);
+        input_add(&touch_queue, EV_ABS, ABS_MT_TRACKING_ID, ptr.tracking_id);
+        ptr.tracking_id = (ptr.tracking_id + 1) & 0xffff;
     }
+    ptr.x = ptr.y = -1;
+    touch_position(x, y);
+    input_add(&touch_queue, EV_KEY, BTN_TOUCH, 1);
+    input_sync(&touch_queue);
+    ptr.down = 1;
 
-    // Then send the X
-    gettimeofday(&ev.time,0);
-    ev.type = EV_ABS;
-    ev.code = ABS_X;
-    ev.value = x;
-    if(write(touchfd, &ev, sizeof(ev)) < 0)
-    {
-        printf("write event failed, %s\n", strerror(errno));
-    }
+    input_log("touch down (x=%d, y=%d)\n", x, y);
+}
 
-    // Then send the Y
-    gettimeofday(&ev.time,0);
-    ev.type = EV_ABS;
-    ev.code = ABS_Y;
-    ev.value = y;
-    if(write(touchfd, &ev, sizeof(ev)) < 0)
-    {
-        printf("write event failed, %s\n", strerror(errno));
-    }
+static void touch_move(int x, int y)
+{
+    touch_position(x, y);
+    input_sync(&touch_queue);
+    ptr.pending = 0;
+    ptr.next_motion = now_usec() + 1000000 / touch_hz;
+
+    input_log("touch move (x=%d, y=%d)\n", x, y);
+}
 
-    // Finally send the SYN
-    gettimeofday(&ev.time,0);
-    ev.type = EV_SYN;
-    ev.code = 0;
-    ev.value = 0;
-    if(write(touchfd, &ev, sizeof(ev)) < 0)
-    {
-        printf("write event failed, %s\n", strerror(errno));
+static void touch_up(void)
+{
+    if (touch_mt)
+        input_add(&touch_queue, EV_ABS, ABS_MT_TRACKING_ID, -1);
+    input_add(&touch_queue, EV_KEY, BTN_TOUCH, 0);
+    input_sync(&touch_queue);
+    ptr.down = 0;
+    ptr.owner = NULL;
+
+    input_log("touch up\n");
+}
+
+/* Lift a contact still held, e.g. by a client which went away. */
+static void touch_release(void)
+{
+    if (!ptr.down)
+        return;
+    ptr.pending = 0;
+    touch_up();
+    input_flush(&touch_queue);
+}
+
+/* Send coalesced motion once it is due and write out the queued touch
+ * frames.  Shortens *timeout to when the pending motion is due. */
+static void touch_pump(long *timeout)
+{
+    if (ptr.pending) {
+        long long wait = ptr.next_motion - now_usec();
+
+        if (wait <= 0)
+            touch_move(ptr.pend_x, ptr.pend_y);
+        else if (*timeout > wait)
+            *timeout = wait;
     }
 
-    printf("injectTouchEvent (x=%d, y=%d, down=%d)\n", x , y, down);    
+    if (touch_queue.count > 0)
+        input_flush(&touch_queue);
 }
 
 static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl)
@@ -385,93 +785,623 @@ a press and release of button 5.
   From: http://www.vislab.usyd.edu.au/blogs/index.php/2009/05/22/an-headerless-indexed-protocol-for-input-1?blog=61 */
 	
 	//printf("Got ptrevent: %04x (x=%d, y=%d)\n", buttonMask, x, y);
-	if(buttonMask & 1) {
-		// Simulate left mouse event as touch event
-		injectTouchEvent(1, x, y);
-		injectTouchEvent(0, x, y);
-	} 
-}
-
-#define PIXEL_FB_TO_RFB(p,r,g,b) \
-	((p >> r) & 0x1f001f) | \
-	(((p >> g) & 0x1f001f) << 5) | \
-	(((p >> b) & 0x1f001f) << 10)
-
-static void update_screen(void)
-{
-	unsigned int *f, *c, *r;
-	int x, y;
-
-	varblock.min_i = varblock.min_j = 9999;
-	varblock.max_i = varblock.max_j = -1;
-
-	f = (unsigned int *)fbmmap;        /* -> framebuffer         */
-	c = (unsigned int *)fbbuf;         /* -> compare framebuffer */
-	r = (unsigned int *)vncbuf;        /* -> remote framebuffer  */
-
-	for (y = 0; y < (int) scrinfo.yres; y++) {
-		/* Compare every 2 pixels at a time, assuming that changes are
-		 * likely in pairs. */
-		for (x = 0; x < (int) scrinfo.xres; x += 2) {
-			unsigned int pixel = *f;
-
-			if (pixel != *c) {
-				*c = pixel;
-
-				/* XXX: Undo the checkered pattern to test the
-				 * efficiency gain using hextile encoding. */
-				if (pixel == 0x18e320e4 || pixel == 0x20e418e3)
-					pixel = 0x18e318e3;
-
-				*r = PIXEL_FB_TO_RFB(pixel,
-				                     varblock.r_offset,
-						     varblock.g_offset,
-						     varblock.b_offset);
-
-				if (x < varblock.min_i)
-					varblock.min_i = x;
-				else {
-					if (x > varblock.max_i)
-						varblock.max_i = x;
-
-					if (y > varblock.max_j)
-						varblock.max_j = y;
-					else if (y < varblock.min_j)
-						varblock.min_j = y;
+
+	/* Frames are only queued here; touch_pump() writes out everything
+	 * that arrived in one pass of the event loop at once. */
+	x = xmin + (x * (xmax - xmin)) / (scrinfo.xres);
+	y = ymin + (y * (ymax - ymin)) / (scrinfo.yres);
+
+	if (ptr.down && cl != ptr.owner)
+		return;
+
+	if ((buttonMask & 1) && !ptr.down) {
+		touch_down(x, y);
+		ptr.owner = cl;
+		ptr.pending = 0;
+		ptr.next_motion = now_usec() + 1000000 / touch_hz;
+	} else if (buttonMask & 1) {
+		ptr.pend_x = x;
+		ptr.pend_y = y;
+		ptr.pending = x != ptr.x || y != ptr.y;
+		if (ptr.pending && now_usec() >= ptr.next_motion)
+			touch_move(x, y);
+	} else if (ptr.down) {
+		/* the contact lifts where the button was released */
+		if (x != ptr.x || y != ptr.y)
+			touch_move(x, y);
+		ptr.pending = 0;
+		touch_up();
+	}
+
+	capture_kick();
+}
+
+/* Also called for the clients rfbShutdownServer() closes. */
+static void clientgone(rfbClientPtr cl)
+{
+	if (ptr.down && cl == ptr.owner)
+		touch_release();
+}
+
+static enum rfbNewClientAction newclient(rfbClientPtr cl)
+{
+	cl->clientGoneHook = clientgone;
+	return RFB_CLIENT_ACCEPT;
+}
+
+/* Merge each run of dirty tiles on a tile row into one rectangle. */
+static sraRegionPtr tile_region(int ty1, int ty2)
+{
+	sraRegionPtr region = sraRgnCreate();
+	int tx, ty, start;
+
+	for (ty = ty1; ty < ty2; ty++) {
+		const unsigned char *map = tile_map + ty * tiles_x;
+		int y1 = ty * TILE_SIZE;
+		int y2 = y1 + TILE_SIZE;
+
+		if (y2 > (int) scrinfo.yres)
+			y2 = scrinfo.yres;
+
+		for (tx = 0; tx < tiles_x; tx++) {
+			sraRegionPtr rect;
+			int x2;
+
+			if (!map[tx])
+				continue;
+
+			for (start = tx; tx < tiles_x && map[tx]; tx++)
+				;
+
+			x2 = tx * TILE_SIZE;
+			if (x2 > (int) scrinfo.xres)
+				x2 = scrinfo.xres;
+
+			rect = sraRgnCreateRect(start * TILE_SIZE, y1, x2, y2);
+			sraRgnOr(region, rect);
+			sraRgnDestroy(rect);
+		}
+	}
+
+	return region;
+}
+
+static inline uint64_t mix64(uint64_t h, uint64_t v)
+{
+	h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 32);
+}
+
+/* Rehash the row and column segments of tile (tx, ty) in the served
+ * picture, keeping the hashes of the previous frame for find_scroll(). */
+static void hash_tile_lines(int tx, int ty)
+{
+	int bpp = vncscr->serverFormat.bitsPerPixel / 8;
+	int stride = vncscr->paddedWidthInBytes;
+	int x1 = tx * TILE_SIZE, y1 = ty * TILE_SIZE;
+	int w = scrinfo.xres - x1 < TILE_SIZE ? scrinfo.xres - x1 : TILE_SIZE;
+	int h = scrinfo.yres - y1 < TILE_SIZE ? scrinfo.yres - y1 : TILE_SIZE;
+	int words = w * bpp / 4, tail = w * bpp % 4;
+	const unsigned char *p = (const unsigned char *)vncscr->frameBuffer +
+	                         (size_t) y1 * stride + x1 * bpp;
+	size_t row = (size_t) y1 * tiles_x + tx;
+	size_t col = (size_t) ty * scrinfo.xres + x1;
+	uint64_t *ch = col_hash + col;
+	int x, y, i;
+
+	memcpy(col_prev + col, ch, w * sizeof(*ch));
+	memset(ch, 0, w * sizeof(*ch));
+
+	for (y = 0; y < h; y++, p += stride, row += tiles_x) {
+		uint64_t rh = fbdiff_hash((const uint32_t *)p, words, 0);
+
+		/* odd widths at 16 and 24bpp end inside a word */
+		for (i = words * 4; i < words * 4 + tail; i++)
+			rh = mix64(rh, p[i]);
+
+		row_prev[row] = row_hash[row];
+		row_hash[row] = rh;
+
+		for (x = 0; x < w; x++) {
+			const unsigned char *q = p + x * bpp;
+			uint32_t v;
+
+			if (bpp == 2)
+				v = *(const uint16_t *)q;
+			else if (bpp == 3)
+				v = q[0] | q[1] << 8 | q[2] << 16;
+			else
+				v = *(const uint32_t *)q;
+			ch[x] = mix64(ch[x], v);
+		}
+	}
+}
+
+/* Find the dirty tiles of one band.  Bands own whole tile rows, so they
+ * never share map entries. */
+static void scan_band(struct band *band)
+{
+	int y = band->ty1 * TILE_SIZE;
+	int y2 = band->ty2 * TILE_SIZE;
+
+	if (y2 > (int) scrinfo.yres)
+		y2 = scrinfo.yres;
+
+	memset(tile_map + band->ty1 * tiles_x, 0,
+	       (band->ty2 - band->ty1) * tiles_x);
+
+	if (capture_mode == CAPTURE_MMAP)
+		fbdiff_hash_rows(&frame, band->acc, tile_hash, y, y2);
+	else if (capture_mode == CAPTURE_HASH)
+		fbdiff_hash_diff_rows(&frame, seg_hash, y, y2);
+	else
+		fbdiff_diff_rows(diff_kernel, &frame, y, y2);
+
+	if (scroll_detect) {
+		int tx, ty;
+
+		for (ty = band->ty1; ty < band->ty2; ty++)
+			for (tx = 0; tx < tiles_x; tx++)
+				if (tile_map[ty * tiles_x + tx])
+					hash_tile_lines(tx, ty);
+	}
+
+	band->region = tile_region(band->ty1, band->ty2);
+}
+
+/* Scan bands until none are left; called with band_lock held. */
+static void run_bands(void)
+{
+	while (band_next < nbands) {
+		struct band *band = &bands[band_next++];
+
+		pthread_mutex_unlock(&band_lock);
+		scan_band(band);
+		pthread_mutex_lock(&band_lock);
+
+		if (--band_pending == 0)
+			pthread_cond_signal(&band_done);
+	}
+}
+
+static void *band_worker(void *arg)
+{
+	int gen = 0;
+
+	pthread_mutex_lock(&band_lock);
+	for (;;) {
+		while (gen == band_gen)
+			pthread_cond_wait(&band_start, &band_lock);
+		gen = band_gen;
+		run_bands();
+	}
+
+	return NULL;
+}
+
+/* Split the screen into bands and start one worker per extra band, up to
+ * the number of CPUs.  Small screens end up with a single band scanned by
+ * the main thread alone. */
+static void init_bands(void)
+{
+	int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_bands = (scrinfo.xres * scrinfo.yres) / BAND_MIN_PIXELS;
+	int nthreads, i;
+
+	if (ncpu < 1)
+		ncpu = 1;
+	if (nbands <= 0)
+		nbands = ncpu;
+	if (nbands > max_bands)
+		nbands = max_bands;
+	if (nbands > tiles_y)
+		nbands = tiles_y;
+	if (nbands < 1)
+		nbands = 1;
+
+	bands = calloc(nbands, sizeof(*bands));
+	assert(bands != NULL);
+
+	for (i = 0; i < nbands; i++) {
+		bands[i].ty1 = tiles_y * i / nbands;
+		bands[i].ty2 = tiles_y * (i + 1) / nbands;
+
+		if (capture_mode == CAPTURE_MMAP) {
+			bands[i].acc = calloc(tiles_x, sizeof(uint64_t));
+			assert(bands[i].acc != NULL);
+		}
+	}
+
+	nthreads = (nbands < ncpu ? nbands : ncpu) - 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, band_worker, NULL) != 0) {
+			perror("pthread_create");
+			break;
+		}
+		pthread_detach(thread);
+	}
+
+	printf("Scanning %d bands with %d threads\n", nbands, i + 1);
+}
+
+static void init_scroll(void)
+{
+	int lines = scrinfo.xres > scrinfo.yres ? scrinfo.xres : scrinfo.yres;
+	size_t rows = (size_t) tiles_x * scrinfo.yres;
+	size_t cols = (size_t) tiles_y * scrinfo.xres;
+	int size;
+
+	row_hash = calloc(rows, sizeof(uint64_t));
+	row_prev = calloc(rows, sizeof(uint64_t));
+	col_hash = calloc(cols, sizeof(uint64_t));
+	col_prev = calloc(cols, sizeof(uint64_t));
+	line_old = calloc(lines, sizeof(uint64_t));
+	line_new = calloc(lines, sizeof(uint64_t));
+
+	for (size = 1; size < 2 * lines; size <<= 1)
+		;
+	line_table = malloc(size * sizeof(int));
+	line_table_mask = size - 1;
+	shift_votes = calloc(2 * lines + 1, sizeof(int));
+
+	assert(row_hash != NULL && row_prev != NULL);
+	assert(col_hash != NULL && col_prev != NULL);
+	assert(line_old != NULL && line_new != NULL);
+	assert(line_table != NULL && shift_votes != NULL);
+	memset(line_table, 0xff, size * sizeof(int));
+}
+
+/* Row segment of tile column tx and column segment of tile row ty as they
+ * were in the previous frame: only dirty tiles have been rehashed. */
+static inline uint64_t old_row(int tx, int y)
+{
+	size_t i = (size_t) y * tiles_x + tx;
+
+	if (tile_map[(y / TILE_SIZE) * tiles_x + tx])
+		return row_prev[i];
+	return row_hash[i];
+}
+
+static inline uint64_t old_col(int x, int ty)
+{
+	size_t i = (size_t) ty * scrinfo.xres + x;
+
+	if (tile_map[ty * tiles_x + x / TILE_SIZE])
+		return col_prev[i];
+	return col_hash[i];
+}
+
+static int *line_lookup(const uint64_t *old, uint64_t h)
+{
+	int *slot = &line_table[h & line_table_mask];
+
+	while (*slot >= 0 && old[*slot] != h) {
+		if (++slot == line_table + line_table_mask + 1)
+			slot = line_table;
+	}
+	return slot;
+}
+
+/* Vote for every shift s with new[i] == old[i - s] on a line that changed.
+ * Lines equal to their neighbour, as on plain backgrounds, say nothing
+ * about the shift and do not vote. */
+static void vote_shift(const uint64_t *old, const uint64_t *new, int n,
+		int lines)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		int *slot;
+
+		if (i > 0 && old[i] == old[i - 1])
+			continue;
+		slot = line_lookup(old, old[i]);
+		if (*slot < 0)
+			*slot = i;
+	}
+
+	for (i = 0; i < n; i++) {
+		int j;
+
+		if (new[i] == old[i] || (i > 0 && new[i] == new[i - 1]))
+			continue;
+		j = *line_lookup(old, new[i]);
+		if (j >= 0)
+			shift_votes[i - j + lines]++;
+	}
+
+	/* Empty the table again, last entry first so that every probe
+	 * sequence is still intact when its entry is removed. */
+	for (i = n - 1; i >= 0; i--) {
+		int *slot = line_lookup(old, old[i]);
+
+		if (*slot == i)
+			*slot = -1;
+	}
+}
+
+/* Returns the votes of the most voted shift, stored in *shift. */
+static int best_shift(int lines, int *shift)
+{
+	int i, best = 0;
+
+	for (i = 0; i <= 2 * lines; i++) {
+		if (shift_votes[i] > best) {
+			best = shift_votes[i];
+			*shift = i - lines;
+		}
+	}
+	return best;
+}
+
+static void add_rect(sraRegionPtr region, int x1, int y1, int x2, int y2)
+{
+	sraRegionPtr rect = sraRgnCreateRect(x1, y1, x2, y2);
+
+	sraRgnOr(region, rect);
+	sraRgnDestroy(rect);
+}
+
+/* Look for content of the dirty area that moved since the last pass.
+ * Returns the part of 'dirty' that can be copied from elsewhere on the
+ * screen by (*dx, *dy), or NULL. */
+static sraRegionPtr find_scroll(sraRegionPtr dirty, int *dx, int *dy)
+{
+	int tx1 = tiles_x, tx2 = 0, ty1 = tiles_y, ty2 = 0;
+	int x1, x2, y1, y2, tx, ty, x, y, vv, hv, sv = 0, sh = 0;
+	sraRegionPtr copy;
+
+	for (ty = 0; ty < tiles_y; ty++) {
+		for (tx = 0; tx < tiles_x; tx++) {
+			if (!tile_map[ty * tiles_x + tx])
+				continue;
+			if (tx < tx1) tx1 = tx;
+			if (tx >= tx2) tx2 = tx + 1;
+			if (ty < ty1) ty1 = ty;
+			ty2 = ty + 1;
+		}
+	}
+	if (tx2 == 0)
+		return NULL;
+
+	x1 = tx1 * TILE_SIZE;
+	y1 = ty1 * TILE_SIZE;
+	x2 = tx2 * TILE_SIZE;
+	if (x2 > (int) scrinfo.xres)
+		x2 = scrinfo.xres;
+	y2 = ty2 * TILE_SIZE;
+	if (y2 > (int) scrinfo.yres)
+		y2 = scrinfo.yres;
+
+	/* Vote per tile column on the row segments of the dirty bounding box,
+	 * and per tile row on its column segments, so areas that move do not
+	 * have to line up with the tiles. */
+	memset(shift_votes, 0, (2 * (y2 - y1) + 1) * sizeof(int));
+	for (tx = tx1; tx < tx2; tx++) {
+		for (y = y1; y < y2; y++) {
+			line_old[y - y1] = old_row(tx, y);
+			line_new[y - y1] = row_hash[(size_t) y * tiles_x + tx];
+		}
+		vote_shift(line_old, line_new, y2 - y1, y2 - y1);
+	}
+	vv = best_shift(y2 - y1, &sv);
+
+	memset(shift_votes, 0, (2 * (x2 - x1) + 1) * sizeof(int));
+	for (ty = ty1; ty < ty2; ty++) {
+		const uint64_t *ch = col_hash + (size_t) ty * scrinfo.xres;
+
+		for (x = x1; x < x2; x++)
+			line_old[x - x1] = old_col(x, ty);
+		vote_shift(line_old, ch + x1, x2 - x1, x2 - x1);
+	}
+	hv = best_shift(x2 - x1, &sh);
+
+	if (vv < SCROLL_MIN_VOTES && hv < SCROLL_MIN_VOTES)
+		return NULL;
+
+	/* Copy every run of segments whose new content is the old content
+	 * at the shifted position. */
+	copy = sraRgnCreate();
+	if (vv >= hv) {
+		*dx = 0, *dy = sv;
+
+		for (tx = tx1; tx < tx2; tx++) {
+			int cx1 = tx * TILE_SIZE;
+			int cx2 = cx1 + TILE_SIZE < x2 ? cx1 + TILE_SIZE : x2;
+			int start = -1;
+
+			for (y = y1; y <= y2; y++) {
+				int ys = y - sv;
+				int match = y < y2 && ys >= 0 &&
+				            ys < (int) scrinfo.yres &&
+				            row_hash[(size_t) y * tiles_x + tx] ==
+				            old_row(tx, ys);
+
+				if (match && start < 0) {
+					start = y;
+				} else if (!match && start >= 0) {
+					if (y - start >= SCROLL_MIN_RUN)
+						add_rect(copy, cx1, start, cx2, y);
+					start = -1;
 				}
 			}
+		}
+	} else {
+		*dx = sh, *dy = 0;
+
+		for (ty = ty1; ty < ty2; ty++) {
+			int cy1 = ty * TILE_SIZE;
+			int cy2 = cy1 + TILE_SIZE < y2 ? cy1 + TILE_SIZE : y2;
+			int start = -1;
+
+			for (x = x1; x <= x2; x++) {
+				int xs = x - sh;
+				int match = x < x2 && xs >= 0 &&
+				            xs < (int) scrinfo.xres &&
+				            col_hash[(size_t) ty * scrinfo.xres + x] ==
+				            old_col(xs, ty);
+
+				if (match && start < 0) {
+					start = x;
+				} else if (!match && start >= 0) {
+					if (x - start >= SCROLL_MIN_RUN)
+						add_rect(copy, start, cy1, x, cy2);
+					start = -1;
+				}
+			}
+		}
+	}
+
+	sraRgnAnd(copy, dirty);
+	if (sraRgnEmpty(copy)) {
+		sraRgnDestroy(copy);
+		return NULL;
+	}
+	return copy;
+}
+
+/* Returns non-zero if the screen changed since the last call. */
+static int update_screen(void)
+{
+	sraRegionPtr region;
+	int i, changed;
+
+	select_page();
+	if (capture_mode == CAPTURE_MMAP)
+		vncscr->frameBuffer = (char *)fbpage;
+
+	pthread_mutex_lock(&band_lock);
+	band_next = 0;
+	band_pending = nbands;
+	band_gen++;
+	pthread_cond_broadcast(&band_start);
+
+	run_bands();
+	while (band_pending > 0)
+		pthread_cond_wait(&band_done, &band_lock);
+	pthread_mutex_unlock(&band_lock);
+
+	region = bands[0].region;
+	for (i = 1; i < nbands; i++) {
+		sraRgnOr(region, bands[i].region);
+		sraRgnDestroy(bands[i].region);
+	}
 
-			f++, c++;
-			r++;
+	changed = !sraRgnEmpty(region);
+	if (changed && scroll_detect) {
+		sraRegionPtr copy;
+		int dx, dy;
+
+		/* Schedule the copy first: pending changes in its source are
+		 * then moved along with it. */
+		copy = find_scroll(region, &dx, &dy);
+		if (copy != NULL) {
+			fprintf(stderr, "Copy region: %lu rects by %d,%d...\n",
+			  sraRgnCountRects(copy), dx, dy);
+
+			rfbScheduleCopyRegion(vncscr, copy, dx, dy);
+			sraRgnSubtract(region, copy);
+			sraRgnDestroy(copy);
 		}
 	}
 
-	if (varblock.min_i < 9999) {
-		if (varblock.max_i < 0)
-			varblock.max_i = varblock.min_i;
+	if (!sraRgnEmpty(region)) {
+		fprintf(stderr, "Dirty region: %lu rects...\n",
+		  sraRgnCountRects(region));
 
-		if (varblock.max_j < 0)
-			varblock.max_j = varblock.min_j;
+		rfbMarkRegionAsModified(vncscr, region);
+	}
 
-		fprintf(stderr, "Dirty page: %dx%d+%d+%d...\n",
-		  (varblock.max_i + 2) - varblock.min_i,
-		  (varblock.max_j + 1) - varblock.min_j,
-		  varblock.min_i, varblock.min_j);
+	sraRgnDestroy(region);
+	return changed;
+}
 
-		rfbMarkRectAsModified(vncscr, varblock.min_i, varblock.min_j,
-		  varblock.max_i + 2, varblock.max_j + 1);
+/*****************************************************************************/
+
+static long long now_usec(void)
+{
+	struct timespec ts;
 
-		rfbProcessEvents(vncscr, 10000);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Input usually changes the screen: scan right away at the full rate. */
+static void capture_kick(void)
+{
+	capture_interval = 1000000 / capture_fps;
+	next_capture = now_usec();
+}
+
+/* Returns non-zero if some client is waiting for a framebuffer update.
+ * Also shortens *timeout while pointer events are being deferred, since
+ * those are only delivered from rfbProcessEvents(). */
+static int clients_waiting(long *timeout)
+{
+	rfbClientIteratorPtr i = rfbGetClientIterator(vncscr);
+	rfbClientPtr cl;
+	int waiting = 0;
+
+	while ((cl = rfbClientIteratorNext(i)) != NULL) {
+		if (!sraRgnEmpty(cl->requestedRegion))
+			waiting = 1;
+		if (cl->lastPtrX >= 0 &&
+		    *timeout > vncscr->deferPtrUpdateTime * 1000L)
+			*timeout = vncscr->deferPtrUpdateTime * 1000L;
+	}
+	rfbReleaseClientIterator(i);
+
+	return waiting;
+}
+
+/* Scan when due and a client wants an update, then sleep in
+ * rfbProcessEvents() until the next scan or until a client talks to us. */
+static void run_capture(void)
+{
+	long long now = now_usec();
+	long timeout = idle_ms * 1000L;
+
+	touch_pump(&timeout);
+
+	if (clients_waiting(&timeout)) {
+		if (now >= next_capture) {
+			if (update_screen()) {
+				capture_interval = 1000000 / capture_fps;
+				/* send it now rather than after the sleep */
+				rfbProcessEvents(vncscr, 0);
+			} else if (capture_interval < idle_ms * 1000LL) {
+				capture_interval *= 2;
+				if (capture_interval > idle_ms * 1000LL)
+					capture_interval = idle_ms * 1000LL;
+			}
+			next_capture = now + capture_interval;
+		}
+
+		if (timeout > next_capture - now)
+			timeout = next_capture - now;
 	}
+
+	rfbProcessEvents(vncscr, timeout);
+	touch_pump(&timeout);
 }
 
 /*****************************************************************************/
 
 void print_usage(char **argv)
 {
-	printf("%s [-k device] [-t device] [-h]\n"
+	printf("%s [-k device] [-t device] [-b bands] [-f fps] [-i ms]"
+		" [-r hz] [-z] [-H] [-c] [-h]\n"
 		"-k device: keyboard device node, default is /dev/input/event3\n"
 		"-t device: touch device node, default is /dev/input/event1\n"
+		"-b bands: screen bands scanned in parallel, default is one per CPU\n"
+		"-f fps: maximum screen capture rate, default is 30\n"
+		"-i ms: capture interval when the screen is idle, default is 500\n"
+		"-r hz: touch motion report rate, default is 60\n"
+		"-z : serve the framebuffer mapping directly (zero copy)\n"
+		"-H : detect changes by row hashes instead of a full copy\n"
+		"-c : do not send scrolled content as CopyRect\n"
 		"-h : print this help\n",
 		APPNAME);
 }
@@ -556,6 +1486,31 @@ int main(int argc, char **argv)
 						i++;
 						strcpy(TOUCH_DEVICE, argv[i]);
 						break;
+					case 'b':
+						i++;
+						nbands = atoi(argv[i]);
+						break;
+					case 'f':
+						i++;
+						capture_fps = atoi(argv[i]);
+						break;
+					case 'i':
+						i++;
+						idle_ms = atoi(argv[i]);
+						break;
+					case 'r':
+						i++;
+						touch_hz = atoi(argv[i]);
+						break;
+					case 'z':
+						zero_copy = 1;
+						break;
+					case 'H':
+						hash_capture = 1;
+						break;
+					case 'c':
+						scroll_detect = 0;
+						break;
 				}
 			}
 			i++;
@@ -565,6 +1520,9 @@ int main(int argc, char **argv)
 	printf("Initializing framebuffer device " FB_DEVICE "...\n");
 	init_fb();
 
+	diff_kernel = fbdiff_select(NULL);
+	printf("Using %s frame differencing\n", diff_kernel->name);
+
 	if (KBD_DEVICE[0]) {
 		printf("Initializing keyboard device %s ...\n", KBD_DEVICE);
 		init_kbd();
@@ -582,18 +1540,26 @@ int main(int argc, char **argv)
 	printf("	port:   %d\n", (int)VNC_PORT);
 	init_fb_server(argc, argv);
 
+	if (capture_fps < 1)
+		capture_fps = 1;
+	if (idle_ms < 1000 / capture_fps)
+		idle_ms = 1000 / capture_fps;
+	if (touch_hz < 1)
+		touch_hz = 1;
+	capture_kick();
+
 	/* Implement our own event loop to detect changes in the framebuffer. */
 	while (1) {
 		while (vncscr->clientHead == NULL)
 			rfbProcessEvents(vncscr, 100000);
 
-		rfbProcessEvents(vncscr, 100000);
-		update_screen();
+		run_capture();
 	}
 
 	printf("Cleaning up...\n");
 	cleanup_fb();
 	cleanup_kbd();
+	touch_release();
 	cleanup_touch();
 	return 0;
 }